@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+namespace FlowVM {
+
+/**
+ * Non-owning, read-only view of a contiguous array, such as a std::vector
+ * or a section of a memory-mapped program file.
+ */
+template<typename T>
+class ArrayRef
+{
+public:
+    typedef T value_type;
+    typedef const T* iterator;
+    typedef const T* const_iterator;
+
+    ArrayRef() : data_(nullptr), size_(0) {}
+    ArrayRef(const T* data, size_t size) : data_(data), size_(size) {}
+    ArrayRef(const std::vector<T>& v) : data_(v.data()), size_(v.size()) {}
+
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+    const T& operator[](size_t i) const { return data_[i]; }
+
+    std::vector<T> vec() const { return std::vector<T>(data_, data_ + size_); }
+
+private:
+    const T* data_;
+    size_t size_;
+};
+
+} // namespace FlowVM
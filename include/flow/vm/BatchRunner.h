@@ -0,0 +1,82 @@
+#pragma once
+
+#include <flow/vm/Runner.h>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+class Handler;
+
+/**
+ * Runs one Handler over a batch of register files in lock-step.
+ *
+ * Each instruction is dispatched once for all lanes: number arithmetic and
+ * comparisons run as SIMD kernels over the lanes (AVX2 where available,
+ * selected at runtime), while string ops, regular expressions and natives
+ * run per lane. Every lane has a Runner of its own, providing userdata and
+ * string storage to the natives called for it.
+ *
+ * Lanes taking different branches are split into groups, which are run
+ * one after another, lowest code offset first, and merged again as soon as
+ * they reach the same instruction.
+ *
+ * Batches are always run in release mode: trace sinks and statistics are
+ * not supported, and natives cannot suspend.
+ */
+class BatchRunner
+{
+public:
+    enum { MaxLanes = 64, LaneWidth = 4 };
+
+    static std::unique_ptr<BatchRunner> create(Handler* handler, size_t lanes);
+    ~BatchRunner();
+
+    Handler* handler() const { return handler_; }
+
+    /** Number of lanes, i.e. register files, in the batch. */
+    size_t size() const { return lanes_.size(); }
+
+    /** The Runner passed to natives on behalf of \p lane. */
+    Runner* lane(size_t lane) const { return lanes_[lane].get(); }
+
+    void setUserData(size_t lane, void* p) { lanes_[lane]->setUserData(p); }
+
+    /**
+     * Runs the handler on all lanes.
+     *
+     * \return bit mask of the lanes whose run returned \c true.
+     */
+    uint64_t run();
+    void reset();
+
+    /** Register \p reg of \p lane. */
+    Register& reg(size_t lane, size_t reg) { return data_[reg * stride_ + lane]; }
+
+private:
+    BatchRunner(Handler* handler, size_t lanes);
+    BatchRunner(const BatchRunner&) = delete;
+    BatchRunner& operator=(const BatchRunner&) = delete;
+
+    /** Lanes at the same instruction, waiting to be run. */
+    struct LaneGroup {
+        size_t pc;
+        uint64_t mask;
+    };
+
+    template<typename Code> uint64_t execute(const Code* code);
+    size_t schedule(uint64_t* mask);
+    void setMask(uint64_t mask);
+
+    Handler* handler_;
+    size_t stride_;                         //!< lanes rounded up to LaneWidth
+    std::vector<std::unique_ptr<Runner>> lanes_;
+    Register* data_;                        //!< registers, lanes of a register adjacent
+    Register* laneMask_;                    //!< all bits set for the current group's lanes
+    std::vector<LaneGroup> pending_;
+    std::vector<Value> argv_;               //!< a lane's native call arguments
+};
+
+} // namespace FlowVM
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+size_t findBytes(const char* haystack, size_t n, const char* needle, size_t m);
+
+/**
+ * Whether the \p n bytes at \p a and \p b are equal.
+ *
+ * Plain memcmp(): the libc implementation beats hand-written word load and
+ * SIMD kernels at all lengths measured (see the string/eq benchmarks).
+ */
+inline bool equalBytes(const char* a, const char* b, size_t n)
+{
+    return std::memcmp(a, b, n) == 0;
+}
+
+/**
+ * Immutable, non-owning reference to a sequence of bytes (pointer + length).
+ *
+ * The referenced bytes are not required to be NUL-terminated.
+ */
+class BufferRef
+{
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    BufferRef() : data_(""), size_(0) {}
+    BufferRef(const char* data, size_t size) : data_(data), size_(size) {}
+    explicit BufferRef(const std::string& s) : data_(s.data()), size_(s.size()) {}
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+
+    char operator[](size_t i) const { return data_[i]; }
+
+    /** Sub-range starting at \p offset, clamped to the referenced bytes. */
+    BufferRef ref(size_t offset, size_t count = npos) const {
+        if (offset > size_)
+            offset = size_;
+        if (count > size_ - offset)
+            count = size_ - offset;
+        return BufferRef(data_ + offset, count);
+    }
+
+    std::string str() const { return std::string(data_, size_); }
+
+    bool begins(const BufferRef& v) const {
+        return size_ >= v.size_ && equalBytes(data_, v.data_, v.size_);
+    }
+
+    bool ends(const BufferRef& v) const {
+        return size_ >= v.size_ && equalBytes(data_ + size_ - v.size_, v.data_, v.size_);
+    }
+
+    /** Offset of the first occurrence of \p v, or npos. */
+    size_t find(const BufferRef& v) const { return findBytes(data_, size_, v.data_, v.size_); }
+
+    int compare(const BufferRef& v) const {
+        int rv = std::memcmp(data_, v.data_, size_ < v.size_ ? size_ : v.size_);
+        if (rv != 0)
+            return rv;
+        return size_ < v.size_ ? -1 : size_ > v.size_ ? 1 : 0;
+    }
+
+    bool operator==(const BufferRef& v) const { return size_ == v.size_ && equalBytes(data_, v.data_, size_); }
+    bool operator!=(const BufferRef& v) const { return !(*this == v); }
+    bool operator<(const BufferRef& v) const { return compare(v) < 0; }
+    bool operator>(const BufferRef& v) const { return compare(v) > 0; }
+    bool operator<=(const BufferRef& v) const { return compare(v) <= 0; }
+    bool operator>=(const BufferRef& v) const { return compare(v) >= 0; }
+
+    int64_t toInt() const;
+    std::string urlEncode() const;
+    std::string urlDecode() const;
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+} // namespace FlowVM
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <flow/vm/IPAddress.h>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+/**
+ * Network set of a PINCIDRSET instruction, compiled into a multibit trie.
+ *
+ * Each node consumes one address byte and stores two 256 bit maps: byte
+ * values whose addresses are all members (leaves), and byte values
+ * continuing in a child node. A node's children are stored consecutively,
+ * so a child is located by counting the set bits in front of it (poptrie).
+ *
+ * IPv4 addresses have a root of their own, thus an IPv4 lookup visits at
+ * most 4 nodes and an IPv6 lookup at most 16, regardless of the set's size.
+ */
+class CidrSet
+{
+public:
+    explicit CidrSet(const std::vector<Cidr>& networks);
+
+    bool contains(const IPAddress& ip) const;
+
+    /** The networks the set has been built from. */
+    const std::vector<Cidr>& networks() const { return networks_; }
+
+    /** Number of trie nodes, including the two roots. */
+    size_t nodeCount() const { return nodes_.size(); }
+
+private:
+    struct Node {
+        uint64_t leaves[4];
+        uint64_t children[4];
+        uint32_t base;                      //!< index of the first child
+        uint16_t rank[4];                   //!< children in front of each word
+    };
+
+    enum { V4Root = 0, V6Root = 1 };
+
+    std::vector<Cidr> networks_;
+    std::vector<Node> nodes_;
+};
+
+} // namespace FlowVM
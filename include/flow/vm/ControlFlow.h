@@ -0,0 +1,103 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <flow/vm/ArrayRef.h>
+#include <flow/vm/TraceSink.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <mutex>
+#include <map>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+class Program;
+class Handler;
+
+/** Whether execution may continue with the instruction following \p instr. */
+bool fallsThrough(Instruction instr);
+
+/**
+ * Collects the jump targets of a JMP, CONDBR, NSWITCH or SSWITCH.
+ *
+ * \param program the program providing the switch tables.
+ */
+void jumpTargets(Instruction instr, const Program* program, std::vector<size_t>* targets);
+
+/**
+ * A maximal sequence of instructions that is only entered at its first
+ * and only left after its last instruction.
+ */
+struct BasicBlock {
+    size_t begin;                       //!< offset of the first instruction
+    size_t end;                         //!< offset past the last instruction
+    std::vector<size_t> successors;     //!< successor blocks, the fall-through block first
+};
+
+/**
+ * Control flow graph of a handler's code over JMP, CONDBR, NSWITCH and
+ * SSWITCH targets.
+ *
+ * Superinstructions are not considered branches; the CONDBR they are
+ * fused with still ends the block.
+ */
+class ControlFlowGraph
+{
+public:
+    ControlFlowGraph(ArrayRef<Instruction> code, const Program* program);
+
+    const std::vector<BasicBlock>& blocks() const { return blocks_; }
+
+    /** Index of the block containing instruction \p ip. */
+    size_t blockOf(size_t ip) const { return blockOf_[ip]; }
+
+    /** Whether \p ip is the first instruction of a block. */
+    bool isLeader(size_t ip) const { return ip < blockOf_.size() && blocks_[blockOf_[ip]].begin == ip; }
+
+private:
+    std::vector<BasicBlock> blocks_;
+    std::vector<size_t> blockOf_;
+};
+
+/**
+ * Edge counts of a handler's control flow graph, as recorded by a ProfileSink.
+ *
+ * Edges are keyed by the offsets of the blocks' first instructions, so
+ * a profile is only meaningful for the very code it was recorded on.
+ */
+struct EdgeProfile {
+    std::map<std::pair<size_t, size_t>, uint64_t> edges;
+
+    uint64_t count(size_t from, size_t to) const;
+    void add(const EdgeProfile& other);
+};
+
+/**
+ * Trace sink recording the control flow edges taken while running a handler.
+ *
+ * Attach it via Handler::setTraceSink() for a sample of real runs, then
+ * pass profile() to Handler::relayout(). Runners attached to the sink may
+ * run concurrently.
+ */
+class ProfileSink : public TraceSink
+{
+public:
+    explicit ProfileSink(const Handler* handler);
+
+    void instruction(Runner* cx, size_t ip, Instruction instr) override;
+    void exit(Runner* cx, bool result, uint64_t ticks) override;
+
+    /** Snapshot of the edge counts recorded so far. */
+    EdgeProfile profile() const;
+    void reset();
+
+private:
+    ControlFlowGraph cfg_;
+    mutable std::mutex lock_;
+    std::unordered_map<Runner*, size_t> lastLeader_;    //!< block each runner currently executes
+    EdgeProfile profile_;
+};
+
+} // namespace FlowVM
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <flow/vm/Instruction.h>
+#include <flow/vm/ArrayRef.h>
+#include <flow/vm/Stats.h>
 #include <string>
 #include <vector>
 #include <memory>
@@ -10,6 +12,40 @@ namespace FlowVM {
 
 class Program;
 class Runner;
+struct EdgeProfile;
+class RunnerPoolSet;
+class TraceSink;
+class MachineCode;
+
+/**
+ * Selects the interpreter loop a Handler's code is executed with.
+ *
+ * Code containing WIDE prefixes always executes its decoded 64-bit form
+ * (see Handler::wideCode()), whichever interpreter is selected.
+ *
+ * Compiled handlers fall back to the direct-threaded (or wide) interpreter
+ * where machine code is not available, and in trace or counting mode.
+ */
+enum class ExecutionEngine {
+    TokenThreaded,      //!< decodes each 32-bit Instruction on dispatch
+    DirectThreaded,     //!< executes the pre-decoded ThreadedInstruction stream
+    Compiled,           //!< executes x86-64 machine code (see MachineCode), if available
+};
+
+/**
+ * Pre-decoded instruction, as executed by the direct-threaded interpreter.
+ *
+ * Jump targets (D) remain instruction offsets, as the threaded code
+ * maps 1:1 onto the handler's token stream.
+ */
+struct ThreadedInstruction {
+    const void* label;  //!< address of the opcode's implementation
+    Operand A;
+    Operand B;
+    Operand C;
+    ImmOperand D;
+    uint8_t opcode;     //!< the instruction's Opcode, for statistics
+};
 
 class Handler
 {
@@ -24,24 +60,76 @@ public:
     Program* program() const { return program_; }
 
     const std::string& name() const { return name_; }
-    void setName(const std::string& name) { name_ = name; }
+    void setName(const std::string& name);
 
     size_t registerCount() const { return registerCount_; }
 
-    const std::vector<Instruction>& code() const { return code_; }
+    ArrayRef<Instruction> code() const { return code_; }
     void setCode(const std::vector<Instruction>& code);
     void setCode(std::vector<Instruction>&& code);
+    void setCodeRef(ArrayRef<Instruction> code);
+
+    bool relayout(const EdgeProfile& profile);
+
+    /** Optimization level applied by setCode() (see optimize()). */
+    int optimizationLevel() const { return optimizationLevel_; }
+    void setOptimizationLevel(int level) { optimizationLevel_ = level; }
+
+    const std::vector<ThreadedInstruction>& threadedCode() const { return threadedCode_; }
+
+    /** Whether the code contains WIDE prefixes, and thus runs from wideCode(). */
+    bool isWide() const { return !wideCode_.empty(); }
+
+    /** The code decoded by widen() if isWide(), empty otherwise. */
+    const std::vector<WideInstruction>& wideCode() const { return wideCode_; }
+
+    ExecutionEngine engine() const { return engine_; }
+    void setEngine(ExecutionEngine engine);
+
+    /** The compiled code if engine() is ExecutionEngine::Compiled, \c nullptr otherwise. */
+    const MachineCode* machineCode() const { return machineCode_.get(); }
+
+    /** Default trace sink for Runners of this handler (\c nullptr for release mode). */
+    TraceSink* traceSink() const { return traceSink_; }
+    void setTraceSink(TraceSink* sink) { traceSink_ = sink; }
+
+    /** Whether the code reads the instruction counter (NTICKS). */
+    bool countsTicks() const { return countsTicks_; }
+
+    /** Snapshot of this handler's execution counters (all zero unless built with FLOW_STATS). */
+    ExecutionCounters stats() const;
+    void resetStats();
 
     std::unique_ptr<Runner> createRunner();
+    RunnerPoolSet& runnerPools() const { return *runnerPools_; }
     bool run(void* userdata = nullptr);
 
     void disassemble();
 
 private:
     Program* program_;
+    int index_;                             //!< in program_'s handler table, or -1
     std::string name_;
     size_t registerCount_;
-    std::vector<Instruction> code_;
+    ArrayRef<Instruction> code_;            //!< either codeStorage_ or external
+    std::vector<Instruction> codeStorage_;
+    std::vector<ThreadedInstruction> threadedCode_;
+    std::vector<WideInstruction> wideCode_;
+    ExecutionEngine engine_;
+    std::shared_ptr<MachineCode> machineCode_;     //!< shared by copies of the handler
+    int optimizationLevel_;
+    TraceSink* traceSink_;
+    bool countsTicks_;
+    std::unique_ptr<RunnerPoolSet> runnerPools_;
+    std::unique_ptr<ExecutionCounters> counters_;   //!< only allocated with FLOW_STATS
+
+    bool isFrozen(const char* what) const;
+    void analyze();
+    void compile();
+
+    friend class Program;
+    friend class Runner;
+    void recordRun(uint64_t runs, uint64_t instructions, const uint64_t* opcodes);
 };
 
 } // namespace FlowVM
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <flow/vm/BufferRef.h>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+/**
+ * An IPv4 or IPv6 address, stored inline as 128 bits.
+ *
+ * IPv4 addresses are kept IPv4-mapped (::ffff:a.b.c.d), so both families
+ * share one representation and compare as plain integers. Addresses are
+ * trivially copyable and used in place from mapped program files.
+ */
+class IPAddress
+{
+public:
+    enum Family { V4 = 4, V6 = 6 };
+
+    /** Maximum length of a formatted address, excluding the NUL. */
+    enum { MaxStringSize = 45 };
+
+    IPAddress() : hi_(0), lo_(0) {}
+    IPAddress(uint64_t hi, uint64_t lo) : hi_(hi), lo_(lo) {}
+
+    static IPAddress fromV4(uint32_t address);
+    static IPAddress fromBytes(const uint8_t* bytes, size_t size);
+    static bool parse(const BufferRef& text, IPAddress* result);
+
+    Family family() const { return isV4() ? V4 : V6; }
+    bool isV4() const { return hi_ == 0 && (lo_ >> 32) == 0xFFFF; }
+
+    /** The IPv4 address in host byte order, if isV4(). */
+    uint32_t v4() const { return static_cast<uint32_t>(lo_); }
+
+    /** The upper and lower 64 address bits, in host byte order. */
+    uint64_t hi() const { return hi_; }
+    uint64_t lo() const { return lo_; }
+
+    /** Address byte \p i (0 to 15) in network byte order. */
+    unsigned byte(size_t i) const {
+        return (i < 8 ? hi_ >> (56 - 8 * i) : lo_ >> (120 - 8 * i)) & 0xFF;
+    }
+
+    size_t format(char* buf, size_t size) const;
+    std::string str() const;
+
+    bool operator==(const IPAddress& other) const { return hi_ == other.hi_ && lo_ == other.lo_; }
+    bool operator!=(const IPAddress& other) const { return !(*this == other); }
+    bool operator<(const IPAddress& other) const {
+        return hi_ < other.hi_ || (hi_ == other.hi_ && lo_ < other.lo_);
+    }
+
+private:
+    uint64_t hi_;
+    uint64_t lo_;
+};
+
+/**
+ * A network in CIDR notation, such as 10.10.0.0/19 or 3ffe::/16.
+ *
+ * The prefix length is kept within the 128 bit address space (IPv4
+ * networks are IPv4-mapped, too) and host bits are cleared on construction.
+ */
+class Cidr
+{
+public:
+    Cidr() : address_(), bits_(0), reserved_(0) {}
+    Cidr(const IPAddress& address, size_t prefix);
+
+    static Cidr fromBits(const IPAddress& address, size_t bits);
+    static bool parse(const BufferRef& text, Cidr* result);
+
+    const IPAddress& address() const { return address_; }
+
+    /** The prefix length as written, i.e. relative to the address family. */
+    size_t prefix() const { return address_.isV4() ? bits_ - 96 : bits_; }
+
+    /** The prefix length within the 128 bit address space. */
+    size_t bits() const { return bits_; }
+
+    bool contains(const IPAddress& ip) const;
+
+    std::string str() const;
+
+    bool operator==(const Cidr& other) const { return address_ == other.address_ && bits_ == other.bits_; }
+    bool operator!=(const Cidr& other) const { return !(*this == other); }
+
+private:
+    void assign(const IPAddress& address, size_t bits);
+
+    IPAddress address_;
+    uint32_t bits_;
+    uint32_t reserved_;
+};
+
+// {{{ inlines
+inline IPAddress IPAddress::fromV4(uint32_t address)
+{
+    return IPAddress(0, (uint64_t(0xFFFF) << 32) | address);
+}
+
+inline bool Cidr::contains(const IPAddress& ip) const
+{
+    const uint64_t hiMask = bits_ >= 64 ? ~uint64_t(0) : bits_ ? ~uint64_t(0) << (64 - bits_) : 0;
+    const uint64_t loMask = bits_ >= 128 ? ~uint64_t(0) : bits_ > 64 ? ~uint64_t(0) << (128 - bits_) : 0;
+
+    return ((ip.hi() ^ address_.hi()) & hiMask) == 0
+        && ((ip.lo() ^ address_.lo()) & loMask) == 0;
+}
+// }}}
+
+} // namespace FlowVM
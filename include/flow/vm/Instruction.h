@@ -2,6 +2,7 @@
 
 #include <sys/param.h> // size_t, odd that it's not part of <stdint.h>.
 #include <stdint.h>
+#include <stdio.h>
 #include <vector>
 
 namespace FlowVM {
@@ -11,6 +12,8 @@ enum Opcode {
     EXIT = 0,       // exit program
     JMP,            // unconditional jump
     CONDBR,         // conditional jump
+    NSWITCH,        // jump to numberSwitches[D].lookup(A)
+    SSWITCH,        // jump to stringSwitches[D].lookup(A)
 
     // debugging
     NTICKS,         // instruction performance counter
@@ -55,16 +58,28 @@ enum Opcode {
     SCMPBEG,        // A = B =^ C           /* B begins with C */
     SCMPEND,        // A = B =$ C           /* B ends with C */
     SCONTAINS,      // A = B in C           /* B is contained in C */
+    SINSET,         // A = B in C           /* B is one of stringSets[int(C)] */
     SLEN,           // A = strlen(B)
     SPRINT,         // puts(A)              /* prints string A to stdout */
 
     // regex
-    SREGMATCH,      // A = B =~ C           /* regex match against regexPool[C] */
-    SREGGROUP,      // A = regex.match(B)   /* regex match result */
+    SREGMATCH,      // A = B =~ C           /* regex match against regexPool[int(C)] */
+    SREGGROUP,      // A = regex.group(B)   /* capture group int(B) of the last match */
+
+    // ip
+    PCONST,         // A = ipaddrConstants[D]
+    PCMPEQ,         // A = B == C
+    PCMPNE,         // A = B != C
+    PINCIDR,        // A = B in C           /* ip B is part of network C */
+    PINCIDRSET,     // A = B in C           /* ip B is part of cidrSets[int(C)] */
+
+    // cidr
+    CCONST,         // A = cidrConstants[D]
 
     // conversion
     I2S,            // A = itoa(B)
     S2I,            // A = atoi(B)
+    P2S,            // A = ip2str(B)
     SURLENC,        // A = urlencode(B)
     SURLDEC,        // A = urldecode(B)
 
@@ -72,8 +87,25 @@ enum Opcode {
     // CALL A=id, B=argc, C=argv
     CALL,           // A = functions[B+0] (B+1 ... B+C)
     HANDLER,        // if (handlers[B+0] (B+1 ... B+C)) EXIT 1
+
+    // superinstructions, fused with the instruction that follows them (see Peephole.h)
+    NCMPEQBR,       // A = B == C; CONDBR A, next.D
+    NCMPNEBR,       // A = B != C; CONDBR A, next.D
+    NCMPLEBR,       // A = B <= C; CONDBR A, next.D
+    NCMPGEBR,       // A = B >= C; CONDBR A, next.D
+    NCMPLTBR,       // A = B < C; CONDBR A, next.D
+    NCMPGTBR,       // A = B > C; CONDBR A, next.D
+    SCMPEQBR,       // A = B == C; CONDBR A, next.D
+    SCMPNEBR,       // A = B != C; CONDBR A, next.D
+    NADDI,          // A = D/imm; next.A = next.B + next.C
+
+    // prefix
+    WIDE,           // high operand bits of the next instruction (see widen())
 };
 
+/** Number of opcodes, i.e. the last opcode plus one. */
+constexpr size_t OpcodeCount = Opcode::WIDE + 1;
+
 enum class InstructionSig {
     None = 0,   //               ()
     R,          // reg           (A)
@@ -87,6 +119,15 @@ typedef uint32_t Instruction;
 typedef uint8_t Operand;
 typedef uint16_t ImmOperand;
 
+/**
+ * Decoded form of an instruction, including the operand bits of its WIDE
+ * prefix: opcode (8 bits), A, B and C (16 bits each), D overlapping B and C
+ * (32 bits), laid out like Instruction.
+ */
+typedef uint64_t WideInstruction;
+typedef uint16_t WideOperand;
+typedef uint32_t WideImmOperand;
+
 // --------------------------------------------------------------------------
 // encoder
 
@@ -97,17 +138,38 @@ constexpr Instruction makeInstruction(Opcode opc, Operand op1, Operand op2, Oper
 constexpr Instruction makeInstructionImm(Opcode opc, ImmOperand op2) { return (opc | (op2 << 16)); }
 constexpr Instruction makeInstructionImm(Opcode opc, Operand op1, ImmOperand op2) { return (opc | (op1 << 8) | (op2 << 16)); }
 
+constexpr WideInstruction makeWideInstruction(Opcode opc) { return (WideInstruction) opc; }
+constexpr WideInstruction makeWideInstruction(Opcode opc, WideOperand op1) { return (opc | ((WideInstruction) op1 << 8)); }
+constexpr WideInstruction makeWideInstruction(Opcode opc, WideOperand op1, WideOperand op2) { return (opc | ((WideInstruction) op1 << 8) | ((WideInstruction) op2 << 24)); }
+constexpr WideInstruction makeWideInstruction(Opcode opc, WideOperand op1, WideOperand op2, WideOperand op3) { return (opc | ((WideInstruction) op1 << 8) | ((WideInstruction) op2 << 24) | ((WideInstruction) op3 << 40)); }
+constexpr WideInstruction makeWideInstructionImm(Opcode opc, WideImmOperand op2) { return (opc | ((WideInstruction) op2 << 24)); }
+constexpr WideInstruction makeWideInstructionImm(Opcode opc, WideOperand op1, WideImmOperand op2) { return (opc | ((WideInstruction) op1 << 8) | ((WideInstruction) op2 << 24)); }
+
+bool isWide(WideInstruction instr);
+size_t appendInstruction(std::vector<Instruction>& code, WideInstruction instr);
+
 // --------------------------------------------------------------------------
 // decoder
 
-void disassemble(Instruction pc, ImmOperand ip, const char* comment = nullptr);
+void disassemble(Instruction pc, size_t ip, const char* comment = nullptr);
+void disassemble(FILE* out, Instruction pc, size_t ip, const char* comment = nullptr);
+void disassemble(FILE* out, WideInstruction pc, size_t ip, const char* comment = nullptr);
 void disassemble(const Instruction* program, size_t n);
 
 constexpr Opcode opcode(Instruction instr) { return static_cast<Opcode>(instr & 0xFF); }
 constexpr Operand operandA(Instruction instr) { return static_cast<Operand>((instr >> 8) & 0xFF); }
 constexpr Operand operandB(Instruction instr) { return static_cast<Operand>((instr >> 16) & 0xFF); }
 constexpr Operand operandC(Instruction instr) { return static_cast<Operand>((instr >> 24) & 0xFF); }
-constexpr ImmOperand operandD(Instruction instr) { return static_cast<Operand>((instr >> 16) & 0xFFFF); }
+constexpr ImmOperand operandD(Instruction instr) { return static_cast<ImmOperand>((instr >> 16) & 0xFFFF); }
+
+constexpr Opcode opcode(WideInstruction instr) { return static_cast<Opcode>(instr & 0xFF); }
+constexpr WideOperand operandA(WideInstruction instr) { return static_cast<WideOperand>((instr >> 8) & 0xFFFF); }
+constexpr WideOperand operandB(WideInstruction instr) { return static_cast<WideOperand>((instr >> 24) & 0xFFFF); }
+constexpr WideOperand operandC(WideInstruction instr) { return static_cast<WideOperand>((instr >> 40) & 0xFFFF); }
+constexpr WideImmOperand operandD(WideInstruction instr) { return static_cast<WideImmOperand>((instr >> 24) & 0xFFFFFFFF); }
+
+WideInstruction widen(Instruction prefix, Instruction instr);
+bool widen(const Instruction* code, size_t size, std::vector<WideInstruction>* result);
 
 inline InstructionSig operandSignature(Opcode opc);
 inline const char* mnemonic(Opcode opc);
@@ -117,6 +179,7 @@ inline const char* mnemonic(Opcode opc);
 
 size_t computeRegisterCount(const Instruction* code, size_t size);
 size_t registerMax(Instruction instr);
+size_t registerMax(WideInstruction instr);
 
 // {{{ inlines
 inline InstructionSig operandSignature(Opcode opc) {
@@ -125,6 +188,8 @@ inline InstructionSig operandSignature(Opcode opc) {
         [Opcode::EXIT]      = InstructionSig::I,
         [Opcode::JMP]       = InstructionSig::I,
         [Opcode::CONDBR]    = InstructionSig::RI,
+        [Opcode::NSWITCH]   = InstructionSig::RI,
+        [Opcode::SSWITCH]   = InstructionSig::RI,
         // debug
         [Opcode::NTICKS]    = InstructionSig::R,
         [Opcode::NDUMPN]    = InstructionSig::RI,
@@ -154,6 +219,7 @@ inline InstructionSig operandSignature(Opcode opc) {
         // string
         [Opcode::SCONST]    = InstructionSig::RI,
         [Opcode::SADD]      = InstructionSig::RRR,
+        [Opcode::SADDMULTI] = InstructionSig::RRR,
         [Opcode::SSUBSTR]   = InstructionSig::RRR,
         [Opcode::SCMPEQ]    = InstructionSig::RRR,
         [Opcode::SCMPNE]    = InstructionSig::RRR,
@@ -164,19 +230,41 @@ inline InstructionSig operandSignature(Opcode opc) {
         [Opcode::SCMPBEG]   = InstructionSig::RRR,
         [Opcode::SCMPEND]   = InstructionSig::RRR,
         [Opcode::SCONTAINS] = InstructionSig::RRR,
-        [Opcode::SLEN]      = InstructionSig::R,
+        [Opcode::SINSET]    = InstructionSig::RRR,
+        [Opcode::SLEN]      = InstructionSig::RR,
         [Opcode::SPRINT]    = InstructionSig::R,
         // regex
         [Opcode::SREGMATCH] = InstructionSig::RRR,
-        [Opcode::SREGGROUP] = InstructionSig::R,
+        [Opcode::SREGGROUP] = InstructionSig::RR,
+        // ip
+        [Opcode::PCONST]     = InstructionSig::RI,
+        [Opcode::PCMPEQ]     = InstructionSig::RRR,
+        [Opcode::PCMPNE]     = InstructionSig::RRR,
+        [Opcode::PINCIDR]    = InstructionSig::RRR,
+        [Opcode::PINCIDRSET] = InstructionSig::RRR,
+        // cidr
+        [Opcode::CCONST]     = InstructionSig::RI,
         // conversion
         [Opcode::I2S]       = InstructionSig::RR,
         [Opcode::S2I]       = InstructionSig::RR,
+        [Opcode::P2S]       = InstructionSig::RR,
         [Opcode::SURLENC]   = InstructionSig::RR,
         [Opcode::SURLDEC]   = InstructionSig::RR,
         // invokation
         [Opcode::CALL]      = InstructionSig::RRR,
         [Opcode::HANDLER]   = InstructionSig::RRR,
+        // superinstructions
+        [Opcode::NCMPEQBR]  = InstructionSig::RRR,
+        [Opcode::NCMPNEBR]  = InstructionSig::RRR,
+        [Opcode::NCMPLEBR]  = InstructionSig::RRR,
+        [Opcode::NCMPGEBR]  = InstructionSig::RRR,
+        [Opcode::NCMPLTBR]  = InstructionSig::RRR,
+        [Opcode::NCMPGTBR]  = InstructionSig::RRR,
+        [Opcode::SCMPEQBR]  = InstructionSig::RRR,
+        [Opcode::SCMPNEBR]  = InstructionSig::RRR,
+        [Opcode::NADDI]     = InstructionSig::RI,
+        // prefix
+        [Opcode::WIDE]      = InstructionSig::None,
     };
     return map[opc];
 };
@@ -187,11 +275,13 @@ inline const char* mnemonic(Opcode opc) {
         [Opcode::EXIT]   = "EXIT",
         [Opcode::JMP]    = "JMP",
         [Opcode::CONDBR] = "CONDBR",
-        // copy
-        [Opcode::MOV]    = "MOV",
+        [Opcode::NSWITCH] = "NSWITCH",
+        [Opcode::SSWITCH] = "SSWITCH",
         // debug
         [Opcode::NTICKS] = "NTICKS",
         [Opcode::NDUMPN] = "NDUMPN",
+        // copy
+        [Opcode::MOV]    = "MOV",
         // numerical
         [Opcode::IMOV]   = "IMOV",
         [Opcode::NCONST] = "NCONST",
@@ -216,6 +306,7 @@ inline const char* mnemonic(Opcode opc) {
         // string
         [Opcode::SCONST]    = "SCONST",
         [Opcode::SADD]      = "SADD",
+        [Opcode::SADDMULTI] = "SADDMULTI",
         [Opcode::SSUBSTR]   = "SSUBSTR",
         [Opcode::SCMPEQ]    = "SCMPEQ",
         [Opcode::SCMPNE]    = "SCMPNE",
@@ -226,19 +317,41 @@ inline const char* mnemonic(Opcode opc) {
         [Opcode::SCMPBEG]   = "SCMPBEG",
         [Opcode::SCMPEND]   = "SCMPEND",
         [Opcode::SCONTAINS] = "SCONTAINS",
+        [Opcode::SINSET]    = "SINSET",
         [Opcode::SLEN]      = "SLEN",
         [Opcode::SPRINT]    = "SPRINT",
         // regex
         [Opcode::SREGMATCH] = "SREGMATCH",
         [Opcode::SREGGROUP] = "SREGGROUP",
+        // ip
+        [Opcode::PCONST]     = "PCONST",
+        [Opcode::PCMPEQ]     = "PCMPEQ",
+        [Opcode::PCMPNE]     = "PCMPNE",
+        [Opcode::PINCIDR]    = "PINCIDR",
+        [Opcode::PINCIDRSET] = "PINCIDRSET",
+        // cidr
+        [Opcode::CCONST]     = "CCONST",
         // conversion
         [Opcode::I2S]       = "I2S",
         [Opcode::S2I]       = "S2I",
+        [Opcode::P2S]       = "P2S",
         [Opcode::SURLENC]   = "SURLENC",
         [Opcode::SURLDEC]   = "SURLDEC",
         // invokation
         [Opcode::CALL]      = "CALL",
         [Opcode::HANDLER]   = "HANDLER",
+        // superinstructions
+        [Opcode::NCMPEQBR]  = "NCMPEQBR",
+        [Opcode::NCMPNEBR]  = "NCMPNEBR",
+        [Opcode::NCMPLEBR]  = "NCMPLEBR",
+        [Opcode::NCMPGEBR]  = "NCMPGEBR",
+        [Opcode::NCMPLTBR]  = "NCMPLTBR",
+        [Opcode::NCMPGTBR]  = "NCMPGTBR",
+        [Opcode::SCMPEQBR]  = "SCMPEQBR",
+        [Opcode::SCMPNEBR]  = "SCMPNEBR",
+        [Opcode::NADDI]     = "NADDI",
+        // prefix
+        [Opcode::WIDE]      = "WIDE",
     };
     return map[opc];
 }
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+class Handler;
+class Runner;
+
+typedef uint64_t Register;
+
+/**
+ * x86-64 machine code compiled from a Handler's code (template JIT).
+ *
+ * Each instruction is translated on its own, keeping all registers in the
+ * Runner's register file. Number arithmetic, comparisons and jumps are
+ * emitted inline; string, IP, regex and switch ops as well as natives call
+ * helpers working on the same runtime structures as the interpreter.
+ *
+ * Instructions without a translation (the debug ops) leave the machine
+ * code, and the interpreter continues the run from there. Runs suspended
+ * by a native continue in machine code once resumed.
+ */
+class MachineCode
+{
+public:
+    /** How run() ended, in the lowest two bits of its result. */
+    enum Status {
+        ExitFalse = 0,
+        ExitTrue = 1,
+        Suspended = 2,      //!< at the CALL or HANDLER above the status bits
+        Interpret = 3,      //!< the instruction above the status bits has to be interpreted
+    };
+
+    static bool isAvailable();
+    static std::unique_ptr<MachineCode> compile(const Handler* handler);
+
+    ~MachineCode();
+
+    /**
+     * Executes the code from instruction offset \p pc on.
+     *
+     * \param runner the Runner passed to natives and helpers.
+     * \param data the register file, usually the runner's.
+     * \return the Status, or-ed with the offset of the instruction it refers
+     *         to shifted left by two bits.
+     */
+    uint64_t run(Runner* runner, Register* data, size_t pc) const { return entry_(runner, data, pc); }
+
+    /** Size of the mapped code, including the instructions' address table. */
+    size_t size() const { return size_; }
+
+private:
+    typedef uint64_t (*Entry)(Runner* runner, Register* data, size_t pc);
+
+    MachineCode(void* memory, size_t size);
+    MachineCode(const MachineCode&) = delete;
+    MachineCode& operator=(const MachineCode&) = delete;
+
+    void* memory_;
+    size_t size_;
+    Entry entry_;
+};
+
+} // namespace FlowVM
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <flow/vm/Type.h>
+#include <flow/vm/IPAddress.h>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+typedef uint64_t Value;
+
+class Runner;
+class Handler;
+
+typedef std::function<void(int argc, Value* argv, Runner* cx)> NativeCallback;
+
+struct NativeBinding;
+
+typedef void (*NativeThunk)(const NativeBinding& binding, int argc, Value* argv, Runner* cx);
+
+/**
+ * The function a native callback is bound to.
+ *
+ * The thunk knows the function's real type and unmarshals \c argv for it.
+ * Function and member function pointers are stored inline, so invoking a
+ * native does not go through std::function nor allocate.
+ */
+struct NativeBinding {
+    NativeThunk thunk;
+    void* object;                       //!< object a member function is bound to
+    char pointer[2 * sizeof(void*)];    //!< function or member function pointer
+    NativeCallback function;            //!< type-erased callback, if bound to one
+
+    NativeBinding() : thunk(nullptr), object(nullptr), pointer(), function() {}
+
+    template<typename T>
+    void setPointer(T p) {
+        static_assert(sizeof(T) <= sizeof(pointer), "Function pointer too large.");
+        memcpy(pointer, &p, sizeof(p));
+    }
+
+    template<typename T>
+    T getPointer() const {
+        T p;
+        memcpy(&p, pointer, sizeof(p));
+        return p;
+    }
+};
+
+// {{{ argument and result marshalling
+/**
+ * Maps a native's C++ parameter type to its Flow type and unmarshals it
+ * from an argv slot.
+ *
+ * A leading Runner* parameter receives the calling Runner instead and is
+ * not part of the signature.
+ */
+template<typename T> struct NativeArg;
+
+template<> struct NativeArg<bool> {
+    static Type type() { return Type::Boolean; }
+    static bool get(Value v, Runner*) { return v != 0; }
+};
+
+template<> struct NativeArg<Number> {
+    static Type type() { return Type::Number; }
+    static Number get(Value v, Runner*) { return static_cast<Number>(v); }
+};
+
+template<> struct NativeArg<String> {
+    static Type type() { return Type::String; }
+    static const String& get(Value v, Runner*) { return *reinterpret_cast<const String*>(v); }
+};
+
+template<> struct NativeArg<IPAddress> {
+    static Type type() { return Type::IPAddress; }
+    static const IPAddress& get(Value v, Runner*) { return *reinterpret_cast<const IPAddress*>(v); }
+};
+
+template<> struct NativeArg<Cidr> {
+    static Type type() { return Type::Cidr; }
+    static const Cidr& get(Value v, Runner*) { return *reinterpret_cast<const Cidr*>(v); }
+};
+
+template<> struct NativeArg<Handler*> {
+    static Type type() { return Type::Handler; }
+    static Handler* get(Value v, Runner* cx);
+};
+
+template<> struct NativeArg<Runner*> {
+    static Type type() { return Type::Void; }
+    static Runner* get(Value, Runner* cx) { return cx; }
+};
+
+/**
+ * Maps a native's C++ return type to its Flow type and marshals it into argv[0].
+ *
+ * Returned Strings are referenced, not copied, so they must outlive the
+ * current run; return a std::string to have it copied into the Runner.
+ * A returned <tt>const String*</tt> is borrowed as is, without allocating
+ * anything, so the host must keep the String object itself alive, too
+ * (e.g. a request's header table). The same applies to IPAddress results.
+ */
+template<typename T> struct NativeResult;
+
+template<> struct NativeResult<void> {
+    static Type type() { return Type::Void; }
+};
+
+template<> struct NativeResult<bool> {
+    static Type type() { return Type::Boolean; }
+    static void set(Value* argv, bool v, Runner*) { argv[0] = v; }
+};
+
+template<> struct NativeResult<Number> {
+    static Type type() { return Type::Number; }
+    static void set(Value* argv, Number v, Runner*) { argv[0] = static_cast<Value>(v); }
+};
+
+template<> struct NativeResult<String> {
+    static Type type() { return Type::String; }
+    static void set(Value* argv, const String& v, Runner* cx);
+};
+
+template<> struct NativeResult<const String*> {
+    static Type type() { return Type::String; }
+    static void set(Value* argv, const String* v, Runner*) { argv[0] = reinterpret_cast<Value>(v); }
+};
+
+template<> struct NativeResult<IPAddress> {
+    static Type type() { return Type::IPAddress; }
+    static void set(Value* argv, const IPAddress& v, Runner* cx);
+};
+
+template<> struct NativeResult<const IPAddress*> {
+    static Type type() { return Type::IPAddress; }
+    static void set(Value* argv, const IPAddress* v, Runner*) { argv[0] = reinterpret_cast<Value>(v); }
+};
+
+template<> struct NativeResult<std::string> {
+    static Type type() { return Type::String; }
+    static void set(Value* argv, const std::string& v, Runner* cx);
+};
+// }}}
+// {{{ thunks
+template<size_t... I> struct NativeIndices {};
+
+template<size_t N, size_t... I>
+struct NativeMakeIndices : NativeMakeIndices<N - 1, N - 1, I...> {};
+
+template<size_t... I>
+struct NativeMakeIndices<0, I...> { typedef NativeIndices<I...> type; };
+
+template<typename... Args>
+struct NativeLeadingContext : std::false_type {};
+
+template<typename... Rest>
+struct NativeLeadingContext<Runner*, Rest...> : std::true_type {};
+
+template<typename... Args>
+struct NativeContextCount : std::integral_constant<size_t, 0> {};
+
+template<typename Arg1, typename... Rest>
+struct NativeContextCount<Arg1, Rest...> : std::integral_constant<size_t,
+    (std::is_same<Arg1, Runner*>::value ? 1 : 0) + NativeContextCount<Rest...>::value> {};
+
+template<typename R>
+struct NativeReturn {
+    template<typename F, typename... A>
+    static void call(Value* argv, Runner* cx, const F& f, A&&... args) {
+        NativeResult<typename std::decay<R>::type>::set(argv, f(std::forward<A>(args)...), cx);
+    }
+};
+
+template<>
+struct NativeReturn<void> {
+    template<typename F, typename... A>
+    static void call(Value* argv, Runner* cx, const F& f, A&&... args) {
+        f(std::forward<A>(args)...);
+    }
+};
+
+template<typename R, typename... Args>
+struct NativeSignature {
+    static const size_t leading = NativeLeadingContext<typename std::decay<Args>::type...>::value ? 1 : 0;
+
+    static_assert(NativeContextCount<typename std::decay<Args>::type...>::value == leading,
+                  "Runner* is only supported as a native's first parameter.");
+
+    static Type returnType() { return NativeResult<typename std::decay<R>::type>::type(); }
+
+    static std::vector<Type> args() {
+        const Type types[] = { NativeArg<typename std::decay<Args>::type>::type()..., Type::Void };
+        std::vector<Type> result;
+        for (size_t i = 0; i != sizeof...(Args); ++i)
+            if (types[i] != Type::Void)
+                result.push_back(types[i]);
+        return result;
+    }
+
+    template<typename F>
+    static void call(const F& f, Value* argv, Runner* cx) {
+        call(f, argv, cx, typename NativeMakeIndices<sizeof...(Args)>::type());
+    }
+
+    template<typename F, size_t... I>
+    static void call(const F& f, Value* argv, Runner* cx, NativeIndices<I...>) {
+        NativeReturn<R>::call(argv, cx, f,
+            NativeArg<typename std::decay<Args>::type>::get(argv[I + 1 - leading], cx)...);
+    }
+};
+
+template<typename Class, typename R, typename... Args>
+struct NativeMethodCall {
+    Class* object;
+    R (Class::*method)(Args...);
+
+    R operator()(Args... args) const { return (object->*method)(args...); }
+};
+
+template<typename R, typename... Args>
+void nativeFunctionThunk(const NativeBinding& binding, int, Value* argv, Runner* cx)
+{
+    NativeSignature<R, Args...>::call(binding.getPointer<R (*)(Args...)>(), argv, cx);
+}
+
+template<typename Class, typename R, typename... Args>
+void nativeMethodThunk(const NativeBinding& binding, int, Value* argv, Runner* cx)
+{
+    NativeMethodCall<Class, R, Args...> call = {
+        static_cast<Class*>(binding.object),
+        binding.getPointer<R (Class::*)(Args...)>()
+    };
+    NativeSignature<R, Args...>::call(call, argv, cx);
+}
+
+template<typename Class>
+void nativeRawMethodThunk(const NativeBinding& binding, int argc, Value* argv, Runner* cx)
+{
+    typedef void (Class::*Method)(int, Value*, Runner*);
+    (static_cast<Class*>(binding.object)->*binding.getPointer<Method>())(argc, argv, cx);
+}
+
+inline void nativeCallbackThunk(const NativeBinding& binding, int argc, Value* argv, Runner* cx)
+{
+    binding.function(argc, argv, cx);
+}
+// }}}
+
+} // namespace FlowVM
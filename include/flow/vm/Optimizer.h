@@ -0,0 +1,90 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <flow/vm/ControlFlow.h>
+#include <vector>
+
+namespace FlowVM {
+
+class Program;
+
+/**
+ * \name Bytecode optimization passes
+ *
+ * Passes that remove instructions replace them by a jump to the next
+ * instruction (a no-op) and leave the actual removal to removeNops(), so
+ * that all passes but the latter keep every instruction's position.
+ *
+ * Passes taking a \p program may add constants to its tables; \p program
+ * may be \c nullptr, in which case fewer instructions can be folded.
+ *
+ * The passes operate on the 32-bit encoding only, so code containing WIDE
+ * prefixes must not be passed to them (optimize() leaves it as is).
+ */
+//@{
+
+/**
+ * Folds constant arithmetic, comparisons, string operations, conditional
+ * branches and switches, and propagates register copies, within basic blocks.
+ *
+ * \retval true instructions have been rewritten.
+ */
+bool foldConstants(std::vector<Instruction>& code, Program* program);
+
+/**
+ * Turns unreachable instructions and stores to registers that are never
+ * read into no-ops, based on a liveness analysis over the control flow graph.
+ *
+ * \retval true instructions have been removed.
+ */
+bool eliminateDeadCode(std::vector<Instruction>& code, const Program* program);
+
+/**
+ * Removes no-ops and jumps to the next instruction, rewriting jump
+ * targets. Switch tables of a program shared with other code are not
+ * modified; remapped copies are added to \p program instead.
+ *
+ * \retval true instructions have been removed.
+ */
+bool removeNops(std::vector<Instruction>& code, Program* program);
+
+/**
+ * Renumbers registers so that registers with disjoint live ranges share
+ * the same register, packing the code into as few registers as possible.
+ *
+ * Register windows (CALL/HANDLER argv, SADDMULTI, SSUBSTR and NDUMPN
+ * operands) are kept contiguous. Code calling natives with an argument
+ * count not loaded by IMOV/NCONST within the same basic block is left as is.
+ *
+ * \retval true registers have been renumbered.
+ */
+bool allocateRegisters(std::vector<Instruction>& code, const Program* program);
+
+/**
+ * Reorders basic blocks by a recorded \p profile (see ProfileSink), so that
+ * the hottest successor of each block falls through, and moves blocks never
+ * executed to the end. Jump targets and switch tables are re-encoded, JMPs
+ * to the next block dropped and JMPs added where a block no longer falls
+ * through to its successor.
+ *
+ * \p code must not contain superinstructions (see unfuseInstructions()) and
+ * must be the code \p profile was recorded on, modulo fusion.
+ *
+ * \retval true blocks have been reordered.
+ */
+bool relayoutBlocks(std::vector<Instruction>& code, Program* program, const EdgeProfile& profile);
+
+/**
+ * Optimizes a handler's code.
+ *
+ * \param code the instruction stream to optimize in place.
+ * \param program the program the code belongs to, or \c nullptr.
+ * \param level 0 leaves the code untouched, 1 runs the peephole passes
+ *              (see Peephole.h) and 2 additionally runs all passes above.
+ *              Code containing WIDE prefixes is always left untouched.
+ */
+void optimize(std::vector<Instruction>& code, Program* program, int level);
+
+//@}
+
+} // namespace FlowVM
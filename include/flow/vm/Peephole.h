@@ -0,0 +1,50 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <vector>
+#include <cstddef>
+
+namespace FlowVM {
+
+/**
+ * \name Peephole optimizations
+ *
+ * These passes rewrite instructions in place and keep the position of
+ * every instruction, so jump targets and switch tables stay valid.
+ */
+//@{
+
+/**
+ * Retargets JMP and CONDBR instructions that point to a JMP to the end of
+ * the JMP chain, and replaces a JMP to an EXIT with that EXIT.
+ *
+ * \return the number of rewritten instructions.
+ */
+size_t threadJumps(std::vector<Instruction>& code);
+
+/**
+ * Fuses common instruction pairs into superinstructions.
+ *
+ * The first instruction's opcode is replaced by the fused one, which then
+ * executes both instructions in a single dispatch, taking the second
+ * one's operands from the (unchanged) instruction that follows it.
+ *
+ * \return the number of fused instructions.
+ */
+size_t fuseInstructions(std::vector<Instruction>& code);
+
+/**
+ * Reverts fuseInstructions(), restoring the original opcodes.
+ *
+ * \return the number of unfused instructions.
+ */
+size_t unfuseInstructions(std::vector<Instruction>& code);
+
+/**
+ * Runs all peephole passes.
+ */
+void peephole(std::vector<Instruction>& code);
+
+//@}
+
+} // namespace FlowVM
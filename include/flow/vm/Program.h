@@ -1,10 +1,20 @@
 #pragma once
 
 #include <flow/vm/Instruction.h>
+#include <flow/vm/ArrayRef.h>
 #include <flow/vm/Runtime.h>        // Runtime::Callback
 #include <flow/vm/Type.h>           // Number
+#include <flow/vm/IPAddress.h>
+#include <flow/vm/CidrSet.h>
+#include <flow/vm/RegExp.h>
+#include <flow/vm/SwitchTable.h>
+#include <flow/vm/StringSet.h>
+#include <flow/vm/Stats.h>
 
 #include <vector>
+#include <deque>
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <memory>
 
@@ -13,9 +23,19 @@ namespace FlowVM {
 class Runner;
 class Handler;
 
+/**
+ * A compiled Flow program: constant tables, handlers and native signatures.
+ *
+ * A program is built and linked by a single thread. Once freeze() succeeded
+ * it is immutable, and its handlers may be run by any number of threads
+ * concurrently (see SharedProgram for replacing it while it runs).
+ */
 class Program
 {
 public:
+    /** Returned by the add*() functions if the program is frozen. */
+    static const size_t npos = static_cast<size_t>(-1);
+
     Program();
     Program(
         const std::vector<Number>& constNumbers,
@@ -29,28 +49,86 @@ public:
     Program& operator=(Program&) = delete;
     ~Program();
 
-    inline const std::vector<Number>& numbers() const { return numbers_; }
+    bool save(const std::string& filename) const;
+    static std::unique_ptr<Program> load(const std::string& filename);
+
+    /** Whether this program's code and constants live in a mapped program file. */
+    bool isMapped() const { return mapping_ != nullptr; }
+
+    inline ArrayRef<Number> numbers() const { return numbers_; }
     inline const std::vector<String>& strings() const { return strings_; }
-    inline const std::vector<std::string>& regularExpressions() const { return regularExpressions_; }
-    inline const std::vector<Handler*> handlers() const { return handlers_; }
+    inline ArrayRef<IPAddress> ipaddrs() const { return ipaddrs_; }
+    inline ArrayRef<Cidr> cidrs() const { return cidrs_; }
+    inline const std::vector<RegExp>& regularExpressions() const { return regularExpressions_; }
+    inline const RegExp& regularExpression(size_t index) const { return regularExpressions_[index]; }
+    inline const std::vector<Handler*>& handlers() const { return handlers_; }
+
+    size_t addNumber(Number value);
+    size_t addString(const std::string& value);
+    size_t addIPAddress(const IPAddress& value);
+    size_t addCidr(const Cidr& value);
+
+    /** Optimization level new handlers are created with (see optimize()). */
+    int optimizationLevel() const { return optimizationLevel_; }
+    void setOptimizationLevel(int level) { if (!frozen_) optimizationLevel_ = level; }
+
+    inline const std::vector<NumberSwitch>& numberSwitches() const { return numberSwitches_; }
+    inline const NumberSwitch& numberSwitch(size_t index) const { return numberSwitches_[index]; }
+    size_t addNumberSwitch(const std::vector<NumberSwitch::Case>& cases, WideImmOperand defaultTarget);
+
+    inline const std::vector<StringSwitch>& stringSwitches() const { return stringSwitches_; }
+    inline const StringSwitch& stringSwitch(size_t index) const { return stringSwitches_[index]; }
+    size_t addStringSwitch(const std::vector<StringSwitch::Case>& cases, WideImmOperand defaultTarget);
+
+    inline const std::vector<StringSet>& stringSets() const { return stringSets_; }
+    inline const StringSet& stringSet(size_t index) const { return stringSets_[index]; }
+    size_t addStringSet(const std::vector<std::string>& strings);
+
+    inline const std::vector<CidrSet>& cidrSets() const { return cidrSets_; }
+    inline const CidrSet& cidrSet(size_t index) const { return cidrSets_[index]; }
+    size_t addCidrSet(const std::vector<Cidr>& networks);
 
     Handler* createHandler(const std::string& name);
     Handler* createHandler(const std::string& name, const std::vector<Instruction>& instructions);
     Handler* findHandler(const std::string& name) const;
     Handler* handler(size_t index) const { return handlers_[index]; }
     int handlerIndex(const std::string& name) const;
+    int handlerIndex(const Handler* handler) const;
 
     Runtime::Callback* nativeHandler(size_t id) const { return nativeHandlers_[id]; }
     Runtime::Callback* nativeFunction(size_t id) const { return nativeFunctions_[id]; }
 
     bool link(Runtime* runtime);
 
+    /**
+     * Makes the program immutable, for concurrent execution.
+     *
+     * Handler settings (engine, trace sink, optimization level) must be
+     * applied before. Fails if the program has not been linked successfully.
+     */
+    bool freeze();
+    bool isFrozen() const { return frozen_; }
+
+    /** Snapshot of all handlers' and linked natives' execution counters (see Stats.h). */
+    ProgramStats stats() const;
+    void resetStats();
+
     void dump();
 
 private:
-    std::vector<Number> numbers_;
+    ArrayRef<Number> numbers_;                                  // numberStorage_ or mapped
+    std::vector<Number> numberStorage_;
+    std::deque<std::string> stringStorage_;                     // owns the bytes of strings_ unless mapped
     std::vector<String> strings_;
-    std::vector<std::string> regularExpressions_;               // XXX to be a pre-compiled handled during runtime
+    ArrayRef<IPAddress> ipaddrs_;                               // ipaddrStorage_ or mapped
+    std::vector<IPAddress> ipaddrStorage_;
+    ArrayRef<Cidr> cidrs_;                                      // cidrStorage_ or mapped
+    std::vector<Cidr> cidrStorage_;
+    std::vector<RegExp> regularExpressions_;                    // compiled at construction time
+    std::vector<NumberSwitch> numberSwitches_;
+    std::vector<StringSwitch> stringSwitches_;
+    std::vector<StringSet> stringSets_;                         // compiled at construction time
+    std::vector<CidrSet> cidrSets_;                             // compiled at construction time
     std::vector<std::pair<std::string, std::string>> modules_;
     std::vector<std::string> nativeHandlerSignatures_;
     std::vector<std::string> nativeFunctionSignatures_;
@@ -58,7 +136,19 @@ private:
     std::vector<Runtime::Callback*> nativeHandlers_;
     std::vector<Runtime::Callback*> nativeFunctions_;
     std::vector<Handler*> handlers_;
+    std::unordered_map<std::string, size_t> handlerIds_;       // handler index by name
+    bool sharedNames_;                                          // some handlers ever shared a name
     Runtime* runtime_;
+    bool linked_;
+    bool frozen_;
+    int optimizationLevel_;
+
+    void* mapping_;                                             // mapped program file, if loaded
+    size_t mappingSize_;
+
+    friend class Handler;
+    void addHandler(Handler* handler);
+    void renameHandler(Handler* handler, const std::string& name);
 };
 
 } // namespace FlowVM
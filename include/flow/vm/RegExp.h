@@ -0,0 +1,134 @@
+#pragma once
+
+#include <flow/vm/BufferRef.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+class RegExp;
+
+/**
+ * Per-Runner match state of the most recent regular expression match.
+ *
+ * Capture groups are resolved lazily on first access and returned as
+ * views into the matched subject, which thus must outlive the context's use.
+ */
+class RegExpContext
+{
+public:
+    RegExpContext();
+
+    void clear();
+
+    /** Retrieves capture group \p index (0 is the whole match), or an empty ref. */
+    BufferRef group(size_t index);
+
+private:
+    friend class RegExp;
+
+    const RegExp* regexp_;
+    BufferRef subject_;
+    bool matched_;
+    bool resolved_;
+    std::vector<size_t> captures_;      //!< begin/end offset pairs
+    std::vector<uint64_t> visited_;     //!< backtracker scratch space
+};
+
+/**
+ * Regular expression, compiled once and safe to share between threads.
+ *
+ * Supported syntax: literals, escapes (\\d \\D \\w \\W \\s \\S \\t \\n \\r and
+ * escaped metacharacters), \c ., character classes with ranges and negation,
+ * capturing and non-capturing (?:) groups, alternation, the greedy and lazy
+ * quantifiers * + ? {n} {n,} {n,m}, as well as the anchors ^ and $.
+ *
+ * Patterns are compiled into a Thompson NFA. Matching runs on a DFA built
+ * eagerly from it at construction time as long as the number of DFA states
+ * stays bounded, and falls back to simulating the NFA otherwise, so matching
+ * always is linear in the subject's length. Capture groups are resolved by
+ * the NFA simulation, with leftmost-first semantics.
+ *
+ * The NFA is simulated by a backtracker that visits each (instruction,
+ * position) pair at most once, as long as the bit set recording the visited
+ * pairs stays within MaxBacktrackBits, and by a Pike VM, stepping all threads
+ * in lock-step over the subject, for longer subjects.
+ */
+class RegExp
+{
+public:
+    explicit RegExp(const std::string& pattern);
+
+    const std::string& pattern() const { return pattern_; }
+
+    bool isValid() const { return error_.empty(); }
+    const std::string& error() const { return error_; }
+
+    /** Number of capture groups, including the implicit group 0. */
+    size_t groupCount() const { return groupCount_; }
+
+    /** Whether a DFA could be built for this pattern. */
+    bool hasDFA() const { return !dfa_.empty(); }
+    size_t dfaStateCount() const { return dfaAccept_.size(); }
+
+    /**
+     * Tests whether the pattern matches anywhere in \p subject.
+     *
+     * \param subject the subject to match against.
+     * \param cx optional context to resolve capture groups from later on.
+     */
+    bool match(const BufferRef& subject, RegExpContext* cx = nullptr) const;
+
+    /**
+     * Matches and immediately resolves all capture groups.
+     *
+     * \param subject the subject to match against.
+     * \param groups receives groupCount() views into \p subject.
+     */
+    bool match(const BufferRef& subject, std::vector<BufferRef>* groups) const;
+
+    enum { MaxInstructions = 10000, MaxDFAStates = 2048, MaxBacktrackBits = 256 * 1024 };
+
+private:
+    struct Instr {
+        enum Op : uint8_t { Class, Split, Jmp, Save, Begin, End, Match };
+
+        Op op;
+        int32_t x;      //!< class index, jump target or capture slot
+        int32_t y;      //!< lower-priority jump target of a Split
+    };
+
+    class Compiler;
+
+    /** Whether the pattern can only match at the beginning of the subject. */
+    bool anchoredBegin() const { return program_[anchoredStart_ + 1].op == Instr::Begin; }
+
+    bool matchDFA(const BufferRef& subject) const;
+    bool matchNFA(const BufferRef& subject, std::vector<size_t>& captures,
+                  std::vector<uint64_t>& visited) const;
+    bool matchBacktrack(const BufferRef& subject, std::vector<size_t>& captures,
+                        std::vector<uint64_t>& visited) const;
+    bool matchPike(const BufferRef& subject, std::vector<size_t>& captures) const;
+    void resolve(RegExpContext* cx) const;
+    void buildDFA();
+
+    friend class RegExpContext;
+
+    std::string pattern_;
+    std::string error_;
+    size_t groupCount_;
+
+    std::vector<Instr> program_;
+    std::vector<uint64_t> classes_;     //!< 256-bit byte sets, 4 words each
+    size_t unanchoredStart_;
+    size_t anchoredStart_;
+
+    uint8_t byteClass_[256];            //!< byte to DFA input class
+    size_t byteClassCount_;
+    std::vector<int32_t> dfa_;          //!< transitions: state * byteClassCount_ + class
+    std::vector<uint8_t> dfaAccept_;    //!< bit 0: accepting, bit 1: accepting at end of input
+};
+
+} // namespace FlowVM
@@ -1,17 +1,26 @@
 #pragma once
 
 #include <flow/vm/Type.h>
+#include <flow/vm/IPAddress.h>
 #include <flow/vm/Handler.h>
 #include <flow/vm/Instruction.h>
-#include <flow/vm/Runtime.h>        // String
+#include <flow/vm/Runtime.h>
+#include <flow/vm/StringArena.h>
+#include <flow/vm/RegExp.h>
+#include <functional>
 #include <utility>
-#include <list>
 #include <memory>
 #include <new>
 #include <cstdint>
 #include <cstdio>
 #include <cmath>
 #include <string>
+#include <vector>
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <atomic>
+#endif
 
 namespace FlowVM {
 
@@ -19,14 +28,37 @@ typedef uint64_t Register;
 
 // ExecutionEngine
 // VM
+class TraceSink;
+class MachineCode;
+
 class Runner
 {
+public:
+    /** Receives a run's result once it completed (see start()). */
+    typedef std::function<void(Runner* cx, bool result)> Completion;
+
 private:
+    enum class State {
+        Idle,
+        Running,        //!< run() in progress, natives cannot suspend
+        RunningAsync,   //!< start() or resume() in progress
+        Suspended,      //!< waiting for resume()
+        Resuming        //!< about to continue after the suspended CALL or HANDLER
+    };
+
     Handler* handler_;
     Program* program_;
     void* userdata_;
+    TraceSink* traceSink_;
+    size_t capacity_;
+
+    State state_;
+    size_t suspendedAt_;        //!< offset of the CALL or HANDLER that suspended
+    uint64_t suspendedTicks_;   //!< instructions executed up to the suspension
+    Completion completion_;
 
-    std::list<std::string> stringGarbage_;
+    StringArena strings_;
+    RegExpContext regexpContext_;
 
     Register data_[];
 
@@ -35,18 +67,100 @@ public:
     static void operator delete (void* p);
 
     bool run();
+    void reset();
+
+    // {{{ asynchronous execution
+    void start(Completion completion);
+    bool suspend();
+    void resume(Value result);
+
+    /** Whether the run waits for resume() with a native's result. */
+    bool isSuspended() const { return state_ == State::Suspended; }
+    // }}}
+
+    /** Number of registers allocated for this Runner. */
+    size_t capacity() const { return capacity_; }
+
+    static void translate(ArrayRef<Instruction> code,
+                          std::vector<ThreadedInstruction>* result);
 
     Handler* handler() const { return handler_; }
     Program* program() const { return program_; }
     void* userdata() const { return userdata_; }
     void setUserData(void* p) { userdata_ = p; }
 
+    /**
+     * Selects trace mode by attaching a sink (defaults to the handler's).
+     * Passing \c nullptr runs the program in release mode.
+     */
+    TraceSink* traceSink() const { return traceSink_; }
+    void setTraceSink(TraceSink* sink) { traceSink_ = sink; }
+
     String* createString(const std::string& value);
+    String* createString(const char* data, size_t size);
+    String* allocateString(size_t size, char** data);
+    String* createStringRef(const char* data, size_t size);
+    IPAddress* createIPAddress(const IPAddress& value);
+
+    /** Arena backing all strings created during the current run. */
+    StringArena& strings() { return strings_; }
+
+    /** Capture groups of the most recent SREGMATCH. */
+    RegExpContext& regexpContext() { return regexpContext_; }
 
 private:
     explicit Runner(Handler* handler);
+
+    bool dispatch();
+    bool runMachineCode(const MachineCode* machineCode);
+    void complete(bool result);
+    WideInstruction instructionAt(size_t pc) const;
+
+    template<typename Engine, typename Mode>
+    static bool execute(Runner* self, const void* const** labels, size_t start = 0);
+
     Runner(Runner&) = delete;
     Runner& operator=(Runner&) = delete;
 };
 
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+/**
+ * Awaitable running a Runner from a C++20 coroutine:
+ *
+ * \code
+ *   bool handled = co_await FlowVM::RunnerAwaiter(runner);
+ * \endcode
+ *
+ * The coroutine is only suspended if a native suspends the run, and is
+ * resumed from within the Runner::resume() call completing it.
+ */
+class RunnerAwaiter
+{
+public:
+    explicit RunnerAwaiter(Runner* runner) : runner_(runner), result_(false), done_(false) {}
+
+    bool await_ready() const { return false; }
+
+    bool await_suspend(std::coroutine_handle<> coroutine) {
+        coroutine_ = coroutine;
+        runner_->start([this](Runner*, bool result) {
+            result_ = result;
+            if (done_.exchange(true))
+                coroutine_.resume();
+        });
+
+        // whichever of completion and suspension comes second continues
+        return !done_.exchange(true);
+    }
+
+    bool await_resume() const { return result_; }
+
+private:
+    Runner* runner_;
+    bool result_;
+    std::atomic<bool> done_;
+    std::coroutine_handle<> coroutine_;
+};
+#endif
+
 } // namespace FlowVM
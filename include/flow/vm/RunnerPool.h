@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+namespace FlowVM {
+
+class Handler;
+class Runner;
+
+/**
+ * Recycles Runners of a single Handler.
+ *
+ * A pool is not thread-safe; each thread uses its own pool
+ * (see RunnerPoolSet). Released Runners are reset and kept for the next
+ * acquire() as long as their register file still matches the handler's
+ * registerCount(), so code changes via Handler::setCode() simply phase
+ * out stale Runners.
+ */
+class RunnerPool
+{
+public:
+    explicit RunnerPool(Handler* handler, size_t maxIdle = 8);
+    RunnerPool(const RunnerPool&) = delete;
+    RunnerPool& operator=(const RunnerPool&) = delete;
+    ~RunnerPool();
+
+    Handler* handler() const { return handler_; }
+
+    /** Number of idle Runners ready to be handed out. */
+    size_t size() const { return idle_.size(); }
+    size_t maxIdle() const { return maxIdle_; }
+
+    Runner* acquire();
+    void release(Runner* runner);
+    void clear();
+
+private:
+    Handler* handler_;
+    size_t maxIdle_;
+    std::vector<Runner*> idle_;
+};
+
+/**
+ * Lazily maintains one RunnerPool per thread for a Handler.
+ *
+ * Lookups are lock-free; only the first use of a pool slot allocates.
+ */
+class RunnerPoolSet
+{
+public:
+    explicit RunnerPoolSet(Handler* handler);
+    RunnerPoolSet(const RunnerPoolSet&) = delete;
+    RunnerPoolSet& operator=(const RunnerPoolSet&) = delete;
+    ~RunnerPoolSet();
+
+    /**
+     * Retrieves the calling thread's pool, creating it on first use.
+     *
+     * \return the pool or \c nullptr if the thread limit (MaxThreads) is exceeded.
+     */
+    RunnerPool* local();
+
+    void clear();
+
+    static size_t threadSlot();
+
+    enum { ChunkSize = 16, ChunkCount = 64, MaxThreads = ChunkSize * ChunkCount };
+
+private:
+    typedef std::atomic<RunnerPool*> Slot;
+
+    Handler* handler_;
+    std::atomic<Slot*> chunks_[ChunkCount];
+};
+
+} // namespace FlowVM
@@ -2,27 +2,25 @@
 
 #include <flow/vm/Type.h>
 #include <flow/vm/Signature.h>
+#include <flow/vm/NativeBinding.h>
+#include <flow/vm/Stats.h>
 #include <string>
 #include <vector>
-#include <functional>
+#include <deque>
+#include <unordered_map>
 
 namespace FlowVM {
 
-typedef uint64_t Value;
-typedef std::string String;
-
-class Runner;
-
-typedef std::function<void(int argc, Value* argv, Runner* cx)> NativeCallback;
-
 class Runtime
 {
 public:
     struct Callback { // {{{
         Runtime* runtime_;
         bool isHandler_;
-        NativeCallback function_;
+        NativeBinding binding_;
         Signature signature_;
+        int signatureId_;               //!< interned ID of signature_, or -1
+        mutable uint64_t invocations_;  //!< only counted with FLOW_STATS
 
         bool isHandler() const { return isHandler_; }
         const std::string name() const { return signature_.name(); }
@@ -32,8 +30,10 @@ public:
         Callback(Runtime* runtime, const std::string& _name) :
             runtime_(runtime),
             isHandler_(true),
-            function_(),
-            signature_()
+            binding_(),
+            signature_(),
+            signatureId_(-1),
+            invocations_(0)
         {
             signature_.setName(_name);
             signature_.setReturnType(Type::Boolean);
@@ -43,64 +43,118 @@ public:
         Callback(Runtime* runtime, const std::string& _name, Type _returnType) :
             runtime_(runtime),
             isHandler_(false),
-            function_(),
-            signature_()
+            binding_(),
+            signature_(),
+            signatureId_(-1),
+            invocations_(0)
         {
             signature_.setName(_name);
             signature_.setReturnType(_returnType);
         }
 
         Callback(const std::string& _name, const NativeCallback& _builtin, Type _returnType) :
+            runtime_(nullptr),
             isHandler_(false),
-            function_(_builtin),
-            signature_()
+            binding_(),
+            signature_(),
+            signatureId_(-1),
+            invocations_(0)
         {
+            bind(_builtin);
             signature_.setName(_name);
             signature_.setReturnType(_returnType);
         }
 
         void invoke(int argc, Value* argv, Runner* cx) const {
-            function_(argc, argv, cx);
+            if (FLOW_STATS)
+                __atomic_fetch_add(&invocations_, 1, __ATOMIC_RELAXED);
+
+            binding_.thunk(binding_, argc, argv, cx);
         }
 
+        uint64_t invocations() const { return __atomic_load_n(&invocations_, __ATOMIC_RELAXED); }
+        void resetStats() { __atomic_store_n(&invocations_, 0, __ATOMIC_RELAXED); }
+
         template<typename Arg1, typename... Args>
         Callback& signature(Arg1 a1, Args... more) {
             signature_.setArgs({a1, more...});
+            if (runtime_)
+                runtime_->reindex(this);
             return *this;
         }
 
         Callback& operator()(const NativeCallback& cb) {
-            function_ = cb;
-            return *this;
+            return bind(cb);
         }
 
+        // {{{ raw bindings: the native unmarshals argv itself
         Callback& bind(const NativeCallback& cb) {
-            function_ = cb;
+            binding_ = NativeBinding();
+            binding_.thunk = &nativeCallbackThunk;
+            binding_.function = cb;
             return *this;
         }
 
         template<typename Class>
         Callback& bind(void (Class::*method)(int, Value*, Runner*), Class* obj) {
-            function_ = std::bind(method, obj,
-                std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
-
+            binding_ = NativeBinding();
+            binding_.thunk = &nativeRawMethodThunk<Class>;
+            binding_.object = obj;
+            binding_.setPointer(method);
             return *this;
         }
 
         template<typename Class>
         Callback& bind(void (Class::*method)(int, Value*, Runner*)) {
-            function_ = std::bind(method, static_cast<Class*>(runtime_),
-                std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+            return bind(method, static_cast<Class*>(runtime_));
+        }
+        // }}}
+        // {{{ typed bindings: signature and argv marshalling derived from the C++ type
+        template<typename R, typename... Args>
+        Callback& bind(R (*function)(Args...)) {
+            binding_ = NativeBinding();
+            binding_.thunk = &nativeFunctionThunk<R, Args...>;
+            binding_.setPointer(function);
+            return typed<R, Args...>();
+        }
+
+        template<typename Class, typename R, typename... Args>
+        Callback& bind(R (Class::*method)(Args...), Class* obj) {
+            binding_ = NativeBinding();
+            binding_.thunk = &nativeMethodThunk<Class, R, Args...>;
+            binding_.object = obj;
+            binding_.setPointer(method);
+            return typed<R, Args...>();
+        }
+
+        template<typename Class, typename R, typename... Args>
+        Callback& bind(R (Class::*method)(Args...)) {
+            return bind(method, static_cast<Class*>(runtime_));
+        }
 
+    private:
+        template<typename R, typename... Args>
+        Callback& typed() {
+            signature_.setArgs(NativeSignature<R, Args...>::args());
+            if (!isHandler_)
+                signature_.setReturnType(NativeSignature<R, Args...>::returnType());
+            if (runtime_)
+                runtime_->reindex(this);
             return *this;
         }
+
+    public:
+        // }}}
     }; // }}}
 public:
     virtual bool import(const std::string& name, const std::string& path) = 0;
 
     bool contains(const std::string& signature) const;
-    Callback* find(const std::string& signature);
-    const std::vector<Callback>& builtins() const { return builtins_; }
+    Callback* find(const std::string& signature) const;
+    const std::deque<Callback>& builtins() const { return builtins_; }
+
+    int signatureId(const std::string& signature) const;
+    Callback* callback(size_t signatureId) const { return callbacks_[signatureId]; }
 
     Callback& registerHandler(const std::string& name);
     Callback& registerFunction(const std::string& name, Type returnType);
@@ -108,7 +162,11 @@ public:
     void invoke(int id, int argc, Value* argv, Runner* cx);
 
 private:
-    std::vector<Callback> builtins_;
+    void reindex(Callback* callback);
+
+    std::deque<Callback> builtins_;                             // deque keeps references stable
+    std::unordered_map<std::string, int> signatureIds_;         // interned signatures
+    std::vector<Callback*> callbacks_;                          // callback by signature ID
 };
 
 }
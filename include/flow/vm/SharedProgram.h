@@ -0,0 +1,103 @@
+#pragma once
+
+#include <flow/vm/RunnerPool.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+class Program;
+
+/**
+ * Publishes the current frozen Program to concurrently running threads.
+ *
+ * Request threads enter a Guard, which pins the program they see without
+ * taking a lock; a reload publish()es a new program atomically. Replaced
+ * programs are retired and only deleted once every Guard that may still
+ * see them has been left (epoch-based reclamation).
+ *
+ * Each thread announces its active epoch in its own slot, indexed by
+ * RunnerPoolSet::threadSlot(). Threads beyond RunnerPoolSet::MaxThreads
+ * share a counter instead, which delays reclamation while any of them is
+ * inside a Guard.
+ */
+class SharedProgram
+{
+public:
+    explicit SharedProgram(std::unique_ptr<Program> program = nullptr);
+    SharedProgram(const SharedProgram&) = delete;
+    SharedProgram& operator=(const SharedProgram&) = delete;
+    ~SharedProgram();
+
+    /**
+     * Pins the current program for the lifetime of the guard.
+     *
+     * Guards may be nested; the program must not be used after the guard
+     * has been left.
+     */
+    class Guard {
+    public:
+        explicit Guard(const SharedProgram& shared);
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard();
+
+        Program* get() const { return program_; }
+        Program* operator->() const { return program_; }
+
+    private:
+        const SharedProgram& shared_;
+        void* slot_;
+        Program* program_;
+    };
+
+    bool publish(std::unique_ptr<Program> program);
+
+    /** Runs handler \p name of the current program. */
+    bool run(const std::string& name, void* userdata = nullptr) const;
+
+    size_t reclaim();
+    void synchronize();
+
+    /** Number of retired programs not yet deleted. */
+    size_t pending() const;
+
+    /** Number of programs published so far. */
+    uint64_t epoch() const { return globalEpoch_.load(std::memory_order_relaxed) - 1; }
+
+private:
+    struct ReaderSlot {
+        std::atomic<uint64_t> epoch;    //!< epoch the thread entered at, or 0 if outside
+        unsigned depth;                 //!< guard nesting, only accessed by the owning thread
+        char padding[64 - sizeof(uint64_t) - sizeof(unsigned)];
+    };
+
+    struct Retired {
+        Program* program;
+        uint64_t epoch;                 //!< last epoch the program was current in
+    };
+
+    enum {
+        ChunkSize = RunnerPoolSet::ChunkSize,
+        ChunkCount = RunnerPoolSet::ChunkCount
+    };
+
+    ReaderSlot* enter() const;
+    void leave(ReaderSlot* slot) const;
+    uint64_t oldestReader() const;
+
+    std::atomic<Program*> current_;
+    std::atomic<uint64_t> globalEpoch_;
+    mutable std::atomic<ReaderSlot*> chunks_[ChunkCount];
+    mutable std::atomic<size_t> overflowReaders_;
+
+    mutable std::mutex retiredLock_;    //!< only taken by writers
+    std::vector<Retired> retired_;
+};
+
+} // namespace FlowVM
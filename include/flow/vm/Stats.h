@@ -0,0 +1,56 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+/**
+ * Execution statistics are collected only if the library (and everything
+ * including its headers) is compiled with FLOW_STATS=1, e.g. by configuring
+ * with -DENABLE_STATS=ON. Otherwise the interpreter loop is not instrumented
+ * and all counters read zero.
+ */
+#if !defined(FLOW_STATS)
+#define FLOW_STATS 0
+#endif
+
+namespace FlowVM {
+
+/**
+ * Execution counters of one or more handlers.
+ */
+struct ExecutionCounters {
+    uint64_t runs;                      //!< completed runs
+    uint64_t instructions;              //!< instructions executed
+    uint64_t opcodes[OpcodeCount];      //!< instructions executed, by opcode
+
+    ExecutionCounters() : runs(0), instructions(0), opcodes() {}
+
+    void add(const ExecutionCounters& other);
+};
+
+struct HandlerStats {
+    std::string name;
+    ExecutionCounters counters;
+};
+
+struct NativeStats {
+    std::string signature;
+    bool isHandler;
+    uint64_t invocations;   //!< invocations by all programs linked to the callback
+};
+
+/**
+ * Snapshot of a program's execution statistics (see Program::stats()).
+ */
+struct ProgramStats {
+    ExecutionCounters total;            //!< sum of all handlers' counters
+    std::vector<HandlerStats> handlers;
+    std::vector<NativeStats> natives;
+
+    void dump(FILE* out = stdout) const;
+};
+
+} // namespace FlowVM
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <flow/vm/Type.h>           // String
+#include <cstddef>
+#include <new>
+
+namespace FlowVM {
+
+/**
+ * Chunked bump-pointer allocator for the strings created while running
+ * a program.
+ *
+ * Strings are immutable String objects (pointer + length) whose bytes
+ * usually live right behind the object inside the same chunk.
+ * Individual strings are never freed; instead the whole arena is
+ * rewound (keeping its chunks for reuse) or cleared in one step.
+ */
+class StringArena
+{
+public:
+    explicit StringArena(size_t chunkSize = 4096);
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+    ~StringArena();
+
+    /** Allocates \p size bytes of raw, pointer-aligned storage. */
+    void* allocate(size_t size);
+
+    /** Allocates a string of \p size bytes to be written via \p data. */
+    String* allocateString(size_t size, char** data);
+
+    /** Creates a string holding a copy of the given bytes. */
+    String* createString(const char* data, size_t size);
+
+    /** Creates a string referencing the given bytes without copying them. */
+    String* createStringRef(const char* data, size_t size);
+
+    /** Invalidates all strings, keeping the standard chunks for reuse. */
+    void rewind();
+
+    /** Invalidates all strings and releases all memory. */
+    void clear();
+
+    /** Total number of bytes currently allocated from the system. */
+    size_t capacity() const;
+
+private:
+    struct Chunk {
+        Chunk* next;
+        size_t size;
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    Chunk* newChunk(size_t size);
+    void* allocateSlow(size_t size);
+
+    size_t chunkSize_;
+    Chunk* head_;           //!< standard chunks, kept across rewind()
+    Chunk* current_;        //!< chunk currently allocated from
+    Chunk* large_;          //!< oversized allocations, freed on rewind()
+    char* pos_;
+    char* end_;
+};
+
+// {{{ inlines
+inline void* StringArena::allocate(size_t size)
+{
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    if (static_cast<size_t>(end_ - pos_) >= size) {
+        void* p = pos_;
+        pos_ += size;
+        return p;
+    }
+
+    return allocateSlow(size);
+}
+
+inline String* StringArena::allocateString(size_t size, char** data)
+{
+    String* s = static_cast<String*>(allocate(sizeof(String) + size));
+    *data = reinterpret_cast<char*>(s + 1);
+    return new (s) String(*data, size);
+}
+
+inline String* StringArena::createStringRef(const char* data, size_t size)
+{
+    return new (allocate(sizeof(String))) String(data, size);
+}
+// }}}
+
+} // namespace FlowVM
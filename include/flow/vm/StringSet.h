@@ -0,0 +1,47 @@
+#pragma once
+
+#include <flow/vm/StringTable.h>
+#include <flow/vm/Type.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+/**
+ * String array constant of a SINSET instruction, compiled into a hash set.
+ *
+ * Members are indexed by a StringTable. A lookup first checks a bit mask
+ * of the member lengths, so most non-members are rejected without hashing.
+ */
+class StringSet
+{
+public:
+    explicit StringSet(const std::vector<std::string>& strings);
+
+    bool contains(const BufferRef& value) const;
+
+    /** The strings the set has been built from, including duplicates. */
+    const std::vector<std::string>& strings() const { return strings_; }
+
+private:
+    static uint64_t lengthBit(size_t size) { return uint64_t(1) << (size < 63 ? size : 63); }
+
+    std::vector<std::string> strings_;
+    StringTable table_;
+    uint64_t lengths_;                      //!< lengthBit() of all members
+};
+
+// {{{ inlines
+inline bool StringSet::contains(const BufferRef& value) const
+{
+    if (!(lengths_ & lengthBit(value.size())))
+        return false;
+
+    return table_.find(value, [this](size_t i) -> const std::string& { return strings_[i]; })
+        != StringTable::npos;
+}
+// }}}
+
+} // namespace FlowVM
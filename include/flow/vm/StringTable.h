@@ -0,0 +1,95 @@
+#pragma once
+
+#include <flow/vm/BufferRef.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace FlowVM {
+
+/**
+ * Open-addressing hash index over strings stored by its owner.
+ *
+ * Each slot holds a string's precomputed hash and length and its index in
+ * the owner's storage. The table is at most half full and probed linearly,
+ * so a lookup hashes the subject once and compares bytes only on a full
+ * hash and length match. The first of duplicate strings wins.
+ *
+ * The strings themselves are passed in as \p key, mapping an index to the
+ * string stored at it, which keeps the table copyable along with its owner.
+ */
+class StringTable
+{
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    /** Indexes the strings key(0) to key(count - 1). */
+    template<typename Key> StringTable(size_t count, Key key);
+
+    /** Index of the string equal to \p value, or npos. */
+    template<typename Key> size_t find(const BufferRef& value, Key key) const;
+
+    static uint32_t hash(const char* data, size_t size);
+
+private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t size;
+        uint32_t index;                     //!< string index + 1, 0 if empty
+    };
+
+    std::vector<Slot> slots_;               //!< power-of-two sized
+    uint32_t mask_;
+};
+
+// {{{ inlines
+template<typename Key>
+StringTable::StringTable(size_t count, Key key) :
+    slots_(),
+    mask_(0)
+{
+    size_t capacity = 8;
+    while (capacity < 2 * count)
+        capacity *= 2;
+
+    slots_.resize(capacity, Slot { 0, 0, 0 });
+    mask_ = capacity - 1;
+
+    for (size_t i = 0; i != count; ++i) {
+        const std::string& s = key(i);
+        const uint32_t h = hash(s.data(), s.size());
+
+        for (uint32_t k = h & mask_; ; k = (k + 1) & mask_) {
+            Slot& slot = slots_[k];
+            if (slot.index == 0) {
+                slot.hash = h;
+                slot.size = s.size();
+                slot.index = i + 1;
+                break;
+            }
+            if (slot.hash == h && key(slot.index - 1) == s)
+                break; // duplicate
+        }
+    }
+}
+
+template<typename Key>
+inline size_t StringTable::find(const BufferRef& value, Key key) const
+{
+    const uint32_t h = hash(value.data(), value.size());
+
+    for (uint32_t k = h & mask_; ; k = (k + 1) & mask_) {
+        const Slot& slot = slots_[k];
+
+        if (slot.index == 0)
+            return npos;
+
+        if (slot.hash == h && slot.size == value.size()
+                && equalBytes(key(slot.index - 1).data(), value.data(), value.size()))
+            return slot.index - 1;
+    }
+}
+// }}}
+
+} // namespace FlowVM
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <flow/vm/StringTable.h>
+#include <flow/vm/Type.h>
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstdint>
+
+namespace FlowVM {
+
+/**
+ * Jump table of a NSWITCH instruction, mapping integers to code offsets.
+ *
+ * Dense case values are looked up in a direct jump table, sparse
+ * ones by binary search over the sorted case values.
+ */
+class NumberSwitch
+{
+public:
+    typedef std::pair<Number, WideImmOperand> Case;
+
+    NumberSwitch(const std::vector<Case>& cases, WideImmOperand defaultTarget);
+
+    WideImmOperand lookup(Number value) const;
+
+    bool isDense() const { return !table_.empty(); }
+    WideImmOperand defaultTarget() const { return default_; }
+    const std::vector<Case>& cases() const { return cases_; }
+
+private:
+    std::vector<Case> cases_;               //!< sorted by case value
+    WideImmOperand default_;
+    Number min_;
+    std::vector<WideImmOperand> table_;     //!< dense: target per (value - min_)
+};
+
+/**
+ * Jump table of a SSWITCH instruction, mapping strings to code offsets.
+ *
+ * Case strings are indexed by a StringTable; the first of duplicate case
+ * values wins.
+ */
+class StringSwitch
+{
+public:
+    typedef std::pair<std::string, WideImmOperand> Case;
+
+    StringSwitch(const std::vector<Case>& cases, WideImmOperand defaultTarget);
+
+    WideImmOperand lookup(const BufferRef& value) const;
+
+    WideImmOperand defaultTarget() const { return default_; }
+    const std::vector<Case>& cases() const { return cases_; }
+
+private:
+    std::vector<Case> cases_;
+    WideImmOperand default_;
+    StringTable table_;
+};
+
+// {{{ inlines
+inline WideImmOperand NumberSwitch::lookup(Number value) const
+{
+    if (!table_.empty()) {
+        uint64_t offset = static_cast<uint64_t>(value) - static_cast<uint64_t>(min_);
+        return offset < table_.size() ? table_[offset] : default_;
+    }
+
+    size_t lo = 0;
+    size_t hi = cases_.size();
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cases_[mid].first < value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < cases_.size() && cases_[lo].first == value ? cases_[lo].second : default_;
+}
+// }}}
+
+} // namespace FlowVM
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <flow/vm/Instruction.h>
+#include <cstdint>
+#include <cstdio>
+
+namespace FlowVM {
+
+class Runner;
+
+/**
+ * Receives execution events of a Runner running in trace mode.
+ *
+ * A sink is attached via Runner::setTraceSink() or Handler::setTraceSink().
+ * Runners without a sink execute in release mode and emit no events at all.
+ */
+class TraceSink
+{
+public:
+    virtual ~TraceSink();
+
+    /**
+     * Invoked right before an instruction is executed.
+     *
+     * \param cx the runner executing the instruction.
+     * \param ip offset of the instruction within its handler's code.
+     * \param instr the instruction about to be executed.
+     */
+    virtual void instruction(Runner* cx, size_t ip, Instruction instr) = 0;
+
+    /**
+     * Invoked when the program terminated.
+     *
+     * \param cx the runner that finished.
+     * \param result the program's exit status.
+     * \param ticks number of instructions executed.
+     */
+    virtual void exit(Runner* cx, bool result, uint64_t ticks);
+};
+
+/**
+ * Writes a disassembly line per executed instruction to a stdio stream.
+ */
+class FileTraceSink : public TraceSink
+{
+public:
+    explicit FileTraceSink(FILE* out);
+
+    void instruction(Runner* cx, size_t ip, Instruction instr) override;
+    void exit(Runner* cx, bool result, uint64_t ticks) override;
+
+private:
+    FILE* out_;
+};
+
+} // namespace FlowVM
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <flow/vm/BufferRef.h>
 #include <string>
 #include <cstdint>
 
@@ -9,7 +10,7 @@ enum class Type {
 	Void = 0,
 	Boolean = 1,        // bool (int64)
 	Number = 2,         // int64
-	String = 3,         // std::string* (TODO: later BufferRef)
+	String = 3,         // String* (BufferRef)
 	IPAddress = 5,      // IPAddress*
 	Cidr = 6,           // Cidr*
 	RegExp = 7,         // RegExp*
@@ -18,7 +19,7 @@ enum class Type {
     AssocArray = 10,    // assocarray<K, V>
 };
 
-typedef std::string String;
+typedef BufferRef String;
 typedef int64_t Number;
 
 } // namespace FlowVM
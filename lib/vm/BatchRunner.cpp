@@ -0,0 +1,880 @@
+#include <flow/vm/BatchRunner.h>
+#include <flow/vm/Handler.h>
+#include <flow/vm/Program.h>
+#include <flow/vm/Instruction.h>
+#include <flow/vm/Runtime.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+
+namespace FlowVM {
+
+// {{{ lane kernels
+namespace {
+    /** LaneWidth registers, one per lane. */
+    typedef int64_t LaneVector __attribute__((vector_size(BatchRunner::LaneWidth * sizeof(int64_t)), may_alias));
+
+    /*
+     * The kernels are compiled for AVX2 and baseline x86-64 (SSE2), the
+     * dynamic linker picks the variant the CPU supports.
+     */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#   define LANE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#   define LANE_KERNEL
+#endif
+
+    /*
+     * Kernels compute all lanes of a register at once and only keep the
+     * results of the lanes set in \p mask, so inactive lanes retain their
+     * registers. Comparisons yield 1 or 0, as in the scalar interpreter.
+     */
+#define LANE_BINARY(name, expr) \
+    LANE_KERNEL void name(Register* a, const Register* b, const Register* c, \
+                          const Register* mask, size_t n) \
+    { \
+        for (size_t i = 0; i < n; i += BatchRunner::LaneWidth) { \
+            LaneVector x = *(const LaneVector*) (b + i); \
+            LaneVector y = *(const LaneVector*) (c + i); \
+            LaneVector m = *(const LaneVector*) (mask + i); \
+            LaneVector& r = *(LaneVector*) (a + i); \
+            r = ((expr) & m) | (r & ~m); \
+        } \
+    }
+
+    LANE_BINARY(laneAdd, x + y)
+    LANE_BINARY(laneSub, x - y)
+    LANE_BINARY(laneMul, x * y)
+    LANE_BINARY(laneShl, x << y)
+    LANE_BINARY(laneShr, x >> y)
+    LANE_BINARY(laneAnd, x & y)
+    LANE_BINARY(laneOr, x | y)
+    LANE_BINARY(laneXor, x ^ y)
+    LANE_BINARY(laneCmpEq, -(x == y))
+    LANE_BINARY(laneCmpNe, -(x != y))
+    LANE_BINARY(laneCmpLe, -(x <= y))
+    LANE_BINARY(laneCmpGe, -(x >= y))
+    LANE_BINARY(laneCmpLt, -(x < y))
+    LANE_BINARY(laneCmpGt, -(x > y))
+
+#undef LANE_BINARY
+
+    LANE_KERNEL void laneNeg(Register* a, const Register* b, const Register* mask, size_t n)
+    {
+        for (size_t i = 0; i < n; i += BatchRunner::LaneWidth) {
+            LaneVector m = *(const LaneVector*) (mask + i);
+            LaneVector& r = *(LaneVector*) (a + i);
+            r = (-*(const LaneVector*) (b + i) & m) | (r & ~m);
+        }
+    }
+
+    LANE_KERNEL void laneMov(Register* a, const Register* b, const Register* mask, size_t n)
+    {
+        for (size_t i = 0; i < n; i += BatchRunner::LaneWidth) {
+            LaneVector m = *(const LaneVector*) (mask + i);
+            LaneVector& r = *(LaneVector*) (a + i);
+            r = (*(const LaneVector*) (b + i) & m) | (r & ~m);
+        }
+    }
+
+    LANE_KERNEL void laneSet(Register* a, int64_t value, const Register* mask, size_t n)
+    {
+        LaneVector v = {};
+        v += value;
+
+        for (size_t i = 0; i < n; i += BatchRunner::LaneWidth) {
+            LaneVector m = *(const LaneVector*) (mask + i);
+            LaneVector& r = *(LaneVector*) (a + i);
+            r = (v & m) | (r & ~m);
+        }
+    }
+
+    /** Bit mask of the lanes whose register \p a is non-zero. */
+    LANE_KERNEL uint64_t laneTest(const Register* a, size_t n)
+    {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < n; ++i)
+            bits |= uint64_t(a[i] != 0) << i;
+        return bits;
+    }
+
+#undef LANE_KERNEL
+}
+// }}}
+
+std::unique_ptr<BatchRunner> BatchRunner::create(Handler* handler, size_t lanes)
+{
+    if (lanes == 0 || lanes > MaxLanes) {
+        fprintf(stderr, "Cannot create batch runner for handler %s: %zu lanes (1 to %d supported).\n",
+                handler->name().c_str(), lanes, MaxLanes);
+        return nullptr;
+    }
+
+    return std::unique_ptr<BatchRunner>(new BatchRunner(handler, lanes));
+}
+
+BatchRunner::BatchRunner(Handler* handler, size_t lanes) :
+    handler_(handler),
+    stride_((lanes + LaneWidth - 1) / LaneWidth * LaneWidth),
+    lanes_(),
+    data_(nullptr),
+    laneMask_(nullptr),
+    pending_(),
+    argv_(handler->registerCount())
+{
+    for (size_t i = 0; i != lanes; ++i)
+        lanes_.push_back(handler->createRunner());
+
+    // the lane mask is kept behind the registers, in the same aligned block
+    const size_t count = (handler->registerCount() + 1) * stride_;
+    void* p = nullptr;
+    if (posix_memalign(&p, sizeof(LaneVector), count * sizeof(Register)) != 0)
+        abort();
+
+    data_ = static_cast<Register*>(p);
+    laneMask_ = data_ + handler->registerCount() * stride_;
+    memset(data_, 0, count * sizeof(Register));
+
+    pending_.reserve(MaxLanes);
+}
+
+BatchRunner::~BatchRunner()
+{
+    free(data_);
+}
+
+/**
+ * Prepares all lanes for another run.
+ */
+void BatchRunner::reset()
+{
+    for (auto& lane: lanes_)
+        lane->reset();
+
+    memset(data_, 0, handler_->registerCount() * stride_ * sizeof(Register));
+}
+
+void BatchRunner::setMask(uint64_t mask)
+{
+    for (size_t i = 0; i != stride_; ++i)
+        laneMask_[i] = (mask >> i) & 1 ? ~Register(0) : 0;
+}
+
+/**
+ * Picks the pending group with the lowest code offset, merging all groups
+ * waiting there.
+ *
+ * \param mask receives the group's lanes.
+ * \return the group's code offset.
+ */
+size_t BatchRunner::schedule(uint64_t* mask)
+{
+    size_t pc = pending_[0].pc;
+    for (const LaneGroup& group: pending_)
+        if (group.pc < pc)
+            pc = group.pc;
+
+    *mask = 0;
+    for (size_t i = 0; i != pending_.size(); ) {
+        if (pending_[i].pc == pc) {
+            *mask |= pending_[i].mask;
+            pending_[i] = pending_.back();
+            pending_.pop_back();
+        } else {
+            ++i;
+        }
+    }
+
+    setMask(*mask);
+    return pc;
+}
+
+/**
+ * The batch interpreter loop, instantiated for 32-bit code and for the
+ * decoded form of code containing WIDE prefixes.
+ */
+template<typename Code>
+uint64_t BatchRunner::execute(const Code* code)
+{
+    #define A operandA(code[pc])
+    #define B operandB(code[pc])
+    #define C operandC(code[pc])
+    #define D operandD(code[pc])
+
+    #define row(R) (&data_[(R) * stride_])
+    #define reg(R, l) data_[(R) * stride_ + (l)]
+    #define toString(R, l) (*(String*) reg(R, l))
+    #define toNumber(R, l) ((Number) reg(R, l))
+    #define toIPAddress(R, l) (*(const IPAddress*) reg(R, l))
+    #define toCidr(R, l) (*(const Cidr*) reg(R, l))
+
+    #define forEachLane(l) \
+        for (uint64_t m_ = mask, l = 0; m_ && ((l = __builtin_ctzll(m_)), true); m_ &= m_ - 1)
+
+    #define instr(name) \
+        l_##name: \
+        ++ticks;
+
+    #define dispatch goto *ops[opcode(code[pc])]
+    #define jump(target) \
+        pc = (target); \
+        if (!pending_.empty()) \
+            goto reschedule; \
+        dispatch
+    #define advance(n) \
+        pc += (n); \
+        if (pc >= join) \
+            goto reschedule; \
+        dispatch
+    #define next advance(1)
+
+    // Continues the lanes in \p taken at \p target and the others with the
+    // instruction \p n behind.
+    #define branch(taken, target, n) \
+        if ((taken) == mask) { \
+            jump(target); \
+        } else if ((taken) == 0) { \
+            advance(n); \
+        } else { \
+            LaneGroup group = { (target), (taken) }; \
+            pending_.push_back(group); \
+            mask &= ~(taken); \
+            pc += (n); \
+            goto reschedule; \
+        }
+
+    // {{{ jump table
+    static const void* ops[] = {
+        // control
+        [Opcode::EXIT]      = &&l_exit,
+        [Opcode::JMP]       = &&l_jmp,
+        [Opcode::CONDBR]    = &&l_condbr,
+        [Opcode::NSWITCH]   = &&l_nswitch,
+        [Opcode::SSWITCH]   = &&l_sswitch,
+
+        // debug
+        [Opcode::NTICKS]    = &&l_nticks,
+        [Opcode::NDUMPN]    = &&l_ndumpn,
+
+        // copy
+        [Opcode::MOV]       = &&l_mov,
+
+        // numerical
+        [Opcode::IMOV]      = &&l_imov,
+        [Opcode::NCONST]    = &&l_nconst,
+        [Opcode::NNEG]      = &&l_nneg,
+        [Opcode::NADD]      = &&l_nadd,
+        [Opcode::NSUB]      = &&l_nsub,
+        [Opcode::NMUL]      = &&l_nmul,
+        [Opcode::NDIV]      = &&l_ndiv,
+        [Opcode::NREM]      = &&l_nrem,
+        [Opcode::NSHL]      = &&l_nshl,
+        [Opcode::NSHR]      = &&l_nshr,
+        [Opcode::NPOW]      = &&l_npow,
+        [Opcode::NAND]      = &&l_nand,
+        [Opcode::NOR]       = &&l_nor,
+        [Opcode::NXOR]      = &&l_nxor,
+        [Opcode::NCMPEQ]    = &&l_ncmpeq,
+        [Opcode::NCMPNE]    = &&l_ncmpne,
+        [Opcode::NCMPLE]    = &&l_ncmple,
+        [Opcode::NCMPGE]    = &&l_ncmpge,
+        [Opcode::NCMPLT]    = &&l_ncmplt,
+        [Opcode::NCMPGT]    = &&l_ncmpgt,
+
+        // string op
+        [Opcode::SCONST]    = &&l_sconst,
+        [Opcode::SADD]      = &&l_sadd,
+        [Opcode::SADDMULTI] = &&l_saddmulti,
+        [Opcode::SSUBSTR]   = &&l_ssubstr,
+        [Opcode::SCMPEQ]    = &&l_scmpeq,
+        [Opcode::SCMPNE]    = &&l_scmpne,
+        [Opcode::SCMPLE]    = &&l_scmple,
+        [Opcode::SCMPGE]    = &&l_scmpge,
+        [Opcode::SCMPLT]    = &&l_scmplt,
+        [Opcode::SCMPGT]    = &&l_scmpgt,
+        [Opcode::SCMPBEG]   = &&l_scmpbeg,
+        [Opcode::SCMPEND]   = &&l_scmpend,
+        [Opcode::SCONTAINS] = &&l_scontains,
+        [Opcode::SINSET]    = &&l_sinset,
+        [Opcode::SLEN]      = &&l_slen,
+        [Opcode::SPRINT]    = &&l_sprint,
+
+        // regex
+        [Opcode::SREGMATCH] = &&l_sregmatch,
+        [Opcode::SREGGROUP] = &&l_sreggroup,
+
+        // ip
+        [Opcode::PCONST]     = &&l_pconst,
+        [Opcode::PCMPEQ]     = &&l_pcmpeq,
+        [Opcode::PCMPNE]     = &&l_pcmpne,
+        [Opcode::PINCIDR]    = &&l_pincidr,
+        [Opcode::PINCIDRSET] = &&l_pincidrset,
+
+        // cidr
+        [Opcode::CCONST]     = &&l_cconst,
+
+        // conversion
+        [Opcode::I2S] = &&l_i2s,
+        [Opcode::S2I] = &&l_s2i,
+        [Opcode::P2S] = &&l_p2s,
+        [Opcode::SURLENC] = &&l_surlenc,
+        [Opcode::SURLDEC] = &&l_surldec,
+
+        // invokation
+        [Opcode::CALL] = &&l_call,
+        [Opcode::HANDLER] = &&l_handler,
+
+        // superinstructions
+        [Opcode::NCMPEQBR] = &&l_ncmpeqbr,
+        [Opcode::NCMPNEBR] = &&l_ncmpnebr,
+        [Opcode::NCMPLEBR] = &&l_ncmplebr,
+        [Opcode::NCMPGEBR] = &&l_ncmpgebr,
+        [Opcode::NCMPLTBR] = &&l_ncmpltbr,
+        [Opcode::NCMPGTBR] = &&l_ncmpgtbr,
+        [Opcode::SCMPEQBR] = &&l_scmpeqbr,
+        [Opcode::SCMPNEBR] = &&l_scmpnebr,
+        [Opcode::NADDI] = &&l_naddi,
+
+        // prefix
+        [Opcode::WIDE] = &&l_wide,
+    };
+    // }}}
+
+    const Program* program = handler_->program();
+    const size_t n = stride_;
+    size_t pc = 0;
+    size_t join = Program::npos;      // offset of the next pending group
+    uint64_t mask = size() == MaxLanes ? ~uint64_t(0) : (uint64_t(1) << size()) - 1;
+    uint64_t handled = 0;
+    uint64_t ticks = 0;
+
+    pending_.clear();
+    setMask(mask);
+
+    dispatch;
+
+    // Lets the lowest pending group run next, merging it with the
+    // current one if they meet.
+reschedule:
+    if (mask) {
+        LaneGroup group = { pc, mask };
+        pending_.push_back(group);
+    }
+
+    if (pending_.empty())
+        return handled;
+
+    pc = schedule(&mask);
+    join = Program::npos;
+    for (const LaneGroup& group: pending_)
+        if (group.pc < join)
+            join = group.pc;
+
+    dispatch;
+
+
+    // {{{ control
+    instr (exit) {
+        if (D != 0)
+            handled |= mask;
+
+        mask = 0;
+        goto reschedule;
+    }
+
+    instr (jmp) {
+        jump(D);
+    }
+
+    instr (condbr) {
+        uint64_t taken = laneTest(row(A), n) & mask;
+        branch(taken, D, 1);
+    }
+
+    instr (nswitch) {
+        forEachLane(l) {
+            LaneGroup group = { program->numberSwitch(D).lookup(toNumber(A, l)), uint64_t(1) << l };
+            pending_.push_back(group);
+        }
+
+        mask = 0;
+        goto reschedule;
+    }
+
+    instr (sswitch) {
+        forEachLane(l) {
+            LaneGroup group = { program->stringSwitch(D).lookup(toString(A, l)), uint64_t(1) << l };
+            pending_.push_back(group);
+        }
+
+        mask = 0;
+        goto reschedule;
+    }
+    // }}}
+    // {{{ copy
+    instr (mov) {
+        laneMov(row(A), row(B), laneMask_, n);
+        next;
+    }
+    // }}}
+    // {{{ debug
+    instr (nticks) {
+        laneSet(row(A), ticks, laneMask_, n);
+        next;
+    }
+
+    instr (ndumpn) {
+        forEachLane(l) {
+            printf("regdump: ");
+            for (int i = 0; i < B; ++i) {
+                if (i) printf(", ");
+                printf("r%d = %li", A + i, (int64_t) reg(A + i, l));
+            }
+            if (B) printf("\n");
+        }
+        next;
+    }
+    // }}}
+    // {{{ numerical
+    instr (imov) {
+        laneSet(row(A), D, laneMask_, n);
+        next;
+    }
+
+    instr (nconst) {
+        laneSet(row(A), program->numbers()[D], laneMask_, n);
+        next;
+    }
+
+    instr (nneg) {
+        laneNeg(row(A), row(B), laneMask_, n);
+        next;
+    }
+
+    instr (nadd) {
+        laneAdd(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (nsub) {
+        laneSub(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (nmul) {
+        laneMul(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    // division may trap, so only active lanes divide
+    instr (ndiv) {
+        forEachLane(l)
+            reg(A, l) = static_cast<Register>(toNumber(B, l) / toNumber(C, l));
+        next;
+    }
+
+    instr (nrem) {
+        forEachLane(l)
+            reg(A, l) = static_cast<Register>(toNumber(B, l) % toNumber(C, l));
+        next;
+    }
+
+    instr (nshl) {
+        laneShl(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (nshr) {
+        laneShr(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (npow) {
+        forEachLane(l)
+            reg(A, l) = static_cast<Register>(powl(toNumber(B, l), toNumber(C, l)));
+        next;
+    }
+
+    instr (nand) {
+        laneAnd(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (nor) {
+        laneOr(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (nxor) {
+        laneXor(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (ncmpeq) {
+        laneCmpEq(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (ncmpne) {
+        laneCmpNe(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (ncmple) {
+        laneCmpLe(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (ncmpge) {
+        laneCmpGe(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (ncmplt) {
+        laneCmpLt(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+
+    instr (ncmpgt) {
+        laneCmpGt(row(A), row(B), row(C), laneMask_, n);
+        next;
+    }
+    // }}}
+    // {{{ string
+    instr (sconst) {
+        laneSet(row(A), (Register) &program->strings()[D], laneMask_, n);
+        next;
+    }
+
+    instr (sadd) {
+        forEachLane(l) {
+            const String& b = toString(B, l);
+            const String& c = toString(C, l);
+            char* buf;
+            reg(A, l) = (Register) lanes_[l]->allocateString(b.size() + c.size(), &buf);
+            memcpy(buf, b.data(), b.size());
+            memcpy(buf + b.size(), c.data(), c.size());
+        }
+        next;
+    }
+
+    instr (saddmulti) {
+        forEachLane(l) {
+            size_t size = 0;
+            for (int i = 0; i < C; ++i)
+                size += toString(B + i, l).size();
+
+            char* buf;
+            String* result = lanes_[l]->allocateString(size, &buf);
+
+            for (int i = 0; i < C; ++i) {
+                const String& s = toString(B + i, l);
+                memcpy(buf, s.data(), s.size());
+                buf += s.size();
+            }
+            reg(A, l) = (Register) result;
+        }
+        next;
+    }
+
+    instr (ssubstr) {
+        forEachLane(l) {
+            const String s = toString(B, l).ref(reg(C, l), reg(C + 1, l));
+            reg(A, l) = (Register) lanes_[l]->createStringRef(s.data(), s.size());
+        }
+        next;
+    }
+
+    instr (scmpeq) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l) == toString(C, l);
+        next;
+    }
+
+    instr (scmpne) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l) != toString(C, l);
+        next;
+    }
+
+    instr (scmple) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l) <= toString(C, l);
+        next;
+    }
+
+    instr (scmpge) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l) >= toString(C, l);
+        next;
+    }
+
+    instr (scmplt) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l) < toString(C, l);
+        next;
+    }
+
+    instr (scmpgt) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l) > toString(C, l);
+        next;
+    }
+
+    instr (scmpbeg) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l).begins(toString(C, l));
+        next;
+    }
+
+    instr (scmpend) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l).ends(toString(C, l));
+        next;
+    }
+
+    instr (scontains) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l).find(toString(C, l)) != String::npos;
+        next;
+    }
+
+    instr (sinset) {
+        forEachLane(l)
+            reg(A, l) = program->stringSet(toNumber(C, l)).contains(toString(B, l));
+        next;
+    }
+
+    instr (slen) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l).size();
+        next;
+    }
+
+    instr (sprint) {
+        forEachLane(l)
+            printf("%.*s\n", (int) toString(A, l).size(), toString(A, l).data());
+        next;
+    }
+    // }}}
+    // {{{ regex
+    instr (sregmatch) {
+        forEachLane(l) {
+            const RegExp& re = program->regularExpression(toNumber(C, l));
+            reg(A, l) = re.match(toString(B, l), &lanes_[l]->regexpContext());
+        }
+        next;
+    }
+
+    instr (sreggroup) {
+        forEachLane(l) {
+            BufferRef group = lanes_[l]->regexpContext().group(toNumber(B, l));
+            reg(A, l) = (Register) lanes_[l]->createStringRef(group.data(), group.size());
+        }
+        next;
+    }
+    // }}}
+    // {{{ ip
+    instr (pconst) {
+        laneSet(row(A), (Register) &program->ipaddrs()[D], laneMask_, n);
+        next;
+    }
+
+    instr (pcmpeq) {
+        forEachLane(l)
+            reg(A, l) = toIPAddress(B, l) == toIPAddress(C, l);
+        next;
+    }
+
+    instr (pcmpne) {
+        forEachLane(l)
+            reg(A, l) = toIPAddress(B, l) != toIPAddress(C, l);
+        next;
+    }
+
+    instr (pincidr) {
+        forEachLane(l)
+            reg(A, l) = toCidr(C, l).contains(toIPAddress(B, l));
+        next;
+    }
+
+    instr (pincidrset) {
+        forEachLane(l)
+            reg(A, l) = program->cidrSet(toNumber(C, l)).contains(toIPAddress(B, l));
+        next;
+    }
+    // }}}
+    // {{{ cidr
+    instr (cconst) {
+        laneSet(row(A), (Register) &program->cidrs()[D], laneMask_, n);
+        next;
+    }
+    // }}}
+    // {{{ conversion
+    instr (s2i) {
+        forEachLane(l)
+            reg(A, l) = toString(B, l).toInt();
+        next;
+    }
+
+    instr (p2s) {
+        forEachLane(l) {
+            char buf[IPAddress::MaxStringSize + 1];
+            size_t len = toIPAddress(B, l).format(buf, sizeof(buf));
+            reg(A, l) = (Register) lanes_[l]->createString(buf, len);
+        }
+        next;
+    }
+
+    instr (i2s) {
+        forEachLane(l) {
+            char buf[64];
+            int len = snprintf(buf, sizeof(buf), "%li", (int64_t) reg(B, l));
+            reg(A, l) = (Register) lanes_[l]->createString(buf, len > 0 ? len : 0);
+        }
+        next;
+    }
+
+    instr (surlenc) {
+        forEachLane(l)
+            reg(A, l) = (Register) lanes_[l]->createString(toString(B, l).urlEncode());
+        next;
+    }
+
+    instr (surldec) {
+        forEachLane(l)
+            reg(A, l) = (Register) lanes_[l]->createString(toString(B, l).urlDecode());
+        next;
+    }
+    // }}}
+    // {{{ invokation
+    // natives get each lane's arguments as consecutive argv[], like in Runner
+    instr (call) {
+        forEachLane(l) {
+            int argc = toNumber(B, l);
+            for (int i = 0; i < argc; ++i)
+                argv_[i] = reg(C + i, l);
+
+            program->nativeFunction(toNumber(A, l))->invoke(argc, argv_.data(), lanes_[l].get());
+
+            reg(C, l) = argv_[0];
+        }
+        next;
+    }
+
+    instr (handler) {
+        uint64_t done = 0;
+
+        forEachLane(l) {
+            int argc = toNumber(B, l);
+            for (int i = 0; i < argc; ++i)
+                argv_[i] = reg(C + i, l);
+
+            program->nativeHandler(toNumber(A, l))->invoke(argc, argv_.data(), lanes_[l].get());
+
+            reg(C, l) = argv_[0];
+            if (argv_[0] != 0)
+                done |= uint64_t(1) << l;
+        }
+
+        if (done) {
+            handled |= done;
+            mask &= ~done;
+            if (!mask)
+                goto reschedule;
+            setMask(mask);
+        }
+        next;
+    }
+    // }}}
+    // {{{ superinstructions
+    #define compareAndBranch(kernel) \
+        kernel(row(A), row(B), row(C), laneMask_, n); \
+        uint64_t taken = laneTest(row(A), n) & mask; \
+        branch(taken, operandD(code[pc + 1]), 2);
+
+    instr (ncmpeqbr) {
+        compareAndBranch(laneCmpEq);
+    }
+
+    instr (ncmpnebr) {
+        compareAndBranch(laneCmpNe);
+    }
+
+    instr (ncmplebr) {
+        compareAndBranch(laneCmpLe);
+    }
+
+    instr (ncmpgebr) {
+        compareAndBranch(laneCmpGe);
+    }
+
+    instr (ncmpltbr) {
+        compareAndBranch(laneCmpLt);
+    }
+
+    instr (ncmpgtbr) {
+        compareAndBranch(laneCmpGt);
+    }
+
+    instr (scmpeqbr) {
+        uint64_t taken = 0;
+        forEachLane(l) {
+            reg(A, l) = toString(B, l) == toString(C, l);
+            taken |= reg(A, l) << l;
+        }
+        branch(taken, operandD(code[pc + 1]), 2);
+    }
+
+    instr (scmpnebr) {
+        uint64_t taken = 0;
+        forEachLane(l) {
+            reg(A, l) = toString(B, l) != toString(C, l);
+            taken |= reg(A, l) << l;
+        }
+        branch(taken, operandD(code[pc + 1]), 2);
+    }
+
+    instr (naddi) {
+        laneSet(row(A), D, laneMask_, n);
+        laneAdd(row(operandA(code[pc + 1])), row(operandB(code[pc + 1])), row(operandC(code[pc + 1])), laneMask_, n);
+        advance(2);
+    }
+
+    #undef compareAndBranch
+    // }}}
+    // {{{ prefix
+    instr (wide) { // the slot of an instruction executed from its prefix' slot
+        next;
+    }
+    // }}}
+
+    #undef branch
+    #undef next
+    #undef advance
+    #undef jump
+    #undef dispatch
+    #undef instr
+    #undef forEachLane
+    #undef toCidr
+    #undef toIPAddress
+    #undef toNumber
+    #undef toString
+    #undef reg
+    #undef row
+    #undef D
+    #undef C
+    #undef B
+    #undef A
+}
+
+uint64_t BatchRunner::run()
+{
+    if (handler_->isWide())
+        return execute(handler_->wideCode().data());
+
+    return execute(handler_->code().data());
+}
+
+} // namespace FlowVM
@@ -0,0 +1,212 @@
+#include <flow/vm/BufferRef.h>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+namespace FlowVM {
+
+const size_t BufferRef::npos;
+
+// {{{ string kernels
+namespace {
+    typedef size_t (*FindFn)(const char* s, size_t n, const char* v, size_t m);
+
+    size_t findPortable(const char* s, size_t n, const char* v, size_t m)
+    {
+        const char* i = s;
+        const char* e = s + n - m + 1;
+
+        while (i != e) {
+            i = static_cast<const char*>(std::memchr(i, v[0], e - i));
+            if (!i)
+                return BufferRef::npos;
+
+            if (std::memcmp(i, v, m) == 0)
+                return i - s;
+
+            ++i;
+        }
+
+        return BufferRef::npos;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    /*
+     * Substring search: a block of candidate offsets is tested at once for
+     * the needle's first and last byte, and only offsets matching both are
+     * compared in full. The remaining offsets are left to findPortable().
+     */
+    __attribute__((target("sse2")))
+    size_t findSSE2(const char* s, size_t n, const char* v, size_t m)
+    {
+        const __m128i first = _mm_set1_epi8(v[0]);
+        const __m128i last = _mm_set1_epi8(v[m - 1]);
+
+        size_t i = 0;
+        for (; i + m + 15 <= n; i += 16) {
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + m - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first),
+                                                            _mm_cmpeq_epi8(l, last)));
+            while (mask) {
+                size_t k = i + __builtin_ctz(mask);
+                if (equalBytes(s + k, v, m))
+                    return k;
+                mask &= mask - 1;
+            }
+        }
+
+        size_t rest = findPortable(s + i, n - i, v, m);
+        return rest != BufferRef::npos ? i + rest : rest;
+    }
+
+    __attribute__((target("avx2")))
+    size_t findAVX2(const char* s, size_t n, const char* v, size_t m)
+    {
+        if (n < m + 31)
+            return findSSE2(s, n, v, m);
+
+        const __m256i first = _mm256_set1_epi8(v[0]);
+        const __m256i last = _mm256_set1_epi8(v[m - 1]);
+
+        size_t i = 0;
+        for (; i + m + 31 <= n; i += 32) {
+            __m256i f = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + m - 1));
+            unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(f, first),
+                                                                  _mm256_cmpeq_epi8(l, last)));
+            while (mask) {
+                size_t k = i + __builtin_ctz(mask);
+                if (equalBytes(s + k, v, m))
+                    return k;
+                mask &= mask - 1;
+            }
+        }
+
+        size_t rest = findSSE2(s + i, n - i, v, m);
+        return rest != BufferRef::npos ? i + rest : rest;
+    }
+
+    FindFn selectFind()
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &findAVX2 : &findSSE2;
+    }
+#else
+    FindFn selectFind() { return &findPortable; }
+#endif
+
+    // selected on first use, as other static initializers might search strings
+    FindFn findImpl = nullptr;
+}
+
+size_t findBytes(const char* s, size_t n, const char* v, size_t m)
+{
+    if (m == 0)
+        return 0;
+
+    if (m > n)
+        return BufferRef::npos;
+
+    if (m == 1) {
+        const void* p = std::memchr(s, v[0], n);
+        return p ? static_cast<const char*>(p) - s : BufferRef::npos;
+    }
+
+    FindFn find = __atomic_load_n(&findImpl, __ATOMIC_RELAXED);
+    if (!find) {
+        find = selectFind();
+        __atomic_store_n(&findImpl, find, __ATOMIC_RELAXED);
+    }
+
+    return find(s, n, v, m);
+}
+// }}}
+
+/**
+ * Parses a decimal integer with optional leading whitespace and sign,
+ * like strtoll() does, but without requiring NUL-termination.
+ */
+int64_t BufferRef::toInt() const
+{
+    const char* i = data_;
+    const char* e = data_ + size_;
+
+    while (i != e && (*i == ' ' || *i == '\t' || *i == '\n' || *i == '\r' || *i == '\f' || *i == '\v'))
+        ++i;
+
+    bool negative = false;
+    if (i != e && (*i == '-' || *i == '+')) {
+        negative = *i == '-';
+        ++i;
+    }
+
+    uint64_t value = 0;
+    while (i != e && *i >= '0' && *i <= '9') {
+        value = value * 10 + (*i - '0');
+        ++i;
+    }
+
+    return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+}
+
+/**
+ * Percent-encodes all bytes but the unreserved characters of RFC 3986
+ * (letters, digits, '-', '.', '_' and '~').
+ */
+std::string BufferRef::urlEncode() const
+{
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result;
+    result.reserve(size_);
+
+    for (const char* i = data_, *e = data_ + size_; i != e; ++i) {
+        const unsigned char ch = *i;
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+                || ch == '-' || ch == '.' || ch == '_' || ch == '~') {
+            result += ch;
+        } else {
+            result += '%';
+            result += hex[ch >> 4];
+            result += hex[ch & 15];
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Decodes percent-encoded bytes. Malformed escapes are kept as they are,
+ * and '+' is not taken for a space.
+ */
+std::string BufferRef::urlDecode() const
+{
+    auto digit = [](char ch) -> int {
+        return ch >= '0' && ch <= '9' ? ch - '0'
+             : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+             : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10
+             : -1;
+    };
+
+    std::string result;
+    result.reserve(size_);
+
+    for (size_t i = 0; i != size_; ++i) {
+        const int hi = data_[i] == '%' && i + 2 < size_ ? digit(data_[i + 1]) : -1;
+        const int lo = hi >= 0 ? digit(data_[i + 2]) : -1;
+
+        if (lo >= 0) {
+            result += static_cast<char>(hi << 4 | lo);
+            i += 2;
+        } else {
+            result += data_[i];
+        }
+    }
+
+    return result;
+}
+
+} // namespace FlowVM
@@ -0,0 +1,194 @@
+#include <flow/vm/CidrSet.h>
+#include <vector>
+#include <cstring>
+
+namespace FlowVM {
+
+namespace {
+    bool testBit(const uint64_t* map, unsigned b) { return (map[b >> 6] >> (b & 63)) & 1; }
+    void setBit(uint64_t* map, unsigned b) { map[b >> 6] |= uint64_t(1) << (b & 63); }
+    void clearBit(uint64_t* map, unsigned b) { map[b >> 6] &= ~(uint64_t(1) << (b & 63)); }
+
+    /** Number of bits set in front of bit \p b. */
+    size_t rankOf(const uint64_t* map, unsigned b)
+    {
+        size_t rank = 0;
+        for (unsigned w = 0; w != b >> 6; ++w)
+            rank += __builtin_popcountll(map[w]);
+        return rank + __builtin_popcountll(map[b >> 6] & ((uint64_t(1) << (b & 63)) - 1));
+    }
+
+    /** Trie node while building the set, children ordered by byte value. */
+    struct BuildNode {
+        BuildNode() : leaves(), children(), kids() {}
+
+        uint64_t leaves[4];
+        uint64_t children[4];
+        std::vector<size_t> kids;
+    };
+
+    class TrieBuilder {
+    public:
+        explicit TrieBuilder(size_t roots) : nodes_(roots) {}
+
+        void insert(size_t root, const IPAddress& address, size_t depth, size_t bits);
+        bool compact(size_t node);
+
+        const BuildNode& node(size_t index) const { return nodes_[index]; }
+
+    private:
+        size_t child(size_t node, unsigned b);
+
+        std::vector<BuildNode> nodes_;
+    };
+
+    /**
+     * Adds the network of \p bits prefix bits to the trie at \p root.
+     *
+     * \param depth the address byte \p root consumes (12 for IPv4 roots).
+     *
+     * A prefix shorter than the bytes above \p root covers all of it.
+     */
+    void TrieBuilder::insert(size_t root, const IPAddress& address, size_t depth, size_t bits)
+    {
+        size_t node = root;
+
+        if (bits < 8 * depth)
+            bits = 8 * depth;
+
+        for (;; ++depth) {
+            const unsigned b = address.byte(depth);
+            const size_t remaining = bits - 8 * depth;
+
+            if (remaining <= 8) {
+                // the network ends within this byte, covering a range of its values
+                const unsigned span = 1u << (8 - remaining);
+                const unsigned first = b & ~(span - 1);
+                for (unsigned v = first; v != first + span; ++v)
+                    setBit(nodes_[node].leaves, v);
+                return;
+            }
+
+            if (testBit(nodes_[node].leaves, b))
+                return; // already covered by a shorter prefix
+
+            node = child(node, b);
+        }
+    }
+
+    size_t TrieBuilder::child(size_t node, unsigned b)
+    {
+        const size_t pos = rankOf(nodes_[node].children, b);
+        if (testBit(nodes_[node].children, b))
+            return nodes_[node].kids[pos];
+
+        const size_t index = nodes_.size();
+        nodes_.push_back(BuildNode());
+
+        setBit(nodes_[node].children, b);
+        nodes_[node].kids.insert(nodes_[node].kids.begin() + pos, index);
+
+        return index;
+    }
+
+    /**
+     * Drops children covered by a leaf and turns full children into leaves.
+     *
+     * \retval true all addresses below \p node are members.
+     */
+    bool TrieBuilder::compact(size_t node)
+    {
+        BuildNode& n = nodes_[node];
+        std::vector<size_t> kept;
+
+        for (unsigned b = 0, i = 0; b != 256; ++b) {
+            if (!testBit(n.children, b))
+                continue;
+
+            const size_t kid = n.kids[i++];
+            if (testBit(n.leaves, b) || compact(kid)) {
+                setBit(n.leaves, b);
+                clearBit(n.children, b);
+            } else {
+                kept.push_back(kid);
+            }
+        }
+
+        n.kids.swap(kept);
+
+        return (n.leaves[0] & n.leaves[1] & n.leaves[2] & n.leaves[3]) == ~uint64_t(0);
+    }
+}
+
+CidrSet::CidrSet(const std::vector<Cidr>& networks) :
+    networks_(networks),
+    nodes_()
+{
+    TrieBuilder builder(2);
+
+    for (const Cidr& network: networks_) {
+        if (network.address().isV4()) {
+            builder.insert(V4Root, network.address(), 12, network.bits());
+        } else {
+            builder.insert(V6Root, network.address(), 0, network.bits());
+
+            // IPv4 addresses are looked up in their own trie
+            if (network.contains(IPAddress::fromV4(0)))
+                builder.insert(V4Root, IPAddress::fromV4(0), 12, 96);
+        }
+    }
+
+    builder.compact(V4Root);
+    builder.compact(V6Root);
+
+    // flatten breadth-first, so that siblings end up next to each other
+    std::vector<size_t> order;
+    order.push_back(V4Root);
+    order.push_back(V6Root);
+
+    for (size_t i = 0; i != order.size(); ++i) {
+        const BuildNode& b = builder.node(order[i]);
+        Node node;
+
+        memcpy(node.leaves, b.leaves, sizeof(node.leaves));
+        memcpy(node.children, b.children, sizeof(node.children));
+        node.base = order.size();
+
+        for (unsigned w = 0, rank = 0; w != 4; ++w) {
+            node.rank[w] = rank;
+            rank += __builtin_popcountll(b.children[w]);
+        }
+
+        order.insert(order.end(), b.kids.begin(), b.kids.end());
+        nodes_.push_back(node);
+    }
+}
+
+/*
+ * Counting the bits in front of a child is the hot spot of a lookup;
+ * baseline x86-64 has no popcnt instruction.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+__attribute__((target_clones("popcnt", "default")))
+#endif
+bool CidrSet::contains(const IPAddress& ip) const
+{
+    const bool v4 = ip.isV4();
+    const Node* node = &nodes_[v4 ? V4Root : V6Root];
+
+    for (size_t depth = v4 ? 12 : 0; ; ++depth) {
+        const unsigned b = ip.byte(depth);
+        const unsigned w = b >> 6;
+        const uint64_t bit = uint64_t(1) << (b & 63);
+
+        if (node->leaves[w] & bit)
+            return true;
+
+        if (!(node->children[w] & bit))
+            return false;
+
+        node = &nodes_[node->base + node->rank[w] + __builtin_popcountll(node->children[w] & (bit - 1))];
+    }
+}
+
+} // namespace FlowVM
@@ -0,0 +1,168 @@
+#include <flow/vm/ControlFlow.h>
+#include <flow/vm/Program.h>
+#include <flow/vm/Handler.h>
+#include <algorithm>
+
+namespace FlowVM {
+
+bool fallsThrough(Instruction instr)
+{
+    switch (opcode(instr)) {
+        case Opcode::EXIT:
+        case Opcode::JMP:
+        case Opcode::NSWITCH:
+        case Opcode::SSWITCH:
+            return false;
+        default:
+            return true;
+    }
+}
+
+void jumpTargets(Instruction instr, const Program* program, std::vector<size_t>* targets)
+{
+    switch (opcode(instr)) {
+        case Opcode::JMP:
+        case Opcode::CONDBR:
+            targets->push_back(operandD(instr));
+            break;
+        case Opcode::NSWITCH: {
+            const NumberSwitch& table = program->numberSwitch(operandD(instr));
+            for (const auto& c: table.cases())
+                targets->push_back(c.second);
+            targets->push_back(table.defaultTarget());
+            break;
+        }
+        case Opcode::SSWITCH: {
+            const StringSwitch& table = program->stringSwitch(operandD(instr));
+            for (const auto& c: table.cases())
+                targets->push_back(c.second);
+            targets->push_back(table.defaultTarget());
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// {{{ ControlFlowGraph
+/**
+ * Builds the graph of \p code.
+ *
+ * \param program the program providing the switch tables referenced by \p code.
+ */
+ControlFlowGraph::ControlFlowGraph(ArrayRef<Instruction> code, const Program* program) :
+    blocks_(),
+    blockOf_(code.size())
+{
+    const size_t n = code.size();
+    std::vector<bool> leaders(n + 1, false);
+    std::vector<size_t> targets;
+
+    if (n == 0)
+        return;
+
+    leaders[0] = true;
+
+    for (size_t i = 0; i != n; ++i) {
+        targets.clear();
+        jumpTargets(code[i], program, &targets);
+
+        for (size_t target: targets)
+            if (target < n)
+                leaders[target] = true;
+
+        if (!targets.empty() || !fallsThrough(code[i]))
+            leaders[i + 1] = true;
+    }
+
+    for (size_t i = 0; i != n; ++i) {
+        if (leaders[i]) {
+            BasicBlock block;
+            block.begin = i;
+            block.end = i + 1;
+            blocks_.push_back(block);
+        } else {
+            blocks_.back().end = i + 1;
+        }
+
+        blockOf_[i] = blocks_.size() - 1;
+    }
+
+    for (BasicBlock& block: blocks_) {
+        Instruction last = code[block.end - 1];
+
+        if (fallsThrough(last) && block.end < n)
+            block.successors.push_back(blockOf_[block.end]);
+
+        targets.clear();
+        jumpTargets(last, program, &targets);
+
+        for (size_t target: targets) {
+            if (target >= n)
+                continue;
+
+            size_t succ = blockOf_[target];
+            if (std::find(block.successors.begin(), block.successors.end(), succ) == block.successors.end())
+                block.successors.push_back(succ);
+        }
+    }
+}
+// }}}
+// {{{ EdgeProfile
+uint64_t EdgeProfile::count(size_t from, size_t to) const
+{
+    auto i = edges.find(std::make_pair(from, to));
+    return i != edges.end() ? i->second : 0;
+}
+
+void EdgeProfile::add(const EdgeProfile& other)
+{
+    for (const auto& edge: other.edges)
+        edges[edge.first] += edge.second;
+}
+// }}}
+// {{{ ProfileSink
+ProfileSink::ProfileSink(const Handler* handler) :
+    cfg_(handler->code(), handler->program()),
+    lock_(),
+    lastLeader_(),
+    profile_()
+{
+}
+
+void ProfileSink::instruction(Runner* cx, size_t ip, Instruction instr)
+{
+    if (!cfg_.isLeader(ip))
+        return;
+
+    std::lock_guard<std::mutex> _l(lock_);
+
+    auto last = lastLeader_.find(cx);
+    if (last != lastLeader_.end()) {
+        ++profile_.edges[std::make_pair(last->second, ip)];
+        last->second = ip;
+    } else {
+        lastLeader_[cx] = ip;
+    }
+}
+
+void ProfileSink::exit(Runner* cx, bool result, uint64_t ticks)
+{
+    std::lock_guard<std::mutex> _l(lock_);
+    lastLeader_.erase(cx);
+}
+
+EdgeProfile ProfileSink::profile() const
+{
+    std::lock_guard<std::mutex> _l(lock_);
+    return profile_;
+}
+
+void ProfileSink::reset()
+{
+    std::lock_guard<std::mutex> _l(lock_);
+    profile_.edges.clear();
+}
+// }}}
+
+} // namespace FlowVM
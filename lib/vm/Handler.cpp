@@ -1,35 +1,95 @@
 #include <flow/vm/Handler.h>
 #include <flow/vm/Runner.h>
+#include <flow/vm/RunnerPool.h>
 #include <flow/vm/Instruction.h>
+#include <flow/vm/Optimizer.h>
+#include <flow/vm/Peephole.h>
+#include <flow/vm/ControlFlow.h>
+#include <flow/vm/Program.h>
+#include <flow/vm/MachineCode.h>
+#include <cstdio>
 
 namespace FlowVM {
 
-Handler::Handler()
+Handler::Handler() :
+    program_(nullptr),
+    index_(-1),
+    name_(),
+    registerCount_(0),
+    code_(),
+    codeStorage_(),
+    threadedCode_(),
+    wideCode_(),
+    engine_(ExecutionEngine::DirectThreaded),
+    machineCode_(),
+    optimizationLevel_(program_ ? program_->optimizationLevel() : 1),
+    traceSink_(nullptr),
+    countsTicks_(false),
+    runnerPools_(new RunnerPoolSet(this)),
+    counters_(FLOW_STATS ? new ExecutionCounters() : nullptr)
 {
 }
 
 Handler::Handler(Program* program, const std::string& name,
         const std::vector<Instruction>& code) :
     program_(program),
+    index_(-1),
     name_(name),
-    registerCount_(computeRegisterCount(code.data(), code.size())),
-    code_(code)
+    registerCount_(0),
+    code_(),
+    codeStorage_(code),
+    threadedCode_(),
+    wideCode_(),
+    engine_(ExecutionEngine::DirectThreaded),
+    machineCode_(),
+    optimizationLevel_(program_ ? program_->optimizationLevel() : 1),
+    traceSink_(nullptr),
+    countsTicks_(false),
+    runnerPools_(new RunnerPoolSet(this)),
+    counters_(FLOW_STATS ? new ExecutionCounters() : nullptr)
 {
+    optimize(codeStorage_, program_, optimizationLevel_);
+    code_ = codeStorage_;
+    analyze();
 }
 
 Handler::Handler(const Handler& v) :
     program_(v.program_),
+    index_(-1),                             // copies are not part of the handler table
     name_(v.name_),
     registerCount_(v.registerCount_),
-    code_(v.code_)
+    code_(v.code_),
+    codeStorage_(v.codeStorage_),
+    threadedCode_(v.threadedCode_),
+    wideCode_(v.wideCode_),
+    engine_(v.engine_),
+    machineCode_(v.machineCode_),
+    optimizationLevel_(v.optimizationLevel_),
+    traceSink_(v.traceSink_),
+    countsTicks_(v.countsTicks_),
+    runnerPools_(new RunnerPoolSet(this)),
+    counters_(FLOW_STATS ? new ExecutionCounters() : nullptr)
 {
+    if (v.code_.data() == v.codeStorage_.data())
+        code_ = codeStorage_;
 }
 
 Handler::Handler(Handler&& v) :
     program_(std::move(v.program_)),
+    index_(-1),
     name_(std::move(v.name_)),
     registerCount_(std::move(v.registerCount_)),
-    code_(std::move(v.code_))
+    code_(std::move(v.code_)),
+    codeStorage_(std::move(v.codeStorage_)),
+    threadedCode_(std::move(v.threadedCode_)),
+    wideCode_(std::move(v.wideCode_)),
+    engine_(std::move(v.engine_)),
+    machineCode_(std::move(v.machineCode_)),
+    optimizationLevel_(std::move(v.optimizationLevel_)),
+    traceSink_(std::move(v.traceSink_)),
+    countsTicks_(std::move(v.countsTicks_)),
+    runnerPools_(new RunnerPoolSet(this)),
+    counters_(std::move(v.counters_))
 {
 }
 
@@ -37,16 +97,198 @@ Handler::~Handler()
 {
 }
 
+/**
+ * Reorders the handler's basic blocks by an edge \p profile recorded on
+ * its current code (see relayoutBlocks()).
+ *
+ * Must not be called while the handler is running.
+ *
+ * \retval true the code has been relaid out.
+ */
+bool Handler::relayout(const EdgeProfile& profile)
+{
+    if (isFrozen("relayout"))
+        return false;
+
+    if (isWide()) {
+        fprintf(stderr, "Cannot relayout handler %s: code contains WIDE prefixes.\n", name_.c_str());
+        return false;
+    }
+
+    std::vector<Instruction> code = code_.vec();
+    unfuseInstructions(code);
+
+    if (!relayoutBlocks(code, program_, profile))
+        return false;
+
+    if (optimizationLevel_ > 0)
+        peephole(code);
+
+    codeStorage_.swap(code);
+    code_ = codeStorage_;
+    analyze();
+
+    return true;
+}
+
+ExecutionCounters Handler::stats() const
+{
+    ExecutionCounters result;
+
+    if (counters_) {
+        result.runs = __atomic_load_n(&counters_->runs, __ATOMIC_RELAXED);
+        result.instructions = __atomic_load_n(&counters_->instructions, __ATOMIC_RELAXED);
+        for (size_t i = 0; i != OpcodeCount; ++i)
+            result.opcodes[i] = __atomic_load_n(&counters_->opcodes[i], __ATOMIC_RELAXED);
+    }
+
+    return result;
+}
+
+void Handler::resetStats()
+{
+    if (counters_) {
+        __atomic_store_n(&counters_->runs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counters_->instructions, 0, __ATOMIC_RELAXED);
+        for (size_t i = 0; i != OpcodeCount; ++i)
+            __atomic_store_n(&counters_->opcodes[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Adds a run's counters, which Runners collect locally while running, to
+ * this handler's counters. Safe to call from multiple threads.
+ *
+ * \param runs 1 for a completed run, 0 for a run that got suspended.
+ */
+void Handler::recordRun(uint64_t runs, uint64_t instructions, const uint64_t* opcodes)
+{
+    if (runs)
+        __atomic_fetch_add(&counters_->runs, runs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters_->instructions, instructions, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i != OpcodeCount; ++i)
+        if (opcodes[i])
+            __atomic_fetch_add(&counters_->opcodes[i], opcodes[i], __ATOMIC_RELAXED);
+}
+
+/**
+ * Renames the handler, keeping its program's name index up to date.
+ */
+void Handler::setName(const std::string& name)
+{
+    if (isFrozen("rename"))
+        return;
+
+    if (program_)
+        program_->renameHandler(this, name);
+
+    name_ = name;
+}
+
+/**
+ * Replaces the handler's code, optimizing it according to optimizationLevel().
+ */
 void Handler::setCode(const std::vector<Instruction>& code)
 {
-    code_ = code;
-    registerCount_ = computeRegisterCount(code_.data(), code_.size());
+    if (isFrozen("set code of"))
+        return;
+
+    codeStorage_ = code;
+    optimize(codeStorage_, program_, optimizationLevel_);
+    code_ = codeStorage_;
+    analyze();
 }
 
 void Handler::setCode(std::vector<Instruction>&& code)
 {
-    code_ = std::move(code);
+    if (isFrozen("set code of"))
+        return;
+
+    codeStorage_ = std::move(code);
+    optimize(codeStorage_, program_, optimizationLevel_);
+    code_ = codeStorage_;
+    analyze();
+}
+
+/**
+ * Uses externally owned code (such as a mapped program file) without
+ * copying or optimizing it. The code must outlive this handler.
+ */
+void Handler::setCodeRef(ArrayRef<Instruction> code)
+{
+    if (isFrozen("set code of"))
+        return;
+
+    codeStorage_.clear();
+    code_ = code;
+    analyze();
+}
+
+/**
+ * Reports an attempt to modify a handler of a frozen program.
+ *
+ * \retval true the handler must not be modified.
+ */
+bool Handler::isFrozen(const char* what) const
+{
+    if (program_ && program_->isFrozen()) {
+        fprintf(stderr, "Cannot %s handler %s: program is frozen.\n", what, name_.c_str());
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Recomputes everything derived from the handler's code.
+ */
+void Handler::analyze()
+{
     registerCount_ = computeRegisterCount(code_.data(), code_.size());
+    countsTicks_ = false;
+
+    for (Instruction instr: code_) {
+        if (opcode(instr) == Opcode::NTICKS) {
+            countsTicks_ = true;
+            break;
+        }
+    }
+
+    // wide code runs from its decoded form, any engine selected
+    if (widen(code_.data(), code_.size(), &wideCode_))
+        threadedCode_.clear();
+    else
+        Runner::translate(code_, &threadedCode_);
+
+    compile();
+}
+
+/**
+ * Selects how the handler's code is executed.
+ *
+ * Selecting ExecutionEngine::Compiled compiles the code right away, and
+ * again whenever it changes. The engine has to be chosen before the program
+ * is frozen (see Program::freeze()), as running handlers read it.
+ */
+void Handler::setEngine(ExecutionEngine engine)
+{
+    if (isFrozen("set engine of"))
+        return;
+
+    engine_ = engine;
+    compile();
+}
+
+/**
+ * Compiles the code into machineCode() if engine() is ExecutionEngine::Compiled.
+ */
+void Handler::compile()
+{
+    if (engine_ == ExecutionEngine::Compiled && MachineCode::isAvailable())
+        machineCode_ = MachineCode::compile(this);
+    else
+        machineCode_.reset();
 }
 
 std::unique_ptr<Runner> Handler::createRunner()
@@ -54,11 +296,24 @@ std::unique_ptr<Runner> Handler::createRunner()
     return Runner::create(this);
 }
 
+/**
+ * Runs this handler using a Runner recycled from the calling thread's pool.
+ */
 bool Handler::run(void* userdata)
 {
-    auto runner = createRunner();
+    RunnerPool* pool = runnerPools_->local();
+    if (!pool) {
+        auto runner = createRunner();
+        runner->setUserData(userdata);
+        return runner->run();
+    }
+
+    Runner* runner = pool->acquire();
     runner->setUserData(userdata);
-    return runner->run();
+    bool result = runner->run();
+    pool->release(runner);
+
+    return result;
 }
 
 void Handler::disassemble()
@@ -0,0 +1,170 @@
+#include <flow/vm/IPAddress.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <arpa/inet.h>
+
+namespace FlowVM {
+
+// {{{ IPAddress
+/**
+ * Creates an address from its bytes in network byte order.
+ *
+ * \param bytes the address bytes.
+ * \param size 4 for an IPv4 address, 16 for an IPv6 address.
+ */
+IPAddress IPAddress::fromBytes(const uint8_t* bytes, size_t size)
+{
+    if (size == 4)
+        return fromV4((uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16)
+                    | (uint32_t(bytes[2]) << 8) | bytes[3]);
+
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+    for (size_t i = 0; i != 8; ++i) {
+        hi = (hi << 8) | bytes[i];
+        lo = (lo << 8) | bytes[8 + i];
+    }
+
+    return IPAddress(hi, lo);
+}
+
+/**
+ * Parses an IPv4 (dotted quad) or IPv6 address.
+ *
+ * \retval true \p result holds the parsed address.
+ * \retval false \p text is not a valid address.
+ */
+bool IPAddress::parse(const BufferRef& text, IPAddress* result)
+{
+    char buf[MaxStringSize + 1];
+    if (text.size() > MaxStringSize)
+        return false;
+
+    memcpy(buf, text.data(), text.size());
+    buf[text.size()] = '\0';
+
+    uint8_t bytes[16];
+
+    if (inet_pton(AF_INET, buf, bytes) == 1) {
+        *result = fromBytes(bytes, 4);
+        return true;
+    }
+
+    if (inet_pton(AF_INET6, buf, bytes) == 1) {
+        *result = fromBytes(bytes, 16);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Formats the address into \p buf, NUL-terminated.
+ *
+ * \return the length of the formatted address, or 0 if \p buf is too small.
+ */
+size_t IPAddress::format(char* buf, size_t size) const
+{
+    uint8_t bytes[16];
+    for (size_t i = 0; i != 16; ++i)
+        bytes[i] = byte(i);
+
+    const char* s = isV4()
+        ? inet_ntop(AF_INET, bytes + 12, buf, size)
+        : inet_ntop(AF_INET6, bytes, buf, size);
+
+    return s ? strlen(buf) : 0;
+}
+
+std::string IPAddress::str() const
+{
+    char buf[MaxStringSize + 1];
+    return std::string(buf, format(buf, sizeof(buf)));
+}
+// }}}
+// {{{ Cidr
+/**
+ * \param address any address within the network.
+ * \param prefix the prefix length, relative to \p address's family.
+ */
+Cidr::Cidr(const IPAddress& address, size_t prefix) :
+    address_(),
+    bits_(0),
+    reserved_(0)
+{
+    if (address.isV4())
+        assign(address, 96 + (prefix > 32 ? 32 : prefix));
+    else
+        assign(address, prefix > 128 ? 128 : prefix);
+}
+
+/**
+ * Creates a network of \p bits prefix bits within the 128 bit address space.
+ */
+Cidr Cidr::fromBits(const IPAddress& address, size_t bits)
+{
+    Cidr result;
+    result.assign(address, bits > 128 ? 128 : bits);
+    return result;
+}
+
+void Cidr::assign(const IPAddress& address, size_t bits)
+{
+    const uint64_t hiMask = bits >= 64 ? ~uint64_t(0) : bits ? ~uint64_t(0) << (64 - bits) : 0;
+    const uint64_t loMask = bits >= 128 ? ~uint64_t(0) : bits > 64 ? ~uint64_t(0) << (128 - bits) : 0;
+
+    address_ = IPAddress(address.hi() & hiMask, address.lo() & loMask);
+    bits_ = bits;
+}
+
+/**
+ * Parses a network as <tt>address/prefix</tt>.
+ *
+ * A missing prefix denotes the single host network (/32 resp. /128).
+ * The prefix of an address in IPv6 notation is always relative to 128 bits,
+ * even if the address is IPv4-mapped.
+ */
+bool Cidr::parse(const BufferRef& text, Cidr* result)
+{
+    const char* sep = static_cast<const char*>(memchr(text.data(), '/', text.size()));
+    const size_t slash = sep ? sep - text.data() : BufferRef::npos;
+    IPAddress address;
+
+    if (!IPAddress::parse(slash == BufferRef::npos ? text : text.ref(0, slash), &address))
+        return false;
+
+    const bool v6 = memchr(text.data(), ':', slash == BufferRef::npos ? text.size() : slash) != nullptr;
+    const size_t max = v6 ? 128 : 32;
+    size_t prefix = max;
+
+    if (slash != BufferRef::npos) {
+        BufferRef digits = text.ref(slash + 1);
+        if (digits.empty() || digits.size() > 3)
+            return false;
+
+        prefix = 0;
+        for (char ch: digits) {
+            if (ch < '0' || ch > '9')
+                return false;
+            prefix = prefix * 10 + (ch - '0');
+        }
+
+        if (prefix > max)
+            return false;
+    }
+
+    *result = v6 ? fromBits(address, prefix) : Cidr(address, prefix);
+    return true;
+}
+
+std::string Cidr::str() const
+{
+    char buf[IPAddress::MaxStringSize + 5];
+    size_t n = address_.format(buf, sizeof(buf));
+    n += snprintf(buf + n, sizeof(buf) - n, "/%zu", prefix());
+    return std::string(buf, n);
+}
+// }}}
+
+} // namespace FlowVM
@@ -7,29 +7,185 @@
 
 namespace FlowVM {
 
-void disassemble(Instruction pc, ImmOperand ip, const char* comment)
+namespace {
+    /** Whether \p opc takes the immediate D rather than registers B and C. */
+    bool hasImmediate(Opcode opc)
+    {
+        switch (operandSignature(opc)) {
+            case InstructionSig::RI:
+            case InstructionSig::I:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /** Implements registerMax() for either encoding. */
+    template<typename T>
+    size_t registerMaxOf(T instr)
+    {
+        // register windows with an immediate width
+        switch (opcode(instr)) {
+            case Opcode::NDUMPN:
+                return operandA(instr) + operandB(instr);
+            case Opcode::SADDMULTI:
+                return std::max<size_t>(1 + operandA(instr), operandB(instr) + operandC(instr));
+            case Opcode::SSUBSTR:
+                return std::max<size_t>(std::max(1 + operandA(instr), 1 + operandB(instr)), 2 + operandC(instr));
+            default:
+                break;
+        }
+
+        size_t result = 0;
+        switch (operandSignature(opcode(instr))) {
+            case InstructionSig::RRR:
+                result = std::max<size_t>(result, 1 + operandC(instr));
+            case InstructionSig::RR:
+                result = std::max<size_t>(result, 1 + operandB(instr));
+            case InstructionSig::R:
+            case InstructionSig::RI:
+                result = std::max<size_t>(result, 1 + operandA(instr));
+            case InstructionSig::I:
+            case InstructionSig::None:
+                break;
+        }
+        return result;
+    }
+}
+
+// {{{ wide encoding
+/**
+ * Tests whether an instruction has operands beyond the 32-bit encoding,
+ * i.e. a register above 255 or an immediate above 65535.
+ */
+bool isWide(WideInstruction instr)
+{
+    if (operandA(instr) > 0xFF)
+        return true;
+
+    if (hasImmediate(opcode(instr)))
+        return operandD(instr) > 0xFFFF;
+
+    return operandB(instr) > 0xFF || operandC(instr) > 0xFF;
+}
+
+/**
+ * Appends an instruction to \p code in its 32-bit encoding, preceded by a
+ * WIDE prefix holding the high operand bits if isWide().
+ *
+ * \return the offset of the instruction, or of its prefix.
+ */
+size_t appendInstruction(std::vector<Instruction>& code, WideInstruction instr)
+{
+    const size_t offset = code.size();
+    const Opcode opc = opcode(instr);
+    const WideOperand A = operandA(instr);
+
+    if (hasImmediate(opc)) {
+        const WideImmOperand D = operandD(instr);
+        if (isWide(instr))
+            code.push_back(makeInstructionImm(Opcode::WIDE, A >> 8, D >> 16));
+        code.push_back(makeInstructionImm(opc, A & 0xFF, D & 0xFFFF));
+    } else {
+        const WideOperand B = operandB(instr);
+        const WideOperand C = operandC(instr);
+        if (isWide(instr))
+            code.push_back(makeInstruction(Opcode::WIDE, A >> 8, B >> 8, C >> 8));
+        code.push_back(makeInstruction(opc, A & 0xFF, B & 0xFF, C & 0xFF));
+    }
+
+    return offset;
+}
+
+/**
+ * Decodes \p instr, completing its operands by the high bits in \p prefix.
+ *
+ * A WIDE prefix holds bits 8 to 15 of the registers A, B and C at their
+ * own positions, or bits 8 to 15 of A and 16 to 31 of D for instructions
+ * taking an immediate. A zero \p prefix decodes \p instr as is.
+ */
+WideInstruction widen(Instruction prefix, Instruction instr)
+{
+    const Opcode opc = opcode(instr);
+    const WideOperand A = operandA(instr) | (operandA(prefix) << 8);
+
+    if (hasImmediate(opc))
+        return makeWideInstructionImm(opc, A, operandD(instr) | ((WideImmOperand) operandD(prefix) << 16));
+
+    return makeWideInstruction(opc, A, operandB(instr) | (operandB(prefix) << 8),
+                                        operandC(instr) | (operandC(prefix) << 8));
+}
+
+/**
+ * Decodes code containing WIDE prefixes into one WideInstruction per
+ * Instruction.
+ *
+ * A prefix' slot receives the instruction it belongs to, and the
+ * instruction's own slot a WIDE, which executes as a no-op. Thus offsets
+ * stay the same, and a jump to the prefix executes the whole instruction.
+ *
+ * \retval true \p code contains prefixes and has been decoded into \p result.
+ * \retval false \p code contains no prefix; \p result is left empty.
+ */
+bool widen(const Instruction* code, size_t size, std::vector<WideInstruction>* result)
+{
+    result->clear();
+
+    size_t i = 0;
+    while (i != size && opcode(code[i]) != Opcode::WIDE)
+        ++i;
+
+    if (i == size)
+        return false;
+
+    result->resize(size);
+
+    for (i = 0; i != size; ++i) {
+        if (opcode(code[i]) == Opcode::WIDE && i + 1 != size) {
+            (*result)[i] = widen(code[i], code[i + 1]);
+            (*result)[++i] = makeWideInstruction(Opcode::WIDE);
+        } else {
+            (*result)[i] = widen(0, code[i]);
+        }
+    }
+
+    return true;
+}
+// }}}
+
+void disassemble(Instruction pc, size_t ip, const char* comment)
+{
+    disassemble(stdout, pc, ip, comment);
+}
+
+void disassemble(FILE* out, Instruction pc, size_t ip, const char* comment)
+{
+    disassemble(out, widen(0, pc), ip, comment);
+}
+
+void disassemble(FILE* out, WideInstruction pc, size_t ip, const char* comment)
 {
     Opcode opc = opcode(pc);
-    Operand A = operandA(pc);
-    Operand B = operandB(pc);
-    Operand C = operandC(pc);
-    ImmOperand D = operandD(pc);
+    WideOperand A = operandA(pc);
+    WideOperand B = operandB(pc);
+    WideOperand C = operandC(pc);
+    WideImmOperand D = operandD(pc);
     const char* mnemo = mnemonic(opc);
     size_t n = 0;
     int rv = 0;
 
-    rv = printf(" %3hu: %-10s", ip, mnemo);
+    rv = fprintf(out, " %3zu: %-10s", ip, mnemo);
     if (rv > 0) {
         n += rv;
     }
 
     switch (operandSignature(opc)) {
         case InstructionSig::None: break;
-        case InstructionSig::R:    rv = printf(" r%d", A); break;
-        case InstructionSig::RR:   rv = printf(" r%d, r%d", A, B); break;
-        case InstructionSig::RRR:  rv = printf(" r%d, r%d, r%d", A, B, C); break;
-        case InstructionSig::RI:   rv = printf(" r%d, %d", A, D); break;
-        case InstructionSig::I:    rv = printf(" %d", D); break;
+        case InstructionSig::R:    rv = fprintf(out, " r%d", A); break;
+        case InstructionSig::RR:   rv = fprintf(out, " r%d, r%d", A, B); break;
+        case InstructionSig::RRR:  rv = fprintf(out, " r%d, r%d, r%d", A, B, C); break;
+        case InstructionSig::RI:   rv = fprintf(out, " r%d, %u", A, D); break;
+        case InstructionSig::I:    rv = fprintf(out, " %u", D); break;
     }
 
     if (rv > 0) {
@@ -38,19 +194,27 @@ void disassemble(Instruction pc, ImmOperand ip, const char* comment)
 
     if (comment && *comment) {
         for (; n < 30; ++n) {
-            printf(" ");
+            fprintf(out, " ");
         }
-        printf("; %s\n", comment);
+        fprintf(out, "; %s\n", comment);
     } else {
-        printf("\n");
+        fprintf(out, "\n");
     }
 }
 
+/**
+ * Disassembles \p program, printing a prefixed instruction at its prefix'
+ * offset.
+ */
 void disassemble(const Instruction* program, size_t n)
 {
-    size_t i = 0;
-    for (const Instruction* pc = program; pc < program + n; ++pc) {
-        disassemble(*pc, i++);
+    for (size_t i = 0; i < n; ++i) {
+        if (opcode(program[i]) == Opcode::WIDE && i + 1 < n) {
+            disassemble(stdout, widen(program[i], program[i + 1]), i, "wide");
+            ++i;
+        } else {
+            disassemble(stdout, program[i], i);
+        }
     }
 }
 
@@ -59,30 +223,29 @@ void disassemble(const Instruction* program, size_t n)
  */
 size_t registerMax(Instruction instr)
 {
-    Operand result = 0;
-    switch (operandSignature(opcode(instr))) {
-        case InstructionSig::RRR:
-            result = std::max(result, (Operand) (1 + operandC(instr)));
-        case InstructionSig::RR:
-            result = std::max(result, (Operand) (1 + operandB(instr)));
-        case InstructionSig::R:
-        case InstructionSig::RI:
-            result = std::max(result, (Operand) (1 + operandA(instr)));
-        case InstructionSig::I:
-        case InstructionSig::None:
-            return static_cast<size_t>(result);
-    }
+    return registerMaxOf(instr);
+}
+
+size_t registerMax(WideInstruction instr)
+{
+    return registerMaxOf(instr);
 }
 
+/**
+ * Computes the number of registers \p code uses, including registers of
+ * WIDE prefixed instructions.
+ */
 size_t computeRegisterCount(const Instruction* code, size_t size)
 {
-    auto* ip = code;
-    auto* e = code + size;
     size_t count = 0;
 
-    while (ip != e) {
-        count = std::max(count, registerMax(*ip));
-        ++ip;
+    for (size_t i = 0; i != size; ++i) {
+        if (opcode(code[i]) == Opcode::WIDE && i + 1 != size) {
+            count = std::max(count, registerMax(widen(code[i], code[i + 1])));
+            ++i;
+        } else {
+            count = std::max(count, registerMax(code[i]));
+        }
     }
 
     return count;
@@ -0,0 +1,650 @@
+#include <flow/vm/MachineCode.h>
+#include <flow/vm/Handler.h>
+#include <flow/vm/Program.h>
+#include <flow/vm/Runner.h>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace FlowVM {
+
+#if defined(__x86_64__)
+// {{{ helpers
+namespace {
+    /*
+     * Instructions translated into calls receive the runner, the register
+     * file and their decoded instruction, and implement the interpreter's
+     * semantics of the opcode.
+     */
+    typedef void (*Helper)(Runner* self, Register* data, WideInstruction instr);
+
+    /** Returns the jump target. */
+    typedef size_t (*SwitchHelper)(Runner* self, Register* data, WideInstruction instr);
+
+    /** Returns 0 to continue, or else the result of the machine code's run. */
+    typedef uint64_t (*NativeHelper)(Runner* self, Register* data, WideInstruction instr, size_t pc);
+
+    #define A operandA(instr)
+    #define B operandB(instr)
+    #define C operandC(instr)
+    #define D operandD(instr)
+
+    #define toString(R) (*(String*) data[R])
+    #define toNumber(R) ((Number) data[R])
+    #define toIPAddress(R) (*(const IPAddress*) data[R])
+    #define toCidr(R) (*(const Cidr*) data[R])
+
+    #define helper(name) void name(Runner* self, Register* data, WideInstruction instr)
+
+    helper(npow) {
+        data[A] = static_cast<Register>(powl(toNumber(B), toNumber(C)));
+    }
+
+    helper(sconst) {
+        data[A] = (Register) &self->program()->strings()[D];
+    }
+
+    helper(sadd) {
+        const String& b = toString(B);
+        const String& c = toString(C);
+        char* buf;
+        data[A] = (Register) self->allocateString(b.size() + c.size(), &buf);
+        memcpy(buf, b.data(), b.size());
+        memcpy(buf + b.size(), c.data(), c.size());
+    }
+
+    helper(saddmulti) {
+        size_t size = 0;
+        for (int i = 0; i < C; ++i)
+            size += toString(B + i).size();
+
+        char* buf;
+        String* result = self->allocateString(size, &buf);
+
+        for (int i = 0; i < C; ++i) {
+            const String& s = toString(B + i);
+            memcpy(buf, s.data(), s.size());
+            buf += s.size();
+        }
+        data[A] = (Register) result;
+    }
+
+    helper(ssubstr) {
+        const String s = toString(B).ref(data[C], data[C + 1]);
+        data[A] = (Register) self->createStringRef(s.data(), s.size());
+    }
+
+    helper(scmpeq) { data[A] = toString(B) == toString(C); }
+    helper(scmpne) { data[A] = toString(B) != toString(C); }
+    helper(scmple) { data[A] = toString(B) <= toString(C); }
+    helper(scmpge) { data[A] = toString(B) >= toString(C); }
+    helper(scmplt) { data[A] = toString(B) < toString(C); }
+    helper(scmpgt) { data[A] = toString(B) > toString(C); }
+    helper(scmpbeg) { data[A] = toString(B).begins(toString(C)); }
+    helper(scmpend) { data[A] = toString(B).ends(toString(C)); }
+
+    helper(scontains) {
+        data[A] = toString(B).find(toString(C)) != String::npos;
+    }
+
+    helper(sinset) {
+        data[A] = self->program()->stringSet(toNumber(C)).contains(toString(B));
+    }
+
+    helper(slen) {
+        data[A] = toString(B).size();
+    }
+
+    helper(sregmatch) {
+        const RegExp& re = self->program()->regularExpression(toNumber(C));
+        data[A] = re.match(toString(B), &self->regexpContext());
+    }
+
+    helper(sreggroup) {
+        BufferRef group = self->regexpContext().group(toNumber(B));
+        data[A] = (Register) self->createStringRef(group.data(), group.size());
+    }
+
+    helper(pconst) {
+        data[A] = (Register) &self->program()->ipaddrs()[D];
+    }
+
+    helper(pcmpeq) { data[A] = toIPAddress(B) == toIPAddress(C); }
+    helper(pcmpne) { data[A] = toIPAddress(B) != toIPAddress(C); }
+
+    helper(pincidr) {
+        data[A] = toCidr(C).contains(toIPAddress(B));
+    }
+
+    helper(pincidrset) {
+        data[A] = self->program()->cidrSet(toNumber(C)).contains(toIPAddress(B));
+    }
+
+    helper(cconst) {
+        data[A] = (Register) &self->program()->cidrs()[D];
+    }
+
+    helper(s2i) {
+        data[A] = toString(B).toInt();
+    }
+
+    helper(p2s) {
+        char buf[IPAddress::MaxStringSize + 1];
+        size_t n = toIPAddress(B).format(buf, sizeof(buf));
+        data[A] = (Register) self->createString(buf, n);
+    }
+
+    helper(i2s) {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "%li", (int64_t) data[B]);
+        data[A] = (Register) self->createString(buf, n > 0 ? n : 0);
+    }
+
+    helper(surlenc) {
+        data[A] = (Register) self->createString(toString(B).urlEncode());
+    }
+
+    helper(surldec) {
+        data[A] = (Register) self->createString(toString(B).urlDecode());
+    }
+
+    #undef helper
+
+    size_t nswitch(Runner* self, Register* data, WideInstruction instr)
+    {
+        return self->program()->numberSwitch(D).lookup(toNumber(A));
+    }
+
+    size_t sswitch(Runner* self, Register* data, WideInstruction instr)
+    {
+        return self->program()->stringSwitch(D).lookup(toString(A));
+    }
+
+    uint64_t callFunction(Runner* self, Register* data, WideInstruction instr, size_t pc)
+    {
+        self->program()->nativeFunction(toNumber(A))->invoke(toNumber(B), &data[C], self);
+
+        if (self->isSuspended())
+            return (pc << 2) | MachineCode::Suspended;
+
+        return 0;
+    }
+
+    uint64_t callHandler(Runner* self, Register* data, WideInstruction instr, size_t pc)
+    {
+        self->program()->nativeHandler(toNumber(A))->invoke(toNumber(B), &data[C], self);
+
+        if (self->isSuspended())
+            return (pc << 2) | MachineCode::Suspended;
+
+        return data[C] != 0 ? MachineCode::ExitTrue : 0;
+    }
+
+    #undef toCidr
+    #undef toIPAddress
+    #undef toNumber
+    #undef toString
+    #undef D
+    #undef C
+    #undef B
+    #undef A
+
+    /** The helper implementing \p opc, if any. */
+    Helper helperOf(Opcode opc)
+    {
+        switch (opc) {
+            case Opcode::NPOW:       return &npow;
+            case Opcode::SCONST:     return &sconst;
+            case Opcode::SADD:       return &sadd;
+            case Opcode::SADDMULTI:  return &saddmulti;
+            case Opcode::SSUBSTR:    return &ssubstr;
+            case Opcode::SCMPEQ:     return &scmpeq;
+            case Opcode::SCMPNE:     return &scmpne;
+            case Opcode::SCMPLE:     return &scmple;
+            case Opcode::SCMPGE:     return &scmpge;
+            case Opcode::SCMPLT:     return &scmplt;
+            case Opcode::SCMPGT:     return &scmpgt;
+            case Opcode::SCMPBEG:    return &scmpbeg;
+            case Opcode::SCMPEND:    return &scmpend;
+            case Opcode::SCONTAINS:  return &scontains;
+            case Opcode::SINSET:     return &sinset;
+            case Opcode::SLEN:       return &slen;
+            case Opcode::SREGMATCH:  return &sregmatch;
+            case Opcode::SREGGROUP:  return &sreggroup;
+            case Opcode::PCONST:     return &pconst;
+            case Opcode::PCMPEQ:     return &pcmpeq;
+            case Opcode::PCMPNE:     return &pcmpne;
+            case Opcode::PINCIDR:    return &pincidr;
+            case Opcode::PINCIDRSET: return &pincidrset;
+            case Opcode::CCONST:     return &cconst;
+            case Opcode::I2S:        return &i2s;
+            case Opcode::S2I:        return &s2i;
+            case Opcode::P2S:        return &p2s;
+            case Opcode::SURLENC:    return &surlenc;
+            case Opcode::SURLDEC:    return &surldec;
+            default: return nullptr;
+        }
+    }
+}
+// }}}
+// {{{ assembler
+namespace {
+    enum Reg {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+        R8 = 8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    /** Condition codes, as encoded into Jcc and SETcc. */
+    enum Cond {
+        CondE = 0x4, CondNE = 0x5, CondL = 0xC, CondGE = 0xD, CondLE = 0xE, CondG = 0xF,
+    };
+
+    /** ALU ops taking a register and a memory operand (reg = reg op mem). */
+    enum Alu {
+        AluAdd = 0x03, AluOr = 0x0B, AluAnd = 0x23, AluSub = 0x2B, AluXor = 0x33, AluCmp = 0x3B,
+    };
+
+    /**
+     * Emits the few x86-64 instructions the compiler needs.
+     *
+     * VM registers are addressed as [r12 + 8 * index], r12 holding the
+     * register file throughout the code.
+     */
+    class Assembler {
+    public:
+        size_t offset() const { return code_.size(); }
+        const std::vector<uint8_t>& code() const { return code_; }
+
+        void byte(uint8_t b) { code_.push_back(b); }
+        void dword(uint32_t v) { for (int i = 0; i < 32; i += 8) byte(v >> i); }
+        void qword(uint64_t v) { for (int i = 0; i < 64; i += 8) byte(v >> i); }
+
+        void align(size_t n) { while (offset() % n) byte(0xCC); }
+
+        void load(Reg r, size_t vreg) { rex(r); byte(0x8B); mem(r, vreg); }
+        void store(size_t vreg, Reg r) { rex(r); byte(0x89); mem(r, vreg); }
+        void alu(Alu op, Reg r, size_t vreg) { rex(r); byte(op); mem(r, vreg); }
+        void imul(Reg r, size_t vreg) { rex(r); byte(0x0F); byte(0xAF); mem(r, vreg); }
+        void idiv(size_t vreg) { rex(RAX); byte(0xF7); mem(RDI /* /7 */, vreg); }
+
+        /** mov qword [vreg], imm32 (sign-extended) */
+        void storeImm(size_t vreg, int32_t imm) { rex(RAX); byte(0xC7); mem(RAX /* /0 */, vreg); dword(imm); }
+
+        void movImm(Reg r, uint64_t imm) {
+            if (imm <= 0xFFFFFFFF) {
+                if (r >= R8)
+                    byte(0x41);
+                byte(0xB8 + (r & 7));
+                dword(imm);
+            } else {
+                byte(0x48 | (r >= R8));
+                byte(0xB8 + (r & 7));
+                qword(imm);
+            }
+        }
+
+        void mov(Reg dst, Reg src) {
+            byte(0x48 | ((src & 8) >> 1) | ((dst & 8) >> 3));
+            byte(0x89);
+            byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+        }
+
+        void push(Reg r) { if (r >= R8) byte(0x41); byte(0x50 + (r & 7)); }
+        void pop(Reg r) { if (r >= R8) byte(0x41); byte(0x58 + (r & 7)); }
+        void ret() { byte(0xC3); }
+
+        void negRax() { byte(0x48); byte(0xF7); byte(0xD8); }
+        void cqo() { byte(0x48); byte(0x99); }
+        void shlRaxCl() { byte(0x48); byte(0xD3); byte(0xE0); }
+        void sarRaxCl() { byte(0x48); byte(0xD3); byte(0xF8); }
+        void testRax() { byte(0x48); byte(0x85); byte(0xC0); }
+
+        /** rax = condition ? 1 : 0 */
+        void setRax(Cond cc) {
+            byte(0x0F); byte(0x90 | cc); byte(0xC0);   // setcc al
+            byte(0x0F); byte(0xB6); byte(0xC0);        // movzx eax, al
+        }
+
+        void callRax() { byte(0xFF); byte(0xD0); }
+
+        /** jmp [r13 + 8 * index] */
+        void jmpTable(Reg index) { byte(0x41); byte(0xFF); byte(0x64); byte(0xC5 | (index << 3)); byte(0); }
+
+        /** lea r, [rip + rel32], returning the rel32's offset for patch(). */
+        size_t leaRip(Reg r) { byte(0x48 | ((r & 8) >> 1)); byte(0x8D); byte(0x05 | ((r & 7) << 3)); dword(0); return offset() - 4; }
+
+        /** Jumps, returning the rel32's offset for patch(). */
+        size_t jmp() { byte(0xE9); dword(0); return offset() - 4; }
+        size_t jcc(Cond cc) { byte(0x0F); byte(0x80 | cc); dword(0); return offset() - 4; }
+
+        void patch(size_t at, size_t target) {
+            const uint32_t rel = static_cast<uint32_t>(target - (at + 4));
+            memcpy(&code_[at], &rel, sizeof(rel));
+        }
+
+    private:
+        void rex(Reg r) { byte(0x49 | ((r & 8) >> 1)); }   // REX.W, REX.B for r12
+
+        void mem(Reg r, size_t vreg) {
+            const size_t disp = vreg * sizeof(Register);
+            if (disp < 128) {
+                byte(0x44 | ((r & 7) << 3));
+                byte(0x24);
+                byte(disp);
+            } else {
+                byte(0x84 | ((r & 7) << 3));
+                byte(0x24);
+                dword(disp);
+            }
+        }
+
+        std::vector<uint8_t> code_;
+    };
+}
+// }}}
+#endif
+
+bool MachineCode::isAvailable()
+{
+#if defined(__x86_64__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Compiles a handler's code into machine code.
+ *
+ * Number constants are compiled in as immediates; all other constants are
+ * looked up in the handler's program at run time.
+ *
+ * \return the machine code, or \c nullptr if not available on this platform.
+ */
+std::unique_ptr<MachineCode> MachineCode::compile(const Handler* handler)
+{
+#if defined(__x86_64__)
+    std::vector<WideInstruction> code;
+    if (handler->isWide()) {
+        code = handler->wideCode();
+    } else {
+        for (Instruction instr: handler->code())
+            code.push_back(widen(0, instr));
+    }
+
+    const Program* program = handler->program();
+    const size_t n = code.size();
+
+    Assembler as;
+    std::vector<size_t> labels(n + 1);
+    std::vector<std::pair<size_t, size_t>> fixups;  // rel32 offset, target instruction
+
+    // the next instruction, skipping the WIDE slot behind a prefixed instruction
+    auto following = [&](size_t pc) {
+        return pc + 1 < n && opcode(code[pc + 1]) == Opcode::WIDE ? pc + 2 : pc + 1;
+    };
+
+    auto target = [&](size_t pc) { return pc < n ? pc : n; };
+
+    // {{{ prologue: rbx = runner, r12 = registers, r13 = address table
+    as.push(RBX);
+    as.push(R12);
+    as.push(R13);
+    as.mov(RBX, RDI);
+    as.mov(R12, RSI);
+    const size_t table = as.leaRip(R13);
+    as.jmpTable(RDX);
+
+    const size_t epilogue = as.offset();
+    as.pop(R13);
+    as.pop(R12);
+    as.pop(RBX);
+    as.ret();
+    // }}}
+
+    auto leave = [&](uint64_t result) {
+        as.movImm(RAX, result);
+        as.patch(as.jmp(), epilogue);
+    };
+
+    // A = B op C
+    auto binary = [&](Alu op, size_t a, size_t b, size_t c) {
+        as.load(RAX, b);
+        as.alu(op, RAX, c);
+        as.store(a, RAX);
+    };
+
+    // A = B cc C, leaving the flags set
+    auto compare = [&](Cond cc, size_t a, size_t b, size_t c) {
+        as.load(RAX, b);
+        as.alu(AluCmp, RAX, c);
+        as.setRax(cc);
+        as.store(a, RAX);
+    };
+
+    // in the order of the NCMP and NCMP..BR opcodes
+    static const Cond conds[] = { CondE, CondNE, CondLE, CondGE, CondL, CondG };
+
+    auto callHelper = [&](const void* fn, WideInstruction instr) {
+        as.mov(RDI, RBX);
+        as.mov(RSI, R12);
+        as.movImm(RDX, instr);
+        as.movImm(RAX, reinterpret_cast<uint64_t>(fn));
+        as.callRax();
+    };
+
+    for (size_t pc = 0; pc != n; ++pc) {
+        const WideInstruction instr = code[pc];
+        const Opcode opc = opcode(instr);
+        const WideOperand A = operandA(instr);
+        const WideOperand B = operandB(instr);
+        const WideOperand C = operandC(instr);
+        const WideImmOperand D = operandD(instr);
+
+        labels[pc] = as.offset();
+
+        switch (opc) {
+            case Opcode::EXIT:
+                leave(D != 0 ? ExitTrue : ExitFalse);
+                break;
+            case Opcode::JMP:
+                fixups.push_back(std::make_pair(as.jmp(), target(D)));
+                break;
+            case Opcode::CONDBR:
+                as.load(RAX, A);
+                as.testRax();
+                fixups.push_back(std::make_pair(as.jcc(CondNE), target(D)));
+                break;
+            case Opcode::NSWITCH:
+            case Opcode::SSWITCH:
+                callHelper(opc == Opcode::NSWITCH ? (const void*) &nswitch : (const void*) &sswitch, instr);
+                as.jmpTable(RAX);
+                break;
+            case Opcode::MOV:
+                as.load(RAX, B);
+                as.store(A, RAX);
+                break;
+            case Opcode::IMOV:
+            case Opcode::NADDI:     // the NADD fused into it follows
+                if (D <= 0x7FFFFFFF) {
+                    as.storeImm(A, D);
+                } else {
+                    as.movImm(RAX, D);
+                    as.store(A, RAX);
+                }
+                break;
+            case Opcode::NCONST:
+                if (!program || D >= program->numbers().size()) {
+                    leave((pc << 2) | Interpret);
+                    break;
+                }
+                as.movImm(RAX, program->numbers()[D]);
+                as.store(A, RAX);
+                break;
+            case Opcode::NNEG:
+                as.load(RAX, B);
+                as.negRax();
+                as.store(A, RAX);
+                break;
+            case Opcode::NADD:
+                binary(AluAdd, A, B, C);
+                break;
+            case Opcode::NSUB:
+                binary(AluSub, A, B, C);
+                break;
+            case Opcode::NAND:
+                binary(AluAnd, A, B, C);
+                break;
+            case Opcode::NOR:
+                binary(AluOr, A, B, C);
+                break;
+            case Opcode::NXOR:
+                binary(AluXor, A, B, C);
+                break;
+            case Opcode::NMUL:
+                as.load(RAX, B);
+                as.imul(RAX, C);
+                as.store(A, RAX);
+                break;
+            case Opcode::NDIV:
+            case Opcode::NREM:
+                as.load(RAX, B);
+                as.cqo();
+                as.idiv(C);
+                as.store(A, opc == Opcode::NDIV ? RAX : RDX);
+                break;
+            case Opcode::NSHL:
+            case Opcode::NSHR:
+                as.load(RAX, B);
+                as.load(RCX, C);
+                if (opc == Opcode::NSHL)
+                    as.shlRaxCl();
+                else
+                    as.sarRaxCl();
+                as.store(A, RAX);
+                break;
+            case Opcode::NCMPEQ:
+            case Opcode::NCMPNE:
+            case Opcode::NCMPLE:
+            case Opcode::NCMPGE:
+            case Opcode::NCMPLT:
+            case Opcode::NCMPGT: {
+                const Cond cc = conds[opc - Opcode::NCMPEQ];
+                compare(cc, A, B, C);
+
+                // branch on the flags right away if a CONDBR on the result follows
+                const size_t next = following(pc);
+                if (next < n && opcode(code[next]) == Opcode::CONDBR && operandA(code[next]) == A) {
+                    fixups.push_back(std::make_pair(as.jcc(cc), target(operandD(code[next]))));
+                    fixups.push_back(std::make_pair(as.jmp(), following(next)));
+                }
+                break;
+            }
+            // The instruction fused into a superinstruction follows it, and
+            // is compiled on its own for jumps targeting it.
+            case Opcode::NCMPEQBR:
+            case Opcode::NCMPNEBR:
+            case Opcode::NCMPLEBR:
+            case Opcode::NCMPGEBR:
+            case Opcode::NCMPLTBR:
+            case Opcode::NCMPGTBR: {
+                const Cond cc = conds[opc - Opcode::NCMPEQBR];
+                compare(cc, A, B, C);
+                if (pc + 1 < n) {
+                    fixups.push_back(std::make_pair(as.jcc(cc), target(operandD(code[pc + 1]))));
+                    fixups.push_back(std::make_pair(as.jmp(), target(pc + 2)));
+                }
+                break;
+            }
+            case Opcode::SCMPEQBR:
+            case Opcode::SCMPNEBR:
+                callHelper((const void*) (opc == Opcode::SCMPEQBR ? &scmpeq : &scmpne), instr);
+                if (pc + 1 < n) {
+                    as.load(RAX, A);
+                    as.testRax();
+                    fixups.push_back(std::make_pair(as.jcc(CondNE), target(operandD(code[pc + 1]))));
+                    fixups.push_back(std::make_pair(as.jmp(), target(pc + 2)));
+                }
+                break;
+            case Opcode::CALL:
+            case Opcode::HANDLER:
+                as.mov(RDI, RBX);
+                as.mov(RSI, R12);
+                as.movImm(RDX, instr);
+                as.movImm(RCX, pc);
+                as.movImm(RAX, reinterpret_cast<uint64_t>(opc == Opcode::CALL ? &callFunction : &callHandler));
+                as.callRax();
+                as.testRax();
+                as.patch(as.jcc(CondNE), epilogue);
+                break;
+            case Opcode::WIDE:      // slot of an instruction compiled at its prefix
+                break;
+            default:
+                if (Helper fn = helperOf(opc))
+                    callHelper((const void*) fn, instr);
+                else
+                    leave((pc << 2) | Interpret);   // NTICKS, NDUMPN, SPRINT
+                break;
+        }
+    }
+
+    // running off the end of the code
+    labels[n] = as.offset();
+    leave(ExitFalse);
+
+    as.align(sizeof(uint64_t));
+    as.patch(table, as.offset());
+    const size_t tableOffset = as.offset();
+    for (size_t i = 0; i <= n; ++i)
+        as.qword(0);
+
+    for (const auto& fixup: fixups)
+        as.patch(fixup.first, labels[fixup.second]);
+
+    // map writable, fill in, then flip to executable
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t size = (as.offset() + pageSize - 1) / pageSize * pageSize;
+
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+
+    uint8_t* base = static_cast<uint8_t*>(memory);
+    memcpy(base, as.code().data(), as.offset());
+
+    uint64_t* addresses = reinterpret_cast<uint64_t*>(base + tableOffset);
+    for (size_t i = 0; i <= n; ++i)
+        addresses[i] = reinterpret_cast<uint64_t>(base + labels[i]);
+
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        perror("mprotect");
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    return std::unique_ptr<MachineCode>(new MachineCode(memory, size));
+#else
+    return nullptr;
+#endif
+}
+
+MachineCode::MachineCode(void* memory, size_t size) :
+    memory_(memory),
+    size_(size),
+    entry_(reinterpret_cast<Entry>(memory))
+{
+}
+
+MachineCode::~MachineCode()
+{
+    munmap(memory_, size_);
+}
+
+} // namespace FlowVM
@@ -0,0 +1,1329 @@
+#include <flow/vm/Optimizer.h>
+#include <flow/vm/Peephole.h>
+#include <flow/vm/ControlFlow.h>
+#include <flow/vm/Program.h>
+#include <flow/vm/Instruction.h>
+#include <bitset>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+namespace FlowVM {
+
+namespace {
+    typedef std::bitset<256> RegisterSet;
+
+    const size_t MaxCodeSize = 0xFFFF;
+
+    /** Registers read and written by an instruction. */
+    struct Effects {
+        RegisterSet uses;
+        RegisterSet defs;
+        bool sideEffects;   //!< must be kept even if no register it defines is read
+    };
+
+    Effects effects(Instruction instr)
+    {
+        Effects e;
+        e.sideEffects = false;
+
+        Operand A = operandA(instr);
+        Operand B = operandB(instr);
+        Operand C = operandC(instr);
+
+        switch (opcode(instr)) {
+            case Opcode::EXIT:
+            case Opcode::JMP:
+                e.sideEffects = true;
+                break;
+            case Opcode::CONDBR:
+            case Opcode::NSWITCH:
+            case Opcode::SSWITCH:
+            case Opcode::SPRINT:
+                e.uses.set(A);
+                e.sideEffects = true;
+                break;
+            case Opcode::NDUMPN:
+                for (size_t i = 0; i < B && A + i < 256; ++i)
+                    e.uses.set(A + i);
+                e.sideEffects = true;
+                break;
+            case Opcode::NTICKS:
+            case Opcode::IMOV:
+            case Opcode::NCONST:
+            case Opcode::SCONST:
+            case Opcode::PCONST:
+            case Opcode::CCONST:
+                e.defs.set(A);
+                break;
+            case Opcode::MOV:
+            case Opcode::NNEG:
+            case Opcode::SLEN:
+            case Opcode::SREGGROUP:
+            case Opcode::I2S:
+            case Opcode::S2I:
+            case Opcode::P2S:
+            case Opcode::SURLENC:
+            case Opcode::SURLDEC:
+                e.uses.set(B);
+                e.defs.set(A);
+                break;
+            case Opcode::SADDMULTI:
+                for (size_t i = 0; i < C && B + i < 256; ++i)
+                    e.uses.set(B + i);
+                e.defs.set(A);
+                break;
+            case Opcode::SSUBSTR:
+                e.uses.set(B);
+                e.uses.set(C);
+                if (C + 1 < 256)
+                    e.uses.set(C + 1);
+                e.defs.set(A);
+                break;
+            case Opcode::SREGMATCH:
+                // also sets the match context read by SREGGROUP
+                e.uses.set(B);
+                e.uses.set(C);
+                e.defs.set(A);
+                e.sideEffects = true;
+                break;
+            case Opcode::CALL:
+            case Opcode::HANDLER:
+                // natives may read and write any register
+                e.uses.set();
+                e.sideEffects = true;
+                break;
+            default: // binary operators
+                e.uses.set(B);
+                e.uses.set(C);
+                e.defs.set(A);
+                break;
+        }
+
+        return e;
+    }
+
+    bool isNop(const std::vector<Instruction>& code, size_t i)
+    {
+        return opcode(code[i]) == Opcode::JMP && operandD(code[i]) == i + 1;
+    }
+
+    Instruction makeNop(size_t i)
+    {
+        return makeInstructionImm(Opcode::JMP, static_cast<ImmOperand>(i + 1));
+    }
+
+    void successors(const std::vector<Instruction>& code, size_t i, const Program* program,
+                    std::vector<size_t>* result)
+    {
+        result->clear();
+
+        if (fallsThrough(code[i]))
+            result->push_back(i + 1);
+
+        jumpTargets(code[i], program, result);
+    }
+
+    /**
+     * Known register contents within a basic block.
+     */
+    class BlockState {
+    public:
+        enum Kind : uint8_t { Unknown, NumberConst, StringConst };
+
+        BlockState() { reset(); }
+
+        void reset() {
+            for (size_t i = 0; i != 256; ++i) {
+                kind_[i] = Unknown;
+                value_[i] = 0;
+                copyOf_[i] = -1;
+            }
+        }
+
+        /** Forgets everything about \p r, as it is about to be overwritten. */
+        void define(Operand r) {
+            kind_[r] = Unknown;
+            copyOf_[r] = -1;
+            for (size_t i = 0; i != 256; ++i)
+                if (copyOf_[i] == r)
+                    copyOf_[i] = -1;
+        }
+
+        void setNumber(Operand r, Number value) {
+            define(r);
+            kind_[r] = NumberConst;
+            value_[r] = value;
+        }
+
+        void setString(Operand r, size_t index) {
+            define(r);
+            kind_[r] = StringConst;
+            value_[r] = index;
+        }
+
+        void setCopy(Operand r, Operand source) {
+            define(r);
+            copyOf_[r] = source;
+        }
+
+        /** Retrieves the register holding the original of \p r's value. */
+        Operand resolve(Operand r) const { return copyOf_[r] >= 0 ? copyOf_[r] : r; }
+
+        bool isNumber(Operand r) const { return kind_[r] == NumberConst; }
+        bool isString(Operand r) const { return kind_[r] == StringConst; }
+        Number number(Operand r) const { return value_[r]; }
+        size_t string(Operand r) const { return value_[r]; }
+
+    private:
+        Kind kind_[256];
+        Number value_[256];
+        int copyOf_[256];
+    };
+
+    /** Evaluates a binary numeric operation, as the Runner would. */
+    bool evaluate(Opcode opc, Number b, Number c, Number* result)
+    {
+        uint64_t ub = static_cast<uint64_t>(b);
+        uint64_t uc = static_cast<uint64_t>(c);
+
+        switch (opc) {
+            case Opcode::NADD: *result = static_cast<Number>(ub + uc); return true;
+            case Opcode::NSUB: *result = static_cast<Number>(ub - uc); return true;
+            case Opcode::NMUL: *result = static_cast<Number>(ub * uc); return true;
+            case Opcode::NDIV:
+                if (c == 0 || (c == -1 && b == INT64_MIN))
+                    return false;
+                *result = b / c;
+                return true;
+            case Opcode::NREM:
+                if (c == 0 || (c == -1 && b == INT64_MIN))
+                    return false;
+                *result = b % c;
+                return true;
+            case Opcode::NSHL:
+                if (c < 0 || c > 63)
+                    return false;
+                *result = static_cast<Number>(ub << c);
+                return true;
+            case Opcode::NSHR:
+                if (c < 0 || c > 63)
+                    return false;
+                *result = b >> c;
+                return true;
+            case Opcode::NPOW: *result = static_cast<Number>(powl(b, c)); return true;
+            case Opcode::NAND: *result = b & c; return true;
+            case Opcode::NOR: *result = b | c; return true;
+            case Opcode::NXOR: *result = b ^ c; return true;
+            case Opcode::NCMPEQ: *result = b == c; return true;
+            case Opcode::NCMPNE: *result = b != c; return true;
+            case Opcode::NCMPLE: *result = b <= c; return true;
+            case Opcode::NCMPGE: *result = b >= c; return true;
+            case Opcode::NCMPLT: *result = b < c; return true;
+            case Opcode::NCMPGT: *result = b > c; return true;
+            default: return false;
+        }
+    }
+
+    /** Evaluates a string comparison, as the Runner would. */
+    bool evaluate(Opcode opc, const String& b, const String& c, Number* result)
+    {
+        switch (opc) {
+            case Opcode::SCMPEQ: *result = b == c; return true;
+            case Opcode::SCMPNE: *result = b != c; return true;
+            case Opcode::SCMPLE: *result = b <= c; return true;
+            case Opcode::SCMPGE: *result = b >= c; return true;
+            case Opcode::SCMPLT: *result = b < c; return true;
+            case Opcode::SCMPGT: *result = b > c; return true;
+            case Opcode::SCMPBEG: *result = b.begins(c); return true;
+            case Opcode::SCMPEND: *result = b.ends(c); return true;
+            case Opcode::SCONTAINS: *result = b.find(c) != String::npos; return true;
+            default: return false;
+        }
+    }
+
+    /** Builds an instruction loading \p value into \p r, if encodable. */
+    bool loadNumber(Operand r, Number value, Program* program, Instruction* result)
+    {
+        if (value >= 0 && value <= 0xFFFF) {
+            *result = makeInstructionImm(Opcode::IMOV, r, static_cast<ImmOperand>(value));
+            return true;
+        }
+
+        if (!program)
+            return false;
+
+        size_t index = program->addNumber(value);
+        if (index > 0xFFFF)
+            return false;
+
+        *result = makeInstructionImm(Opcode::NCONST, r, static_cast<ImmOperand>(index));
+        return true;
+    }
+
+    /** Builds an instruction loading string constant \p value into \p r, if encodable. */
+    bool loadString(Operand r, const std::string& value, Program* program, size_t* index, Instruction* result)
+    {
+        if (!program)
+            return false;
+
+        *index = program->addString(value);
+        if (*index > 0xFFFF)
+            return false;
+
+        *result = makeInstructionImm(Opcode::SCONST, r, static_cast<ImmOperand>(*index));
+        return true;
+    }
+
+    /**
+     * Whether the passes can handle \p code, i.e. it fits the 16-bit jump
+     * targets and all switch tables it uses are known.
+     */
+    bool isAnalyzable(const std::vector<Instruction>& code, const Program* program)
+    {
+        if (code.empty() || code.size() > MaxCodeSize)
+            return false;
+
+        for (Instruction instr: code) {
+            switch (opcode(instr)) {
+                case Opcode::NSWITCH:
+                    if (!program || operandD(instr) >= program->numberSwitches().size())
+                        return false;
+                    break;
+                case Opcode::SSWITCH:
+                    if (!program || operandD(instr) >= program->stringSwitches().size())
+                        return false;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        return true;
+    }
+
+    /** Marks the first instruction of each basic block. */
+    std::vector<bool> blockLeaders(const std::vector<Instruction>& code, const Program* program)
+    {
+        std::vector<bool> leaders(code.size() + 1, false);
+        std::vector<size_t> targets;
+        leaders[0] = true;
+
+        for (size_t i = 0, e = code.size(); i != e; ++i) {
+            if (isNop(code, i))
+                continue;
+
+            targets.clear();
+            jumpTargets(code[i], program, &targets);
+            for (size_t target: targets)
+                if (target < e)
+                    leaders[target] = true;
+
+            if (!targets.empty() || !fallsThrough(code[i]))
+                leaders[i + 1] = true;
+        }
+
+        return leaders;
+    }
+
+    /** Computes the registers live after each instruction, by backward analysis until fixpoint. */
+    std::vector<RegisterSet> liveness(const std::vector<std::vector<size_t>>& succ, const std::vector<Effects>& fx)
+    {
+        const size_t n = succ.size();
+        std::vector<RegisterSet> liveIn(n);
+        std::vector<RegisterSet> liveOut(n);
+
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (size_t i = n; i-- > 0; ) {
+                RegisterSet out;
+                for (size_t s: succ[i])
+                    if (s < n)
+                        out |= liveIn[s];
+
+                RegisterSet in = fx[i].uses | (out & ~fx[i].defs);
+                liveOut[i] = out;
+
+                if (in != liveIn[i]) {
+                    liveIn[i] = in;
+                    changed = true;
+                }
+            }
+        }
+
+        return liveOut;
+    }
+}
+
+bool foldConstants(std::vector<Instruction>& code, Program* program)
+{
+    if (!isAnalyzable(code, program))
+        return false;
+
+    std::vector<bool> leaders = blockLeaders(code, program);
+    BlockState state;
+    bool changed = false;
+
+    for (size_t i = 0, e = code.size(); i != e; ++i) {
+        if (leaders[i])
+            state.reset();
+
+        const Instruction instr = code[i];
+        const Opcode opc = opcode(instr);
+        const Operand A = operandA(instr);
+        const Operand B = state.resolve(operandB(instr));
+        const Operand C = state.resolve(operandC(instr));
+        const ImmOperand D = operandD(instr);
+        Instruction result = instr;
+
+        switch (opc) {
+            case Opcode::IMOV:
+                state.setNumber(A, D);
+                break;
+            case Opcode::NCONST:
+                if (program && D < program->numbers().size())
+                    state.setNumber(A, program->numbers()[D]);
+                else
+                    state.define(A);
+                break;
+            case Opcode::SCONST:
+                if (program && D < program->strings().size())
+                    state.setString(A, D);
+                else
+                    state.define(A);
+                break;
+            case Opcode::MOV:
+                if (B == A) {
+                    result = makeNop(i);
+                } else if (state.isNumber(B) && loadNumber(A, state.number(B), program, &result)) {
+                    state.setNumber(A, state.number(B));
+                } else if (state.isString(B)) {
+                    result = makeInstructionImm(Opcode::SCONST, A, static_cast<ImmOperand>(state.string(B)));
+                    state.setString(A, state.string(B));
+                } else {
+                    result = makeInstruction(opc, A, B);
+                    state.setCopy(A, B);
+                }
+                break;
+            case Opcode::NNEG: {
+                Number value = static_cast<Number>(-static_cast<uint64_t>(state.number(B)));
+                if (state.isNumber(B) && loadNumber(A, value, program, &result)) {
+                    state.setNumber(A, value);
+                } else {
+                    result = makeInstruction(opc, A, B);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::NADD:
+            case Opcode::NSUB:
+            case Opcode::NMUL:
+            case Opcode::NDIV:
+            case Opcode::NREM:
+            case Opcode::NSHL:
+            case Opcode::NSHR:
+            case Opcode::NPOW:
+            case Opcode::NAND:
+            case Opcode::NOR:
+            case Opcode::NXOR:
+            case Opcode::NCMPEQ:
+            case Opcode::NCMPNE:
+            case Opcode::NCMPLE:
+            case Opcode::NCMPGE:
+            case Opcode::NCMPLT:
+            case Opcode::NCMPGT: {
+                Number value;
+                if (state.isNumber(B) && state.isNumber(C)
+                        && evaluate(opc, state.number(B), state.number(C), &value)
+                        && loadNumber(A, value, program, &result)) {
+                    state.setNumber(A, value);
+                } else {
+                    result = makeInstruction(opc, A, B, C);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::SCMPEQ:
+            case Opcode::SCMPNE:
+            case Opcode::SCMPLE:
+            case Opcode::SCMPGE:
+            case Opcode::SCMPLT:
+            case Opcode::SCMPGT:
+            case Opcode::SCMPBEG:
+            case Opcode::SCMPEND:
+            case Opcode::SCONTAINS: {
+                Number value;
+                if (state.isString(B) && state.isString(C)
+                        && evaluate(opc, program->strings()[state.string(B)],
+                                    program->strings()[state.string(C)], &value)
+                        && loadNumber(A, value, program, &result)) {
+                    state.setNumber(A, value);
+                } else {
+                    result = makeInstruction(opc, A, B, C);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::SINSET: {
+                const bool known = state.isString(B) && state.isNumber(C)
+                    && static_cast<uint64_t>(state.number(C)) < program->stringSets().size();
+                const Number value = known
+                    && program->stringSet(state.number(C)).contains(program->strings()[state.string(B)]);
+                if (known && loadNumber(A, value, program, &result)) {
+                    state.setNumber(A, value);
+                } else {
+                    result = makeInstruction(opc, A, B, C);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::SADD: {
+                size_t index;
+                if (state.isString(B) && state.isString(C)
+                        && loadString(A, program->strings()[state.string(B)].str()
+                                        + program->strings()[state.string(C)].str(),
+                                      program, &index, &result)) {
+                    state.setString(A, index);
+                } else {
+                    result = makeInstruction(opc, A, B, C);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::SLEN: {
+                Number value = state.isString(B) ? program->strings()[state.string(B)].size() : 0;
+                if (state.isString(B) && loadNumber(A, value, program, &result)) {
+                    state.setNumber(A, value);
+                } else {
+                    result = makeInstruction(opc, A, B);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::S2I: {
+                Number value = state.isString(B) ? program->strings()[state.string(B)].toInt() : 0;
+                if (state.isString(B) && loadNumber(A, value, program, &result)) {
+                    state.setNumber(A, value);
+                } else {
+                    result = makeInstruction(opc, A, B);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::I2S: {
+                size_t index;
+                char buf[64];
+                int n = snprintf(buf, sizeof(buf), "%li", (int64_t) state.number(B));
+                if (state.isNumber(B) && loadString(A, std::string(buf, n > 0 ? n : 0), program, &index, &result)) {
+                    state.setString(A, index);
+                } else {
+                    result = makeInstruction(opc, A, B);
+                    state.define(A);
+                }
+                break;
+            }
+            case Opcode::SREGMATCH:
+                result = makeInstruction(opc, A, B, C);
+                state.define(A);
+                break;
+            case Opcode::SREGGROUP:
+                result = makeInstruction(opc, A, B);
+                state.define(A);
+                break;
+            case Opcode::SPRINT:
+                result = makeInstruction(opc, state.resolve(A));
+                break;
+            case Opcode::CONDBR: {
+                Operand a = state.resolve(A);
+                if (state.isNumber(a))
+                    result = state.number(a) ? makeInstructionImm(Opcode::JMP, D) : makeNop(i);
+                else
+                    result = makeInstructionImm(opc, a, D);
+                break;
+            }
+            case Opcode::NSWITCH: {
+                Operand a = state.resolve(A);
+                if (state.isNumber(a))
+                    result = makeInstructionImm(Opcode::JMP, program->numberSwitch(D).lookup(state.number(a)));
+                else
+                    result = makeInstructionImm(opc, a, D);
+                break;
+            }
+            case Opcode::SSWITCH: {
+                Operand a = state.resolve(A);
+                if (state.isString(a))
+                    result = makeInstructionImm(Opcode::JMP, program->stringSwitch(D).lookup(program->strings()[state.string(a)]));
+                else
+                    result = makeInstructionImm(opc, a, D);
+                break;
+            }
+            case Opcode::CALL:
+            case Opcode::HANDLER:
+                state.reset();
+                break;
+            case Opcode::EXIT:
+            case Opcode::JMP:
+            case Opcode::NDUMPN:
+                break;
+            default: // writes A without being tracked (NTICKS, SADDMULTI, SSUBSTR, ...)
+                state.define(A);
+                break;
+        }
+
+        if (result != instr) {
+            code[i] = result;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+bool eliminateDeadCode(std::vector<Instruction>& code, const Program* program)
+{
+    if (!isAnalyzable(code, program))
+        return false;
+
+    const size_t n = code.size();
+    std::vector<std::vector<size_t>> succ(n);
+    std::vector<Effects> fx;
+    fx.reserve(n);
+
+    for (size_t i = 0; i != n; ++i) {
+        successors(code, i, program, &succ[i]);
+        fx.push_back(effects(code[i]));
+    }
+
+    // reachability from the entry point
+    std::vector<bool> reachable(n, false);
+    std::vector<size_t> worklist(1, 0);
+    reachable[0] = true;
+
+    while (!worklist.empty()) {
+        size_t i = worklist.back();
+        worklist.pop_back();
+
+        for (size_t s: succ[i]) {
+            if (s < n && !reachable[s]) {
+                reachable[s] = true;
+                worklist.push_back(s);
+            }
+        }
+    }
+
+    std::vector<RegisterSet> liveOut = liveness(succ, fx);
+
+    bool changed = false;
+
+    for (size_t i = 0; i != n; ++i) {
+        if (isNop(code, i))
+            continue;
+
+        bool dead = !reachable[i]
+            || (fx[i].defs.any() && !fx[i].sideEffects && (fx[i].defs & liveOut[i]).none());
+
+        if (dead) {
+            code[i] = makeNop(i);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+bool removeNops(std::vector<Instruction>& code, Program* program)
+{
+    if (!isAnalyzable(code, program))
+        return false;
+
+    const size_t n = code.size();
+    std::vector<bool> keep(n);
+    std::vector<size_t> newIndex(n + 1);
+
+    for (size_t i = 0; i != n; ++i)
+        keep[i] = !isNop(code, i);
+
+    // removing instructions may turn jumps into jumps to the next instruction
+    for (bool again = true; again; ) {
+        size_t k = 0;
+        for (size_t i = 0; i != n; ++i) {
+            newIndex[i] = k;
+            if (keep[i])
+                ++k;
+        }
+        newIndex[n] = k;
+
+        again = false;
+        for (size_t i = 0; i != n; ++i) {
+            if (keep[i] && opcode(code[i]) == Opcode::JMP
+                    && newIndex[std::min<size_t>(operandD(code[i]), n)] == newIndex[i] + 1) {
+                keep[i] = false;
+                again = true;
+            }
+        }
+    }
+
+    if (newIndex[n] == n)
+        return false;
+
+    // switch tables may be shared, so add remapped copies
+    std::vector<int> numberSwitchMap(program ? program->numberSwitches().size() : 0, -1);
+    std::vector<int> stringSwitchMap(program ? program->stringSwitches().size() : 0, -1);
+
+    for (size_t i = 0; i != n; ++i) {
+        if (!keep[i])
+            continue;
+
+        ImmOperand D = operandD(code[i]);
+
+        if (opcode(code[i]) == Opcode::NSWITCH && numberSwitchMap[D] < 0) {
+            const NumberSwitch& table = program->numberSwitch(D);
+            std::vector<NumberSwitch::Case> cases;
+            for (const auto& c: table.cases())
+                cases.push_back(NumberSwitch::Case(c.first, newIndex[std::min<size_t>(c.second, n)]));
+
+            size_t index = program->addNumberSwitch(cases, newIndex[std::min<size_t>(table.defaultTarget(), n)]);
+            if (index > 0xFFFF)
+                return false;
+
+            numberSwitchMap[D] = index;
+        } else if (opcode(code[i]) == Opcode::SSWITCH && stringSwitchMap[D] < 0) {
+            const StringSwitch& table = program->stringSwitch(D);
+            std::vector<StringSwitch::Case> cases;
+            for (const auto& c: table.cases())
+                cases.push_back(StringSwitch::Case(c.first, newIndex[std::min<size_t>(c.second, n)]));
+
+            size_t index = program->addStringSwitch(cases, newIndex[std::min<size_t>(table.defaultTarget(), n)]);
+            if (index > 0xFFFF)
+                return false;
+
+            stringSwitchMap[D] = index;
+        }
+    }
+
+    std::vector<Instruction> result;
+    result.reserve(newIndex[n]);
+
+    for (size_t i = 0; i != n; ++i) {
+        if (!keep[i])
+            continue;
+
+        Instruction instr = code[i];
+        Opcode opc = opcode(instr);
+        ImmOperand D = operandD(instr);
+
+        switch (opc) {
+            case Opcode::JMP:
+            case Opcode::CONDBR:
+                instr = makeInstructionImm(opc, operandA(instr), newIndex[std::min<size_t>(D, n)]);
+                break;
+            case Opcode::NSWITCH:
+                instr = makeInstructionImm(opc, operandA(instr), numberSwitchMap[D]);
+                break;
+            case Opcode::SSWITCH:
+                instr = makeInstructionImm(opc, operandA(instr), stringSwitchMap[D]);
+                break;
+            default:
+                break;
+        }
+
+        result.push_back(instr);
+    }
+
+    code.swap(result);
+    return true;
+}
+
+namespace {
+    /** A register or a contiguous window of registers accessed by an instruction. */
+    struct Window {
+        Operand base;
+        size_t width;
+    };
+
+    /** Register accesses of an instruction, with CALL/HANDLER argv windows resolved. */
+    struct Accesses {
+        RegisterSet uses;
+        RegisterSet defs;           //!< registers possibly written
+        RegisterSet kills;          //!< registers definitely overwritten
+        std::vector<Window> windows;
+    };
+
+    void addWindow(Accesses* a, Operand base, size_t width, bool use, bool def)
+    {
+        width = std::min<size_t>(width, 256 - base);
+
+        for (size_t i = 0; i != width; ++i) {
+            if (use) a->uses.set(base + i);
+            if (def) a->defs.set(base + i);
+        }
+
+        if (width > 1) {
+            Window w = { base, width };
+            a->windows.push_back(w);
+        }
+    }
+
+    /**
+     * Finds the value of number register \p r as loaded by IMOV or NCONST
+     * earlier within the basic block of instruction \p i.
+     */
+    bool blockConstant(const std::vector<Instruction>& code, const std::vector<bool>& leaders,
+                       size_t i, Operand r, const Program* program, Number* result)
+    {
+        while (!leaders[i]) {
+            Instruction instr = code[--i];
+            Opcode opc = opcode(instr);
+
+            if (opc == Opcode::CALL || opc == Opcode::HANDLER)
+                return false;
+
+            if (!effects(instr).defs.test(r))
+                continue;
+
+            if (opc == Opcode::IMOV) {
+                *result = operandD(instr);
+                return true;
+            }
+
+            if (opc == Opcode::NCONST && program && operandD(instr) < program->numbers().size()) {
+                *result = program->numbers()[operandD(instr)];
+                return true;
+            }
+
+            return false;
+        }
+
+        return false;
+    }
+
+    /** Collects an instruction's register accesses; \p argc is only used for CALL/HANDLER. */
+    Accesses accesses(Instruction instr, size_t argc)
+    {
+        Accesses a;
+        Operand A = operandA(instr);
+        Operand B = operandB(instr);
+        Operand C = operandC(instr);
+
+        switch (opcode(instr)) {
+            case Opcode::EXIT:
+            case Opcode::JMP:
+                break;
+            case Opcode::NDUMPN:
+                addWindow(&a, A, B, true, false);
+                break;
+            case Opcode::SADDMULTI:
+                addWindow(&a, B, C, true, false);
+                addWindow(&a, A, 1, false, true);
+                break;
+            case Opcode::SSUBSTR:
+                addWindow(&a, B, 1, true, false);
+                addWindow(&a, C, 2, true, false);
+                addWindow(&a, A, 1, false, true);
+                break;
+            case Opcode::CALL:
+            case Opcode::HANDLER:
+                // argv[0] receives the result, even if argc is 0
+                addWindow(&a, A, 1, true, false);
+                addWindow(&a, B, 1, true, false);
+                addWindow(&a, C, std::max<size_t>(argc, 1), true, true);
+                break;
+            default: {
+                Effects e = effects(instr);
+                a.uses = e.uses;
+                a.defs = e.defs;
+                break;
+            }
+        }
+
+        if (opcode(instr) != Opcode::CALL && opcode(instr) != Opcode::HANDLER)
+            a.kills = a.defs & ~a.uses;
+
+        return a;
+    }
+
+    /** Applies \p map to all register operands of \p instr. */
+    Instruction renameRegisters(Instruction instr, const int* map)
+    {
+        Opcode opc = opcode(instr);
+        Operand A = operandA(instr);
+        Operand B = operandB(instr);
+        Operand C = operandC(instr);
+
+        switch (opc) {
+            case Opcode::SADDMULTI: // C is a count
+                return makeInstruction(opc, map[A], map[B], C);
+            case Opcode::NDUMPN:    // B is a count
+                return makeInstruction(opc, map[A], B, C);
+            default:
+                break;
+        }
+
+        switch (operandSignature(opc)) {
+            case InstructionSig::R:   return makeInstruction(opc, map[A]);
+            case InstructionSig::RR:  return makeInstruction(opc, map[A], map[B]);
+            case InstructionSig::RRR: return makeInstruction(opc, map[A], map[B], map[C]);
+            case InstructionSig::RI:  return makeInstructionImm(opc, map[A], operandD(instr));
+            default:                  return instr;
+        }
+    }
+}
+
+bool allocateRegisters(std::vector<Instruction>& code, const Program* program)
+{
+    if (!isAnalyzable(code, program))
+        return false;
+
+    const size_t n = code.size();
+    std::vector<bool> leaders = blockLeaders(code, program);
+    std::vector<Accesses> acc;
+    acc.reserve(n);
+
+    for (size_t i = 0; i != n; ++i) {
+        Number argc = 0;
+        Opcode opc = opcode(code[i]);
+
+        // the argv window's size must be known to keep it contiguous
+        if ((opc == Opcode::CALL || opc == Opcode::HANDLER)
+                && (!blockConstant(code, leaders, i, operandB(code[i]), program, &argc)
+                    || argc < 0 || argc > 256))
+            return false;
+
+        acc.push_back(accesses(code[i], argc));
+    }
+
+    // group registers into units: overlapping windows are merged into one
+    // unit whose registers keep their relative order, any other register
+    // forms a unit of its own
+    int unitOf[256];
+    size_t unitBase[256];
+    size_t unitWidth[256];
+    size_t unitCount = 0;
+    size_t windowEnd[256] = { 0 };
+    RegisterSet referenced;
+
+    for (const Accesses& a: acc) {
+        referenced |= a.uses | a.defs;
+        for (const Window& w: a.windows)
+            windowEnd[w.base] = std::max(windowEnd[w.base], w.base + w.width);
+    }
+
+    for (size_t r = 0; r != 256; ) {
+        if (!referenced.test(r) && !windowEnd[r]) {
+            unitOf[r] = -1;
+            ++r;
+            continue;
+        }
+
+        size_t end = std::max(r + 1, windowEnd[r]);
+        for (size_t i = r + 1; i < end; ++i)
+            end = std::max(end, windowEnd[i]);
+
+        unitBase[unitCount] = r;
+        unitWidth[unitCount] = end - r;
+        for (; r != end; ++r)
+            unitOf[r] = unitCount;
+        ++unitCount;
+    }
+
+    // liveness on register level
+    std::vector<std::vector<size_t>> succ(n);
+    for (size_t i = 0; i != n; ++i)
+        successors(code, i, program, &succ[i]);
+
+    std::vector<RegisterSet> liveIn(n);
+    std::vector<RegisterSet> liveOut(n);
+
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t i = n; i-- > 0; ) {
+            RegisterSet out;
+            for (size_t s: succ[i])
+                if (s < n)
+                    out |= liveIn[s];
+
+            RegisterSet in = acc[i].uses | (out & ~acc[i].kills);
+            liveOut[i] = out;
+
+            if (in != liveIn[i]) {
+                liveIn[i] = in;
+                changed = true;
+            }
+        }
+    }
+
+    // interference on unit level: units live at the same time, or written
+    // while another one is live, must not share registers
+    std::vector<RegisterSet> interferes(unitCount);
+
+    auto unitsOf = [&](const RegisterSet& regs) {
+        RegisterSet units;
+        for (size_t r = 0; r != 256; ++r)
+            if (regs.test(r))
+                units.set(unitOf[r]);
+        return units;
+    };
+
+    auto addInterference = [&](const RegisterSet& a, const RegisterSet& b) {
+        for (size_t u = 0; u != unitCount; ++u)
+            if (a.test(u))
+                interferes[u] |= b;
+        for (size_t u = 0; u != unitCount; ++u)
+            if (b.test(u))
+                interferes[u] |= a;
+    };
+
+    addInterference(unitsOf(liveIn[0]), unitsOf(liveIn[0]));
+
+    for (size_t i = 0; i != n; ++i) {
+        RegisterSet out = unitsOf(liveOut[i]);
+        addInterference(out, out);
+        addInterference(unitsOf(acc[i].defs), out);
+    }
+
+    // assign units to the lowest registers not taken by interfering units,
+    // wider units first
+    std::vector<size_t> order(unitCount);
+    for (size_t u = 0; u != unitCount; ++u)
+        order[u] = u;
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return unitWidth[a] > unitWidth[b];
+    });
+
+    std::vector<int> assigned(unitCount, -1);
+
+    for (size_t u: order) {
+        RegisterSet taken;
+        for (size_t v = 0; v != unitCount; ++v)
+            if (v != u && assigned[v] >= 0 && interferes[u].test(v))
+                for (size_t i = 0; i != unitWidth[v]; ++i)
+                    taken.set(assigned[v] + i);
+
+        for (size_t base = 0; base + unitWidth[u] <= 256 && assigned[u] < 0; ++base) {
+            bool fits = true;
+            for (size_t i = 0; i != unitWidth[u] && fits; ++i)
+                fits = !taken.test(base + i);
+
+            if (fits)
+                assigned[u] = base;
+        }
+
+        if (assigned[u] < 0)
+            return false;
+    }
+
+    int map[256];
+    bool changed = false;
+
+    for (size_t r = 0; r != 256; ++r) {
+        map[r] = unitOf[r] < 0 ? r : assigned[unitOf[r]] + (r - unitBase[unitOf[r]]);
+        if (map[r] != static_cast<int>(r) && referenced.test(r))
+            changed = true;
+    }
+
+    if (!changed)
+        return false;
+
+    for (Instruction& instr: code)
+        instr = renameRegisters(instr, map);
+
+    return true;
+}
+
+namespace {
+    /** A sequence of blocks to be laid out consecutively. */
+    struct Chain {
+        std::vector<size_t> blocks;
+        uint64_t weight;        //!< execution count of the chain's hottest block
+    };
+
+    /** Retrieves the comparison negating \p opc, or EXIT if \p opc is none. */
+    Opcode invertedComparison(Opcode opc)
+    {
+        switch (opc) {
+            case Opcode::NCMPEQ: return Opcode::NCMPNE;
+            case Opcode::NCMPNE: return Opcode::NCMPEQ;
+            case Opcode::NCMPLE: return Opcode::NCMPGT;
+            case Opcode::NCMPGE: return Opcode::NCMPLT;
+            case Opcode::NCMPLT: return Opcode::NCMPGE;
+            case Opcode::NCMPGT: return Opcode::NCMPLE;
+            case Opcode::SCMPEQ: return Opcode::SCMPNE;
+            case Opcode::SCMPNE: return Opcode::SCMPEQ;
+            case Opcode::SCMPLE: return Opcode::SCMPGT;
+            case Opcode::SCMPGE: return Opcode::SCMPLT;
+            case Opcode::SCMPLT: return Opcode::SCMPGE;
+            case Opcode::SCMPGT: return Opcode::SCMPLE;
+            default:             return Opcode::EXIT;
+        }
+    }
+}
+
+bool relayoutBlocks(std::vector<Instruction>& code, Program* program, const EdgeProfile& profile)
+{
+    if (!isAnalyzable(code, program))
+        return false;
+
+    const size_t n = code.size();
+    ControlFlowGraph cfg(code, program);
+    const std::vector<BasicBlock>& blocks = cfg.blocks();
+    const size_t blockCount = blocks.size();
+
+    // code falling off its end must stay last
+    if (fallsThrough(code[n - 1]))
+        return false;
+
+    struct Edge {
+        size_t from;
+        size_t to;
+        uint64_t count;
+    };
+
+    std::vector<Edge> edges;
+    std::vector<uint64_t> weight(blockCount, 0);
+    std::vector<uint64_t> hottestEntry(blockCount, 0);
+
+    for (const auto& e: profile.edges) {
+        if (!e.second || !cfg.isLeader(e.first.first) || !cfg.isLeader(e.first.second))
+            continue;
+
+        Edge edge = { cfg.blockOf(e.first.first), cfg.blockOf(e.first.second), e.second };
+        const std::vector<size_t>& succ = blocks[edge.from].successors;
+
+        if (std::find(succ.begin(), succ.end(), edge.to) == succ.end())
+            continue;
+
+        weight[edge.to] += edge.count;
+
+        // loop back edges remain branches, keeping loop headers in front of their bodies
+        if (edge.to <= edge.from)
+            continue;
+
+        hottestEntry[edge.to] = std::max(hottestEntry[edge.to], edge.count);
+        edges.push_back(edge);
+    }
+
+    if (edges.empty())
+        return false;
+
+    weight[0] = std::max<uint64_t>(weight[0], 1);
+
+    // greedily chain blocks along the hottest forward edges, so they fall
+    // through, only placing a block after the predecessor entering it most often
+    std::stable_sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+        return a.count > b.count;
+    });
+
+    std::vector<Chain> chains(blockCount);
+    std::vector<size_t> chainOf(blockCount);
+
+    for (size_t b = 0; b != blockCount; ++b) {
+        chains[b].blocks.push_back(b);
+        chains[b].weight = weight[b];
+        chainOf[b] = b;
+    }
+
+    for (const Edge& edge: edges) {
+        size_t head = chainOf[edge.from];
+        size_t tail = chainOf[edge.to];
+
+        if (head == tail || edge.to == 0 || edge.count < hottestEntry[edge.to]
+                || chains[head].blocks.back() != edge.from
+                || chains[tail].blocks.front() != edge.to)
+            continue;
+
+        for (size_t b: chains[tail].blocks) {
+            chains[head].blocks.push_back(b);
+            chainOf[b] = head;
+        }
+
+        chains[head].weight = std::max(chains[head].weight, chains[tail].weight);
+        chains[tail].blocks.clear();
+    }
+
+    // entry chain first, then hot chains by weight, then cold chains in their original order
+    std::vector<size_t> order;
+    for (size_t c = 0; c != blockCount; ++c)
+        if (!chains[c].blocks.empty() && c != chainOf[0])
+            order.push_back(c);
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return chains[a].weight > chains[b].weight;
+    });
+
+    std::vector<size_t> layout(chains[chainOf[0]].blocks);
+    for (size_t c: order)
+        layout.insert(layout.end(), chains[c].blocks.begin(), chains[c].blocks.end());
+
+    bool reordered = false;
+    for (size_t i = 0; i != blockCount; ++i)
+        if (layout[i] != i)
+            reordered = true;
+
+    if (!reordered)
+        return false;
+
+    // registers live after each instruction, to tell whether a CONDBR's
+    // condition may be negated by inverting the comparison computing it
+    std::vector<std::vector<size_t>> succ(n);
+    std::vector<Effects> fx;
+    fx.reserve(n);
+
+    for (size_t i = 0; i != n; ++i) {
+        successors(code, i, program, &succ[i]);
+        fx.push_back(effects(code[i]));
+    }
+
+    std::vector<RegisterSet> liveOut = liveness(succ, fx);
+
+    // compute the blocks' new offsets, dropping JMPs to the next block,
+    // inverting branches to the next block, and adding JMPs where a block
+    // no longer falls through to its successor
+    std::vector<size_t> newBegin(blockCount);
+    std::vector<bool> dropJump(blockCount, false);
+    std::vector<bool> addJump(blockCount, false);
+    std::vector<bool> invert(blockCount, false);
+    size_t size = 0;
+
+    for (size_t i = 0; i != blockCount; ++i) {
+        const BasicBlock& block = blocks[layout[i]];
+        size_t last = block.end - 1;
+        size_t next = i + 1 < blockCount ? blocks[layout[i + 1]].begin : n;
+
+        newBegin[layout[i]] = size;
+        size += block.end - block.begin;
+
+        if (opcode(code[last]) == Opcode::JMP && operandD(code[last]) == next) {
+            dropJump[layout[i]] = true;
+            --size;
+        } else if (fallsThrough(code[last]) && block.end != next) {
+            Operand cond = operandA(code[last]);
+
+            if (opcode(code[last]) == Opcode::CONDBR && operandD(code[last]) == next
+                    && last > block.begin && operandA(code[last - 1]) == cond
+                    && invertedComparison(opcode(code[last - 1])) != Opcode::EXIT
+                    && !liveOut[last].test(cond)) {
+                invert[layout[i]] = true;
+            } else {
+                addJump[layout[i]] = true;
+                ++size;
+            }
+        }
+    }
+
+    if (size > MaxCodeSize)
+        return false;
+
+    auto newTarget = [&](size_t target) -> ImmOperand {
+        return static_cast<ImmOperand>(target < n ? newBegin[cfg.blockOf(target)] : size);
+    };
+
+    // switch tables may be shared, so add remapped copies
+    std::vector<int> numberSwitchMap(program ? program->numberSwitches().size() : 0, -1);
+    std::vector<int> stringSwitchMap(program ? program->stringSwitches().size() : 0, -1);
+
+    for (size_t i = 0; i != n; ++i) {
+        ImmOperand D = operandD(code[i]);
+
+        if (opcode(code[i]) == Opcode::NSWITCH && numberSwitchMap[D] < 0) {
+            const NumberSwitch& table = program->numberSwitch(D);
+            std::vector<NumberSwitch::Case> cases;
+            for (const auto& c: table.cases())
+                cases.push_back(NumberSwitch::Case(c.first, newTarget(c.second)));
+
+            size_t index = program->addNumberSwitch(cases, newTarget(table.defaultTarget()));
+            if (index > 0xFFFF)
+                return false;
+
+            numberSwitchMap[D] = index;
+        } else if (opcode(code[i]) == Opcode::SSWITCH && stringSwitchMap[D] < 0) {
+            const StringSwitch& table = program->stringSwitch(D);
+            std::vector<StringSwitch::Case> cases;
+            for (const auto& c: table.cases())
+                cases.push_back(StringSwitch::Case(c.first, newTarget(c.second)));
+
+            size_t index = program->addStringSwitch(cases, newTarget(table.defaultTarget()));
+            if (index > 0xFFFF)
+                return false;
+
+            stringSwitchMap[D] = index;
+        }
+    }
+
+    std::vector<Instruction> result;
+    result.reserve(size);
+
+    for (size_t b: layout) {
+        const BasicBlock& block = blocks[b];
+        size_t end = dropJump[b] ? block.end - 1 : block.end;
+
+        for (size_t i = block.begin; i != end; ++i) {
+            Instruction instr = code[i];
+            Opcode opc = opcode(instr);
+            ImmOperand D = operandD(instr);
+
+            if (invert[b] && i + 2 == block.end) {
+                result.push_back(makeInstruction(invertedComparison(opc), operandA(instr), operandB(instr), operandC(instr)));
+                continue;
+            }
+
+            if (invert[b] && i + 1 == block.end) {
+                result.push_back(makeInstructionImm(opc, operandA(instr), newTarget(block.end)));
+                continue;
+            }
+
+            switch (opc) {
+                case Opcode::JMP:
+                case Opcode::CONDBR:
+                    instr = makeInstructionImm(opc, operandA(instr), newTarget(D));
+                    break;
+                case Opcode::NSWITCH:
+                    instr = makeInstructionImm(opc, operandA(instr), numberSwitchMap[D]);
+                    break;
+                case Opcode::SSWITCH:
+                    instr = makeInstructionImm(opc, operandA(instr), stringSwitchMap[D]);
+                    break;
+                default:
+                    break;
+            }
+
+            result.push_back(instr);
+        }
+
+        if (addJump[b])
+            result.push_back(makeInstructionImm(Opcode::JMP, newTarget(block.end)));
+    }
+
+    code.swap(result);
+    return true;
+}
+
+void optimize(std::vector<Instruction>& code, Program* program, int level)
+{
+    if (level <= 0)
+        return;
+
+    for (Instruction instr: code)
+        if (opcode(instr) == Opcode::WIDE)
+            return;
+
+    unfuseInstructions(code);
+
+    if (level >= 2) {
+        for (int pass = 0; pass < 8; ++pass) {
+            bool changed = foldConstants(code, program);
+            changed = eliminateDeadCode(code, program) || changed;
+            if (!changed)
+                break;
+        }
+        removeNops(code, program);
+        allocateRegisters(code, program);
+    }
+
+    peephole(code);
+}
+
+} // namespace FlowVM
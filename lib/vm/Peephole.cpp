@@ -0,0 +1,109 @@
+#include <flow/vm/Peephole.h>
+#include <flow/vm/Instruction.h>
+#include <vector>
+
+namespace FlowVM {
+
+namespace {
+    /** Retrieves the superinstruction fusing \p first with \p second, or EXIT if none. */
+    Opcode fusedOpcode(Instruction first, Instruction second)
+    {
+        switch (opcode(first)) {
+            case Opcode::NCMPEQ:
+            case Opcode::NCMPNE:
+            case Opcode::NCMPLE:
+            case Opcode::NCMPGE:
+            case Opcode::NCMPLT:
+            case Opcode::NCMPGT:
+                if (opcode(second) == Opcode::CONDBR && operandA(second) == operandA(first))
+                    return static_cast<Opcode>(Opcode::NCMPEQBR + (opcode(first) - Opcode::NCMPEQ));
+                break;
+            case Opcode::SCMPEQ:
+            case Opcode::SCMPNE:
+                if (opcode(second) == Opcode::CONDBR && operandA(second) == operandA(first))
+                    return static_cast<Opcode>(Opcode::SCMPEQBR + (opcode(first) - Opcode::SCMPEQ));
+                break;
+            case Opcode::IMOV:
+                if (opcode(second) == Opcode::NADD &&
+                        (operandB(second) == operandA(first) || operandC(second) == operandA(first)))
+                    return Opcode::NADDI;
+                break;
+            default:
+                break;
+        }
+        return Opcode::EXIT;
+    }
+}
+
+size_t threadJumps(std::vector<Instruction>& code)
+{
+    size_t count = 0;
+
+    for (size_t i = 0, e = code.size(); i != e; ++i) {
+        Opcode opc = opcode(code[i]);
+        if (opc != Opcode::JMP && opc != Opcode::CONDBR)
+            continue;
+
+        // follow the chain, bounded in case of JMP cycles
+        size_t target = operandD(code[i]);
+        for (size_t n = 0; n != e && target < e && opcode(code[target]) == Opcode::JMP; ++n)
+            target = operandD(code[target]);
+
+        if (opc == Opcode::JMP && target < e && opcode(code[target]) == Opcode::EXIT) {
+            code[i] = code[target];
+            ++count;
+        } else if (target != operandD(code[i])) {
+            code[i] = makeInstructionImm(opc, operandA(code[i]), target);
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+size_t fuseInstructions(std::vector<Instruction>& code)
+{
+    size_t count = 0;
+
+    for (size_t i = 0, e = code.size(); i + 1 < e; ++i) {
+        Opcode fused = fusedOpcode(code[i], code[i + 1]);
+        if (fused != Opcode::EXIT) {
+            code[i] = (code[i] & ~Instruction(0xFF)) | fused;
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+size_t unfuseInstructions(std::vector<Instruction>& code)
+{
+    size_t count = 0;
+
+    for (Instruction& instr: code) {
+        Opcode opc = opcode(instr);
+        Opcode base;
+
+        if (opc >= Opcode::NCMPEQBR && opc <= Opcode::NCMPGTBR)
+            base = static_cast<Opcode>(Opcode::NCMPEQ + (opc - Opcode::NCMPEQBR));
+        else if (opc >= Opcode::SCMPEQBR && opc <= Opcode::SCMPNEBR)
+            base = static_cast<Opcode>(Opcode::SCMPEQ + (opc - Opcode::SCMPEQBR));
+        else if (opc == Opcode::NADDI)
+            base = Opcode::IMOV;
+        else
+            continue;
+
+        instr = (instr & ~Instruction(0xFF)) | base;
+        ++count;
+    }
+
+    return count;
+}
+
+void peephole(std::vector<Instruction>& code)
+{
+    threadJumps(code);
+    fuseInstructions(code);
+}
+
+} // namespace FlowVM
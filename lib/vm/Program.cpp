@@ -6,95 +6,388 @@
 #include <vector>
 #include <memory>
 #include <new>
+#include <sys/mman.h>
 
 namespace FlowVM {
 
-/* {{{ possible binary file format
- * ----------------------------------------------
- * u32                  magic number (0xbeafbabe)
- * u32                  version
- * u64                  flags
- * u64                  register count
- * u64                  code start
- * u64                  code size
- * u64                  integer const-table start
- * u64                  integer const-table element count
- * u64                  string const-table start
- * u64                  string const-table element count
- * u64                  regex const-table start (stored as string)
- * u64                  regex const-table element count
- * u64                  debug source-lines-table start
- * u64                  debug source-lines-table element count
- *
- * u32[]                code segment
- * u64[]                integer const-table segment
- * u64[]                string const-table segment
- * {u32, u8[]}[]        strings
- * {u32, u32, u32}[]    debug source lines segment
- */ // }}}
-
 Program::Program() :
     numbers_(),
+    numberStorage_(),
+    stringStorage_(),
     strings_(),
+    ipaddrs_(),
+    ipaddrStorage_(),
+    cidrs_(),
+    cidrStorage_(),
     regularExpressions_(),
+    numberSwitches_(),
+    stringSwitches_(),
+    stringSets_(),
+    cidrSets_(),
     modules_(),
     nativeHandlerSignatures_(),
     nativeFunctionSignatures_(),
     nativeHandlers_(),
     nativeFunctions_(),
     handlers_(),
-    runtime_(nullptr)
+    handlerIds_(),
+    sharedNames_(false),
+    runtime_(nullptr),
+    linked_(false),
+    frozen_(false),
+    optimizationLevel_(1),
+    mapping_(nullptr),
+    mappingSize_(0)
 {
 }
 
 Program::Program(
         const std::vector<Number>& numbers,
-        const std::vector<String>& strings,
+        const std::vector<std::string>& strings,
         const std::vector<std::string>& regularExpressions,
         const std::vector<std::pair<std::string, std::string>>& modules,
         const std::vector<std::string>& nativeHandlerSignatures,
         const std::vector<std::string>& nativeFunctionSignatures) :
-    numbers_(numbers),
-    strings_(strings),
-    regularExpressions_(regularExpressions),
+    numbers_(),
+    numberStorage_(numbers),
+    stringStorage_(strings.begin(), strings.end()),
+    strings_(),
+    ipaddrs_(),
+    ipaddrStorage_(),
+    cidrs_(),
+    cidrStorage_(),
+    regularExpressions_(regularExpressions.begin(), regularExpressions.end()),
+    numberSwitches_(),
+    stringSwitches_(),
+    stringSets_(),
+    cidrSets_(),
     modules_(modules),
     nativeHandlerSignatures_(nativeHandlerSignatures),
     nativeFunctionSignatures_(nativeFunctionSignatures),
     nativeHandlers_(),
     nativeFunctions_(),
     handlers_(),
-    runtime_(nullptr)
+    handlerIds_(),
+    sharedNames_(false),
+    runtime_(nullptr),
+    linked_(false),
+    frozen_(false),
+    optimizationLevel_(1),
+    mapping_(nullptr),
+    mappingSize_(0)
 {
+    numbers_ = numberStorage_;
+
+    strings_.reserve(stringStorage_.size());
+    for (const auto& s: stringStorage_)
+        strings_.push_back(String(s));
 }
 
 Program::~Program()
 {
     for (auto& handler: handlers_)
         delete handler;
+
+    if (mapping_)
+        munmap(mapping_, mappingSize_);
+}
+
+/**
+ * Reports an attempt to modify a frozen program.
+ *
+ * \retval true the program is frozen and must not be modified.
+ */
+static bool checkFrozen(const Program* program, const char* what)
+{
+    if (program->isFrozen()) {
+        fprintf(stderr, "Cannot %s: program is frozen.\n", what);
+        return true;
+    }
+
+    return false;
 }
 
 Handler* Program::createHandler(const std::string& name)
 {
-    Handler* handler = new Handler(this, name, {});
-    handlers_.push_back(handler);
+    if (checkFrozen(this, "create handler"))
+        return nullptr;
+
+    Handler* handler = new Handler(this, name, std::vector<Instruction>());
+    addHandler(handler);
     return handler;
 }
 
 Handler* Program::createHandler(const std::string& name, const std::vector<Instruction>& instructions)
 {
+    if (checkFrozen(this, "create handler"))
+        return nullptr;
+
     Handler* handler = new Handler(this, name, instructions);
-    handlers_.push_back(handler);
+    addHandler(handler);
 
     return handler;
 }
 
+/**
+ * Appends \p handler to the handler table and indexes it by name.
+ *
+ * If multiple handlers share a name, the one created first is found by name.
+ */
+void Program::addHandler(Handler* handler)
+{
+    handler->index_ = handlers_.size();
+    handlers_.push_back(handler);
+
+    if (!handlerIds_.insert(std::make_pair(handler->name(), handler->index_)).second)
+        sharedNames_ = true;
+}
+
+/**
+ * Updates the name index before \p handler is renamed to \p name.
+ */
+void Program::renameHandler(Handler* handler, const std::string& name)
+{
+    int index = handlerIndex(handler);
+    if (index < 0)
+        return; // not (yet) part of this program's handler table
+
+    auto old = handlerIds_.find(handler->name());
+    if (old != handlerIds_.end() && old->second == (size_t) index) {
+        handlerIds_.erase(old);
+
+        // another handler of the same name may take over the old name
+        if (sharedNames_) {
+            for (size_t i = index + 1, e = handlers_.size(); i != e; ++i) {
+                if (handlers_[i]->name() == handler->name()) {
+                    handlerIds_[handler->name()] = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    auto entry = handlerIds_.insert(std::make_pair(name, (size_t) index));
+    if (!entry.second) {
+        sharedNames_ = true;
+        if (entry.first->second > (size_t) index)
+            entry.first->second = index;
+    }
+}
+
+/**
+ * Retrieves the index of number constant \p value, adding it if needed.
+ *
+ * Constants must not be added while handlers of this program are running.
+ */
+size_t Program::addNumber(Number value)
+{
+    if (checkFrozen(this, "add number constant"))
+        return npos;
+
+    for (size_t i = 0, e = numbers_.size(); i != e; ++i)
+        if (numbers_[i] == value)
+            return i;
+
+    // detach from a mapped program file before growing the table
+    if (numbers_.data() != numberStorage_.data())
+        numberStorage_ = numbers_.vec();
+
+    numberStorage_.push_back(value);
+    numbers_ = numberStorage_;
+
+    return numbers_.size() - 1;
+}
+
+/**
+ * Retrieves the index of string constant \p value, adding it if needed.
+ *
+ * Constants must not be added while handlers of this program are running,
+ * as running handlers may refer to the current string table.
+ */
+size_t Program::addString(const std::string& value)
+{
+    if (checkFrozen(this, "add string constant"))
+        return npos;
+
+    for (size_t i = 0, e = strings_.size(); i != e; ++i)
+        if (strings_[i] == String(value))
+            return i;
+
+    stringStorage_.push_back(value);
+    strings_.push_back(String(stringStorage_.back()));
+
+    return strings_.size() - 1;
+}
+
+/**
+ * Retrieves the index of IP address constant \p value, adding it if needed.
+ */
+size_t Program::addIPAddress(const IPAddress& value)
+{
+    if (checkFrozen(this, "add IP address constant"))
+        return npos;
+
+    for (size_t i = 0, e = ipaddrs_.size(); i != e; ++i)
+        if (ipaddrs_[i] == value)
+            return i;
+
+    if (ipaddrs_.data() != ipaddrStorage_.data())
+        ipaddrStorage_ = ipaddrs_.vec();
+
+    ipaddrStorage_.push_back(value);
+    ipaddrs_ = ipaddrStorage_;
+
+    return ipaddrs_.size() - 1;
+}
+
+/**
+ * Retrieves the index of network constant \p value, adding it if needed.
+ */
+size_t Program::addCidr(const Cidr& value)
+{
+    if (checkFrozen(this, "add CIDR constant"))
+        return npos;
+
+    for (size_t i = 0, e = cidrs_.size(); i != e; ++i)
+        if (cidrs_[i] == value)
+            return i;
+
+    if (cidrs_.data() != cidrStorage_.data())
+        cidrStorage_ = cidrs_.vec();
+
+    cidrStorage_.push_back(value);
+    cidrs_ = cidrStorage_;
+
+    return cidrs_.size() - 1;
+}
+
+/**
+ * Adds a jump table for NSWITCH.
+ *
+ * \param cases case values and the code offsets to jump to.
+ * \param defaultTarget code offset to jump to if no case matches.
+ * \return the table's index, to be used as NSWITCH's D operand.
+ */
+size_t Program::addNumberSwitch(const std::vector<NumberSwitch::Case>& cases, WideImmOperand defaultTarget)
+{
+    if (checkFrozen(this, "add switch table"))
+        return npos;
+
+    numberSwitches_.push_back(NumberSwitch(cases, defaultTarget));
+    return numberSwitches_.size() - 1;
+}
+
+/**
+ * Adds a jump table for SSWITCH.
+ *
+ * \param cases case strings and the code offsets to jump to.
+ * \param defaultTarget code offset to jump to if no case matches.
+ * \return the table's index, to be used as SSWITCH's D operand.
+ */
+size_t Program::addStringSwitch(const std::vector<StringSwitch::Case>& cases, WideImmOperand defaultTarget)
+{
+    if (checkFrozen(this, "add switch table"))
+        return npos;
+
+    stringSwitches_.push_back(StringSwitch(cases, defaultTarget));
+    return stringSwitches_.size() - 1;
+}
+
+/**
+ * Adds a string array constant for SINSET, compiling it into a hash set.
+ *
+ * \param strings the array's elements.
+ * \return the set's index, to be loaded into SINSET's C register.
+ */
+size_t Program::addStringSet(const std::vector<std::string>& strings)
+{
+    if (checkFrozen(this, "add string set"))
+        return npos;
+
+    stringSets_.push_back(StringSet(strings));
+    return stringSets_.size() - 1;
+}
+
+/**
+ * Adds a network set for PINCIDRSET, compiling it into a trie.
+ *
+ * \param networks the set's members, which may overlap.
+ * \return the set's index, to be loaded into PINCIDRSET's C register.
+ */
+size_t Program::addCidrSet(const std::vector<Cidr>& networks)
+{
+    if (checkFrozen(this, "add CIDR set"))
+        return npos;
+
+    cidrSets_.push_back(CidrSet(networks));
+    return cidrSets_.size() - 1;
+}
+
 Handler* Program::findHandler(const std::string& name) const
 {
-    for (auto handler: handlers_)
-        if (handler->name() == name)
-            return handler;
+    auto i = handlerIds_.find(name);
+    return i != handlerIds_.end() ? handlers_[i->second] : nullptr;
+}
 
-    return nullptr;
+/**
+ * Retrieves the index of the handler named \p name, or -1 if there is none.
+ *
+ * The index identifies the handler in handler references, i.e. it is the
+ * value a handler reference register holds and natives receive.
+ */
+int Program::handlerIndex(const std::string& name) const
+{
+    auto i = handlerIds_.find(name);
+    return i != handlerIds_.end() ? (int) i->second : -1;
+}
+
+/**
+ * Retrieves the index of \p handler, or -1 if it is not part of this program.
+ */
+int Program::handlerIndex(const Handler* handler) const
+{
+    return handler->program_ == this ? handler->index_ : -1;
+}
+
+ProgramStats Program::stats() const
+{
+    ProgramStats result;
+
+    for (const Handler* handler: handlers_) {
+        HandlerStats hs;
+        hs.name = handler->name();
+        hs.counters = handler->stats();
+        result.total.add(hs.counters);
+        result.handlers.push_back(hs);
+    }
+
+    for (int isHandler = 1; isHandler >= 0; --isHandler) {
+        for (const Runtime::Callback* callback: isHandler ? nativeHandlers_ : nativeFunctions_) {
+            if (callback) {
+                NativeStats ns = { callback->signature().to_s(), callback->isHandler(), callback->invocations() };
+                result.natives.push_back(ns);
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Resets the counters of all handlers and of the natives this program is linked to.
+ */
+void Program::resetStats()
+{
+    for (Handler* handler: handlers_)
+        handler->resetStats();
+
+    for (Runtime::Callback* callback: nativeHandlers_)
+        if (callback)
+            callback->resetStats();
+
+    for (Runtime::Callback* callback: nativeFunctions_)
+        if (callback)
+            callback->resetStats();
 }
 
 void Program::dump()
@@ -132,12 +425,57 @@ void Program::dump()
 
     printf("\n; String Constants\n");
     for (size_t i = 0, e = strings_.size(); i != e; ++i) {
-        printf(".const string %6zu = '%s'\n", i, strings_[i].c_str());
+        printf(".const string %6zu = '%.*s'\n", i, (int) strings_[i].size(), strings_[i].data());
+    }
+
+    printf("\n; IP Address Constants\n");
+    for (size_t i = 0, e = ipaddrs_.size(); i != e; ++i) {
+        printf(".const ipaddr %6zu = %s\n", i, ipaddrs_[i].str().c_str());
+    }
+
+    printf("\n; CIDR Constants\n");
+    for (size_t i = 0, e = cidrs_.size(); i != e; ++i) {
+        printf(".const cidr %8zu = %s\n", i, cidrs_[i].str().c_str());
     }
 
     printf("\n; Regular Expression Constants\n");
     for (size_t i = 0, e = regularExpressions_.size(); i != e; ++i) {
-        printf(".const regex %7zu = /%s/\n", i, regularExpressions_[i].c_str());
+        const RegExp& re = regularExpressions_[i];
+        if (!re.isValid())
+            printf(".const regex %7zu = /%s/ ; invalid: %s\n", i, re.pattern().c_str(), re.error().c_str());
+        else if (re.hasDFA())
+            printf(".const regex %7zu = /%s/ ; %zu DFA states\n", i, re.pattern().c_str(), re.dfaStateCount());
+        else
+            printf(".const regex %7zu = /%s/ ; backtracking\n", i, re.pattern().c_str());
+    }
+
+    printf("\n; Switch Tables\n");
+    for (size_t i = 0, e = numberSwitches_.size(); i != e; ++i) {
+        const NumberSwitch& table = numberSwitches_[i];
+        printf(".switch number %5zu = %s, default -> %u\n", i, table.isDense() ? "dense" : "sparse", table.defaultTarget());
+        for (const auto& c: table.cases())
+            printf("    %li -> %u\n", c.first, c.second);
+    }
+    for (size_t i = 0, e = stringSwitches_.size(); i != e; ++i) {
+        const StringSwitch& table = stringSwitches_[i];
+        printf(".switch string %5zu = hashed, default -> %u\n", i, table.defaultTarget());
+        for (const auto& c: table.cases())
+            printf("    '%s' -> %u\n", c.first.c_str(), c.second);
+    }
+
+    printf("\n; String Sets\n");
+    for (size_t i = 0, e = stringSets_.size(); i != e; ++i) {
+        const StringSet& set = stringSets_[i];
+        printf(".set string %7zu = [", i);
+        for (size_t k = 0, n = set.strings().size(); k != n; ++k)
+            printf("%s'%s'", k ? ", " : "", set.strings()[k].c_str());
+        printf("]\n");
+    }
+
+    printf("\n; CIDR Sets\n");
+    for (size_t i = 0, e = cidrSets_.size(); i != e; ++i) {
+        const CidrSet& set = cidrSets_[i];
+        printf(".set cidr %9zu = %zu networks, %zu trie nodes\n", i, set.networks().size(), set.nodeCount());
     }
 
     for (size_t i = 0, e = handlers_.size(); i != e; ++i) {
@@ -159,6 +497,9 @@ void Program::dump()
  */
 bool Program::link(Runtime* runtime)
 {
+    if (checkFrozen(this, "link"))
+        return false;
+
     runtime_ = runtime;
     int errors = 0;
 
@@ -169,6 +510,14 @@ bool Program::link(Runtime* runtime)
         }
     }
 
+    // report regular expressions that failed to compile
+    for (const auto& re: regularExpressions_) {
+        if (!re.isValid()) {
+            fprintf(stderr, "Invalid regular expression /%s/: %s\n", re.pattern().c_str(), re.error().c_str());
+            errors++;
+        }
+    }
+
     // link nattive handlers
     nativeHandlers_.resize(nativeHandlerSignatures_.size());
     size_t i = 0;
@@ -200,7 +549,19 @@ bool Program::link(Runtime* runtime)
         ++i;
     }
 
-    return errors == 0;
+    linked_ = errors == 0;
+    return linked_;
+}
+
+bool Program::freeze()
+{
+    if (!linked_) {
+        fprintf(stderr, "Cannot freeze program: not linked.\n");
+        return false;
+    }
+
+    frozen_ = true;
+    return true;
 }
 
 } // namespace FlowVM
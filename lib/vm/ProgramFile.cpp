@@ -0,0 +1,703 @@
+#include <flow/vm/Program.h>
+#include <flow/vm/Handler.h>
+#include <flow/vm/Instruction.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace FlowVM {
+
+/* {{{ binary file format
+ * ----------------------------------------------
+ * u32                  magic number (0xbeafbabe)
+ * u32                  version
+ * u64                  flags (byte order of the writing host)
+ * {u64, u64}[19]       section table: file offset and element count of
+ *                      each of the sections below, in this order
+ *
+ * u32[]                code segment, all handlers concatenated (may contain WIDE prefixes)
+ * i64[]                integer const-table segment
+ * {u64, u64}[]         string const-table: offset/size into string data
+ * u8[]                 string data (constants, patterns, names; no NULs)
+ * {u64, u64}[]         regex const-table (stored as string)
+ * {str, u64, u64}[]    handlers: name, code offset and instruction count
+ * {str, str}[]         modules: name, path
+ * str[]                native handler signatures
+ * str[]                native function signatures
+ * {u64, u64, u64}[]    number switches: first case, case count, default target
+ * {i64, u64}[]         number switch cases: value, target
+ * {u64, u64, u64}[]    string switches: first case, case count, default target
+ * {str, u64}[]         string switch cases: value, target
+ * ip[]                 IP address const-table, ip = {u64, u64}: upper and lower 64 bits
+ * cidr[]               CIDR const-table, cidr = {ip, u32, u32}: network, prefix bits, reserved
+ * {u64, u64}[]         CIDR sets: first network, network count
+ * cidr[]               CIDR set networks
+ * {u64, u64}[]         string sets: first string, string count
+ * str[]                string set strings
+ *
+ * All integers are stored in the writing host's byte order and each
+ * section starts 8-byte aligned, so that code and constants can be used
+ * straight from a read-only shared mapping of the file.
+ */ // }}}
+
+namespace {
+    enum {
+        Magic = 0xbeafbabe,
+        Version = 4,
+    };
+
+    enum Section {
+        CodeSection,
+        NumberSection,
+        StringSection,
+        StringDataSection,
+        RegExpSection,
+        HandlerSection,
+        ModuleSection,
+        NativeHandlerSection,
+        NativeFunctionSection,
+        NumberSwitchSection,
+        NumberCaseSection,
+        StringSwitchSection,
+        StringCaseSection,
+        IPAddressSection,
+        CidrSection,
+        CidrSetSection,
+        CidrSetNetworkSection,
+        StringSetSection,
+        StringSetStringSection,
+        SectionCount
+    };
+
+    struct SectionEntry {
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t flags;
+        SectionEntry sections[SectionCount];
+    };
+
+    struct StringEntry {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct HandlerEntry {
+        StringEntry name;
+        uint64_t codeOffset;
+        uint64_t codeSize;
+    };
+
+    struct ModuleEntry {
+        StringEntry name;
+        StringEntry path;
+    };
+
+    struct SwitchEntry {
+        uint64_t firstCase;
+        uint64_t caseCount;
+        uint64_t defaultTarget;
+    };
+
+    struct NumberCaseEntry {
+        int64_t value;
+        uint64_t target;
+    };
+
+    struct StringCaseEntry {
+        StringEntry value;
+        uint64_t target;
+    };
+
+    struct CidrSetEntry {
+        uint64_t firstNetwork;
+        uint64_t networkCount;
+    };
+
+    struct StringSetEntry {
+        uint64_t firstString;
+        uint64_t stringCount;
+    };
+
+    // stored and mapped as is
+    static_assert(sizeof(IPAddress) == 16, "IPAddress must be 128 bits.");
+    static_assert(sizeof(Cidr) == 24, "Cidr must be an IPAddress plus 64 bits.");
+
+    /** Byte-order marker, so files are not loaded on a host of different endianness. */
+    uint64_t hostFlags()
+    {
+        const uint16_t probe = 1;
+        return *reinterpret_cast<const uint8_t*>(&probe) == 1 ? 0 : 1;
+    }
+
+    class FileWriter {
+    public:
+        FileWriter() : header_(), data_(sizeof(FileHeader), '\0'), strings_() {
+            header_.magic = Magic;
+            header_.version = Version;
+            header_.flags = hostFlags();
+        }
+
+        StringEntry string(const char* data, size_t size) {
+            StringEntry e = { strings_.size(), size };
+            strings_.append(data, size);
+            return e;
+        }
+
+        StringEntry string(const std::string& s) { return string(s.data(), s.size()); }
+
+        template<typename T>
+        void section(Section id, const std::vector<T>& items) {
+            section(id, items.data(), items.size(), sizeof(T));
+        }
+
+        void section(Section id, const void* items, size_t count, size_t elementSize) {
+            data_.resize((data_.size() + 7) & ~size_t(7), '\0');
+            header_.sections[id].offset = data_.size();
+            header_.sections[id].count = count;
+            data_.append(static_cast<const char*>(items), count * elementSize);
+        }
+
+        void finish() {
+            section(StringDataSection, strings_.data(), strings_.size(), 1);
+            memcpy(&data_[0], &header_, sizeof(header_));
+        }
+
+        const std::string& data() const { return data_; }
+
+    private:
+        FileHeader header_;
+        std::string data_;
+        std::string strings_;
+    };
+
+    class FileReader {
+    public:
+        FileReader(const std::string& filename, const uint8_t* data, size_t size) :
+            filename_(filename), data_(data), size_(size), header_(nullptr) {}
+
+        bool verify() {
+            if (size_ < sizeof(FileHeader))
+                return error("file too small");
+
+            header_ = reinterpret_cast<const FileHeader*>(data_);
+
+            if (header_->magic != Magic)
+                return error("bad magic number");
+
+            if (header_->version != Version)
+                return error("unsupported version");
+
+            if (header_->flags != hostFlags())
+                return error("byte order mismatch");
+
+            static const size_t elementSizes[SectionCount] = {
+                sizeof(Instruction),
+                sizeof(Number),
+                sizeof(StringEntry),
+                1,
+                sizeof(StringEntry),
+                sizeof(HandlerEntry),
+                sizeof(ModuleEntry),
+                sizeof(StringEntry),
+                sizeof(StringEntry),
+                sizeof(SwitchEntry),
+                sizeof(NumberCaseEntry),
+                sizeof(SwitchEntry),
+                sizeof(StringCaseEntry),
+                sizeof(IPAddress),
+                sizeof(Cidr),
+                sizeof(CidrSetEntry),
+                sizeof(Cidr),
+                sizeof(StringSetEntry),
+                sizeof(StringEntry),
+            };
+
+            for (size_t i = 0; i != SectionCount; ++i) {
+                const SectionEntry& s = header_->sections[i];
+                if (s.offset % 8 || s.offset > size_ || s.count > (size_ - s.offset) / elementSizes[i])
+                    return error("corrupt section table");
+            }
+
+            return true;
+        }
+
+        template<typename T>
+        ArrayRef<T> section(Section id) const {
+            const SectionEntry& s = header_->sections[id];
+            return ArrayRef<T>(reinterpret_cast<const T*>(data_ + s.offset), s.count);
+        }
+
+        bool string(const StringEntry& e, BufferRef* result) {
+            const SectionEntry& s = header_->sections[StringDataSection];
+            if (e.offset > s.count || e.size > s.count - e.offset)
+                return error("string out of range");
+
+            *result = BufferRef(reinterpret_cast<const char*>(data_ + s.offset + e.offset), e.size);
+            return true;
+        }
+
+        bool string(const StringEntry& e, std::string* result) {
+            BufferRef ref;
+            if (!string(e, &ref))
+                return false;
+
+            *result = ref.str();
+            return true;
+        }
+
+        bool error(const char* message) {
+            fprintf(stderr, "Could not load program file %s: %s\n", filename_.c_str(), message);
+            return false;
+        }
+
+    private:
+        std::string filename_;
+        const uint8_t* data_;
+        size_t size_;
+        const FileHeader* header_;
+    };
+
+    /**
+     * Tests whether \p network is as Cidr construction leaves it: at most 128
+     * prefix bits, host bits cleared, and IPv4 networks at least 96 bits long.
+     */
+    bool isNormalized(const Cidr& network)
+    {
+        return network.bits() <= 128 && Cidr::fromBits(network.address(), network.bits()) == network;
+    }
+
+    /**
+     * Tests whether a switch target as stored in the file lies within the
+     * code section, before it is narrowed to a WideImmOperand. The targets
+     * are checked against the code of each handler using the table, too.
+     */
+    bool isCodeOffset(uint64_t target, size_t codeSize)
+    {
+        return target < codeSize && target <= static_cast<WideImmOperand>(-1);
+    }
+
+    /** Tests whether all targets of a switch table lie within \p codeSize. */
+    template<typename Switch>
+    bool verifyTargets(const Switch& table, size_t codeSize)
+    {
+        if (table.defaultTarget() >= codeSize)
+            return false;
+
+        for (const auto& c: table.cases())
+            if (c.second >= codeSize)
+                return false;
+
+        return true;
+    }
+
+    /**
+     * Verifies a handler's code against the program's constant tables, so
+     * it cannot make the interpreter read outside of them or of the code.
+     *
+     * Checks opcodes, constant and switch table indices, jump targets, and
+     * that the code neither ends in a WIDE prefix nor runs off its end.
+     * Regular expression and set indices are register values and thus
+     * left to the interpreter.
+     */
+    bool verifyCode(FileReader& reader, const Program& program, ArrayRef<Instruction> code)
+    {
+        const size_t size = code.size();
+        WideInstruction instr = 0;
+
+        for (size_t i = 0; i != size; ++i) {
+            if (opcode(code[i]) >= OpcodeCount)
+                return reader.error("invalid opcode in handler code");
+
+            if (opcode(code[i]) != Opcode::WIDE) {
+                instr = widen(0, code[i]);
+            } else if (i + 1 == size) {
+                return reader.error("truncated WIDE prefix in handler code");
+            } else if (opcode(code[i + 1]) >= OpcodeCount || opcode(code[i + 1]) == Opcode::WIDE) {
+                return reader.error("invalid opcode in handler code");
+            } else {
+                instr = widen(code[i], code[i + 1]);
+                ++i;
+            }
+
+            const WideImmOperand D = operandD(instr);
+            bool valid = true;
+
+            switch (opcode(instr)) {
+                case Opcode::JMP:
+                case Opcode::CONDBR:
+                    if (D >= size)
+                        return reader.error("jump target out of range in handler code");
+                    break;
+                case Opcode::NSWITCH:
+                    valid = D < program.numberSwitches().size() && verifyTargets(program.numberSwitch(D), size);
+                    break;
+                case Opcode::SSWITCH:
+                    valid = D < program.stringSwitches().size() && verifyTargets(program.stringSwitch(D), size);
+                    break;
+                case Opcode::NCONST:
+                    valid = D < program.numbers().size();
+                    break;
+                case Opcode::SCONST:
+                    valid = D < program.strings().size();
+                    break;
+                case Opcode::PCONST:
+                    valid = D < program.ipaddrs().size();
+                    break;
+                case Opcode::CCONST:
+                    valid = D < program.cidrs().size();
+                    break;
+                default:
+                    break;
+            }
+
+            if (!valid)
+                return reader.error("table index out of range in handler code");
+        }
+
+        // the last instruction must not continue past the end
+        if (size) {
+            switch (opcode(instr)) {
+                case Opcode::EXIT:
+                case Opcode::JMP:
+                case Opcode::NSWITCH:
+                case Opcode::SSWITCH:
+                    break;
+                default:
+                    return reader.error("handler code runs off its end");
+            }
+        }
+
+        return true;
+    }
+}
+
+/**
+ * Serializes this program into the binary program file format.
+ *
+ * Native bindings are stored by signature and must be linked again after loading.
+ *
+ * \param filename path to the file to write.
+ * \retval true the program has been written.
+ * \retval false an I/O error occurred.
+ */
+bool Program::save(const std::string& filename) const
+{
+    FileWriter writer;
+
+    std::vector<Instruction> code;
+    std::vector<HandlerEntry> handlers;
+    for (const Handler* handler: handlers_) {
+        HandlerEntry e = { writer.string(handler->name()), code.size(), handler->code().size() };
+        code.insert(code.end(), handler->code().begin(), handler->code().end());
+        handlers.push_back(e);
+    }
+
+    std::vector<StringEntry> strings;
+    for (const String& s: strings_)
+        strings.push_back(writer.string(s.data(), s.size()));
+
+    std::vector<StringEntry> regexps;
+    for (const RegExp& re: regularExpressions_)
+        regexps.push_back(writer.string(re.pattern()));
+
+    std::vector<ModuleEntry> modules;
+    for (const auto& module: modules_) {
+        ModuleEntry e = { writer.string(module.first), writer.string(module.second) };
+        modules.push_back(e);
+    }
+
+    std::vector<StringEntry> nativeHandlers;
+    for (const std::string& signature: nativeHandlerSignatures_)
+        nativeHandlers.push_back(writer.string(signature));
+
+    std::vector<StringEntry> nativeFunctions;
+    for (const std::string& signature: nativeFunctionSignatures_)
+        nativeFunctions.push_back(writer.string(signature));
+
+    std::vector<SwitchEntry> numberSwitches;
+    std::vector<NumberCaseEntry> numberCases;
+    for (const NumberSwitch& table: numberSwitches_) {
+        SwitchEntry e = { numberCases.size(), table.cases().size(), table.defaultTarget() };
+        for (const auto& c: table.cases()) {
+            NumberCaseEntry ce = { c.first, c.second };
+            numberCases.push_back(ce);
+        }
+        numberSwitches.push_back(e);
+    }
+
+    std::vector<SwitchEntry> stringSwitches;
+    std::vector<StringCaseEntry> stringCases;
+    for (const StringSwitch& table: stringSwitches_) {
+        SwitchEntry e = { stringCases.size(), table.cases().size(), table.defaultTarget() };
+        for (const auto& c: table.cases()) {
+            StringCaseEntry ce = { writer.string(c.first), c.second };
+            stringCases.push_back(ce);
+        }
+        stringSwitches.push_back(e);
+    }
+
+    std::vector<CidrSetEntry> cidrSets;
+    std::vector<Cidr> cidrSetNetworks;
+    for (const CidrSet& set: cidrSets_) {
+        CidrSetEntry e = { cidrSetNetworks.size(), set.networks().size() };
+        cidrSetNetworks.insert(cidrSetNetworks.end(), set.networks().begin(), set.networks().end());
+        cidrSets.push_back(e);
+    }
+
+    std::vector<StringSetEntry> stringSets;
+    std::vector<StringEntry> stringSetStrings;
+    for (const StringSet& set: stringSets_) {
+        StringSetEntry e = { stringSetStrings.size(), set.strings().size() };
+        for (const std::string& value: set.strings())
+            stringSetStrings.push_back(writer.string(value));
+        stringSets.push_back(e);
+    }
+
+    writer.section(CodeSection, code);
+    writer.section(NumberSection, numbers_.data(), numbers_.size(), sizeof(Number));
+    writer.section(StringSection, strings);
+    writer.section(RegExpSection, regexps);
+    writer.section(HandlerSection, handlers);
+    writer.section(ModuleSection, modules);
+    writer.section(NativeHandlerSection, nativeHandlers);
+    writer.section(NativeFunctionSection, nativeFunctions);
+    writer.section(NumberSwitchSection, numberSwitches);
+    writer.section(NumberCaseSection, numberCases);
+    writer.section(StringSwitchSection, stringSwitches);
+    writer.section(StringCaseSection, stringCases);
+    writer.section(IPAddressSection, ipaddrs_.data(), ipaddrs_.size(), sizeof(IPAddress));
+    writer.section(CidrSection, cidrs_.data(), cidrs_.size(), sizeof(Cidr));
+    writer.section(CidrSetSection, cidrSets);
+    writer.section(CidrSetNetworkSection, cidrSetNetworks);
+    writer.section(StringSetSection, stringSets);
+    writer.section(StringSetStringSection, stringSetStrings);
+    writer.finish();
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s for writing: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ok = fwrite(writer.data().data(), 1, writer.data().size(), fp) == writer.data().size();
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok)
+        fprintf(stderr, "Could not write %s: %s\n", filename.c_str(), strerror(errno));
+
+    return ok;
+}
+
+/**
+ * Loads a program file written by save().
+ *
+ * The file is mapped read-only and shared, and handler code as well as
+ * number, string, IP address and CIDR constants are used in place rather
+ * than copied, so processes loading the same file share its physical pages.
+ * Regular expressions, switch tables, string sets and CIDR sets are
+ * rebuilt from their stored definitions, and handler code is verified
+ * against them. The returned program still needs to be linked.
+ *
+ * \param filename path to the program file.
+ * \return the loaded program or \c nullptr on error.
+ */
+std::unique_ptr<Program> Program::load(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", filename.c_str(), strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = st.st_size;
+    void* mapping = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    int mapError = errno;
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", filename.c_str(), size ? strerror(mapError) : "empty file");
+        return nullptr;
+    }
+
+    std::unique_ptr<Program> program(new Program());
+    program->mapping_ = mapping;
+    program->mappingSize_ = size;
+
+    FileReader reader(filename, static_cast<const uint8_t*>(mapping), size);
+    if (!reader.verify())
+        return nullptr;
+
+    program->numbers_ = reader.section<Number>(NumberSection);
+
+    for (const StringEntry& e: reader.section<StringEntry>(StringSection)) {
+        BufferRef s;
+        if (!reader.string(e, &s))
+            return nullptr;
+        program->strings_.push_back(s);
+    }
+
+    for (const StringEntry& e: reader.section<StringEntry>(RegExpSection)) {
+        std::string pattern;
+        if (!reader.string(e, &pattern))
+            return nullptr;
+        program->regularExpressions_.push_back(RegExp(pattern));
+    }
+
+    for (const ModuleEntry& e: reader.section<ModuleEntry>(ModuleSection)) {
+        std::pair<std::string, std::string> module;
+        if (!reader.string(e.name, &module.first) || !reader.string(e.path, &module.second))
+            return nullptr;
+        program->modules_.push_back(module);
+    }
+
+    for (const StringEntry& e: reader.section<StringEntry>(NativeHandlerSection)) {
+        std::string signature;
+        if (!reader.string(e, &signature))
+            return nullptr;
+        program->nativeHandlerSignatures_.push_back(signature);
+    }
+
+    for (const StringEntry& e: reader.section<StringEntry>(NativeFunctionSection)) {
+        std::string signature;
+        if (!reader.string(e, &signature))
+            return nullptr;
+        program->nativeFunctionSignatures_.push_back(signature);
+    }
+
+    program->ipaddrs_ = reader.section<IPAddress>(IPAddressSection);
+    program->cidrs_ = reader.section<Cidr>(CidrSection);
+
+    for (const Cidr& network: program->cidrs_) {
+        if (!isNormalized(network)) {
+            reader.error("corrupt CIDR constant");
+            return nullptr;
+        }
+    }
+
+    ArrayRef<Cidr> cidrSetNetworks = reader.section<Cidr>(CidrSetNetworkSection);
+    for (const CidrSetEntry& e: reader.section<CidrSetEntry>(CidrSetSection)) {
+        if (e.firstNetwork > cidrSetNetworks.size() || e.networkCount > cidrSetNetworks.size() - e.firstNetwork) {
+            reader.error("CIDR set out of range");
+            return nullptr;
+        }
+
+        std::vector<Cidr> networks(cidrSetNetworks.data() + e.firstNetwork,
+                                   cidrSetNetworks.data() + e.firstNetwork + e.networkCount);
+        for (const Cidr& network: networks) {
+            if (!isNormalized(network)) {
+                reader.error("corrupt CIDR set");
+                return nullptr;
+            }
+        }
+        program->addCidrSet(networks);
+    }
+
+    ArrayRef<StringEntry> stringSetStrings = reader.section<StringEntry>(StringSetStringSection);
+    for (const StringSetEntry& e: reader.section<StringSetEntry>(StringSetSection)) {
+        if (e.firstString > stringSetStrings.size() || e.stringCount > stringSetStrings.size() - e.firstString) {
+            reader.error("string set out of range");
+            return nullptr;
+        }
+
+        std::vector<std::string> strings(e.stringCount);
+        for (size_t i = 0; i != e.stringCount; ++i)
+            if (!reader.string(stringSetStrings[e.firstString + i], &strings[i]))
+                return nullptr;
+
+        program->addStringSet(strings);
+    }
+
+    ArrayRef<Instruction> code = reader.section<Instruction>(CodeSection);
+
+    ArrayRef<NumberCaseEntry> numberCases = reader.section<NumberCaseEntry>(NumberCaseSection);
+    for (const SwitchEntry& e: reader.section<SwitchEntry>(NumberSwitchSection)) {
+        if (e.firstCase > numberCases.size() || e.caseCount > numberCases.size() - e.firstCase) {
+            reader.error("switch table out of range");
+            return nullptr;
+        }
+
+        std::vector<NumberSwitch::Case> cases;
+        for (size_t i = 0; i != e.caseCount; ++i) {
+            const NumberCaseEntry& c = numberCases[e.firstCase + i];
+            if (!isCodeOffset(c.target, code.size())) {
+                reader.error("switch target out of range");
+                return nullptr;
+            }
+            cases.push_back(NumberSwitch::Case(c.value, c.target));
+        }
+        if (!isCodeOffset(e.defaultTarget, code.size())) {
+            reader.error("switch target out of range");
+            return nullptr;
+        }
+        program->addNumberSwitch(cases, e.defaultTarget);
+    }
+
+    ArrayRef<StringCaseEntry> stringCases = reader.section<StringCaseEntry>(StringCaseSection);
+    for (const SwitchEntry& e: reader.section<SwitchEntry>(StringSwitchSection)) {
+        if (e.firstCase > stringCases.size() || e.caseCount > stringCases.size() - e.firstCase) {
+            reader.error("switch table out of range");
+            return nullptr;
+        }
+
+        std::vector<StringSwitch::Case> cases;
+        for (size_t i = 0; i != e.caseCount; ++i) {
+            const StringCaseEntry& c = stringCases[e.firstCase + i];
+            std::string value;
+            if (!reader.string(c.value, &value))
+                return nullptr;
+            if (!isCodeOffset(c.target, code.size())) {
+                reader.error("switch target out of range");
+                return nullptr;
+            }
+            cases.push_back(StringSwitch::Case(value, c.target));
+        }
+        if (!isCodeOffset(e.defaultTarget, code.size())) {
+            reader.error("switch target out of range");
+            return nullptr;
+        }
+        program->addStringSwitch(cases, e.defaultTarget);
+    }
+
+    for (const HandlerEntry& e: reader.section<HandlerEntry>(HandlerSection)) {
+        std::string name;
+        if (!reader.string(e.name, &name))
+            return nullptr;
+
+        if (e.codeOffset > code.size() || e.codeSize > code.size() - e.codeOffset) {
+            reader.error("handler code out of range");
+            return nullptr;
+        }
+
+        ArrayRef<Instruction> handlerCode(code.data() + e.codeOffset, e.codeSize);
+        if (!verifyCode(reader, *program, handlerCode))
+            return nullptr;
+
+        Handler* handler = program->createHandler(name);
+        handler->setCodeRef(handlerCode);
+    }
+
+    return program;
+}
+
+} // namespace FlowVM
@@ -0,0 +1,1045 @@
+#include <flow/vm/RegExp.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <string>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+
+namespace FlowVM {
+
+/* {{{ Compiler
+ *
+ * Parses the pattern into a small syntax tree and emits a Thompson NFA:
+ *
+ *     0: SPLIT 3, 1    ; unanchored prefix: prefer matching at the current position
+ *     1: CLASS any     ;   skip one byte
+ *     2: JMP 0
+ *     3: SAVE 0        ; anchored start
+ *        ...           ; pattern body
+ *        SAVE 1
+ *        MATCH
+ */
+class RegExp::Compiler {
+public:
+    Compiler(RegExp* re) : re_(re), nodes_(), p_(nullptr), e_(nullptr), groups_(1) {}
+
+    bool compile();
+
+private:
+    struct Node {
+        enum Kind { Empty, Class, Concat, Alternate, Repeat, Group, Begin, End };
+
+        Kind kind;
+        uint64_t bits[4];
+        std::vector<int> children;
+        int min;
+        int max;            // -1 for unbounded
+        bool greedy;
+        int capture;        // -1 for non-capturing groups
+    };
+
+    int newNode(Node::Kind kind);
+    int fail(const char* message);
+
+    int parseAlternation();
+    int parseConcat();
+    int parseRepeat();
+    int parseAtom();
+    int parseClass();
+    bool parseEscape(uint64_t* bits);
+    bool parseNumber(int* result);
+
+    bool emit(int node);
+    size_t push(Instr::Op op, int32_t x = 0, int32_t y = 0);
+    int32_t classIndex(const uint64_t* bits);
+
+    static void set(uint64_t* bits, unsigned ch) { bits[ch >> 6] |= uint64_t(1) << (ch & 63); }
+    static void setRange(uint64_t* bits, unsigned lo, unsigned hi) { for (unsigned c = lo; c <= hi; ++c) set(bits, c); }
+    static void negate(uint64_t* bits) { for (int i = 0; i < 4; ++i) bits[i] = ~bits[i]; }
+
+    RegExp* re_;
+    std::vector<Node> nodes_;
+    const char* p_;
+    const char* e_;
+    int groups_;
+};
+
+int RegExp::Compiler::newNode(Node::Kind kind)
+{
+    Node node;
+    node.kind = kind;
+    memset(node.bits, 0, sizeof(node.bits));
+    node.min = 0;
+    node.max = 0;
+    node.greedy = true;
+    node.capture = -1;
+    nodes_.push_back(node);
+    return nodes_.size() - 1;
+}
+
+int RegExp::Compiler::fail(const char* message)
+{
+    if (re_->error_.empty()) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%s at offset %zu", message,
+                 static_cast<size_t>(p_ - re_->pattern_.data()));
+        re_->error_ = buf;
+    }
+    return -1;
+}
+
+bool RegExp::Compiler::compile()
+{
+    p_ = re_->pattern_.data();
+    e_ = p_ + re_->pattern_.size();
+
+    int root = parseAlternation();
+    if (root < 0)
+        return false;
+
+    if (p_ != e_)
+        return fail("Unbalanced ')'") >= 0;
+
+    uint64_t any[4];
+    memset(any, 0xFF, sizeof(any));
+
+    re_->program_.clear();
+    push(Instr::Split, 3, 1);
+    push(Instr::Class, classIndex(any));
+    push(Instr::Jmp, 0);
+    push(Instr::Save, 0);
+
+    if (!emit(root))
+        return false;
+
+    push(Instr::Save, 1);
+    push(Instr::Match);
+
+    re_->unanchoredStart_ = 0;
+    re_->anchoredStart_ = 3;
+    re_->groupCount_ = groups_;
+
+    return true;
+}
+
+int RegExp::Compiler::parseAlternation()
+{
+    int first = parseConcat();
+    if (first < 0 || p_ == e_ || *p_ != '|')
+        return first;
+
+    int alt = newNode(Node::Alternate);
+    nodes_[alt].children.push_back(first);
+
+    while (p_ != e_ && *p_ == '|') {
+        ++p_;
+        int next = parseConcat();
+        if (next < 0)
+            return -1;
+        nodes_[alt].children.push_back(next);
+    }
+
+    return alt;
+}
+
+int RegExp::Compiler::parseConcat()
+{
+    int concat = newNode(Node::Concat);
+
+    while (p_ != e_ && *p_ != '|' && *p_ != ')') {
+        int node = parseRepeat();
+        if (node < 0)
+            return -1;
+        nodes_[concat].children.push_back(node);
+    }
+
+    return concat;
+}
+
+bool RegExp::Compiler::parseNumber(int* result)
+{
+    if (p_ == e_ || *p_ < '0' || *p_ > '9')
+        return false;
+
+    int n = 0;
+    while (p_ != e_ && *p_ >= '0' && *p_ <= '9') {
+        n = n * 10 + (*p_ - '0');
+        if (n > 1000)
+            return false;
+        ++p_;
+    }
+
+    *result = n;
+    return true;
+}
+
+int RegExp::Compiler::parseRepeat()
+{
+    int atom = parseAtom();
+    if (atom < 0)
+        return -1;
+
+    while (p_ != e_) {
+        int min, max;
+
+        switch (*p_) {
+            case '*': min = 0; max = -1; ++p_; break;
+            case '+': min = 1; max = -1; ++p_; break;
+            case '?': min = 0; max = 1; ++p_; break;
+            case '{':
+                ++p_;
+                if (!parseNumber(&min))
+                    return fail("Invalid repetition count");
+                max = min;
+                if (p_ != e_ && *p_ == ',') {
+                    ++p_;
+                    max = -1;
+                    if (p_ != e_ && *p_ != '}' && (!parseNumber(&max) || max < min))
+                        return fail("Invalid repetition range");
+                }
+                if (p_ == e_ || *p_ != '}')
+                    return fail("Missing '}'");
+                ++p_;
+                break;
+            default:
+                return atom;
+        }
+
+        int repeat = newNode(Node::Repeat);
+        nodes_[repeat].children.push_back(atom);
+        nodes_[repeat].min = min;
+        nodes_[repeat].max = max;
+
+        if (p_ != e_ && *p_ == '?') {
+            nodes_[repeat].greedy = false;
+            ++p_;
+        }
+
+        atom = repeat;
+    }
+
+    return atom;
+}
+
+int RegExp::Compiler::parseAtom()
+{
+    switch (*p_) {
+        case '(': {
+            ++p_;
+            int capture = -1;
+            if (e_ - p_ >= 2 && p_[0] == '?' && p_[1] == ':') {
+                p_ += 2;
+            } else {
+                capture = groups_++;
+            }
+
+            int inner = parseAlternation();
+            if (inner < 0)
+                return -1;
+
+            if (p_ == e_ || *p_ != ')')
+                return fail("Missing ')'");
+            ++p_;
+
+            int group = newNode(Node::Group);
+            nodes_[group].children.push_back(inner);
+            nodes_[group].capture = capture;
+            return group;
+        }
+        case '[':
+            ++p_;
+            return parseClass();
+        case '.': {
+            ++p_;
+            int node = newNode(Node::Class);
+            setRange(nodes_[node].bits, 0, 255);
+            nodes_[node].bits[0] &= ~(uint64_t(1) << '\n');
+            return node;
+        }
+        case '^':
+            ++p_;
+            return newNode(Node::Begin);
+        case '$':
+            ++p_;
+            return newNode(Node::End);
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            return fail("Nothing to repeat");
+        case '\\': {
+            ++p_;
+            int node = newNode(Node::Class);
+            if (!parseEscape(nodes_[node].bits))
+                return -1;
+            return node;
+        }
+        default: {
+            int node = newNode(Node::Class);
+            set(nodes_[node].bits, static_cast<unsigned char>(*p_++));
+            return node;
+        }
+    }
+}
+
+/**
+ * Parses the escape sequence following a backslash into the given byte set.
+ */
+bool RegExp::Compiler::parseEscape(uint64_t* bits)
+{
+    if (p_ == e_)
+        return fail("Trailing backslash") >= 0;
+
+    char ch = *p_++;
+    uint64_t tmp[4] = { 0, 0, 0, 0 };
+
+    switch (ch) {
+        case 'd': case 'D':
+            setRange(tmp, '0', '9');
+            break;
+        case 'w': case 'W':
+            setRange(tmp, '0', '9');
+            setRange(tmp, 'A', 'Z');
+            setRange(tmp, 'a', 'z');
+            set(tmp, '_');
+            break;
+        case 's': case 'S':
+            set(tmp, ' '); set(tmp, '\t'); set(tmp, '\n');
+            set(tmp, '\r'); set(tmp, '\f'); set(tmp, '\v');
+            break;
+        case 't': set(bits, '\t'); return true;
+        case 'n': set(bits, '\n'); return true;
+        case 'r': set(bits, '\r'); return true;
+        case 'f': set(bits, '\f'); return true;
+        case 'v': set(bits, '\v'); return true;
+        case 'x': {
+            unsigned value = 0;
+            for (int i = 0; i < 2; ++i) {
+                if (p_ == e_ || !isxdigit(static_cast<unsigned char>(*p_)))
+                    return fail("Invalid hex escape") >= 0;
+                char c = *p_++;
+                value = value * 16 + (isdigit(static_cast<unsigned char>(c)) ? c - '0' : (tolower(c) - 'a' + 10));
+            }
+            set(bits, value);
+            return true;
+        }
+        default:
+            if (isalnum(static_cast<unsigned char>(ch)))
+                return fail("Unsupported escape sequence") >= 0;
+            set(bits, static_cast<unsigned char>(ch));
+            return true;
+    }
+
+    if (isupper(static_cast<unsigned char>(ch)))
+        negate(tmp);
+
+    for (int i = 0; i < 4; ++i)
+        bits[i] |= tmp[i];
+
+    return true;
+}
+
+int RegExp::Compiler::parseClass()
+{
+    int node = newNode(Node::Class);
+    uint64_t bits[4] = { 0, 0, 0, 0 };
+    bool negated = false;
+
+    if (p_ != e_ && *p_ == '^') {
+        negated = true;
+        ++p_;
+    }
+
+    bool first = true;
+    while (p_ != e_ && (*p_ != ']' || first)) {
+        first = false;
+        unsigned lo;
+
+        if (*p_ == '\\') {
+            ++p_;
+            uint64_t esc[4] = { 0, 0, 0, 0 };
+            if (!parseEscape(esc))
+                return -1;
+
+            // single characters may start a range, \d and friends may not
+            int count = 0;
+            for (unsigned c = 0; c < 256; ++c) {
+                if (esc[c >> 6] & (uint64_t(1) << (c & 63))) {
+                    lo = c;
+                    ++count;
+                }
+            }
+
+            if (count != 1) {
+                for (int i = 0; i < 4; ++i)
+                    bits[i] |= esc[i];
+                continue;
+            }
+        } else {
+            lo = static_cast<unsigned char>(*p_++);
+        }
+
+        if (e_ - p_ >= 2 && p_[0] == '-' && p_[1] != ']') {
+            ++p_;
+            unsigned hi;
+            if (*p_ == '\\') {
+                ++p_;
+                uint64_t esc[4] = { 0, 0, 0, 0 };
+                if (!parseEscape(esc))
+                    return -1;
+                hi = 256;
+                for (unsigned c = 0; c < 256 && hi == 256; ++c)
+                    if (esc[c >> 6] & (uint64_t(1) << (c & 63)))
+                        hi = c;
+            } else {
+                hi = static_cast<unsigned char>(*p_++);
+            }
+
+            if (hi == 256 || hi < lo)
+                return fail("Invalid character range");
+
+            setRange(bits, lo, hi);
+        } else {
+            set(bits, lo);
+        }
+    }
+
+    if (p_ == e_)
+        return fail("Missing ']'");
+    ++p_;
+
+    if (negated)
+        negate(bits);
+
+    memcpy(nodes_[node].bits, bits, sizeof(bits));
+    return node;
+}
+
+size_t RegExp::Compiler::push(Instr::Op op, int32_t x, int32_t y)
+{
+    Instr instr;
+    instr.op = op;
+    instr.x = x;
+    instr.y = y;
+    re_->program_.push_back(instr);
+    return re_->program_.size() - 1;
+}
+
+int32_t RegExp::Compiler::classIndex(const uint64_t* bits)
+{
+    auto& classes = re_->classes_;
+
+    for (size_t i = 0, e = classes.size(); i != e; i += 4)
+        if (memcmp(&classes[i], bits, 4 * sizeof(uint64_t)) == 0)
+            return i / 4;
+
+    classes.insert(classes.end(), bits, bits + 4);
+    return classes.size() / 4 - 1;
+}
+
+bool RegExp::Compiler::emit(int index)
+{
+    if (re_->program_.size() > MaxInstructions)
+        return fail("Pattern too large") >= 0;
+
+    const Node& node = nodes_[index];
+    auto& program = re_->program_;
+
+    switch (node.kind) {
+        case Node::Empty:
+            return true;
+        case Node::Class:
+            push(Instr::Class, classIndex(node.bits));
+            return true;
+        case Node::Concat:
+            for (int child: node.children)
+                if (!emit(child))
+                    return false;
+            return true;
+        case Node::Alternate: {
+            std::vector<size_t> exits;
+            for (size_t i = 0, e = node.children.size(); i != e; ++i) {
+                if (i + 1 != e) {
+                    size_t split = push(Instr::Split, program.size() + 1, 0);
+                    if (!emit(node.children[i]))
+                        return false;
+                    exits.push_back(push(Instr::Jmp));
+                    program[split].y = program.size();
+                } else if (!emit(node.children[i])) {
+                    return false;
+                }
+            }
+            for (size_t exit: exits)
+                program[exit].x = program.size();
+            return true;
+        }
+        case Node::Repeat: {
+            for (int i = 0; i < node.min; ++i)
+                if (!emit(node.children[0]))
+                    return false;
+
+            if (node.max < 0) {
+                size_t loop = push(Instr::Split);
+                if (!emit(node.children[0]))
+                    return false;
+                push(Instr::Jmp, loop);
+                int32_t body = loop + 1;
+                int32_t out = program.size();
+                program[loop].x = node.greedy ? body : out;
+                program[loop].y = node.greedy ? out : body;
+            } else {
+                std::vector<size_t> splits;
+                for (int i = node.min; i < node.max; ++i) {
+                    splits.push_back(push(Instr::Split));
+                    if (!emit(node.children[0]))
+                        return false;
+                }
+                int32_t out = program.size();
+                for (size_t split: splits) {
+                    program[split].x = node.greedy ? split + 1 : out;
+                    program[split].y = node.greedy ? out : split + 1;
+                }
+            }
+            return true;
+        }
+        case Node::Group:
+            if (node.capture >= 0)
+                push(Instr::Save, 2 * node.capture);
+            if (!emit(node.children[0]))
+                return false;
+            if (node.capture >= 0)
+                push(Instr::Save, 2 * node.capture + 1);
+            return true;
+        case Node::Begin:
+            push(Instr::Begin);
+            return true;
+        case Node::End:
+            push(Instr::End);
+            return true;
+    }
+
+    return false;
+}
+// }}}
+// {{{ RegExp
+RegExp::RegExp(const std::string& pattern) :
+    pattern_(pattern),
+    error_(),
+    groupCount_(0),
+    program_(),
+    classes_(),
+    unanchoredStart_(0),
+    anchoredStart_(0),
+    byteClassCount_(0),
+    dfa_(),
+    dfaAccept_()
+{
+    memset(byteClass_, 0, sizeof(byteClass_));
+
+    Compiler compiler(this);
+    if (!compiler.compile()) {
+        program_.clear();
+        classes_.clear();
+        return;
+    }
+
+    buildDFA();
+}
+
+void RegExp::buildDFA()
+{
+    // partition all bytes into classes that no NFA instruction distinguishes
+    std::map<std::vector<bool>, uint8_t> signatures;
+    const size_t classCount = classes_.size() / 4;
+
+    for (unsigned ch = 0; ch < 256; ++ch) {
+        std::vector<bool> signature(classCount);
+        for (size_t i = 0; i < classCount; ++i)
+            signature[i] = (classes_[i * 4 + (ch >> 6)] >> (ch & 63)) & 1;
+
+        auto it = signatures.find(signature);
+        if (it == signatures.end())
+            it = signatures.insert(std::make_pair(signature, static_cast<uint8_t>(signatures.size()))).first;
+
+        byteClass_[ch] = it->second;
+    }
+
+    byteClassCount_ = signatures.size();
+
+    unsigned char representative[256];
+    for (int ch = 255; ch >= 0; --ch)
+        representative[byteClass_[ch]] = ch;
+
+    // subset construction
+    const size_t n = program_.size();
+    std::vector<uint32_t> mark(n, 0);
+    uint32_t stamp = 0;
+    std::vector<uint32_t> stack;
+
+    // epsilon closure, keeping only instructions that consume input, MATCH
+    // and (unless at end of input) pending END assertions
+    auto closure = [&](const std::vector<uint32_t>& seeds, bool atBegin, bool atEnd) {
+        std::vector<uint32_t> result;
+        ++stamp;
+        stack.assign(seeds.rbegin(), seeds.rend());
+
+        while (!stack.empty()) {
+            uint32_t pc = stack.back();
+            stack.pop_back();
+
+            if (mark[pc] == stamp)
+                continue;
+            mark[pc] = stamp;
+
+            const Instr& instr = program_[pc];
+            switch (instr.op) {
+                case Instr::Class:
+                case Instr::Match:
+                    result.push_back(pc);
+                    break;
+                case Instr::Split:
+                    stack.push_back(instr.y);
+                    stack.push_back(instr.x);
+                    break;
+                case Instr::Jmp:
+                    stack.push_back(instr.x);
+                    break;
+                case Instr::Save:
+                    stack.push_back(pc + 1);
+                    break;
+                case Instr::Begin:
+                    if (atBegin)
+                        stack.push_back(pc + 1);
+                    break;
+                case Instr::End:
+                    if (atEnd)
+                        stack.push_back(pc + 1);
+                    else
+                        result.push_back(pc);
+                    break;
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+        return result;
+    };
+
+    auto acceptFlags = [&](const std::vector<uint32_t>& state, bool atBegin) {
+        uint8_t flags = 0;
+        std::vector<uint32_t> pending;
+
+        for (uint32_t pc: state) {
+            if (program_[pc].op == Instr::Match)
+                flags |= 3;
+            else if (program_[pc].op == Instr::End)
+                pending.push_back(pc + 1);
+        }
+
+        if (!(flags & 2) && !pending.empty())
+            for (uint32_t pc: closure(pending, atBegin, true))
+                if (program_[pc].op == Instr::Match)
+                    flags |= 2;
+
+        return flags;
+    };
+
+    // the start state is keyed separately, as only it may satisfy '^'
+    std::map<std::vector<uint32_t>, int32_t> states;
+    std::vector<std::vector<uint32_t>> queue;
+
+    const uint32_t entry = anchoredBegin() ? anchoredStart_ : unanchoredStart_;
+    std::vector<uint32_t> start = closure(std::vector<uint32_t>(1, entry), true, false);
+    queue.push_back(start);
+    dfaAccept_.push_back(acceptFlags(start, true));
+    dfa_.assign(byteClassCount_, -1);
+
+    for (size_t s = 0; s < queue.size(); ++s) {
+        for (size_t c = 0; c < byteClassCount_; ++c) {
+            const unsigned ch = representative[c];
+            std::vector<uint32_t> seeds;
+
+            for (uint32_t pc: queue[s]) {
+                const Instr& instr = program_[pc];
+                if (instr.op == Instr::Class && ((classes_[instr.x * 4 + (ch >> 6)] >> (ch & 63)) & 1))
+                    seeds.push_back(pc + 1);
+            }
+
+            if (seeds.empty())
+                continue; // dead transition
+
+            std::vector<uint32_t> next = closure(seeds, false, false);
+            auto it = states.find(next);
+            int32_t target;
+
+            if (it != states.end()) {
+                target = it->second;
+            } else {
+                if (queue.size() >= MaxDFAStates) {
+                    // too many states: leave matching to the backtracker
+                    dfa_.clear();
+                    dfaAccept_.clear();
+                    return;
+                }
+
+                target = queue.size();
+                states[next] = target;
+                dfaAccept_.push_back(acceptFlags(next, false));
+                dfa_.resize(dfa_.size() + byteClassCount_, -1);
+                queue.push_back(std::move(next));
+            }
+
+            dfa_[s * byteClassCount_ + c] = target;
+        }
+    }
+}
+
+bool RegExp::matchDFA(const BufferRef& subject) const
+{
+    int32_t state = 0;
+
+    if (dfaAccept_[state] & 1)
+        return true;
+
+    for (const char* i = subject.begin(), *e = subject.end(); i != e; ++i) {
+        state = dfa_[state * byteClassCount_ + byteClass_[static_cast<unsigned char>(*i)]];
+
+        if (state < 0)
+            return false;
+
+        if (dfaAccept_[state] & 1)
+            return true;
+    }
+
+    return (dfaAccept_[state] & 2) != 0;
+}
+
+/**
+ * Simulates the NFA, by the backtracker as long as its visited set stays
+ * small, and by the Pike VM otherwise, so that memory does not grow with
+ * program size times subject length.
+ */
+bool RegExp::matchNFA(const BufferRef& subject, std::vector<size_t>& captures,
+                      std::vector<uint64_t>& visited) const
+{
+    if (program_.size() * (subject.size() + 1) <= MaxBacktrackBits)
+        return matchBacktrack(subject, captures, visited);
+
+    visited.clear();
+    return matchPike(subject, captures);
+}
+
+/**
+ * Leftmost-first search that explores every (instruction, position) pair
+ * at most once, bounding the work to O(program size * subject length).
+ */
+bool RegExp::matchBacktrack(const BufferRef& subject, std::vector<size_t>& captures,
+                            std::vector<uint64_t>& visited) const
+{
+    const size_t n = subject.size();
+    const size_t width = n + 1;
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(subject.data());
+
+    visited.assign((program_.size() * width + 63) / 64, 0);
+    captures.assign(2 * groupCount_, BufferRef::npos);
+
+    struct Job {
+        uint32_t pc;        // instruction, or capture slot to restore
+        bool restore;
+        size_t pos;         // position, or saved capture value
+    };
+    std::vector<Job> stack;
+
+    const size_t last = anchoredBegin() ? 0 : n;
+
+    for (size_t begin = 0; begin <= last; ++begin) {
+        stack.push_back(Job { static_cast<uint32_t>(anchoredStart_), false, begin });
+
+        while (!stack.empty()) {
+            Job job = stack.back();
+            stack.pop_back();
+
+            if (job.restore) {
+                captures[job.pc] = job.pos;
+                continue;
+            }
+
+            uint32_t pc = job.pc;
+            size_t pos = job.pos;
+
+            for (;;) {
+                const size_t bit = pc * width + pos;
+                if (visited[bit / 64] & (uint64_t(1) << (bit % 64)))
+                    break;
+                visited[bit / 64] |= uint64_t(1) << (bit % 64);
+
+                const Instr& instr = program_[pc];
+                bool fail = false;
+
+                switch (instr.op) {
+                    case Instr::Class:
+                        if (pos < n && ((classes_[instr.x * 4 + (s[pos] >> 6)] >> (s[pos] & 63)) & 1)) {
+                            ++pc;
+                            ++pos;
+                        } else {
+                            fail = true;
+                        }
+                        break;
+                    case Instr::Split:
+                        stack.push_back(Job { static_cast<uint32_t>(instr.y), false, pos });
+                        pc = instr.x;
+                        break;
+                    case Instr::Jmp:
+                        pc = instr.x;
+                        break;
+                    case Instr::Save:
+                        stack.push_back(Job { static_cast<uint32_t>(instr.x), true, captures[instr.x] });
+                        captures[instr.x] = pos;
+                        ++pc;
+                        break;
+                    case Instr::Begin:
+                        if (pos == 0) ++pc; else fail = true;
+                        break;
+                    case Instr::End:
+                        if (pos == n) ++pc; else fail = true;
+                        break;
+                    case Instr::Match:
+                        return true;
+                }
+
+                if (fail)
+                    break;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Leftmost-first search advancing all threads one subject byte at a time,
+ * in O(program size * subject length) time and O(program size * groups)
+ * space.
+ *
+ * Threads are kept in priority order; a thread reaching MATCH cuts off all
+ * threads of lower priority, and new threads starting at later positions
+ * are only spawned until the first match.
+ */
+bool RegExp::matchPike(const BufferRef& subject, std::vector<size_t>& captures) const
+{
+    const size_t n = subject.size();
+    const size_t slots = 2 * groupCount_;
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(subject.data());
+
+    struct ThreadList {
+        std::vector<uint32_t> pcs;      // Class and Match instructions, by priority
+        std::vector<size_t> captures;   // slots per thread
+        std::vector<size_t> mark;       // position + 1 the instruction has been added at
+    };
+    ThreadList lists[2];
+    for (ThreadList& list: lists)
+        list.mark.assign(program_.size(), 0);
+
+    struct Job {
+        uint32_t pc;        // instruction, or capture slot to restore
+        bool restore;
+        size_t value;       // saved capture value
+    };
+    std::vector<Job> stack;
+    std::vector<size_t> scratch(slots);
+
+    // follows the empty transitions from pc at pos, adding threads in priority order
+    auto add = [&](ThreadList& list, uint32_t start, size_t pos) {
+        stack.push_back(Job { start, false, 0 });
+
+        while (!stack.empty()) {
+            Job job = stack.back();
+            stack.pop_back();
+
+            if (job.restore) {
+                scratch[job.pc] = job.value;
+                continue;
+            }
+
+            for (uint32_t pc = job.pc; list.mark[pc] != pos + 1; ) {
+                list.mark[pc] = pos + 1;
+
+                const Instr& instr = program_[pc];
+                bool stop = false;
+
+                switch (instr.op) {
+                    case Instr::Class:
+                    case Instr::Match:
+                        list.pcs.push_back(pc);
+                        list.captures.resize(list.captures.size() + slots);
+                        std::copy(scratch.begin(), scratch.end(), list.captures.end() - slots);
+                        stop = true;
+                        break;
+                    case Instr::Split:
+                        stack.push_back(Job { static_cast<uint32_t>(instr.y), false, 0 });
+                        pc = instr.x;
+                        break;
+                    case Instr::Jmp:
+                        pc = instr.x;
+                        break;
+                    case Instr::Save:
+                        stack.push_back(Job { static_cast<uint32_t>(instr.x), true, scratch[instr.x] });
+                        scratch[instr.x] = pos;
+                        ++pc;
+                        break;
+                    case Instr::Begin:
+                        if (pos == 0) ++pc; else stop = true;
+                        break;
+                    case Instr::End:
+                        if (pos == n) ++pc; else stop = true;
+                        break;
+                }
+
+                if (stop)
+                    break;
+            }
+        }
+    };
+
+    bool matched = false;
+    ThreadList* current = &lists[0];
+    ThreadList* next = &lists[1];
+
+    for (size_t pos = 0; ; ++pos) {
+        if (!matched && (pos == 0 || !anchoredBegin())) {
+            scratch.assign(slots, BufferRef::npos);
+            add(*current, static_cast<uint32_t>(anchoredStart_), pos);
+        }
+
+        if (current->pcs.empty() && (matched || anchoredBegin()))
+            break;
+
+        for (size_t t = 0, e = current->pcs.size(); t != e; ++t) {
+            const uint32_t pc = current->pcs[t];
+            const Instr& instr = program_[pc];
+            const size_t* caps = &current->captures[t * slots];
+
+            if (instr.op == Instr::Match) {
+                captures.assign(caps, caps + slots);
+                matched = true;
+                break;
+            }
+
+            if (pos < n && ((classes_[instr.x * 4 + (s[pos] >> 6)] >> (s[pos] & 63)) & 1)) {
+                std::copy(caps, caps + slots, scratch.begin());
+                add(*next, pc + 1, pos + 1);
+            }
+        }
+
+        current->pcs.clear();
+        current->captures.clear();
+        std::swap(current, next);
+
+        if (pos == n)
+            break;
+    }
+
+    if (!matched)
+        captures.assign(slots, BufferRef::npos);
+
+    return matched;
+}
+
+bool RegExp::match(const BufferRef& subject, RegExpContext* cx) const
+{
+    if (!isValid())
+        return false;
+
+    bool matched;
+
+    if (!dfa_.empty()) {
+        matched = matchDFA(subject);
+        if (cx) {
+            cx->regexp_ = this;
+            cx->subject_ = subject;
+            cx->matched_ = matched;
+            cx->resolved_ = false;
+        }
+    } else if (cx) {
+        matched = matchNFA(subject, cx->captures_, cx->visited_);
+        cx->regexp_ = this;
+        cx->subject_ = subject;
+        cx->matched_ = matched;
+        cx->resolved_ = true;
+    } else {
+        std::vector<size_t> captures;
+        std::vector<uint64_t> visited;
+        matched = matchNFA(subject, captures, visited);
+    }
+
+    return matched;
+}
+
+bool RegExp::match(const BufferRef& subject, std::vector<BufferRef>* groups) const
+{
+    RegExpContext cx;
+
+    if (!match(subject, &cx))
+        return false;
+
+    groups->resize(groupCount_);
+    for (size_t i = 0; i < groupCount_; ++i)
+        (*groups)[i] = cx.group(i);
+
+    return true;
+}
+
+void RegExp::resolve(RegExpContext* cx) const
+{
+    if (cx->matched_) {
+        matchNFA(cx->subject_, cx->captures_, cx->visited_);
+    } else {
+        cx->captures_.clear();
+    }
+    cx->resolved_ = true;
+}
+// }}}
+// {{{ RegExpContext
+RegExpContext::RegExpContext() :
+    regexp_(nullptr),
+    subject_(),
+    matched_(false),
+    resolved_(true),
+    captures_(),
+    visited_()
+{
+}
+
+void RegExpContext::clear()
+{
+    regexp_ = nullptr;
+    subject_ = BufferRef();
+    matched_ = false;
+    resolved_ = true;
+    captures_.clear();
+}
+
+BufferRef RegExpContext::group(size_t index)
+{
+    if (!regexp_ || !matched_)
+        return BufferRef();
+
+    if (!resolved_)
+        regexp_->resolve(this);
+
+    if (2 * index + 1 >= captures_.size())
+        return BufferRef();
+
+    size_t begin = captures_[2 * index];
+    size_t end = captures_[2 * index + 1];
+
+    if (begin == BufferRef::npos || end == BufferRef::npos)
+        return BufferRef();
+
+    return subject_.ref(begin, end - begin);
+}
+// }}}
+
+} // namespace FlowVM
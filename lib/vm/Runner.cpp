@@ -2,6 +2,8 @@
 #include <flow/vm/Handler.h>
 #include <flow/vm/Program.h>
 #include <flow/vm/Instruction.h>
+#include <flow/vm/TraceSink.h>
+#include <flow/vm/MachineCode.h>
 #include <vector>
 #include <utility>
 #include <memory>
@@ -13,6 +15,89 @@
 
 namespace FlowVM {
 
+namespace {
+    /**
+     * Token-threaded dispatch: decodes operands from the 32-bit Instruction
+     * and looks up the opcode's label on every dispatch.
+     */
+    struct TokenThreaded {
+        typedef Instruction Code;
+
+        static const Code* begin(const Handler* handler) { return handler->code().data(); }
+        static const void* label(const void* const* ops, const Code* pc) { return ops[FlowVM::opcode(*pc)]; }
+        static Opcode opcode(const Code* pc) { return FlowVM::opcode(*pc); }
+        static Operand A(const Code* pc) { return operandA(*pc); }
+        static Operand B(const Code* pc) { return operandB(*pc); }
+        static Operand C(const Code* pc) { return operandC(*pc); }
+        static ImmOperand D(const Code* pc) { return operandD(*pc); }
+    };
+
+    /**
+     * Direct-threaded dispatch: jumps straight to the label stored in the
+     * handler's pre-decoded ThreadedInstruction stream.
+     */
+    struct DirectThreaded {
+        typedef ThreadedInstruction Code;
+
+        static const Code* begin(const Handler* handler) { return handler->threadedCode().data(); }
+        static const void* label(const void* const* /*ops*/, const Code* pc) { return pc->label; }
+        static Opcode opcode(const Code* pc) { return static_cast<Opcode>(pc->opcode); }
+        static Operand A(const Code* pc) { return pc->A; }
+        static Operand B(const Code* pc) { return pc->B; }
+        static Operand C(const Code* pc) { return pc->C; }
+        static ImmOperand D(const Code* pc) { return pc->D; }
+    };
+
+    /**
+     * Wide dispatch: decodes operands from the handler's WideInstruction
+     * stream, for code containing WIDE prefixes (see widen()).
+     */
+    struct WideThreaded {
+        typedef WideInstruction Code;
+
+        static const Code* begin(const Handler* handler) { return handler->wideCode().data(); }
+        static const void* label(const void* const* ops, const Code* pc) { return ops[FlowVM::opcode(*pc)]; }
+        static Opcode opcode(const Code* pc) { return FlowVM::opcode(*pc); }
+        static WideOperand A(const Code* pc) { return operandA(*pc); }
+        static WideOperand B(const Code* pc) { return operandB(*pc); }
+        static WideOperand C(const Code* pc) { return operandC(*pc); }
+        static WideImmOperand D(const Code* pc) { return operandD(*pc); }
+    };
+
+    /**
+     * Release mode: neither traces nor counts instructions.
+     */
+    struct Release {
+        static constexpr bool ticks = false;
+        static constexpr bool trace = false;
+    };
+
+    /**
+     * Counts executed instructions, as required by NTICKS.
+     */
+    struct Counting {
+        static constexpr bool ticks = true;
+        static constexpr bool trace = false;
+    };
+
+    /**
+     * Counts executed instructions and reports each of them to the trace sink.
+     */
+    struct Tracing {
+        static constexpr bool ticks = true;
+        static constexpr bool trace = true;
+    };
+
+    /**
+     * Operands of the instruction following a superinstruction, which
+     * provides the operands of the instruction fused into it.
+     */
+    template<typename Engine> WideOperand nextA(const typename Engine::Code* pc) { return Engine::A(pc + 1); }
+    template<typename Engine> WideOperand nextB(const typename Engine::Code* pc) { return Engine::B(pc + 1); }
+    template<typename Engine> WideOperand nextC(const typename Engine::Code* pc) { return Engine::C(pc + 1); }
+    template<typename Engine> WideImmOperand nextD(const typename Engine::Code* pc) { return Engine::D(pc + 1); }
+}
+
 std::unique_ptr<Runner> Runner::create(Handler* handler)
 {
     Runner* p = (Runner*) malloc(sizeof(Runner) + handler->registerCount() * sizeof(uint64_t));
@@ -24,9 +109,33 @@ Runner::Runner(Handler* handler) :
     handler_(handler),
     program_(handler->program()),
     userdata_(nullptr),
-    stringGarbage_()
+    traceSink_(handler->traceSink()),
+    capacity_(handler->registerCount()),
+    state_(State::Idle),
+    suspendedAt_(0),
+    suspendedTicks_(0),
+    completion_(),
+    strings_(),
+    regexpContext_()
+{
+    memset(data_, 0, sizeof(Register) * capacity_);
+}
+
+/**
+ * Prepares this Runner for another run of its handler.
+ *
+ * Rewinds the string arena and clears the register file.
+ * The handler's registerCount() must still match capacity().
+ */
+void Runner::reset()
 {
-    memset(data_, 0, sizeof(Register) * handler_->registerCount());
+    userdata_ = nullptr;
+    traceSink_ = handler_->traceSink();
+    state_ = State::Idle;
+    completion_ = nullptr;
+    strings_.rewind();
+    regexpContext_.clear();
+    memset(data_, 0, sizeof(Register) * capacity_);
 }
 
 void Runner::operator delete (void* p)
@@ -36,32 +145,292 @@ void Runner::operator delete (void* p)
 
 String* Runner::createString(const std::string& value)
 {
-    stringGarbage_.push_back(value);
-    return &stringGarbage_.back();
+    return strings_.createString(value.data(), value.size());
+}
+
+String* Runner::createString(const char* data, size_t size)
+{
+    return strings_.createString(data, size);
+}
+
+/**
+ * Allocates an uninitialized string of \p size bytes inside the arena,
+ * for the caller to write into directly via \p data.
+ */
+String* Runner::allocateString(size_t size, char** data)
+{
+    return strings_.allocateString(size, data);
+}
+
+/**
+ * Creates a string referencing \p data without copying it.
+ *
+ * The referenced bytes must outlive the current run.
+ */
+String* Runner::createStringRef(const char* data, size_t size)
+{
+    return strings_.createStringRef(data, size);
 }
 
+/**
+ * Copies \p value into the arena, valid until the runner is reset.
+ */
+IPAddress* Runner::createIPAddress(const IPAddress& value)
+{
+    return new (strings_.allocate(sizeof(IPAddress))) IPAddress(value);
+}
+
+/**
+ * Executes the handler's program.
+ *
+ * Natives cannot suspend a synchronous run (see start()).
+ */
 bool Runner::run()
 {
-    const Program* program = handler_->program();
-    const auto& code = handler_->code();
-    register const Instruction* pc = code.data();
-    uint64_t ticks = 0;
+    if (state_ == State::Suspended) {
+        fprintf(stderr, "Cannot run handler %s: runner is suspended.\n", handler_->name().c_str());
+        return false;
+    }
+
+    state_ = State::Running;
+    bool result = dispatch();
+    state_ = State::Idle;
+
+    return result;
+}
+
+/**
+ * Selects the interpreter loop, or the handler's machine code.
+ *
+ * Without a trace sink the release loop runs, counting instructions only
+ * if the code makes use of NTICKS. The direct-threaded code is bound to the
+ * release loop, so the instrumented loops always dispatch token-threaded.
+ * Code containing WIDE prefixes runs from its decoded form in any mode.
+ *
+ * Machine code neither traces nor counts, so it only runs in release mode
+ * and without FLOW_STATS.
+ */
+bool Runner::dispatch()
+{
+    const bool wide = handler_->isWide();
+
+    if (traceSink_)
+        return wide ? execute<WideThreaded, Tracing>(this, nullptr)
+                    : execute<TokenThreaded, Tracing>(this, nullptr);
+
+    if (handler_->countsTicks())
+        return wide ? execute<WideThreaded, Counting>(this, nullptr)
+                    : execute<TokenThreaded, Counting>(this, nullptr);
+
+    if (!FLOW_STATS && handler_->machineCode())
+        return runMachineCode(handler_->machineCode());
+
+    if (wide)
+        return execute<WideThreaded, Release>(this, nullptr);
+
+    switch (handler_->engine()) {
+        case ExecutionEngine::DirectThreaded:
+        case ExecutionEngine::Compiled:
+            return execute<DirectThreaded, Release>(this, nullptr);
+        case ExecutionEngine::TokenThreaded:
+        default:
+            return execute<TokenThreaded, Release>(this, nullptr);
+    }
+}
+
+/**
+ * Runs (or resumes) the handler's machine code, continuing in the release
+ * interpreter at the first instruction the code leaves to it.
+ */
+bool Runner::runMachineCode(const MachineCode* machineCode)
+{
+    size_t pc = 0;
+
+    if (state_ == State::Resuming) {
+        // resume() stored the native's result already
+        state_ = State::RunningAsync;
+
+        const WideInstruction instr = instructionAt(suspendedAt_);
+        if (opcode(instr) == Opcode::HANDLER && data_[operandC(instr)] != 0)
+            return true;
+
+        pc = suspendedAt_ + 1;
+    }
+
+    const uint64_t result = machineCode->run(this, data_, pc);
+    pc = result >> 2;
+
+    switch (result & 3) {
+        case MachineCode::ExitFalse:
+            return false;
+        case MachineCode::ExitTrue:
+            return true;
+        case MachineCode::Suspended:
+            suspendedAt_ = pc;
+            suspendedTicks_ = 0;
+            return false;
+        case MachineCode::Interpret:
+        default:
+            return handler_->isWide() ? execute<WideThreaded, Release>(this, nullptr, pc)
+                                      : execute<DirectThreaded, Release>(this, nullptr, pc);
+    }
+}
+
+/**
+ * Decodes the instruction at offset \p pc of the handler's code.
+ */
+WideInstruction Runner::instructionAt(size_t pc) const
+{
+    if (handler_->isWide())
+        return handler_->wideCode()[pc];
+
+    return widen(0, handler_->code()[pc]);
+}
+
+// {{{ asynchronous execution
+/**
+ * Executes the handler's program, allowing natives to suspend it.
+ *
+ * \param completion invoked with the run's result once it completed, which
+ *                   is from within start() unless a native suspended the
+ *                   run, or else from within the resume() completing it.
+ *                   It may reset or destroy the runner.
+ */
+void Runner::start(Completion completion)
+{
+    if (state_ == State::Suspended) {
+        fprintf(stderr, "Cannot start handler %s: runner is suspended.\n", handler_->name().c_str());
+        return;
+    }
+
+    completion_ = std::move(completion);
+    state_ = State::RunningAsync;
+
+    bool result = dispatch();
+
+    if (state_ != State::Suspended)
+        complete(result);
+}
+
+/**
+ * Suspends the run once the calling native returned.
+ *
+ * To be called by a CALL or HANDLER native that cannot provide its result
+ * yet. The native's result is passed to resume() later on; registers and
+ * strings of the run are kept meanwhile.
+ *
+ * \retval true the run will be suspended.
+ * \retval false the run is synchronous (see run()); the native must
+ *               provide its result right away.
+ */
+bool Runner::suspend()
+{
+    if (state_ != State::RunningAsync)
+        return false;
+
+    state_ = State::Suspended;
+    return true;
+}
+
+/**
+ * Continues a suspended run with the result of the native that suspended it.
+ *
+ * Must be called on the thread owning the runner, after the start() or
+ * resume() call that got suspended has returned.
+ *
+ * \param result the native's result, as it would have stored it into argv[0].
+ */
+void Runner::resume(Value result)
+{
+    if (state_ != State::Suspended) {
+        fprintf(stderr, "Cannot resume handler %s: runner is not suspended.\n", handler_->name().c_str());
+        return;
+    }
+
+    data_[operandC(instructionAt(suspendedAt_))] = result;
+
+    state_ = State::Resuming;
+
+    bool done = dispatch();
+
+    if (state_ != State::Suspended)
+        complete(done);
+}
+
+void Runner::complete(bool result)
+{
+    state_ = State::Idle;
+
+    Completion completion;
+    completion.swap(completion_);
+
+    if (completion)
+        completion(this, result);
+}
+// }}}
+
+/**
+ * Translates a token-threaded instruction stream into its pre-decoded,
+ * direct-threaded representation.
+ *
+ * \param code the handler's instruction stream.
+ * \param result output vector receiving one ThreadedInstruction per Instruction.
+ */
+void Runner::translate(ArrayRef<Instruction> code,
+                       std::vector<ThreadedInstruction>* result)
+{
+    const void* const* ops = nullptr;
+    execute<DirectThreaded, Release>(nullptr, &ops);
+
+    result->resize(code.size());
+
+    for (size_t i = 0, e = code.size(); i != e; ++i) {
+        ThreadedInstruction& ti = (*result)[i];
+        ti.label = ops[opcode(code[i])];
+        ti.A = operandA(code[i]);
+        ti.B = operandB(code[i]);
+        ti.C = operandC(code[i]);
+        ti.D = operandD(code[i]);
+        ti.opcode = opcode(code[i]);
+    }
+}
 
-    #define OP opcode(*pc)
-    #define A  operandA(*pc)
-    #define B  operandB(*pc)
-    #define C  operandC(*pc)
-    #define D  operandD(*pc)
+/**
+ * The interpreter loop, instantiated once per dispatch technique.
+ *
+ * \param self the runner to execute, or \c nullptr if only the jump table is requested.
+ * \param labels if non-null, receives the jump table and the function returns immediately.
+ * \param start offset of the instruction to start at, unless resuming.
+ */
+template<typename Engine, typename Mode>
+bool Runner::execute(Runner* self, const void* const** labels, size_t start)
+{
+    #define A  Engine::A(pc)
+    #define B  Engine::B(pc)
+    #define C  Engine::C(pc)
+    #define D  Engine::D(pc)
 
     #define toString(R) (*(String*) data_[R])
     #define toNumber(R)   ((Number) data_[R])
+    #define toIPAddress(R) (*(const IPAddress*) data_[R])
+    #define toCidr(R) (*(const Cidr*) data_[R])
 
     #define instr(name) \
         l_##name: \
-        disassemble(*pc, pc - code.data()); \
-        ++ticks;
+        if (Mode::trace) \
+            self->traceSink_->instruction(self, pc - code, self->handler_->code()[pc - code]); \
+        if (Mode::ticks || FLOW_STATS) \
+            ++ticks; \
+        if (FLOW_STATS) \
+            ++opcodeCounts[Engine::opcode(pc)];
+
+    #define recordRun(runs) \
+        if (FLOW_STATS) \
+            self->handler_->recordRun(runs, ticks - startTicks, opcodeCounts);
 
-    #define next goto *ops[opcode(*++pc)]
+    #define jump(target) pc = code + (target); goto *Engine::label(ops, pc)
+    #define next goto *Engine::label(ops, ++pc)
+    #define skip goto *Engine::label(ops, pc += 2)
 
     // {{{ jump table
     static const void* ops[] = {
@@ -69,6 +438,8 @@ bool Runner::run()
         [Opcode::EXIT]      = &&l_exit,
         [Opcode::JMP]       = &&l_jmp,
         [Opcode::CONDBR]    = &&l_condbr,
+        [Opcode::NSWITCH]   = &&l_nswitch,
+        [Opcode::SSWITCH]   = &&l_sswitch,
 
         // debug
         [Opcode::NTICKS]    = &&l_nticks,
@@ -102,6 +473,7 @@ bool Runner::run()
         // string op
         [Opcode::SCONST]    = &&l_sconst,
         [Opcode::SADD]      = &&l_sadd,
+        [Opcode::SADDMULTI] = &&l_saddmulti,
         [Opcode::SSUBSTR]   = &&l_ssubstr,
         [Opcode::SCMPEQ]    = &&l_scmpeq,
         [Opcode::SCMPNE]    = &&l_scmpne,
@@ -112,6 +484,7 @@ bool Runner::run()
         [Opcode::SCMPBEG]   = &&l_scmpbeg,
         [Opcode::SCMPEND]   = &&l_scmpend,
         [Opcode::SCONTAINS] = &&l_scontains,
+        [Opcode::SINSET]    = &&l_sinset,
         [Opcode::SLEN]      = &&l_slen,
         [Opcode::SPRINT]    = &&l_sprint,
 
@@ -119,39 +492,118 @@ bool Runner::run()
         [Opcode::SREGMATCH] = &&l_sregmatch,
         [Opcode::SREGGROUP] = &&l_sreggroup,
 
+        // ip
+        [Opcode::PCONST]     = &&l_pconst,
+        [Opcode::PCMPEQ]     = &&l_pcmpeq,
+        [Opcode::PCMPNE]     = &&l_pcmpne,
+        [Opcode::PINCIDR]    = &&l_pincidr,
+        [Opcode::PINCIDRSET] = &&l_pincidrset,
+
+        // cidr
+        [Opcode::CCONST]     = &&l_cconst,
+
         // conversion
-        [Opcode::S2I] = &&l_s2i,
         [Opcode::I2S] = &&l_i2s,
+        [Opcode::S2I] = &&l_s2i,
+        [Opcode::P2S] = &&l_p2s,
         [Opcode::SURLENC] = &&l_surlenc,
         [Opcode::SURLDEC] = &&l_surldec,
 
         // invokation
         [Opcode::CALL] = &&l_call,
         [Opcode::HANDLER] = &&l_handler,
+
+        // superinstructions
+        [Opcode::NCMPEQBR] = &&l_ncmpeqbr,
+        [Opcode::NCMPNEBR] = &&l_ncmpnebr,
+        [Opcode::NCMPLEBR] = &&l_ncmplebr,
+        [Opcode::NCMPGEBR] = &&l_ncmpgebr,
+        [Opcode::NCMPLTBR] = &&l_ncmpltbr,
+        [Opcode::NCMPGTBR] = &&l_ncmpgtbr,
+        [Opcode::SCMPEQBR] = &&l_scmpeqbr,
+        [Opcode::SCMPNEBR] = &&l_scmpnebr,
+        [Opcode::NADDI] = &&l_naddi,
+
+        // prefix
+        [Opcode::WIDE] = &&l_wide,
     };
     // }}}
 
-    goto *ops[opcode(*pc)];
+    if (labels) {
+        *labels = ops;
+        return true;
+    }
+
+    const Program* program = self->program_;
+    const typename Engine::Code* code = Engine::begin(self->handler_);
+    const typename Engine::Code* pc = code + start;
+    Register* data_ = self->data_;
+    uint64_t ticks = 0;
+    uint64_t startTicks = 0;    // of this invocation, in case of resuming
+    uint64_t opcodeCounts[FLOW_STATS ? OpcodeCount : 1];
+
+    if (FLOW_STATS)
+        memset(opcodeCounts, 0, sizeof(opcodeCounts));
+
+    if (self->state_ == State::Resuming) {
+        // resume() stored the native's result already
+        self->state_ = State::RunningAsync;
+        pc = code + self->suspendedAt_;
+        ticks = startTicks = self->suspendedTicks_;
+
+        if (Engine::opcode(pc) == Opcode::HANDLER && data_[C] != 0)
+            goto handled;
+
+        ++pc;
+    }
+
+    goto *Engine::label(ops, pc);
 
     // {{{ control
     instr (exit) {
-        printf("exiting program. ran %lu instructions\n", ticks);
+        if (Mode::trace)
+            self->traceSink_->exit(self, D != 0, ticks);
+
+        recordRun(1);
+
         return D != 0;
     }
 
+handled:
+    if (Mode::trace)
+        self->traceSink_->exit(self, true, ticks);
+
+    recordRun(1);
+
+    return true;
+
+suspended:
+    self->suspendedAt_ = pc - code;
+    self->suspendedTicks_ = ticks;
+
+    recordRun(0);
+
+    return false;
+
     instr (jmp) {
-        pc = code.data() + D;
-        goto *ops[OP];
+        jump(D);
     }
 
     instr (condbr) {
         if (data_[A] != 0) {
-            pc = code.data() + D;
-            goto *ops[OP];
+            jump(D);
         } else {
             next;
         }
     }
+
+    instr (nswitch) {
+        jump(program->numberSwitch(D).lookup(toNumber(A)));
+    }
+
+    instr (sswitch) {
+        jump(program->stringSwitch(D).lookup(toString(A)));
+    }
     // }}}
     // {{{ copy
     instr (mov) {
@@ -283,12 +735,37 @@ bool Runner::run()
     }
 
     instr (sadd) { // A = concat(B, C)
-        data_[A] = (Register) createString(toString(B) + toString(C));
+        const String& b = toString(B);
+        const String& c = toString(C);
+        char* buf;
+        data_[A] = (Register) self->allocateString(b.size() + c.size(), &buf);
+        memcpy(buf, b.data(), b.size());
+        memcpy(buf + b.size(), c.data(), c.size());
+        next;
+    }
+
+    instr (saddmulti) { // A = concat(B /*rbase*/, C /*count*/)
+        size_t size = 0;
+        for (int i = 0; i < C; ++i)
+            size += toString(B + i).size();
+
+        // A may be part of the window, so it is assigned last
+        char* buf;
+        String* result = self->allocateString(size, &buf);
+
+        for (int i = 0; i < C; ++i) {
+            const String& s = toString(B + i);
+            memcpy(buf, s.data(), s.size());
+            buf += s.size();
+        }
+        data_[A] = (Register) result;
         next;
     }
 
     instr (ssubstr) { // A = substr(B, C /*offset*/, C+1 /*count*/)
-        data_[A] = (Register) createString(toString(B).substr(data_[C], data_[C + 1]));
+        // strings are immutable, so the substring may just reference B's bytes
+        const String s = toString(B).ref(data_[C], data_[C + 1]);
+        data_[A] = (Register) self->createStringRef(s.data(), s.size());
         next;
     }
 
@@ -325,14 +802,14 @@ bool Runner::run()
     instr (scmpbeg) {
         const auto& b = toString(B);
         const auto& c = toString(C);
-        data_[A] = b.size() >= c.size() && strncmp(b.c_str(), c.c_str(), c.size()) == 0;
+        data_[A] = b.begins(c);
         next;
     }
 
     instr (scmpend) {
         const auto& b = toString(B);
         const auto& c = toString(C);
-        data_[A] = b.size() >= c.size() && strcmp(b.c_str() + c.size() - c.size(), c.c_str()) == 0;
+        data_[A] = b.ends(c);
         next;
     }
 
@@ -341,50 +818,94 @@ bool Runner::run()
         next;
     }
 
+    instr (sinset) { // A = B in stringSets[int(C)]
+        data_[A] = program->stringSet(toNumber(C)).contains(toString(B));
+        next;
+    }
+
     instr (slen) {
         data_[A] = toString(B).size();
         next;
     }
 
     instr (sprint) {
-        printf("%s\n", toString(A).c_str());
+        printf("%.*s\n", (int) toString(A).size(), toString(A).data());
         next;
     }
     // }}}
     // {{{ regex
     instr (sregmatch) { // A = B =~ C
-        // TODO
+        const RegExp& re = program->regularExpression(toNumber(C));
+        data_[A] = re.match(toString(B), &self->regexpContext_);
         next;
     }
 
     instr (sreggroup) { // A = regex.match(B)
-        // TODO
+        // the group is a view into the subject of the last match
+        BufferRef group = self->regexpContext_.group(toNumber(B));
+        data_[A] = (Register) self->createStringRef(group.data(), group.size());
+        next;
+    }
+    // }}}
+    // {{{ ip
+    instr (pconst) { // A = ipaddrConstants[D]
+        data_[A] = (Register) &program->ipaddrs()[D];
+        next;
+    }
+
+    instr (pcmpeq) {
+        data_[A] = toIPAddress(B) == toIPAddress(C);
+        next;
+    }
+
+    instr (pcmpne) {
+        data_[A] = toIPAddress(B) != toIPAddress(C);
+        next;
+    }
+
+    instr (pincidr) { // A = B in C
+        data_[A] = toCidr(C).contains(toIPAddress(B));
+        next;
+    }
+
+    instr (pincidrset) { // A = B in cidrSets[int(C)]
+        data_[A] = program->cidrSet(toNumber(C)).contains(toIPAddress(B));
+        next;
+    }
+    // }}}
+    // {{{ cidr
+    instr (cconst) { // A = cidrConstants[D]
+        data_[A] = (Register) &program->cidrs()[D];
         next;
     }
     // }}}
     // {{{ conversion
     instr (s2i) { // A = atoi(B)
-        data_[A] = strtoll(toString(B).c_str(), nullptr, 10);
+        data_[A] = toString(B).toInt();
+        next;
+    }
+
+    instr (p2s) { // A = ip2str(B)
+        char buf[IPAddress::MaxStringSize + 1];
+        size_t n = toIPAddress(B).format(buf, sizeof(buf));
+        data_[A] = (Register) self->createString(buf, n);
         next;
     }
 
     instr (i2s) { // A = itoa(B)
         char buf[64];
-        if (snprintf(buf, sizeof(buf), "%li", (int64_t) data_[B]) > 0) {
-            data_[A] = (Register) createString(buf);
-        } else {
-            data_[A] = (Register) createString("");
-        }
+        int n = snprintf(buf, sizeof(buf), "%li", (int64_t) data_[B]);
+        data_[A] = (Register) self->createString(buf, n > 0 ? n : 0);
         next;
     }
 
     instr (surlenc) { // A = urlencode(B)
-        // TODO
+        data_[A] = (Register) self->createString(toString(B).urlEncode());
         next;
     }
 
-    instr (surldec) { // B = urldecode(B)
-        // TODO
+    instr (surldec) { // A = urldecode(B)
+        data_[A] = (Register) self->createString(toString(B).urlDecode());
         next;
     }
     // }}}
@@ -394,8 +915,11 @@ bool Runner::run()
         int argc = toNumber(B);
         Value* argv = &data_[C];
 
-        Runtime::Callback* cb = handler_->program()->nativeFunction(id);
-        cb->invoke(argc, argv, this);
+        Runtime::Callback* cb = program->nativeFunction(id);
+        cb->invoke(argc, argv, self);
+
+        if (self->state_ == State::Suspended)
+            goto suspended;
 
         next;
     }
@@ -405,17 +929,91 @@ bool Runner::run()
         int argc = toNumber(B);
         Value* argv = &data_[C];
 
-        Runtime::Callback* cb = handler_->program()->nativeHandler(id);
+        Runtime::Callback* cb = program->nativeHandler(id);
 
-        cb->invoke(argc, argv, this);
+        cb->invoke(argc, argv, self);
 
-        if (argv[0] != 0) {
-            return true;
+        if (self->state_ == State::Suspended)
+            goto suspended;
+
+        if (argv[0] != 0)
+            goto handled;
+
+        next;
+    }
+    // }}}
+    // {{{ superinstructions
+    // The instruction fused into a superinstruction still follows it, both
+    // for jumps targeting it and for providing its operands.
+    #define branch(cond) \
+        data_[A] = static_cast<Register>(cond); \
+        if (data_[A] != 0) { \
+            jump(nextD<Engine>(pc)); \
+        } else { \
+            skip; \
         }
 
+    instr (ncmpeqbr) {
+        branch(toNumber(B) == toNumber(C));
+    }
+
+    instr (ncmpnebr) {
+        branch(toNumber(B) != toNumber(C));
+    }
+
+    instr (ncmplebr) {
+        branch(toNumber(B) <= toNumber(C));
+    }
+
+    instr (ncmpgebr) {
+        branch(toNumber(B) >= toNumber(C));
+    }
+
+    instr (ncmpltbr) {
+        branch(toNumber(B) < toNumber(C));
+    }
+
+    instr (ncmpgtbr) {
+        branch(toNumber(B) > toNumber(C));
+    }
+
+    instr (scmpeqbr) {
+        branch(toString(B) == toString(C));
+    }
+
+    instr (scmpnebr) {
+        branch(toString(B) != toString(C));
+    }
+
+    instr (naddi) {
+        data_[A] = D;
+        data_[nextA<Engine>(pc)] = static_cast<Register>(toNumber(nextB<Engine>(pc)) + toNumber(nextC<Engine>(pc)));
+        skip;
+    }
+
+    #undef branch
+    // }}}
+    // {{{ prefix
+    // Only wide code contains WIDE, in the slot of the instruction it
+    // prefixed, which has been executed from the prefix' slot already.
+    instr (wide) {
         next;
     }
     // }}}
+
+    #undef skip
+    #undef next
+    #undef jump
+    #undef recordRun
+    #undef instr
+    #undef toCidr
+    #undef toIPAddress
+    #undef toNumber
+    #undef toString
+    #undef D
+    #undef C
+    #undef B
+    #undef A
 }
 
 } // namespace FlowVM
@@ -0,0 +1,163 @@
+#include <flow/vm/RunnerPool.h>
+#include <flow/vm/Runner.h>
+#include <flow/vm/Handler.h>
+#include <vector>
+#include <mutex>
+
+namespace FlowVM {
+
+// {{{ RunnerPool
+RunnerPool::RunnerPool(Handler* handler, size_t maxIdle) :
+    handler_(handler),
+    maxIdle_(maxIdle),
+    idle_()
+{
+    idle_.reserve(maxIdle_);
+}
+
+RunnerPool::~RunnerPool()
+{
+    clear();
+}
+
+/**
+ * Hands out a Runner ready for execution, allocating only if no idle
+ * Runner with a matching register file is available.
+ */
+Runner* RunnerPool::acquire()
+{
+    const size_t registerCount = handler_->registerCount();
+
+    while (!idle_.empty()) {
+        Runner* runner = idle_.back();
+        idle_.pop_back();
+
+        if (runner->capacity() == registerCount)
+            return runner;
+
+        delete runner;
+    }
+
+    return Runner::create(handler_).release();
+}
+
+/**
+ * Returns a Runner to the pool, resetting it for its next use.
+ */
+void RunnerPool::release(Runner* runner)
+{
+    if (idle_.size() < maxIdle_ && runner->capacity() == handler_->registerCount()) {
+        runner->reset();
+        idle_.push_back(runner);
+    } else {
+        delete runner;
+    }
+}
+
+void RunnerPool::clear()
+{
+    for (Runner* runner: idle_)
+        delete runner;
+
+    idle_.clear();
+}
+// }}}
+// {{{ RunnerPoolSet
+namespace {
+    std::mutex slotLock;
+    std::vector<size_t> freeSlots;
+    size_t nextSlot = 0;
+
+    /**
+     * Small, dense per-thread index. Slots of exited threads are reused.
+     */
+    struct ThreadSlot {
+        size_t index;
+
+        ThreadSlot() {
+            std::lock_guard<std::mutex> _l(slotLock);
+            if (!freeSlots.empty()) {
+                index = freeSlots.back();
+                freeSlots.pop_back();
+            } else {
+                index = nextSlot++;
+            }
+        }
+
+        ~ThreadSlot() {
+            std::lock_guard<std::mutex> _l(slotLock);
+            freeSlots.push_back(index);
+        }
+    };
+}
+
+RunnerPoolSet::RunnerPoolSet(Handler* handler) :
+    handler_(handler)
+{
+    for (auto& chunk: chunks_)
+        chunk.store(nullptr, std::memory_order_relaxed);
+}
+
+RunnerPoolSet::~RunnerPoolSet()
+{
+    clear();
+
+    for (auto& chunk: chunks_)
+        delete[] chunk.load(std::memory_order_relaxed);
+}
+
+size_t RunnerPoolSet::threadSlot()
+{
+    static thread_local ThreadSlot slot;
+    return slot.index;
+}
+
+RunnerPool* RunnerPoolSet::local()
+{
+    const size_t slot = threadSlot();
+    if (slot >= MaxThreads)
+        return nullptr;
+
+    std::atomic<Slot*>& chunkRef = chunks_[slot / ChunkSize];
+    Slot* chunk = chunkRef.load(std::memory_order_acquire);
+
+    if (!chunk) {
+        Slot* fresh = new Slot[ChunkSize];
+        for (size_t i = 0; i < ChunkSize; ++i)
+            fresh[i].store(nullptr, std::memory_order_relaxed);
+
+        if (chunkRef.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+            chunk = fresh;
+        } else {
+            delete[] fresh; // another thread won the race
+        }
+    }
+
+    // only the owning thread ever writes its own slot
+    Slot& poolRef = chunk[slot % ChunkSize];
+    RunnerPool* pool = poolRef.load(std::memory_order_relaxed);
+
+    if (!pool) {
+        pool = new RunnerPool(handler_);
+        poolRef.store(pool, std::memory_order_release);
+    }
+
+    return pool;
+}
+
+/**
+ * Destroys all pools. Must not be called while any thread executes the handler.
+ */
+void RunnerPoolSet::clear()
+{
+    for (auto& chunkRef: chunks_) {
+        if (Slot* chunk = chunkRef.load(std::memory_order_acquire)) {
+            for (size_t i = 0; i < ChunkSize; ++i) {
+                delete chunk[i].exchange(nullptr);
+            }
+        }
+    }
+}
+// }}}
+
+} // namespace FlowVM
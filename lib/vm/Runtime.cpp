@@ -1,26 +1,96 @@
 #include <flow/vm/Runtime.h>
+#include <flow/vm/Runner.h>
+#include <flow/vm/Program.h>
 
 namespace FlowVM {
 
 Runtime::Callback& Runtime::registerHandler(const std::string& name)
 {
-    builtins_.push_back(Callback(this, name, Type::Boolean));
-    return builtins_[builtins_.size() - 1];
+    builtins_.push_back(Callback(this, name));
+    reindex(&builtins_.back());
+    return builtins_.back();
 }
 
 Runtime::Callback& Runtime::registerFunction(const std::string& name, Type returnType)
 {
     builtins_.push_back(Callback(this, name, returnType));
-    return builtins_[builtins_.size() - 1];
+    reindex(&builtins_.back());
+    return builtins_.back();
 }
 
-Runtime::Callback* Runtime::find(const std::string& signature)
+/**
+ * Updates the signature index after \p callback's signature changed.
+ *
+ * Signature IDs are interned and never reused. If multiple callbacks share
+ * a signature, the one registered first wins.
+ */
+void Runtime::reindex(Callback* callback)
 {
-    for (auto& callback: builtins_)
-        if (callback.signature().to_s() == signature)
-            return &callback;
+    auto inserted = signatureIds_.insert(std::make_pair(callback->signature().to_s(), (int) callbacks_.size()));
+    if (inserted.second)
+        callbacks_.push_back(nullptr);
 
-    return nullptr;
+    int previous = callback->signatureId_;
+    callback->signatureId_ = inserted.first->second;
+
+    if (previous == callback->signatureId_)
+        return;
+
+    // hand the old signature over to the next callback still registered with it
+    if (previous >= 0 && callbacks_[previous] == callback) {
+        callbacks_[previous] = nullptr;
+        for (Callback& other: builtins_) {
+            if (&other != callback && other.signatureId_ == previous) {
+                callbacks_[previous] = &other;
+                break;
+            }
+        }
+    }
+
+    if (!callbacks_[callback->signatureId_])
+        callbacks_[callback->signatureId_] = callback;
+}
+
+/**
+ * Retrieves the interned ID of \p signature, or -1 if no callback has ever been registered with it.
+ */
+int Runtime::signatureId(const std::string& signature) const
+{
+    auto i = signatureIds_.find(signature);
+    return i != signatureIds_.end() ? i->second : -1;
+}
+
+bool Runtime::contains(const std::string& signature) const
+{
+    return find(signature) != nullptr;
+}
+
+Runtime::Callback* Runtime::find(const std::string& signature) const
+{
+    int id = signatureId(signature);
+    return id >= 0 ? callbacks_[id] : nullptr;
+}
+
+// {{{ native argument marshalling
+Handler* NativeArg<Handler*>::get(Value v, Runner* cx)
+{
+    return cx->program()->handler(v);
+}
+
+void NativeResult<String>::set(Value* argv, const String& v, Runner* cx)
+{
+    argv[0] = (Value) cx->createStringRef(v.data(), v.size());
+}
+
+void NativeResult<IPAddress>::set(Value* argv, const IPAddress& v, Runner* cx)
+{
+    argv[0] = (Value) cx->createIPAddress(v);
+}
+
+void NativeResult<std::string>::set(Value* argv, const std::string& v, Runner* cx)
+{
+    argv[0] = (Value) cx->createString(v);
 }
+// }}}
 
 } // namespace FlowVM
@@ -0,0 +1,228 @@
+#include <flow/vm/SharedProgram.h>
+#include <flow/vm/Program.h>
+#include <flow/vm/Handler.h>
+#include <thread>
+#include <limits>
+#include <cstdio>
+
+namespace FlowVM {
+
+SharedProgram::SharedProgram(std::unique_ptr<Program> program) :
+    current_(nullptr),
+    globalEpoch_(1),
+    overflowReaders_(0),
+    retiredLock_(),
+    retired_()
+{
+    for (auto& chunk: chunks_)
+        chunk.store(nullptr, std::memory_order_relaxed);
+
+    if (program)
+        publish(std::move(program));
+}
+
+SharedProgram::~SharedProgram()
+{
+    synchronize();
+    delete current_.load(std::memory_order_relaxed);
+
+    for (auto& chunk: chunks_)
+        delete[] chunk.load(std::memory_order_relaxed);
+}
+
+// {{{ readers
+/**
+ * Announces the calling thread as a reader of the current epoch.
+ *
+ * \return the thread's slot, or \c nullptr if it has been counted as overflow reader.
+ */
+SharedProgram::ReaderSlot* SharedProgram::enter() const
+{
+    const size_t index = RunnerPoolSet::threadSlot();
+    if (index >= RunnerPoolSet::MaxThreads) {
+        overflowReaders_.fetch_add(1, std::memory_order_seq_cst);
+        return nullptr;
+    }
+
+    std::atomic<ReaderSlot*>& chunkRef = chunks_[index / ChunkSize];
+    ReaderSlot* chunk = chunkRef.load(std::memory_order_acquire);
+
+    if (!chunk) {
+        ReaderSlot* fresh = new ReaderSlot[ChunkSize];
+        for (size_t i = 0; i < ChunkSize; ++i) {
+            fresh[i].epoch.store(0, std::memory_order_relaxed);
+            fresh[i].depth = 0;
+        }
+
+        if (chunkRef.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+            chunk = fresh;
+        } else {
+            delete[] fresh; // another thread won the race
+        }
+    }
+
+    // The epoch must be visible to reclaim() before current_ is loaded,
+    // hence the sequentially consistent exchange (a plain store would need a fence).
+    ReaderSlot* slot = &chunk[index % ChunkSize];
+    if (slot->depth++ == 0)
+        slot->epoch.exchange(globalEpoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+
+    return slot;
+}
+
+void SharedProgram::leave(ReaderSlot* slot) const
+{
+    if (!slot) {
+        overflowReaders_.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+
+    if (--slot->depth == 0)
+        slot->epoch.store(0, std::memory_order_release);
+}
+
+SharedProgram::Guard::Guard(const SharedProgram& shared) :
+    shared_(shared),
+    slot_(shared.enter()),
+    program_(shared.current_.load(std::memory_order_seq_cst))
+{
+}
+
+SharedProgram::Guard::~Guard()
+{
+    shared_.leave(static_cast<ReaderSlot*>(slot_));
+}
+
+bool SharedProgram::run(const std::string& name, void* userdata) const
+{
+    Guard program(*this);
+
+    if (!program.get()) {
+        fprintf(stderr, "Cannot run handler %s: no program published.\n", name.c_str());
+        return false;
+    }
+
+    Handler* handler = program->findHandler(name);
+    if (!handler) {
+        fprintf(stderr, "Cannot run handler %s: no such handler.\n", name.c_str());
+        return false;
+    }
+
+    return handler->run(userdata);
+}
+// }}}
+// {{{ writers
+/**
+ * Atomically replaces the current program by \p program.
+ *
+ * The previous program is retired and deleted as soon as no reader can
+ * access it anymore (see reclaim()). Concurrent publishers are serialized.
+ *
+ * \retval true the program has been published.
+ * \retval false the program has not been frozen (see Program::freeze()).
+ */
+bool SharedProgram::publish(std::unique_ptr<Program> program)
+{
+    if (!program || !program->isFrozen()) {
+        fprintf(stderr, "Cannot publish program: not frozen.\n");
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> _l(retiredLock_);
+
+        Program* old = current_.exchange(program.release(), std::memory_order_seq_cst);
+
+        // readers entering from now on observe a later epoch
+        // and thus cannot see the old program anymore
+        uint64_t epoch = globalEpoch_.fetch_add(1, std::memory_order_seq_cst);
+
+        if (old) {
+            Retired retired = { old, epoch };
+            retired_.push_back(retired);
+        }
+    }
+
+    reclaim();
+    return true;
+}
+
+/**
+ * Oldest epoch any reader is currently in, or the maximum value if there
+ * are no readers.
+ */
+uint64_t SharedProgram::oldestReader() const
+{
+    if (overflowReaders_.load(std::memory_order_seq_cst) != 0)
+        return 0;
+
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+
+    for (const auto& chunkRef: chunks_) {
+        const ReaderSlot* chunk = chunkRef.load(std::memory_order_acquire);
+        if (!chunk)
+            continue;
+
+        for (size_t i = 0; i != ChunkSize; ++i) {
+            uint64_t epoch = chunk[i].epoch.load(std::memory_order_seq_cst);
+            if (epoch != 0 && epoch < oldest)
+                oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
+/**
+ * Deletes the retired programs no reader can access anymore.
+ *
+ * \return the number of programs deleted.
+ */
+size_t SharedProgram::reclaim()
+{
+    std::vector<Program*> garbage;
+
+    {
+        std::lock_guard<std::mutex> _l(retiredLock_);
+
+        if (retired_.empty())
+            return 0;
+
+        const uint64_t oldest = oldestReader();
+
+        for (size_t i = 0; i != retired_.size(); ) {
+            if (retired_[i].epoch < oldest) {
+                garbage.push_back(retired_[i].program);
+                retired_[i] = retired_.back();
+                retired_.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    for (Program* program: garbage)
+        delete program;
+
+    return garbage.size();
+}
+
+/**
+ * Waits until all retired programs have been deleted.
+ *
+ * Must not be called from within a Guard.
+ */
+void SharedProgram::synchronize()
+{
+    while (reclaim(), pending() != 0)
+        std::this_thread::yield();
+}
+
+size_t SharedProgram::pending() const
+{
+    std::lock_guard<std::mutex> _l(retiredLock_);
+    return retired_.size();
+}
+// }}}
+
+} // namespace FlowVM
@@ -0,0 +1,57 @@
+#include <flow/vm/Stats.h>
+#include <flow/vm/Instruction.h>
+#include <algorithm>
+#include <cinttypes>
+
+namespace FlowVM {
+
+void ExecutionCounters::add(const ExecutionCounters& other)
+{
+    runs += other.runs;
+    instructions += other.instructions;
+
+    for (size_t i = 0; i != OpcodeCount; ++i)
+        opcodes[i] += other.opcodes[i];
+}
+
+/**
+ * Prints the counters, hottest opcodes and handlers first.
+ */
+void ProgramStats::dump(FILE* out) const
+{
+    fprintf(out, "; Statistics (%" PRIu64 " runs, %" PRIu64 " instructions)\n",
+            total.runs, total.instructions);
+
+    std::vector<size_t> opcodes;
+    for (size_t i = 0; i != OpcodeCount; ++i)
+        if (total.opcodes[i])
+            opcodes.push_back(i);
+
+    std::stable_sort(opcodes.begin(), opcodes.end(), [&](size_t a, size_t b) {
+        return total.opcodes[a] > total.opcodes[b];
+    });
+
+    fprintf(out, "\n; Opcodes\n");
+    for (size_t opc: opcodes)
+        fprintf(out, "%-10s %12" PRIu64 "\n", mnemonic(static_cast<Opcode>(opc)), total.opcodes[opc]);
+
+    std::vector<const HandlerStats*> handlers;
+    for (const HandlerStats& hs: this->handlers)
+        handlers.push_back(&hs);
+
+    std::stable_sort(handlers.begin(), handlers.end(), [](const HandlerStats* a, const HandlerStats* b) {
+        return a->counters.instructions > b->counters.instructions;
+    });
+
+    fprintf(out, "\n; Handlers (runs, instructions)\n");
+    for (const HandlerStats* hs: handlers)
+        fprintf(out, "%-24s %10" PRIu64 " %12" PRIu64 "\n",
+                hs->name.c_str(), hs->counters.runs, hs->counters.instructions);
+
+    fprintf(out, "\n; Natives (invocations)\n");
+    for (const NativeStats& ns: natives)
+        fprintf(out, "%-8s %-24s %10" PRIu64 "\n",
+                ns.isHandler ? "handler" : "function", ns.signature.c_str(), ns.invocations);
+}
+
+} // namespace FlowVM
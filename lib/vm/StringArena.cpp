@@ -0,0 +1,114 @@
+#include <flow/vm/StringArena.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace FlowVM {
+
+StringArena::StringArena(size_t chunkSize) :
+    chunkSize_(chunkSize),
+    head_(nullptr),
+    current_(nullptr),
+    large_(nullptr),
+    pos_(nullptr),
+    end_(nullptr)
+{
+}
+
+StringArena::~StringArena()
+{
+    clear();
+}
+
+StringArena::Chunk* StringArena::newChunk(size_t size)
+{
+    Chunk* chunk = static_cast<Chunk*>(malloc(sizeof(Chunk) + size));
+    if (!chunk)
+        throw std::bad_alloc();
+
+    chunk->next = nullptr;
+    chunk->size = size;
+    return chunk;
+}
+
+void* StringArena::allocateSlow(size_t size)
+{
+    // oversized requests get a dedicated chunk, so they don't waste the current one
+    if (size > chunkSize_ / 2) {
+        Chunk* chunk = newChunk(size);
+        chunk->next = large_;
+        large_ = chunk;
+        return chunk->data();
+    }
+
+    if (current_ && current_->next) {
+        current_ = current_->next;
+    } else {
+        Chunk* chunk = newChunk(chunkSize_);
+        if (current_)
+            current_->next = chunk;
+        else
+            head_ = chunk;
+        current_ = chunk;
+    }
+
+    pos_ = current_->data() + size;
+    end_ = current_->data() + current_->size;
+
+    return current_->data();
+}
+
+String* StringArena::createString(const char* data, size_t size)
+{
+    char* buf;
+    String* s = allocateString(size, &buf);
+    memcpy(buf, data, size);
+    return s;
+}
+
+void StringArena::rewind()
+{
+    while (large_) {
+        Chunk* next = large_->next;
+        free(large_);
+        large_ = next;
+    }
+
+    current_ = head_;
+
+    if (current_) {
+        pos_ = current_->data();
+        end_ = current_->data() + current_->size;
+    } else {
+        pos_ = end_ = nullptr;
+    }
+}
+
+void StringArena::clear()
+{
+    rewind();
+
+    while (head_) {
+        Chunk* next = head_->next;
+        free(head_);
+        head_ = next;
+    }
+
+    current_ = nullptr;
+    pos_ = end_ = nullptr;
+}
+
+size_t StringArena::capacity() const
+{
+    size_t result = 0;
+
+    for (Chunk* chunk = head_; chunk; chunk = chunk->next)
+        result += chunk->size;
+
+    for (Chunk* chunk = large_; chunk; chunk = chunk->next)
+        result += chunk->size;
+
+    return result;
+}
+
+} // namespace FlowVM
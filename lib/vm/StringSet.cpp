@@ -0,0 +1,14 @@
+#include <flow/vm/StringSet.h>
+
+namespace FlowVM {
+
+StringSet::StringSet(const std::vector<std::string>& strings) :
+    strings_(strings),
+    table_(strings_.size(), [this](size_t i) -> const std::string& { return strings_[i]; }),
+    lengths_(0)
+{
+    for (const std::string& s: strings_)
+        lengths_ |= lengthBit(s.size());
+}
+
+} // namespace FlowVM
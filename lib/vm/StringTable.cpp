@@ -0,0 +1,34 @@
+#include <flow/vm/StringTable.h>
+#include <cstring>
+
+namespace FlowVM {
+
+const size_t StringTable::npos;
+
+/**
+ * Hashes 8 bytes per multiplication, as keys such as user agents
+ * easily are a hundred bytes long.
+ */
+uint32_t StringTable::hash(const char* data, size_t size)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    uint64_t h = size * k;
+
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+
+    if (size) {
+        uint64_t w = 0;
+        memcpy(&w, data, size);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+
+    return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+} // namespace FlowVM
@@ -0,0 +1,50 @@
+#include <flow/vm/SwitchTable.h>
+#include <algorithm>
+
+namespace FlowVM {
+
+// {{{ NumberSwitch
+NumberSwitch::NumberSwitch(const std::vector<Case>& cases, WideImmOperand defaultTarget) :
+    cases_(cases),
+    default_(defaultTarget),
+    min_(0),
+    table_()
+{
+    std::stable_sort(cases_.begin(), cases_.end(),
+        [](const Case& a, const Case& b) { return a.first < b.first; });
+
+    // the first of duplicate case values wins
+    cases_.erase(std::unique(cases_.begin(), cases_.end(),
+        [](const Case& a, const Case& b) { return a.first == b.first; }), cases_.end());
+
+    if (cases_.empty())
+        return;
+
+    min_ = cases_.front().first;
+    const uint64_t range = static_cast<uint64_t>(cases_.back().first) - static_cast<uint64_t>(min_) + 1;
+
+    // use a direct jump table if at least a third of its entries are actual cases
+    if (range != 0 && range <= 65536 && range <= 3 * cases_.size()) {
+        table_.assign(range, default_);
+        for (const Case& c: cases_) {
+            table_[static_cast<uint64_t>(c.first) - static_cast<uint64_t>(min_)] = c.second;
+        }
+    }
+}
+// }}}
+// {{{ StringSwitch
+StringSwitch::StringSwitch(const std::vector<Case>& cases, WideImmOperand defaultTarget) :
+    cases_(cases),
+    default_(defaultTarget),
+    table_(cases_.size(), [this](size_t i) -> const std::string& { return cases_[i].first; })
+{
+}
+
+WideImmOperand StringSwitch::lookup(const BufferRef& value) const
+{
+    size_t index = table_.find(value, [this](size_t i) -> const std::string& { return cases_[i].first; });
+    return index != StringTable::npos ? cases_[index].second : default_;
+}
+// }}}
+
+} // namespace FlowVM
@@ -0,0 +1,30 @@
+#include <flow/vm/TraceSink.h>
+#include <flow/vm/Instruction.h>
+#include <cstdio>
+
+namespace FlowVM {
+
+TraceSink::~TraceSink()
+{
+}
+
+void TraceSink::exit(Runner* cx, bool result, uint64_t ticks)
+{
+}
+
+FileTraceSink::FileTraceSink(FILE* out) :
+    out_(out)
+{
+}
+
+void FileTraceSink::instruction(Runner* cx, size_t ip, Instruction instr)
+{
+    disassemble(out_, instr, ip);
+}
+
+void FileTraceSink::exit(Runner* cx, bool result, uint64_t ticks)
+{
+    fprintf(out_, "exiting program. ran %lu instructions\n", ticks);
+}
+
+} // namespace FlowVM
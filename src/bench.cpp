@@ -0,0 +1,933 @@
+#include <flow/vm/Program.h>
+#include <flow/vm/Handler.h>
+#include <flow/vm/Runner.h>
+#include <flow/vm/RunnerPool.h>
+#include <flow/vm/Runtime.h>
+#include <flow/vm/TraceSink.h>
+#include <flow/vm/Instruction.h>
+#include <flow/vm/Optimizer.h>
+#include <flow/vm/ControlFlow.h>
+#include <flow/vm/RegExp.h>
+#include <flow/vm/SharedProgram.h>
+#include <flow/vm/BatchRunner.h>
+#include <flow/vm/MachineCode.h>
+#include <flow/vm/IPAddress.h>
+#include <flow/vm/CidrSet.h>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <regex>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+using namespace FlowVM;
+
+/*
+ * r1 = 0;
+ * r2 = 0;
+ *
+ * while (r1 < 1000) {
+ *     r1 = r1 + 1;
+ *     r2 = r2 + r1;
+ * }
+ */
+static const std::vector<Instruction> loopCode = {
+    makeInstructionImm(Opcode::IMOV, 0, 1000),  // r0 = 1000
+    makeInstructionImm(Opcode::IMOV, 1, 0),     // r1 = 0
+    makeInstructionImm(Opcode::IMOV, 2, 0),     // r2 = 0
+    makeInstructionImm(Opcode::IMOV, 4, 1),     // r4 = 1
+    makeInstructionImm(Opcode::JMP, 7),         // IP = condition
+    makeInstruction(Opcode::NADD, 1, 1, 4),     // r1 = r1 + 1
+    makeInstruction(Opcode::NADD, 2, 2, 1),     // r2 = r2 + r1
+    makeInstruction(Opcode::NCMPLT, 3, 1, 0),   // r3 = r1 < r0
+    makeInstructionImm(Opcode::CONDBR, 3, 5),   // if isTrue(r3) then IP = loopBody
+    makeInstructionImm(Opcode::EXIT, 1),
+};
+
+class BenchRuntime : public Runtime { // {{{
+public:
+    virtual bool import(const std::string& name, const std::string& path)
+    {
+        return true;
+    }
+}; // }}}
+
+/**
+ * Trace sink that swallows all events, measuring the cost of trace mode itself.
+ */
+class NullTraceSink : public TraceSink { // {{{
+public:
+    NullTraceSink() : count_(0) {}
+
+    void instruction(Runner* cx, size_t ip, Instruction instr) override { ++count_; }
+
+    uint64_t count() const { return count_; }
+
+private:
+    uint64_t count_;
+}; // }}}
+
+struct BenchResult {
+    std::string name;
+    size_t iterations;
+    double nsPerIteration;
+};
+
+static std::vector<BenchResult> results;
+static const char* filter = nullptr;    //!< only run benchmarks whose name contains this
+static bool jsonOutput = false;         //!< print results as JSON once all ran
+
+static bool selected(const char* name)
+{
+    return !filter || strstr(name, filter);
+}
+
+template<typename Fn>
+static void benchmark(const char* name, size_t iterations, Fn fn)
+{
+    if (!selected(name))
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+        fn();
+
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    BenchResult result = { name, iterations, ns / iterations };
+    results.push_back(result);
+
+    if (!jsonOutput)
+        printf("%-40s %10zu iterations %12.1f ns/iter\n", name, iterations, ns / iterations);
+}
+
+/**
+ * Wraps \p body into a loop executing it \p count times.
+ *
+ * Registers r0 to r3 hold the loop state; \p setup runs once before the
+ * loop and, like \p body, must only use registers from r4 on.
+ */
+static std::vector<Instruction> makeLoop(const std::vector<Instruction>& setup,
+                                         const std::vector<Instruction>& body,
+                                         size_t count = 1000)
+{
+    std::vector<Instruction> code = {
+        makeInstructionImm(Opcode::IMOV, 0, count), // r0 = count
+        makeInstructionImm(Opcode::IMOV, 1, 0),     // r1 = 0
+        makeInstructionImm(Opcode::IMOV, 2, 1),     // r2 = 1
+    };
+
+    code.insert(code.end(), setup.begin(), setup.end());
+
+    size_t loopBody = code.size();
+    code.insert(code.end(), body.begin(), body.end());
+
+    code.push_back(makeInstruction(Opcode::NADD, 1, 1, 2));     // r1 = r1 + 1
+    code.push_back(makeInstruction(Opcode::NCMPLT, 3, 1, 0));   // r3 = r1 < r0
+    code.push_back(makeInstructionImm(Opcode::CONDBR, 3, loopBody));
+    code.push_back(makeInstructionImm(Opcode::EXIT, 1));
+
+    return code;
+}
+
+static void benchTraceModes(Program& program)
+{
+    Handler* handler = program.createHandler("loop", loopCode);
+    NullTraceSink sink;
+    const size_t n = 10000;
+
+    handler->setEngine(ExecutionEngine::DirectThreaded);
+    benchmark("run/release/direct-threaded", n, [&]() { handler->run(); });
+
+    handler->setEngine(ExecutionEngine::TokenThreaded);
+    benchmark("run/release/token-threaded", n, [&]() { handler->run(); });
+
+    handler->setTraceSink(&sink);
+    benchmark("run/trace/null-sink", n, [&]() { handler->run(); });
+    handler->setTraceSink(nullptr);
+}
+
+static void benchRunnerAllocation(Program& program)
+{
+    Handler* handler = program.createHandler("alloc", loopCode);
+    RunnerPool pool(handler);
+    const size_t n = 1000000;
+
+    benchmark("runner/create", n, [&]() {
+        handler->createRunner();
+    });
+
+    benchmark("runner/pool-acquire-release", n, [&]() {
+        pool.release(pool.acquire());
+    });
+}
+
+/**
+ * Numerical ops, 1000 loop iterations per run.
+ */
+static void benchNumberOps(Program& program)
+{
+    Handler* arith = program.createHandler("number.arith", makeLoop({
+        makeInstructionImm(Opcode::IMOV, 4, 7),     // r4 = 7
+    }, {
+        makeInstruction(Opcode::NMUL, 5, 1, 4),     // r5 = r1 * r4
+        makeInstruction(Opcode::NREM, 6, 5, 4),     // r6 = r5 % r4
+        makeInstruction(Opcode::NSHL, 7, 1, 2),     // r7 = r1 << 1
+        makeInstruction(Opcode::NSUB, 8, 7, 6),     // r8 = r7 - r6
+    }));
+
+    Handler* compare = program.createHandler("number.compare", makeLoop({
+        makeInstructionImm(Opcode::IMOV, 4, 500),   // r4 = 500
+    }, {
+        makeInstruction(Opcode::NCMPGT, 5, 1, 4),   // r5 = r1 > r4
+        makeInstructionImm(Opcode::CONDBR, 5, 6),   // if (r5) continue
+    }));
+
+    const size_t n = 10000;
+
+    benchmark("opcode/number/arith", n, [&]() { arith->run(); });
+    benchmark("opcode/number/compare-branch", n, [&]() { compare->run(); });
+}
+
+/**
+ * String ops, 1000 loop iterations per run.
+ */
+static void benchStringOps(Program& program)
+{
+    const ImmOperand host = program.addString("www.example.com");
+    const ImmOperand other = program.addString("www.example.org");
+    const ImmOperand domain = program.addString("example");
+    const ImmOperand prefix = program.addString("www.");
+    const ImmOperand suffix = program.addString(".com");
+
+    const std::vector<Instruction> setup = {
+        makeInstructionImm(Opcode::SCONST, 4, host),    // r4 = "www.example.com"
+        makeInstructionImm(Opcode::SCONST, 5, other),   // r5 = "www.example.org"
+        makeInstructionImm(Opcode::SCONST, 6, domain),  // r6 = "example"
+        makeInstructionImm(Opcode::SCONST, 7, prefix),  // r7 = "www."
+        makeInstructionImm(Opcode::SCONST, 8, suffix),  // r8 = ".com"
+        makeInstructionImm(Opcode::IMOV, 9, 4),         // r9 = 4 (offset)
+        makeInstructionImm(Opcode::IMOV, 10, 7),        // r10 = 7 (count)
+    };
+
+    struct { const char* name; Instruction instr; } ops[] = {
+        { "opcode/string/sadd",      makeInstruction(Opcode::SADD, 11, 4, 8) },
+        { "opcode/string/ssubstr",   makeInstruction(Opcode::SSUBSTR, 11, 4, 9) },
+        { "opcode/string/scontains", makeInstruction(Opcode::SCONTAINS, 11, 6, 4) },
+        { "opcode/string/scmpeq",    makeInstruction(Opcode::SCMPEQ, 11, 4, 5) },
+        { "opcode/string/scmplt",    makeInstruction(Opcode::SCMPLT, 11, 4, 5) },
+        { "opcode/string/scmpbeg",   makeInstruction(Opcode::SCMPBEG, 11, 4, 7) },
+        { "opcode/string/scmpend",   makeInstruction(Opcode::SCMPEND, 11, 4, 8) },
+        { "opcode/string/slen",      makeInstruction(Opcode::SLEN, 11, 4) },
+    };
+
+    const size_t n = 10000;
+
+    for (const auto& op: ops) {
+        Handler* handler = program.createHandler(op.name, makeLoop(setup, {op.instr}));
+        benchmark(op.name, n, [&]() { handler->run(); });
+    }
+}
+
+/**
+ * String kernels on typical header and URL lengths, against std::string.
+ */
+static void benchStringKernels()
+{
+    const std::string host = "static.cdn.example.com";
+    const std::string path = "/api/v2/customers/4711/orders/2024-05/invoices/latest.json";
+    const std::string agent = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+                              "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36 Mobile";
+    std::string cookie;
+    for (int i = 0; cookie.size() < 400; ++i)
+        cookie += "_pref" + std::to_string(i) + "=aGVsbG8gd29ybGQ; ";
+    cookie += "session=8c1f0e";
+
+    const std::string hostCopy = host;
+    const std::string agentCopy = agent;
+
+    struct { const char* name; const std::string& subject; std::string needle; } finds[] = {
+        { "string/find/host-22", host, "example" },
+        { "string/find/agent-134", agent, "Mobile" },
+        { "string/find/cookie-400", cookie, "session=" },
+    };
+
+    const size_t n = 1000000;
+    volatile size_t sink = 0;
+
+    benchmark("string/eq/host-22", n, [&]() { sink += BufferRef(host) == BufferRef(hostCopy); });
+    benchmark("string/eq/host-22/std", n, [&]() { sink += host == hostCopy; });
+    benchmark("string/eq/agent-134", n, [&]() { sink += BufferRef(agent) == BufferRef(agentCopy); });
+    benchmark("string/eq/agent-134/std", n, [&]() { sink += agent == agentCopy; });
+    benchmark("string/prefix/path-58", n, [&]() { sink += BufferRef(path).begins(BufferRef("/api/v2/", 8)); });
+    benchmark("string/suffix/path-58", n, [&]() { sink += BufferRef(path).ends(BufferRef(".json", 5)); });
+
+    for (const auto& f: finds) {
+        std::string stdName = std::string(f.name) + "/std";
+        benchmark(f.name, n, [&]() { sink += BufferRef(f.subject).find(BufferRef(f.needle)); });
+        benchmark(stdName.c_str(), n, [&]() { sink += f.subject.find(f.needle); });
+    }
+}
+
+/**
+ * Allow/deny list lookups over 50000 networks: the CidrSet trie versus
+ * checking each network in turn.
+ */
+static void benchCidrSet()
+{
+    std::vector<Cidr> networks;
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    auto random = [&seed]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return seed; };
+
+    for (size_t i = 0; i != 45000; ++i)
+        networks.push_back(Cidr(IPAddress::fromV4(random()), 16 + random() % 13));
+    for (size_t i = 0; i != 5000; ++i)
+        networks.push_back(Cidr(IPAddress(0x2001000000000000ull | (random() >> 16), 0), 32 + random() % 33));
+
+    CidrSet set(networks);
+
+    std::vector<IPAddress> clients;
+    for (size_t i = 0; i != 1024; ++i)
+        clients.push_back(i % 8 ? IPAddress::fromV4(random()) : IPAddress(0x2001000000000000ull | (random() >> 16), random()));
+
+    volatile size_t sink = 0;
+    size_t k = 0;
+
+    benchmark("ip/cidrset/50k/trie", 1000000, [&]() { sink += set.contains(clients[k++ & 1023]); });
+    benchmark("ip/cidrset/50k/linear", 1000, [&]() {
+        const IPAddress& ip = clients[k++ & 1023];
+        for (const Cidr& network: networks) {
+            if (network.contains(ip)) {
+                ++sink;
+                break;
+            }
+        }
+    });
+}
+
+static Number benchAdd(Number a, Number b)
+{
+    return a + b;
+}
+
+static bool benchCheck(Number value)
+{
+    return false;
+}
+
+static Number pendingSum = 0;
+
+static Number benchAddAsync(Runner* cx, Number a, Number b)
+{
+    if (cx->suspend())
+        pendingSum = a + b;
+
+    return a + b;
+}
+
+/**
+ * CALL and HANDLER round trips into the host, 1000 per run.
+ */
+static void benchNativeRoundTrips()
+{
+    BenchRuntime runtime;
+    runtime.registerFunction("add", Type::Number).bind(&benchAdd);
+    runtime.registerHandler("check").bind(&benchCheck);
+    runtime.registerFunction("addAsync", Type::Number).bind(&benchAddAsync);
+
+    Program program({}, {}, {}, {}, {"check(I)B"}, {"add(II)I", "addAsync(II)I"});
+    if (!program.link(&runtime))
+        return;
+
+    Handler* call = program.createHandler("call", makeLoop({
+        makeInstructionImm(Opcode::IMOV, 4, 0),     // r4 = function ID
+        makeInstructionImm(Opcode::IMOV, 5, 3),     // r5 = argc
+        makeInstructionImm(Opcode::IMOV, 8, 2),     // argv[2] = 2
+    }, {
+        makeInstruction(Opcode::MOV, 7, 1),         // argv[1] = r1
+        makeInstruction(Opcode::CALL, 4, 5, 6),     // argv[0] = add(argv[1], argv[2])
+    }));
+
+    Handler* handler = program.createHandler("handler", makeLoop({
+        makeInstructionImm(Opcode::IMOV, 4, 0),     // r4 = handler ID
+        makeInstructionImm(Opcode::IMOV, 5, 2),     // r5 = argc
+    }, {
+        makeInstruction(Opcode::MOV, 7, 1),         // argv[1] = r1
+        makeInstruction(Opcode::HANDLER, 4, 5, 6),  // if (check(argv[1])) EXIT 1
+    }));
+
+    Handler* async = program.createHandler("async", makeLoop({
+        makeInstructionImm(Opcode::IMOV, 4, 1),     // r4 = function ID
+        makeInstructionImm(Opcode::IMOV, 5, 3),     // r5 = argc
+        makeInstructionImm(Opcode::IMOV, 8, 2),     // argv[2] = 2
+    }, {
+        makeInstruction(Opcode::MOV, 7, 1),         // argv[1] = r1
+        makeInstruction(Opcode::CALL, 4, 5, 6),     // argv[0] = addAsync(argv[1], argv[2])
+    }));
+
+    const size_t n = 10000;
+
+    benchmark("opcode/native/call", n, [&]() { call->run(); });
+    benchmark("opcode/native/handler", n, [&]() { handler->run(); });
+
+    // suspends on every CALL and gets resumed right away
+    auto runner = async->createRunner();
+    benchmark("opcode/native/call-suspended", n, [&]() {
+        runner->start(nullptr);
+        while (runner->isSuspended())
+            runner->resume(pendingSum);
+    });
+}
+
+/**
+ * The same loop with and without peephole-optimized superinstructions.
+ */
+static void benchSuperinstructions(Program& program)
+{
+    Handler* fused = program.createHandler("fused", loopCode);
+    Handler* plain = program.createHandler("plain");
+    plain->setCodeRef(loopCode);
+    const size_t n = 10000;
+
+    benchmark("run/peephole/plain", n, [&]() { plain->run(); });
+    benchmark("run/peephole/superinstructions", n, [&]() { fused->run(); });
+}
+
+/**
+ * A loop whose rarely taken branch is laid out inline with the hot path,
+ * before and after profile-guided block relayout.
+ */
+static void benchBlockLayout(Program& program)
+{
+    std::vector<Instruction> code = {
+        makeInstructionImm(Opcode::IMOV, 0, 1000),  // r0 = 1000
+        makeInstructionImm(Opcode::IMOV, 1, 0),     // r1 = 0
+        makeInstructionImm(Opcode::IMOV, 2, 1),     // r2 = 1
+        makeInstructionImm(Opcode::IMOV, 4, 64),    // r4 = 64
+        makeInstructionImm(Opcode::IMOV, 5, 63),    // r5 = 63
+        makeInstructionImm(Opcode::IMOV, 6, 0),     // r6 = 0
+        makeInstruction(Opcode::NREM, 7, 1, 4),     // r7 = r1 % r4
+        makeInstruction(Opcode::NCMPNE, 8, 7, 5),   // r8 = r7 != r5
+        makeInstructionImm(Opcode::CONDBR, 8, 18),  // if (r8) goto hot
+    };
+
+    for (int i = 0; i < 8; ++i)                     // cold: r6 = r6 + r7 (8x)
+        code.push_back(makeInstruction(Opcode::NADD, 6, 6, 7));
+
+    code.push_back(makeInstructionImm(Opcode::JMP, 19));
+    code.push_back(makeInstruction(Opcode::NADD, 6, 6, 2));     // hot: r6 = r6 + 1
+    code.push_back(makeInstruction(Opcode::NADD, 1, 1, 2));     // r1 = r1 + 1
+    code.push_back(makeInstruction(Opcode::NCMPLT, 3, 1, 0));   // r3 = r1 < r0
+    code.push_back(makeInstructionImm(Opcode::CONDBR, 3, 6));
+    code.push_back(makeInstructionImm(Opcode::EXIT, 1));
+
+    Handler* emitted = program.createHandler("layout.emitted", code);
+    Handler* relaid = program.createHandler("layout.relaid", code);
+
+    ProfileSink sink(relaid);
+    relaid->setTraceSink(&sink);
+    relaid->run();
+    relaid->setTraceSink(nullptr);
+    relaid->relayout(sink.profile());
+
+    const size_t n = 10000;
+
+    benchmark("layout/cold-inline/emitted", n, [&]() { emitted->run(); });
+    benchmark("layout/cold-inline/relaid-out", n, [&]() { relaid->run(); });
+}
+
+/**
+ * A handler touching r0 and r200 only, with and without register allocation.
+ */
+static void benchRegisterAllocation(Program& program)
+{
+    const std::vector<Instruction> sparseCode = {
+        makeInstructionImm(Opcode::IMOV, 0, 1),     // r0 = 1
+        makeInstructionImm(Opcode::IMOV, 200, 2),   // r200 = 2
+        makeInstruction(Opcode::NADD, 0, 0, 200),   // r0 = r0 + r200
+        makeInstructionImm(Opcode::CONDBR, 0, 5),   // if isTrue(r0) then IP = exit
+        makeInstructionImm(Opcode::EXIT, 0),
+        makeInstructionImm(Opcode::EXIT, 1),
+    };
+
+    // level 2 would fold this code away entirely, so only allocate registers
+    std::vector<Instruction> packedCode = sparseCode;
+    allocateRegisters(packedCode, &program);
+
+    Handler* plain = program.createHandler("sparse", sparseCode);
+    Handler* packed = program.createHandler("packed", packedCode);
+
+    const size_t n = 1000000;
+
+    if (!jsonOutput && selected("regalloc/register-count"))
+        printf("%-40s %zu vs %zu registers\n", "regalloc/register-count", plain->registerCount(), packed->registerCount());
+    benchmark("regalloc/run/sparse", n, [&]() { plain->run(); });
+    benchmark("regalloc/run/packed", n, [&]() { packed->run(); });
+    benchmark("regalloc/create/sparse", n, [&]() { plain->createRunner(); });
+    benchmark("regalloc/create/packed", n, [&]() { packed->createRunner(); });
+}
+
+/**
+ * Linking a program calling 200 natives against a runtime exposing 500.
+ */
+static void benchLink()
+{
+    BenchRuntime runtime;
+    std::vector<std::string> signatures;
+
+    for (size_t i = 0; i < 500; ++i) {
+        runtime.registerFunction("native" + std::to_string(i), Type::Number)
+               .signature(Type::String, Type::Number)
+               .bind([](int argc, Value* argv, Runner* cx) {});
+    }
+
+    for (size_t i = 0; i < 500; i += 5)
+        signatures.push_back("native" + std::to_string(i) + "(SI)I");
+
+    for (size_t i = 0; i < 500; i += 5)
+        signatures.push_back("native" + std::to_string(i + 2) + "(SI)I");
+
+    Program program({}, {}, {}, {}, {}, signatures);
+
+    benchmark("link/200-of-500-natives", 10000, [&]() { program.link(&runtime); });
+}
+
+/**
+ * Resolving the entry handler of each of 10k vhosts by name, as on a config reload.
+ */
+static void benchHandlerLookup()
+{
+    const size_t count = 10000;
+    Program program({}, {}, {}, {}, {}, {});
+    std::vector<std::string> names;
+
+    for (size_t i = 0; i < count; ++i) {
+        names.push_back("vhost" + std::to_string(i) + ".main");
+        program.createHandler(names.back(), {makeInstructionImm(Opcode::EXIT, 0)});
+    }
+
+    size_t found = 0;
+    benchmark("handler/find-10k-by-name", 100, [&]() {
+        for (const std::string& name: names)
+            found += program.findHandler(name) != nullptr;
+    });
+}
+
+/**
+ * The dispatch loop for 64 requests, one run each versus one batch run.
+ */
+static void benchBatch(Program& program)
+{
+    Handler* handler = program.createHandler("batch", loopCode);
+    auto runner = handler->createRunner();
+    auto batch = BatchRunner::create(handler, 64);
+
+    benchmark("batch/loop/64-runs", 100, [&]() {
+        for (size_t i = 0; i < 64; ++i)
+            runner->run();
+    });
+
+    benchmark("batch/loop/64-lanes", 100, [&]() { batch->run(); });
+}
+
+/**
+ * The interpreter versus machine code, 1000 loop iterations per run.
+ */
+static void benchMachineCode(Program& program)
+{
+    if (!MachineCode::isAvailable())
+        return;
+
+    const ImmOperand host = program.addString("www.example.com");
+    const ImmOperand other = program.addString("www.example.org");
+
+    struct { const char* name; std::vector<Instruction> code; } programs[] = {
+        { "loop", loopCode },
+        { "number-arith", makeLoop({
+            makeInstructionImm(Opcode::IMOV, 4, 7),     // r4 = 7
+        }, {
+            makeInstruction(Opcode::NMUL, 5, 1, 4),     // r5 = r1 * r4
+            makeInstruction(Opcode::NREM, 6, 5, 4),     // r6 = r5 % r4
+            makeInstruction(Opcode::NSHL, 7, 1, 2),     // r7 = r1 << 1
+            makeInstruction(Opcode::NSUB, 8, 7, 6),     // r8 = r7 - r6
+        }) },
+        { "string-compare", makeLoop({
+            makeInstructionImm(Opcode::SCONST, 4, host),    // r4 = "www.example.com"
+            makeInstructionImm(Opcode::SCONST, 5, other),   // r5 = "www.example.org"
+        }, {
+            makeInstruction(Opcode::SCMPEQ, 6, 4, 5),       // r6 = r4 == r5
+            makeInstruction(Opcode::SCMPLT, 7, 4, 5),       // r7 = r4 < r5
+        }) },
+    };
+
+    const size_t n = 10000;
+
+    for (const auto& p: programs) {
+        Handler* handler = program.createHandler(p.name, p.code);
+        std::string name = std::string("jit/") + p.name;
+
+        handler->setEngine(ExecutionEngine::DirectThreaded);
+        benchmark((name + "/direct-threaded").c_str(), n, [&]() { handler->run(); });
+
+        handler->setEngine(ExecutionEngine::Compiled);
+        benchmark((name + "/compiled").c_str(), n, [&]() { handler->run(); });
+    }
+}
+
+static std::unique_ptr<Program> makeFrozenProgram(Runtime* runtime)
+{
+    std::unique_ptr<Program> program(new Program({}, {}, {}, {}, {}, {}));
+    program->createHandler("main", {makeInstructionImm(Opcode::EXIT, 1)});
+
+    if (!program->link(runtime) || !program->freeze())
+        return nullptr;
+
+    return program;
+}
+
+/**
+ * Request path overhead of a SharedProgram, and runs racing with reloads.
+ */
+static void benchSharedProgram()
+{
+    BenchRuntime runtime;
+    SharedProgram shared(makeFrozenProgram(&runtime));
+    std::unique_ptr<Program> plain = makeFrozenProgram(&runtime);
+    Handler* direct = plain->findHandler("main");
+
+    benchmark("shared/guard", 10000000, [&]() { SharedProgram::Guard program(shared); });
+    benchmark("shared/run/direct", 1000000, [&]() { direct->run(); });
+    benchmark("shared/run/guarded", 1000000, [&]() { shared.run("main"); });
+    benchmark("shared/publish", 10000, [&]() { shared.publish(makeFrozenProgram(&runtime)); });
+
+    if (!selected("shared/run/during-reloads"))
+        return;
+
+    std::atomic<bool> done(false);
+    std::thread reloader([&]() {
+        while (!done.load(std::memory_order_relaxed)) {
+            shared.publish(makeFrozenProgram(&runtime));
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    });
+
+    benchmark("shared/run/during-reloads", 1000000, [&]() { shared.run("main"); });
+
+    done = true;
+    reloader.join();
+}
+
+static Number addNumbers(Number a, Number b)
+{
+    return a + b;
+}
+
+/**
+ * Invoking a native through a type-erased std::function versus a typed binding.
+ */
+static void benchNativeCall()
+{
+    BenchRuntime runtime;
+    Number bias = 0;
+
+    Runtime::Callback& erased = runtime.registerFunction("erasedAdd", Type::Number)
+        .signature(Type::Number, Type::Number)
+        .bind([&bias](int argc, Value* argv, Runner* cx) {
+            argv[0] = (Value) ((Number) argv[1] + (Number) argv[2] + bias);
+        });
+
+    Runtime::Callback& typed = runtime.registerFunction("typedAdd", Type::Number)
+        .bind(&addNumbers);
+
+    Value argv[3] = { 0, 1, 2 };
+    const size_t n = 10000000;
+
+    benchmark("native/call/std-function", n, [&]() { erased.invoke(2, argv, nullptr); argv[1] = argv[0]; });
+    benchmark("native/call/typed", n, [&]() { typed.invoke(2, argv, nullptr); argv[1] = argv[0]; });
+}
+
+/**
+ * A request header as seen by a host, owning its bytes for the whole run.
+ */
+struct BenchHeader { // {{{
+    std::string storage;
+    String value;
+}; // }}}
+
+static BenchHeader benchHeader;
+
+static std::string headerCopied() { return benchHeader.storage; }
+static String headerReferenced() { return benchHeader.value; }
+static const String* headerBorrowed() { return &benchHeader.value; }
+
+/**
+ * Passing a 1 KiB host string into a run: copied into the Runner, referenced
+ * via a String allocated in the Runner, or borrowed from the host as is.
+ */
+static void benchBorrowedStrings()
+{
+    BenchRuntime runtime;
+    Runtime::Callback& copied = runtime.registerFunction("copied", Type::String).bind(&headerCopied);
+    Runtime::Callback& referenced = runtime.registerFunction("referenced", Type::String).bind(&headerReferenced);
+    Runtime::Callback& borrowed = runtime.registerFunction("borrowed", Type::String).bind(&headerBorrowed);
+
+    benchHeader.storage.assign(1024, 'x');
+    benchHeader.value = String(benchHeader.storage.data(), benchHeader.storage.size());
+
+    Program program;
+    Handler* handler = program.createHandler("main", { makeInstructionImm(Opcode::EXIT, 1) });
+    auto runner = handler->createRunner();
+
+    Value argv[1] = { 0 };
+    const size_t n = 1000000;
+
+    benchmark("native/string/copied", n, [&]() { copied.invoke(0, argv, runner.get()); runner->strings().rewind(); });
+    benchmark("native/string/referenced", n, [&]() { referenced.invoke(0, argv, runner.get()); runner->strings().rewind(); });
+    benchmark("native/string/borrowed", n, [&]() { borrowed.invoke(0, argv, runner.get()); runner->strings().rewind(); });
+}
+
+/**
+ * Dispatch over N virtual host names: SSWITCH versus a SCMPEQ/CONDBR chain.
+ */
+static void benchMultiBranch()
+{
+    const size_t count = 500;
+    std::vector<std::string> hosts;
+
+    for (size_t i = 0; i < count; ++i)
+        hosts.push_back("www.vhost" + std::to_string(i) + ".example.com");
+
+    Program program({}, hosts, {}, {}, {}, {});
+    BenchRuntime runtime;
+    program.link(&runtime);
+
+    std::vector<StringSwitch::Case> cases;
+    std::vector<Instruction> chain;
+    std::vector<Instruction> table;
+
+    // r0 = subject (last vhost, worst case for the chain)
+    chain.push_back(makeInstructionImm(Opcode::SCONST, 0, count - 1));
+    for (size_t i = 0; i < count; ++i) {
+        chain.push_back(makeInstructionImm(Opcode::SCONST, 1, i));
+        chain.push_back(makeInstruction(Opcode::SCMPEQ, 2, 0, 1));
+        chain.push_back(makeInstructionImm(Opcode::CONDBR, 2, 3 * count + 2));
+    }
+    chain.push_back(makeInstructionImm(Opcode::EXIT, 0));
+    chain.push_back(makeInstructionImm(Opcode::EXIT, 1));
+
+    for (size_t i = 0; i < count; ++i)
+        cases.push_back(std::make_pair(hosts[i], 3));
+
+    table.push_back(makeInstructionImm(Opcode::SCONST, 0, count - 1));
+    table.push_back(makeInstructionImm(Opcode::SSWITCH, 0, program.addStringSwitch(cases, 2)));
+    table.push_back(makeInstructionImm(Opcode::EXIT, 0));
+    table.push_back(makeInstructionImm(Opcode::EXIT, 1));
+
+    Handler* chained = program.createHandler("chain", chain);
+    Handler* switched = program.createHandler("switch", table);
+
+    benchmark("branch/vhost-500/scmpeq-chain", 2000, [&]() { chained->run(); });
+    benchmark("branch/vhost-500/sswitch", 2000, [&]() { switched->run(); });
+
+    if (MachineCode::isAvailable()) {
+        chained->setEngine(ExecutionEngine::Compiled);
+        benchmark("branch/vhost-500/scmpeq-chain/compiled", 2000, [&]() { chained->run(); });
+    }
+}
+
+static String benchUserAgent;
+
+static const String* userAgent()
+{
+    return &benchUserAgent;
+}
+
+/**
+ * A user agent checked against a 300 entry blocklist it is not part of:
+ * SCMPEQ/CONDBR chain versus SINSET.
+ */
+static void benchStringSet()
+{
+    const size_t count = 300;
+    std::vector<std::string> agents;
+
+    for (size_t i = 0; i < count; ++i)
+        agents.push_back("Mozilla/5.0 (compatible; crawler" + std::to_string(i) + "/2.1; +http://crawler.example.com/bot.html)");
+
+    const std::string agent = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+                              "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36";
+    benchUserAgent = String(agent.data(), agent.size());
+
+    BenchRuntime runtime;
+    runtime.registerFunction("userAgent", Type::String).bind(&userAgent);
+
+    Program program({}, agents, {}, {}, {}, {"userAgent()S"});
+    if (!program.link(&runtime))
+        return;
+
+    std::vector<Instruction> chain;
+    std::vector<Instruction> set;
+
+    // r2 = userAgent()
+    const Instruction prologue[] = {
+        makeInstructionImm(Opcode::IMOV, 0, 0),
+        makeInstructionImm(Opcode::IMOV, 1, 1),
+        makeInstruction(Opcode::CALL, 0, 1, 2),
+    };
+
+    chain.assign(prologue, prologue + 3);
+    for (size_t i = 0; i < count; ++i) {
+        chain.push_back(makeInstructionImm(Opcode::SCONST, 3, i));
+        chain.push_back(makeInstruction(Opcode::SCMPEQ, 4, 2, 3));
+        chain.push_back(makeInstructionImm(Opcode::CONDBR, 4, 3 * count + 4));
+    }
+    chain.push_back(makeInstructionImm(Opcode::EXIT, 0));
+    chain.push_back(makeInstructionImm(Opcode::EXIT, 1));
+
+    set.assign(prologue, prologue + 3);
+    set.push_back(makeInstructionImm(Opcode::IMOV, 3, program.addStringSet(agents)));
+    set.push_back(makeInstruction(Opcode::SINSET, 4, 2, 3));
+    set.push_back(makeInstructionImm(Opcode::CONDBR, 4, 7));
+    set.push_back(makeInstructionImm(Opcode::EXIT, 0));
+    set.push_back(makeInstructionImm(Opcode::EXIT, 1));
+
+    Handler* chained = program.createHandler("chain", chain);
+    Handler* hashed = program.createHandler("set", set);
+
+    benchmark("string/set/agent-300/scmpeq-chain", 10000, [&]() { chained->run(); });
+    benchmark("string/set/agent-300/sinset", 10000, [&]() { hashed->run(); });
+}
+
+static void benchRegExp()
+{
+    static const char* patterns[] = {
+        "^/api/v[0-9]+/users/([0-9]+)/profile$",
+        "\\.(php|cgi|pl)$",
+        "^/static/.*\\.(css|js|png|jpe?g)$",
+        "^/([a-z]+)/([a-z0-9_-]+)\\?(.*)$",
+    };
+
+    static const char* subjects[] = {
+        "/api/v2/users/1234567/profile",
+        "/index.php",
+        "/static/assets/vendor/bootstrap/dist/css/bootstrap.min.css",
+        "/blog/2014-11-02-flow-vm?utm_source=feed&utm_medium=rss",
+        "/images/logo.png",
+        "/api/v1/orders/42",
+    };
+
+    const size_t n = 20000;
+    char name[128];
+
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(*patterns); ++i) {
+        RegExp re(patterns[i]);
+        std::regex stdre(patterns[i]);
+        std::vector<BufferRef> groups;
+
+        snprintf(name, sizeof(name), "regex/%zu/flow-%s", i, re.hasDFA() ? "dfa" : "backtrack");
+        benchmark(name, n, [&]() {
+            for (const char* subject: subjects)
+                re.match(BufferRef(subject, strlen(subject)));
+        });
+
+        snprintf(name, sizeof(name), "regex/%zu/flow-captures", i);
+        benchmark(name, n, [&]() {
+            for (const char* subject: subjects)
+                re.match(BufferRef(subject, strlen(subject)), &groups);
+        });
+
+        snprintf(name, sizeof(name), "regex/%zu/std-regex", i);
+        benchmark(name, n, [&]() {
+            std::cmatch m;
+            for (const char* subject: subjects)
+                std::regex_search(subject, m, stdre);
+        });
+    }
+
+    // hostile input: exponential for naive backtracking, linear here
+    RegExp evil("^(a+)+$");
+    std::string subject(4096, 'a');
+    subject += 'b';
+
+    benchmark("regex/hostile-4k/flow", 1000, [&]() {
+        evil.match(BufferRef(subject));
+    });
+
+    // capture groups of a 64 KB subject, beyond the backtracker's visited set
+    RegExp path("^/(\\w+)/(.*)\\.(png|jpg)$");
+    std::string longPath = "/static/" + std::string(65536, 'x') + ".png";
+    std::vector<BufferRef> groups;
+
+    benchmark("regex/captures-64k/flow", 100, [&]() {
+        path.match(BufferRef(longPath), &groups);
+    });
+}
+
+static void printJSON()
+{
+    printf("{\n  \"benchmarks\": [");
+
+    for (size_t i = 0, e = results.size(); i != e; ++i) {
+        printf("%s\n    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_iter\": %.1f}",
+               i ? "," : "", results[i].name.c_str(), results[i].iterations, results[i].nsPerIteration);
+    }
+
+    printf("\n  ]\n}\n");
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s [--json] [--filter SUBSTRING]\n", program);
+}
+
+int main(int argc, const char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            jsonOutput = true;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Program program({}, {}, {}, {}, {}, {});
+    BenchRuntime runtime;
+
+    if (!program.link(&runtime))
+        return 1;
+
+    benchTraceModes(program);
+    benchNumberOps(program);
+    benchStringOps(program);
+    benchStringKernels();
+    benchCidrSet();
+    benchNativeRoundTrips();
+    benchRunnerAllocation(program);
+    benchSuperinstructions(program);
+    benchRegisterAllocation(program);
+    benchBlockLayout(program);
+    benchBatch(program);
+    benchMachineCode(program);
+    benchLink();
+    benchNativeCall();
+    benchBorrowedStrings();
+    benchHandlerLookup();
+    benchSharedProgram();
+    benchMultiBranch();
+    benchStringSet();
+    benchRegExp();
+
+    if (jsonOutput)
+        printJSON();
+
+    return 0;
+}
@@ -1,13 +1,20 @@
 #include <flow/vm/Program.h>
+#include <flow/vm/RegExp.h>
 #include <flow/vm/Runner.h>
+#include <flow/vm/BatchRunner.h>
+#include <flow/vm/MachineCode.h>
 #include <flow/vm/Runtime.h>
 #include <flow/vm/Signature.h>
 #include <flow/vm/Instruction.h>
+#include <flow/vm/TraceSink.h>
 #include <initializer_list>
+#include <algorithm>
 #include <vector>
+#include <string>
 #include <utility>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <memory>
 #include <new>
@@ -155,26 +162,337 @@ static const std::vector<FlowVM::Instruction> code6 = {
     makeInstructionImm(FlowVM::Opcode::EXIT, 0),
 };
 
+/* regex test
+ *
+ * r3 = "Hello" + " " + "World"
+ * r5 = r3 =~ /^H(.ll.) W.rld$/
+ * r6 = regex.group(0)
+ * record(r5); recordString(r6); recordString(regex.group(1));
+ */
+static const std::vector<FlowVM::Instruction> code7 = {
+    makeInstructionImm(FlowVM::Opcode::SCONST, 0, 1),   // r0 = "Hello"
+    makeInstructionImm(FlowVM::Opcode::SCONST, 1, 3),   // r1 = " "
+    makeInstructionImm(FlowVM::Opcode::SCONST, 2, 2),   // r2 = "World"
+    makeInstruction(FlowVM::Opcode::SADDMULTI, 3, 0, 3),
+    makeInstructionImm(FlowVM::Opcode::IMOV, 4, 0),     // r4 = regex #0
+    makeInstruction(FlowVM::Opcode::SREGMATCH, 5, 3, 4),
+    makeInstructionImm(FlowVM::Opcode::IMOV, 7, 0),     // r7 = group #0
+    makeInstruction(FlowVM::Opcode::SREGGROUP, 6, 7),
+    makeInstruction(FlowVM::Opcode::SPRINT, 6),
+    makeInstruction(FlowVM::Opcode::NDUMPN, 5, 1),
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 8, 3),     // fid of record(I)V
+    makeInstructionImm(FlowVM::Opcode::IMOV, 9, 2),     // argc
+    makeInstruction(FlowVM::Opcode::MOV, 11, 5),        // argv[1] = r5
+    makeInstruction(FlowVM::Opcode::CALL, 8, 9, 10),
+    makeInstructionImm(FlowVM::Opcode::IMOV, 8, 7),     // fid of recordString(S)V
+    makeInstruction(FlowVM::Opcode::MOV, 11, 6),        // argv[1] = r6
+    makeInstruction(FlowVM::Opcode::CALL, 8, 9, 10),
+    makeInstructionImm(FlowVM::Opcode::IMOV, 7, 1),     // r7 = group #1
+    makeInstruction(FlowVM::Opcode::SREGGROUP, 11, 7),  // argv[1] = regex.group(1)
+    makeInstruction(FlowVM::Opcode::CALL, 8, 9, 10),
+
+    makeInstructionImm(FlowVM::Opcode::EXIT, 1),
+};
+
+/* multi-branch test
+ *
+ * switch ("World") {
+ *     case "Hello": print("Hello"); break;
+ *     case "World": print("World"); break;
+ *     default: print("");
+ * }
+ */
+static const std::vector<FlowVM::Instruction> code8 = {
+    makeInstructionImm(FlowVM::Opcode::SCONST, 0, 2),   // r0 = "World"
+    makeInstructionImm(FlowVM::Opcode::SSWITCH, 0, 0),  // switch (r0) using stringSwitches[0]
+
+    makeInstructionImm(FlowVM::Opcode::SCONST, 1, 0),   // 2: default
+    makeInstructionImm(FlowVM::Opcode::JMP, 8),
+    makeInstructionImm(FlowVM::Opcode::SCONST, 1, 1),   // 4: case "Hello"
+    makeInstructionImm(FlowVM::Opcode::JMP, 8),
+    makeInstructionImm(FlowVM::Opcode::SCONST, 1, 2),   // 6: case "World"
+    makeInstructionImm(FlowVM::Opcode::JMP, 8),
+
+    makeInstruction(FlowVM::Opcode::SPRINT, 1),         // 8:
+    makeInstructionImm(FlowVM::Opcode::EXIT, 1),
+};
+
+/*
+ * test2, reporting its results through record() rather than NDUMPN, so
+ * that its optimized and unoptimized forms can be compared.
+ */
+static const std::vector<FlowVM::Instruction> code9 = {
+    makeInstructionImm(FlowVM::Opcode::IMOV, 0, 4),     // r0 = 4
+    makeInstructionImm(FlowVM::Opcode::IMOV, 1, 0),     // r1 = 0
+    makeInstructionImm(FlowVM::Opcode::IMOV, 2, 0),     // r2 = 0
+    makeInstructionImm(FlowVM::Opcode::IMOV, 4, 1),     // r4 = 1
+    makeInstructionImm(FlowVM::Opcode::JMP, 7),         // IP = condition
+
+    makeInstruction(FlowVM::Opcode::NADD, 1, 1, 4),     // r1 = r1 + 1
+    makeInstruction(FlowVM::Opcode::NADD, 2, 2, 1),     // r2 = r2 + r1
+
+    makeInstruction(FlowVM::Opcode::NCMPLT, 3, 1, 0),   // r3 = r1 < r0
+    makeInstructionImm(FlowVM::Opcode::CONDBR, 3, 5),   // if isTrue(r3) then IP = loopBody
+
+    // record(r2)
+    makeInstructionImm(FlowVM::Opcode::IMOV, 5, 3),     // fid
+    makeInstructionImm(FlowVM::Opcode::IMOV, 6, 2),     // argc
+    makeInstruction(FlowVM::Opcode::MOV, 8, 2),         // argv[1] = r2
+    makeInstruction(FlowVM::Opcode::CALL, 5, 6, 7),
+
+    // record(nconst[0] - nconst[1])
+    makeInstructionImm(FlowVM::Opcode::NCONST, 0, 0),   // r0 = nconst[0]
+    makeInstructionImm(FlowVM::Opcode::NCONST, 1, 1),   // r1 = nconst[1]
+    makeInstruction(FlowVM::Opcode::NSUB, 2, 0, 1),     // r2 = r0 - r1
+    makeInstruction(FlowVM::Opcode::MOV, 8, 2),         // argv[1] = r2
+    makeInstruction(FlowVM::Opcode::CALL, 5, 6, 7),
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 9, 7),     // dead store
+    makeInstructionImm(FlowVM::Opcode::EXIT, 1),
+};
+
+/* asynchronous natives test
+ *
+ * r2 = fetch(21);      // suspends
+ * record(r2);
+ * await(r2);           // suspends; handled if resumed with true
+ * exit(0);
+ */
+static const std::vector<FlowVM::Instruction> code10 = {
+    makeInstructionImm(FlowVM::Opcode::IMOV, 0, 4),     // fid of fetch(I)I
+    makeInstructionImm(FlowVM::Opcode::IMOV, 1, 2),     // argc
+    makeInstructionImm(FlowVM::Opcode::IMOV, 3, 21),    // argv[1]
+    makeInstruction(FlowVM::Opcode::CALL, 0, 1, 2),
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 4, 3),     // fid of record(I)V
+    makeInstruction(FlowVM::Opcode::MOV, 7, 2),         // argv[1] = r2
+    makeInstruction(FlowVM::Opcode::CALL, 4, 1, 6),
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 8, 1),     // handler id of await(I)B
+    makeInstruction(FlowVM::Opcode::MOV, 10, 2),        // argv[1] = r2
+    makeInstruction(FlowVM::Opcode::HANDLER, 8, 1, 9),
+
+    makeInstructionImm(FlowVM::Opcode::EXIT, 0),
+};
+
+/* batch test, lanes taking different branches
+ *
+ * r2 = input();
+ * if (r2 < 3) {
+ *     output(r2 * 10);
+ *     exit(1);
+ * }
+ * output(r2 - 1);
+ * exit(r2 & 1);
+ */
+static const std::vector<FlowVM::Instruction> code11 = {
+    makeInstructionImm(FlowVM::Opcode::IMOV, 0, 5),     // fid of input()I
+    makeInstructionImm(FlowVM::Opcode::IMOV, 1, 1),     // argc
+    makeInstruction(FlowVM::Opcode::CALL, 0, 1, 2),     // r2 = input()
+    makeInstructionImm(FlowVM::Opcode::IMOV, 7, 6),     // fid of output(I)V
+    makeInstructionImm(FlowVM::Opcode::IMOV, 1, 2),     // argc
+    makeInstructionImm(FlowVM::Opcode::IMOV, 3, 3),
+    makeInstruction(FlowVM::Opcode::NCMPLT, 4, 2, 3),   // r4 = r2 < 3
+    makeInstructionImm(FlowVM::Opcode::CONDBR, 4, 14),
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 5, 1),
+    makeInstruction(FlowVM::Opcode::NSUB, 9, 2, 5),     // argv[1] = r2 - 1
+    makeInstruction(FlowVM::Opcode::CALL, 7, 1, 8),
+    makeInstruction(FlowVM::Opcode::NAND, 6, 2, 5),     // r6 = r2 & 1
+    makeInstructionImm(FlowVM::Opcode::CONDBR, 6, 17),
+    makeInstructionImm(FlowVM::Opcode::EXIT, 0),
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 5, 10),    // 14: r2 < 3
+    makeInstruction(FlowVM::Opcode::NMUL, 9, 2, 5),     // argv[1] = r2 * 10
+    makeInstruction(FlowVM::Opcode::CALL, 7, 1, 8),
+    makeInstructionImm(FlowVM::Opcode::EXIT, 1),        // 17:
+};
+
+/* suffix test, the suffix longer than the string
+ *
+ * r3 = "Hello" + " " + "World";
+ * record(r3 =$ "World");
+ * record("World" =$ r3);
+ */
+static const std::vector<FlowVM::Instruction> code12 = {
+    makeInstructionImm(FlowVM::Opcode::SCONST, 0, 1),   // r0 = "Hello"
+    makeInstructionImm(FlowVM::Opcode::SCONST, 1, 3),   // r1 = " "
+    makeInstruction(FlowVM::Opcode::SADD, 2, 0, 1),     // r2 = r0 + r1
+    makeInstructionImm(FlowVM::Opcode::SCONST, 1, 2),   // r1 = "World"
+    makeInstruction(FlowVM::Opcode::SADD, 3, 2, 1),     // r3 = r2 + r1
+    makeInstruction(FlowVM::Opcode::SCMPEND, 4, 3, 1),  // r4 = r3 =$ r1
+    makeInstruction(FlowVM::Opcode::SCMPEND, 5, 1, 3),  // r5 = r1 =$ r3
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 6, 3),     // fid of record(I)V
+    makeInstructionImm(FlowVM::Opcode::IMOV, 7, 2),     // argc
+    makeInstruction(FlowVM::Opcode::MOV, 9, 4),         // argv[1] = r4
+    makeInstruction(FlowVM::Opcode::CALL, 6, 7, 8),
+    makeInstruction(FlowVM::Opcode::MOV, 9, 5),         // argv[1] = r5
+    makeInstruction(FlowVM::Opcode::CALL, 6, 7, 8),
+    makeInstructionImm(FlowVM::Opcode::EXIT, 1),
+};
+
+/* URL encoding test
+ *
+ * recordString(urlencode("a b&c=d/e~"));
+ * recordString(urldecode("%41%zz%4"));
+ * recordString(urldecode(urlencode("a b&c=d/e~")));
+ */
+static const std::vector<FlowVM::Instruction> code14 = {
+    makeInstructionImm(FlowVM::Opcode::SCONST, 0, 5),   // r0 = "a b&c=d/e~"
+    makeInstruction(FlowVM::Opcode::SURLENC, 1, 0),     // r1 = urlencode(r0)
+    makeInstructionImm(FlowVM::Opcode::SCONST, 2, 6),   // r2 = "%41%zz%4"
+    makeInstruction(FlowVM::Opcode::SURLDEC, 3, 2),     // r3 = urldecode(r2)
+    makeInstruction(FlowVM::Opcode::SURLDEC, 4, 1),     // r4 = urldecode(r1)
+
+    makeInstructionImm(FlowVM::Opcode::IMOV, 5, 7),     // fid of recordString(S)V
+    makeInstructionImm(FlowVM::Opcode::IMOV, 6, 2),     // argc
+    makeInstruction(FlowVM::Opcode::MOV, 8, 1),         // argv[1] = r1
+    makeInstruction(FlowVM::Opcode::CALL, 5, 6, 7),
+    makeInstruction(FlowVM::Opcode::MOV, 8, 3),         // argv[1] = r3
+    makeInstruction(FlowVM::Opcode::CALL, 5, 6, 7),
+    makeInstruction(FlowVM::Opcode::MOV, 8, 4),         // argv[1] = r4
+    makeInstruction(FlowVM::Opcode::CALL, 5, 6, 7),
+    makeInstructionImm(FlowVM::Opcode::EXIT, 1),
+};
+
+/* wide operand test: test2 on registers above 255
+ *
+ * r300 = 4; r301 = 0; r302 = 0; r304 = 1;
+ * while (r301 < r300) {        // JMP onto the WIDE prefix of NCMPLT
+ *     r301 = r301 + r304;      // CONDBR onto the WIDE prefix of NADD
+ *     r302 = r302 + r301;
+ * }
+ * record(r302);
+ */
+static std::vector<FlowVM::Instruction> makeCode13()
+{
+    using FlowVM::Opcode;
+    using FlowVM::appendInstruction;
+    std::vector<FlowVM::Instruction> code;
+
+    appendInstruction(code, makeWideInstructionImm(Opcode::IMOV, 300, 4));
+    appendInstruction(code, makeWideInstructionImm(Opcode::IMOV, 301, 0));
+    appendInstruction(code, makeWideInstructionImm(Opcode::IMOV, 302, 0));
+    appendInstruction(code, makeWideInstructionImm(Opcode::IMOV, 304, 1));
+    size_t jump = appendInstruction(code, makeWideInstructionImm(Opcode::JMP, 0));
+
+    size_t body = appendInstruction(code, makeWideInstruction(Opcode::NADD, 301, 301, 304));
+    appendInstruction(code, makeWideInstruction(Opcode::NADD, 302, 302, 301));
+
+    size_t condition = appendInstruction(code, makeWideInstruction(Opcode::NCMPLT, 303, 301, 300));
+    appendInstruction(code, makeWideInstructionImm(Opcode::CONDBR, 303, body));
+    code[jump] = makeInstructionImm(Opcode::JMP, condition);
+
+    appendInstruction(code, makeWideInstructionImm(Opcode::IMOV, 5, 3));    // fid of record(I)V
+    appendInstruction(code, makeWideInstructionImm(Opcode::IMOV, 6, 2));    // argc
+    appendInstruction(code, makeWideInstruction(Opcode::MOV, 8, 302));      // argv[1] = r302
+    appendInstruction(code, makeWideInstruction(Opcode::CALL, 5, 6, 7));
+    appendInstruction(code, makeWideInstructionImm(Opcode::EXIT, 1));
+
+    return code;
+}
+
+/** Userdata of test11's runs, providing input() and collecting output(). */
+struct TestLane {
+    FlowVM::Number input;
+    std::vector<FlowVM::Number> output;
+};
+
+/**
+ * Replaces every copy of \p from in the file at \p path by \p to, which
+ * must be of the same size, so as to corrupt a saved program file.
+ */
+static bool patchFile(const char* path, const std::string& from, const std::string& to)
+{
+    std::string data;
+    if (FILE* file = fopen(path, "rb")) {
+        char buf[4096];
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) != 0; )
+            data.append(buf, n);
+        fclose(file);
+    }
+
+    size_t count = 0;
+    for (size_t i = data.find(from); i != std::string::npos; i = data.find(from, i + 1), ++count)
+        data.replace(i, to.size(), to);
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return fclose(file) == 0 && written && count != 0;
+}
+
+/** The bytes of \p value as saved in a program file. */
+template<typename T>
+static std::string bytesOf(const T& value)
+{
+    return std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static int failures = 0;
+
+/** Reports the outcome of a check, failing the test program on \c false. */
+static void check(bool result, const char* description)
+{
+    printf("%-6s %s\n", result ? "ok" : "FAILED", description);
+
+    if (!result)
+        ++failures;
+}
+
 class FlowTest : public FlowVM::Runtime { // {{{
 public:
     FlowTest()
     {
+        // typed bindings derive their signature from the method's C++ type
         registerHandler("assert")
-            .signature(FlowVM::Type::Boolean, FlowVM::Type::String)
             .bind(&FlowTest::_assert);
 
         registerFunction("getcwd", FlowVM::Type::String)
             .bind(&FlowTest::_getcwd);
 
         registerFunction("print", FlowVM::Type::Number)
-            .signature(FlowVM::Type::String)
             .bind(&FlowTest::_print);
 
         registerFunction("printHandlers", FlowVM::Type::Void)
             .signature(FlowVM::Type::Array, FlowVM::Type::String)
             .bind(&FlowTest::_printHandlers);
+
+        registerFunction("record", FlowVM::Type::Void)
+            .bind(&FlowTest::_record);
+
+        registerFunction("recordString", FlowVM::Type::Void)
+            .bind(&FlowTest::_recordString);
+
+        registerFunction("fetch", FlowVM::Type::Number)
+            .signature(FlowVM::Type::Number)
+            .bind(&FlowTest::_suspend);
+
+        registerHandler("await")
+            .signature(FlowVM::Type::Number)
+            .bind(&FlowTest::_suspend);
+
+        registerFunction("input", FlowVM::Type::Number)
+            .bind(&FlowTest::_input);
+
+        registerFunction("output", FlowVM::Type::Void)
+            .signature(FlowVM::Type::Number)
+            .bind(&FlowTest::_output);
     }
 
+    /** Strings passed to recordString(). */
+    std::vector<std::string> recordedStrings;
+
+    /** Runner suspended by fetch() or await(), waiting for resume(). */
+    FlowVM::Runner* suspended = nullptr;
+
+    /** Numbers passed to record(), for comparing runs. */
+    std::vector<FlowVM::Number> recorded;
+
     virtual bool import(const std::string& name, const std::string& path)
     {
         printf("FlowTest: about to import plugin '%s' from path '%s' (no-op)\n",
@@ -195,22 +513,57 @@ public:
     // signature:
     //     "assert(BS)B"
     //      bool assert(bool exprResult, string exprSourceCode);
-    void _assert(int argc, FlowVM::Value* argv, FlowVM::Runner* cx)
+    bool _assert(bool result, const FlowVM::String& message)
     {
-        printf("assertion: %-6s; %s\n", argv[1] ? "true" : "false", ((FlowVM::String*)argv[2])->c_str());
-        argv[0] = argv[1] == 0;
+        printf("assertion: %-6s; %.*s\n", result ? "true" : "false", (int) message.size(), message.data());
+        return !result;
     }
 
-    void _print(int argc, FlowVM::Value* argv, FlowVM::Runner* cx)
+    // signature: "print(S)I"
+    FlowVM::Number _print(const FlowVM::String& s)
     {
-        printf("%s\n", ((FlowVM::String*)argv[1])->c_str());
+        printf("%.*s\n", (int) s.size(), s.data());
+        return s.size();
     }
 
-    void _getcwd(int argc, FlowVM::Value* argv, FlowVM::Runner* cx)
+    // signature: "record(I)V"
+    void _record(FlowVM::Number value)
+    {
+        recorded.push_back(value);
+    }
+
+    // signature: "recordString(S)V"
+    void _recordString(const FlowVM::String& s)
+    {
+        recordedStrings.push_back(s.str());
+    }
+
+    // signatures: "fetch(I)I", "await(I)B"
+    void _suspend(int argc, FlowVM::Value* argv, FlowVM::Runner* cx)
+    {
+        if (cx->suspend())
+            suspended = cx;
+        else
+            argv[0] = argv[1];
+    }
+
+    // signature: "input()I"
+    void _input(int argc, FlowVM::Value* argv, FlowVM::Runner* cx)
+    {
+        argv[0] = static_cast<TestLane*>(cx->userdata())->input;
+    }
+
+    // signature: "output(I)V"
+    void _output(int argc, FlowVM::Value* argv, FlowVM::Runner* cx)
+    {
+        static_cast<TestLane*>(cx->userdata())->output.push_back(argv[1]);
+    }
+
+    // signature: "getcwd()S"
+    std::string _getcwd()
     {
         char cwd[PATH_MAX];
-        getcwd(cwd, sizeof(cwd));
-        argv[0] = (FlowVM::Value) cx->createString(cwd);
+        return getcwd(cwd, sizeof(cwd)) ? cwd : "";
     }
 }; // }}}
 
@@ -218,13 +571,15 @@ int main()
 {
     FlowVM::Program program(
         {123456789, 56789},                 // integer constants
-        {"", "Hello", "World", " ", "rl"},  // string constants
-        {"^H.ll. W.rld$"},                  // regex constants
+        {"", "Hello", "World", " ", "rl",   // string constants
+         "a b&c=d/e~", "%41%zz%4"},
+        {"^H(.ll.) W.rld$"},                // regex constants
         {{"fnord", ""},                     // external modules
          {"foo", "/usr/libexec"}},
-        {"assert(BS)B"},                    // native handler signatures
+        {"assert(BS)B", "await(I)B"},       // native handler signatures
         {"print(S)I", "getcwd()S",          // native function signatures
-         "printHandlers([S)V"}
+         "printHandlers([S)V", "record(I)V", "fetch(I)I",
+         "input()I", "output(I)V", "recordString(S)V"}
     );
 
     program.createHandler("test1", code1); // simple
@@ -233,18 +588,295 @@ int main()
     program.createHandler("test4", code4); // function call test
     program.createHandler("test5", code5); // handler call test
     program.createHandler("test6")->setCode(code6); // handler ref + array call args test
+    FlowVM::Handler* regex = program.createHandler("test7", code7); // regex test
+    program.addStringSwitch({{"Hello", 4}, {"World", 6}}, 2);
+    program.createHandler("test8", code8); // multi-branch test
+
+    // optimizer test: test9 at level 2 must behave as at level 0
+    FlowVM::Handler* optimized = program.createHandler("test9");
+    optimized->setOptimizationLevel(2);
+    optimized->setCode(code9);
+    FlowVM::Handler* unoptimized = program.createHandler("test9.O0");
+    unoptimized->setOptimizationLevel(0);
+    unoptimized->setCode(code9);
+
+    FlowVM::Handler* async = program.createHandler("test10", code10); // asynchronous natives test
+    FlowVM::Handler* batched = program.createHandler("test11", code11); // batch test
+    FlowVM::Handler* suffix = program.createHandler("test12", code12); // suffix test
+
+    // wide operand test, unoptimized to keep its jumps onto WIDE prefixes
+    const std::vector<FlowVM::Instruction> code13 = makeCode13();
+    FlowVM::Handler* wide = program.createHandler("test13");
+    wide->setOptimizationLevel(0);
+    wide->setCode(code13);
+
+    FlowVM::Handler* urls = program.createHandler("test14", code14); // URL encoding test
 
     FlowTest runtime;
     if (!program.link(&runtime))
         return 1;
 
+    // a callback leaving a shared signature hands it over to the other one
+    {
+        FlowVM::Runtime::Callback& first = runtime.registerFunction("twin", FlowVM::Type::Void)
+                                                  .signature(FlowVM::Type::Number);
+        FlowVM::Runtime::Callback& second = runtime.registerFunction("twin", FlowVM::Type::Void)
+                                                   .signature(FlowVM::Type::Number);
+        bool shared = runtime.find("twin(I)V") == &first;
+        first.signature(FlowVM::Type::String);
+        check(shared && runtime.find("twin(I)V") == &second && runtime.find("twin(S)V") == &first,
+              "re-signed callback leaves its old signature to another callback");
+    }
+
     program.dump();
 
     if (FlowVM::Handler* handler = program.findHandler("test6")) {
         printf("Running %s ...\n", handler->name().c_str());
+        FlowVM::FileTraceSink trace(stdout);
         std::unique_ptr<FlowVM::Runner> flow = handler->createRunner();
+        flow->setTraceSink(&trace);
         flow->run();
     }
 
-    return 0;
+    if (FLOW_STATS)
+        program.stats().dump();
+
+    runtime.recorded.clear();
+    bool result = unoptimized->run();
+    std::vector<FlowVM::Number> expected;
+    expected.swap(runtime.recorded);
+
+    check(result && expected == std::vector<FlowVM::Number>({10, 123456789 - 56789}),
+          "test9 records its results");
+    check(optimized->run() == result && runtime.recorded == expected,
+          "test9 at optimization level 2 matches level 0");
+    check(optimized->code().size() < unoptimized->code().size(),
+          "test9 at optimization level 2 is shorter");
+
+    runtime.recorded.clear();
+    runtime.recordedStrings.clear();
+    check(regex->run() && runtime.recorded == std::vector<FlowVM::Number>({1})
+          && runtime.recordedStrings == std::vector<std::string>({"Hello World", "ello"}),
+          "test7 matches and captures \"ello\" of \"Hello World\"");
+
+    // capture groups of a subject too long for the backtracker's visited set
+    {
+        FlowVM::RegExp re("^/(\\w+)/(.*)\\.(png|jpg)$");
+        std::string subject = "/static/" + std::string(65536, 'x') + ".png";
+        std::vector<FlowVM::BufferRef> groups;
+        check(re.match(FlowVM::BufferRef(subject), &groups) && groups.size() == 4
+              && groups[1].str() == "static" && groups[2].size() == 65536 && groups[3].str() == "png",
+              "regex captures groups of a 64 KB subject");
+    }
+
+    runtime.recorded.clear();
+    check(suffix->run() && runtime.recorded == std::vector<FlowVM::Number>({1, 0}),
+          "test12 \"Hello World\" =$ \"World\" but not \"World\" =$ \"Hello World\"");
+
+    runtime.recorded.clear();
+    check(wide->isWide() && wide->registerCount() == 305 && wide->code().size() == code13.size()
+          && std::equal(code13.begin(), code13.end(), wide->code().begin()),
+          "test13 decodes WIDE prefixes and registers above 255");
+    check(wide->run() && runtime.recorded == std::vector<FlowVM::Number>({10}),
+          "test13 jumps onto WIDE prefixes and records its result");
+
+    const std::vector<std::string> urlStrings = {"a%20b%26c%3Dd%2Fe~", "A%zz%4", "a b&c=d/e~"};
+    runtime.recordedStrings.clear();
+    check(urls->run() && runtime.recordedStrings == urlStrings,
+          "test14 URL-encodes and decodes, keeping malformed escapes");
+
+    // test14 on 2 lanes, each recording the same strings
+    {
+        std::unique_ptr<FlowVM::BatchRunner> batch = FlowVM::BatchRunner::create(urls, 2);
+        std::vector<std::string> expected;
+        for (const std::string& s: urlStrings)
+            expected.insert(expected.end(), 2, s);
+
+        runtime.recordedStrings.clear();
+        check(batch && batch->run() == 0x3 && runtime.recordedStrings == expected,
+              "test14 batch URL-encodes and decodes on every lane");
+    }
+
+    // test10, resuming await() with true and false
+    for (FlowVM::Value handled: {1, 0}) {
+        std::unique_ptr<FlowVM::Runner> runner = async->createRunner();
+        int completions = 0;
+        bool completed = false;
+
+        runtime.recorded.clear();
+        runtime.suspended = nullptr;
+        runner->start([&](FlowVM::Runner*, bool result) { ++completions; completed = result; });
+        check(runtime.suspended == runner.get() && runner->isSuspended() && !completions,
+              "test10 suspends in fetch()");
+
+        runtime.suspended = nullptr;
+        runner->resume(42);
+        check(runtime.suspended == runner.get() && !completions &&
+              runtime.recorded == std::vector<FlowVM::Number>({42}),
+              "test10 resumes fetch() with its result and suspends in await()");
+
+        runner->resume(handled);
+        check(completions == 1 && completed == (handled != 0) && !runner->isSuspended(),
+              handled ? "test10 completes true once await() resumes handled"
+                      : "test10 completes false once await() resumes unhandled");
+    }
+
+    // test11 on 8 lanes versus 8 runs
+    {
+        const size_t lanes = 8;
+        std::vector<TestLane> expected(lanes);
+        std::vector<TestLane> actual(lanes);
+        std::unique_ptr<FlowVM::BatchRunner> batch = FlowVM::BatchRunner::create(batched, lanes);
+        uint64_t expectedMask = 0;
+
+        for (size_t i = 0; i != lanes; ++i) {
+            expected[i].input = actual[i].input = i;
+            if (batched->run(&expected[i]))
+                expectedMask |= uint64_t(1) << i;
+            batch->setUserData(i, &actual[i]);
+        }
+
+        bool outputs = true;
+        uint64_t mask = batch->run();
+        for (size_t i = 0; i != lanes; ++i)
+            outputs = outputs && actual[i].output == expected[i].output && !actual[i].output.empty();
+
+        check(mask == expectedMask && expectedMask == 0xAF, "test11 batch returns the runs' results");
+        check(outputs, "test11 batch calls natives as the runs do");
+    }
+
+    // the handlers above once more, compiled to machine code
+    if (FlowVM::MachineCode::isAvailable()) {
+        for (FlowVM::Handler* handler: {program.findHandler("test2"), program.findHandler("test8"),
+                                        unoptimized, optimized, suffix, wide, urls}) {
+            runtime.recorded.clear();
+            runtime.recordedStrings.clear();
+            bool result = handler->run();
+            std::vector<FlowVM::Number> recorded;
+            std::vector<std::string> recordedStrings;
+            recorded.swap(runtime.recorded);
+            recordedStrings.swap(runtime.recordedStrings);
+
+            handler->setEngine(FlowVM::ExecutionEngine::Compiled);
+            std::string description = handler->name() + " compiled matches direct-threaded";
+            check(handler->machineCode() && handler->run() == result && runtime.recorded == recorded
+                  && runtime.recordedStrings == recordedStrings,
+                  description.c_str());
+        }
+
+        async->setEngine(FlowVM::ExecutionEngine::Compiled);
+        std::unique_ptr<FlowVM::Runner> runner = async->createRunner();
+        int completions = 0;
+        bool completed = false;
+
+        runtime.recorded.clear();
+        runtime.suspended = nullptr;
+        runner->start([&](FlowVM::Runner*, bool result) { ++completions; completed = result; });
+        bool suspended = runtime.suspended == runner.get() && runner->isSuspended();
+        runtime.suspended = nullptr;
+        runner->resume(42);
+        suspended = suspended && runtime.suspended == runner.get() && !completions;
+        runner->resume(1);
+        check(async->machineCode() && suspended && completions == 1 && completed
+              && runtime.recorded == std::vector<FlowVM::Number>({42}),
+              "test10 compiled suspends and resumes as direct-threaded");
+    }
+
+    // round-trip through the binary program file format
+    char path[] = "/tmp/flow-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return 1;
+    close(fd);
+
+    if (!program.save(path))
+        return 1;
+
+    std::unique_ptr<FlowVM::Program> loaded = FlowVM::Program::load(path);
+    if (!loaded || !loaded->link(&runtime))
+        return 1;
+
+    if (FlowVM::Handler* handler = loaded->findHandler("test8")) {
+        printf("Running mapped %s ...\n", handler->name().c_str());
+        check(handler->run(nullptr), "mapped test8 exits true");
+
+        // engines are fixed once the program is frozen
+        FlowVM::ExecutionEngine engine = handler->engine();
+        loaded->freeze();
+        handler->setEngine(engine == FlowVM::ExecutionEngine::Compiled
+                           ? FlowVM::ExecutionEngine::TokenThreaded
+                           : FlowVM::ExecutionEngine::Compiled);
+        check(handler->engine() == engine && handler->machineCode() == nullptr,
+              "frozen test8 keeps its engine");
+    }
+
+    // renaming keeps the name index, with the first-created handler owning a shared name
+    {
+        const std::vector<FlowVM::Instruction> exit = {makeInstructionImm(FlowVM::Opcode::EXIT, 1)};
+        FlowVM::Program names({}, {}, {}, {}, {}, {});
+        FlowVM::Handler* a = names.createHandler("a", exit);
+        FlowVM::Handler* b = names.createHandler("b", exit);
+        FlowVM::Handler* shadow = names.createHandler("b", exit);
+        FlowVM::Handler copy(*a);
+
+        b->setName("c");
+        a->setName("d");
+        check(names.findHandler("b") == shadow && names.findHandler("c") == b && names.findHandler("d") == a
+              && !names.findHandler("a") && names.handlerIndex(b) == 1 && names.handlerIndex(shadow) == 2
+              && names.handlerIndex(&copy) == -1,
+              "renamed handlers keep their indices and hand shared names over");
+    }
+
+    // code indexing past the constant tables must not load
+    FlowVM::Program corrupt({}, {"Hello"}, {}, {}, {}, {});
+    corrupt.createHandler("main", {
+        makeInstructionImm(FlowVM::Opcode::SCONST, 0, 1),   // r0 = sconst[1]
+        makeInstructionImm(FlowVM::Opcode::EXIT, 1),
+    });
+    check(corrupt.save(path) && !FlowVM::Program::load(path), "load rejects out-of-range constant");
+
+    // an IPv4 network shorter than 96 bits must not reach the CIDR trie
+    const FlowVM::Cidr network(FlowVM::IPAddress::fromV4(0x0A000000), 8);   // 10.0.0.0/8
+    std::string shortened = bytesOf(network);
+    const uint32_t bits = 10;
+    memcpy(&shortened[sizeof(FlowVM::IPAddress)], &bits, sizeof(bits));
+
+    FlowVM::Program cidrs({}, {}, {}, {}, {}, {});
+    cidrs.addCidr(network);
+    check(cidrs.save(path) && patchFile(path, bytesOf(network), shortened) && !FlowVM::Program::load(path),
+          "load rejects non-normalized CIDR constant");
+
+    FlowVM::Program cidrSets({}, {}, {}, {}, {}, {});
+    cidrSets.addCidrSet({network});
+    check(cidrSets.save(path) && patchFile(path, bytesOf(network), shortened) && !FlowVM::Program::load(path),
+          "load rejects non-normalized CIDR set network");
+
+    // switch targets beyond 16 bits, and stored ones beyond 32 bits
+    FlowVM::Program far({}, {}, {}, {}, {}, {});
+    const FlowVM::Number farCase = 0x5717C4;
+    far.addNumber(farCase);
+    far.addNumberSwitch({{farCase, 0x10002}}, 2);   // truncated to 16 bits, the case hits EXIT 0
+    std::vector<FlowVM::Instruction> farCode(0x10003, makeInstructionImm(FlowVM::Opcode::EXIT, 0));
+    farCode[0] = makeInstructionImm(FlowVM::Opcode::NCONST, 0, 0);
+    farCode[1] = makeInstructionImm(FlowVM::Opcode::NSWITCH, 0, 0);
+    farCode[0x10002] = makeInstructionImm(FlowVM::Opcode::EXIT, 1);
+    FlowVM::Handler* farHandler = far.createHandler("far");
+    farHandler->setOptimizationLevel(0);
+    farHandler->setCode(farCode);
+    check(far.link(&runtime) && farHandler->run(), "NSWITCH jumps beyond offset 0xFFFF");
+
+    std::unique_ptr<FlowVM::Program> farLoaded;
+    check(far.save(path) && (farLoaded = FlowVM::Program::load(path)) && farLoaded->link(&runtime)
+          && farLoaded->findHandler("far")->run(),
+          "mapped NSWITCH jumps beyond offset 0xFFFF");
+    farLoaded.reset();
+
+    const uint64_t wrapped[2] = { uint64_t(farCase), (uint64_t(1) << 32) + 0x10002 };
+    const uint64_t stored[2] = { uint64_t(farCase), 0x10002 };
+    check(patchFile(path, bytesOf(stored), bytesOf(wrapped)) && !FlowVM::Program::load(path),
+          "load rejects switch target beyond 32 bits");
+
+    unlink(path);
+
+    return failures ? 1 : 0;
 }